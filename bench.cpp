@@ -0,0 +1,300 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "include/ndarray.hpp"
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<execution>)
+#include <execution>
+#define ND_BENCH_EXECUTION
+#endif
+#endif
+
+
+
+
+/**
+ * Benchmarks for the library's kernels. Build with `make bench`, which
+ * compiles with optimizations (and as C++17 where available, so that the
+ * parallel STL algorithms can be measured too). Each case reports the best
+ * of several runs, in milliseconds.
+ */
+// ============================================================================
+template<typename Setup, typename Function>
+static void measure(const std::string& name, Setup setup, Function f, int repeats=5)
+{
+    auto best = 1e300;
+
+    for (int n = 0; n < repeats; ++n)
+    {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    std::cout << std::left << std::setw(52) << name << std::right << std::setw(10) << std::fixed << std::setprecision(3) << best << " ms\n";
+}
+
+
+
+
+// ============================================================================
+static void bench_iterators()
+{
+    auto _ = nd::axis::all();
+    auto rng = std::mt19937(42);
+    auto dist = std::uniform_real_distribution<double>();
+    auto random = nd::ndarray<double, 2>(1024, 2048);
+    auto A = nd::ndarray<double, 2>(1024, 2048);
+
+    for (auto& x : random) x = dist(rng);
+
+    auto contiguous = A.reshape(1024 * 2048);
+    auto strided = A.select(_|0|1024, _|0|2048|2);
+    auto transposed = A.transpose();
+    auto reset = [&] { A = random; };
+
+    std::cout << "\n" << "iterators over " << strided.size() << " (strided) and " << A.size() << " (other) doubles\n";
+
+    measure("std::sort, contiguous", reset, [&] { std::sort(contiguous.begin(), contiguous.end()); });
+    measure("std::sort, every other column", reset, [&] { std::sort(strided.begin(), strided.end()); });
+    measure("std::nth_element, every other column", reset, [&] { std::nth_element(strided.begin(), strided.begin() + strided.size() / 2, strided.end()); });
+    measure("std::accumulate, contiguous", reset, [&] { volatile double x = std::accumulate(contiguous.begin(), contiguous.end(), 0.0); (void) x; });
+    measure("std::accumulate, transposed", reset, [&] { volatile double x = std::accumulate(transposed.begin(), transposed.end(), 0.0); (void) x; });
+
+#ifdef ND_BENCH_EXECUTION
+    measure("std::reduce(par), contiguous", reset, [&] { volatile double x = std::reduce(std::execution::par, contiguous.begin(), contiguous.end()); (void) x; });
+    measure("std::reduce(par), every other column", reset, [&] { volatile double x = std::reduce(std::execution::par, strided.begin(), strided.end()); (void) x; });
+    measure("std::reduce(par), transposed", reset, [&] { volatile double x = std::reduce(std::execution::par, transposed.begin(), transposed.end()); (void) x; });
+    measure("std::sort(par), every other column", reset, [&] { std::sort(std::execution::par, strided.begin(), strided.end()); });
+#else
+    std::cout << "(std::execution is unavailable; parallel algorithms skipped)\n";
+#endif
+}
+
+
+
+
+// ============================================================================
+static void bench_linalg()
+{
+    auto rng = std::mt19937(42);
+    auto dist = std::uniform_real_distribution<double>();
+    int n = 1024;
+    auto A = nd::ndarray<double, 2>(n, n);
+    auto B = nd::ndarray<double, 2>(n, n);
+    auto C = nd::ndarray<double, 2>(n, n);
+
+    for (auto& x : A) x = dist(rng);
+    for (auto& x : B) x = dist(rng);
+
+    std::cout << "\n" << "matrix products of " << n << " x " << n << " doubles (" << 2e-9 * n * n * n << " GFLOP)\n";
+
+    measure("naive i-k-j loops", [] {}, [&]
+    {
+        auto a = A.data(), b = B.data(), c = C.data();
+        std::fill(c, c + n * n, 0.0);
+
+        for (int i = 0; i < n; ++i)
+            for (int k = 0; k < n; ++k)
+                for (int j = 0; j < n; ++j)
+                    c[i * n + j] += a[i * n + k] * b[k * n + j];
+    }, 1);
+    measure("nd::matmul", [] {}, [&] { C = nd::matmul(A, B); }, 3);
+    measure("nd::matmul, transposed operands", [] {}, [&] { C = nd::matmul(A.transpose(), B.transpose()); }, 3);
+    measure("nd::matmul, matrix-vector", [] {}, [&] { volatile double x = nd::matmul(A, B[0])(0); (void) x; });
+    measure("nd::matmul, vector-matrix", [] {}, [&] { volatile double x = nd::matmul(B[0], A)(0); (void) x; });
+    measure("nd::dot", [] {}, [&] { volatile double x = nd::dot(A[0], B[0]); (void) x; });
+
+    int count = 1 << 20;
+    auto M = nd::ndarray<double, 3>(count, 3, 3);
+    auto D = nd::ndarray<double, 1>(count);
+
+    for (auto& x : M) x = dist(rng);
+
+    std::cout << "\n" << "batches of " << count << " 3 x 3 matrices\n";
+
+    measure("det, slicing A[n]", [] {}, [&]
+    {
+        for (int n = 0; n < count; ++n)
+        {
+            auto m = M[n];
+            D(n) = m(0, 0) * (m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1)) - m(0, 1) * (m(1, 0) * m(2, 2) - m(1, 2) * m(2, 0)) + m(0, 2) * (m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0));
+        }
+    });
+    measure("nd::batch_det<3>", [] {}, [&] { D = nd::batch_det<3>(M); });
+    measure("nd::batch_inverse<3>", [] {}, [&] { volatile double x = nd::batch_inverse<3>(M)(0, 0, 0); (void) x; });
+    measure("nd::batch_matmul<3, 3, 3>", [] {}, [&] { volatile double x = nd::batch_matmul<3, 3, 3>(M, M)(0, 0, 0); (void) x; });
+}
+
+
+
+
+// ============================================================================
+static void bench_stencil()
+{
+    auto _ = nd::axis::all();
+    auto rng = std::mt19937(42);
+    auto dist = std::uniform_real_distribution<double>();
+    auto A = nd::ndarray<double, 2>(4096, 4096);
+    auto B = nd::ndarray<double, 2>(4094, 4094);
+    auto V = nd::ndarray<double, 3>(256, 256, 256);
+    auto W = nd::ndarray<double, 3>(254, 254, 254);
+    auto L2 = nd::stencil<double, 2>::laplacian();
+    auto L3 = nd::stencil<double, 3>::laplacian();
+
+    for (auto& x : A) x = dist(rng);
+    for (auto& x : V) x = dist(rng);
+
+    std::cout << "\n" << "Laplacians of 4096^2 and 256^3 doubles\n";
+
+    measure("2D, sum of shifted views", [] {}, [&]
+    {
+        B = A.shift<0>(-2).take<1>(_|1|4095) + A.shift<0>(+2).take<1>(_|1|4095)
+          + A.take<0>(_|1|4095).shift<1>(-2) + A.take<0>(_|1|4095).shift<1>(+2)
+          - A.take<0>(_|1|4095).take<1>(_|1|4095) * 4.0;
+    }, 3);
+    measure("2D, nd::stencil", [] {}, [&] { L2.apply(A, B); });
+    measure("2D, nd::apply_stencil with a lambda", [] {}, [&]
+    {
+        nd::apply_stencil([] (auto n) { return n(-1, 0) + n(1, 0) + n(0, -1) + n(0, 1) - 4 * n(0, 0); }, {1, 1}, A, B);
+    });
+    measure("3D, nd::stencil", [] {}, [&] { L3.apply(V, W); });
+
+    auto D = nd::stencil<double, 3>::laplacian(0.1).add({0, 0, 0}, 1.0);
+    auto U = nd::ndarray<double, 3>(400, 400, 400);
+    int steps = 8;
+
+    for (auto& x : U) x = dist(rng);
+
+    std::cout << "\n" << steps << " diffusion steps on 400^3 doubles (two 488 MiB arrays, larger than the last-level cache)\n";
+
+    for (int block : {1, 2, 4, 8})
+    {
+        auto name = "stencil::sweep, time_block " + std::to_string(block);
+        measure(name, [] {}, [&] { auto X = D.sweep(U, steps, block); }, 3);
+    }
+}
+
+
+
+
+// ============================================================================
+static void bench_factories()
+{
+    const int n = 1 << 24;
+
+    std::cout << "\n" << "Factories of 2^24 doubles\n";
+
+    measure("zeros, allocate then fill through iterators", [] {}, [&]
+    {
+        auto A = nd::ndarray<double, 1>(n);
+        for (auto& a : A) a = 0;
+    });
+    measure("nd::zeros", [] {}, [&] { auto A = nd::zeros<double>(n); });
+    measure("arange, allocate then fill through iterators", [] {}, [&]
+    {
+        auto A = nd::ndarray<double, 1>(n);
+        auto x = 0.0;
+        for (auto& a : A) a = x++;
+    });
+    measure("nd::arange", [] {}, [&] { auto A = nd::arange<double>(n); });
+    measure("nd::empty", [] {}, [&] { auto A = nd::empty<double>(n); });
+
+    auto parts = std::vector<nd::ndarray<double, 2>>();
+
+    for (int k = 0; k < 64; ++k)
+    {
+        auto P = nd::full(double(k), 512, 512);
+        parts.emplace_back(P);
+    }
+
+    std::cout << "\n" << "Assembling 64 arrays of 512^2 doubles\n";
+
+    measure("stack, element by element through A[n]", [] {}, [&]
+    {
+        auto A = nd::ndarray<double, 3>(64, 512, 512);
+        for (int k = 0; k < 64; ++k)
+        {
+            auto S = A[k];
+            auto it = S.begin();
+            for (const auto& x : parts[k]) *it++ = x;
+        }
+    });
+    measure("nd::stack", [] {}, [&] { auto A = nd::stack(parts); });
+    measure("nd::concatenate along axis 1", [] {}, [&] { auto A = nd::concatenate(parts, 1); });
+}
+
+
+
+
+// ============================================================================
+static void bench_random()
+{
+    auto A = nd::ndarray<double, 1>(1 << 24);
+    auto rng = std::mt19937(42);
+    auto g = nd::philox(42);
+
+    std::cout << "\n" << "Random fills of 2^24 doubles\n";
+
+    measure("uniform, std::mt19937 through iterators", [] {}, [&]
+    {
+        auto dist = std::uniform_real_distribution<double>();
+        for (auto& x : A) x = dist(rng);
+    }, 3);
+    measure("uniform, nd::philox", [] {}, [&] { g.uniform(A); });
+    measure("normal, std::mt19937 through iterators", [] {}, [&]
+    {
+        auto dist = std::normal_distribution<double>();
+        for (auto& x : A) x = dist(rng);
+    }, 3);
+    measure("normal, nd::philox", [] {}, [&] { g.normal(A); });
+}
+
+
+
+
+// ============================================================================
+static void bench_growable()
+{
+    const int n = 1 << 14;
+    auto row = nd::arange<double>(8);
+
+    std::cout << "\n" << "Appending 2^14 rows of 8 doubles\n";
+
+    measure("concatenate onto a new array per row", [] {}, [&]
+    {
+        auto A = nd::ndarray<double, 2>(0, 8);
+        for (int i = 0; i < n; ++i)
+        {
+            auto B = nd::concatenate({A, row.reshape(1, 8)});
+            A.become(B);
+        }
+    }, 1);
+    measure("nd::growable::append", [] {}, [&]
+    {
+        auto G = nd::growable<double, 2>({8});
+        for (int i = 0; i < n; ++i) G.append(row);
+    });
+}
+
+
+
+
+int main()
+{
+    std::cout << "threads: " << nd::parallel::num_threads() << "\n";
+    bench_iterators();
+    bench_linalg();
+    bench_stencil();
+    bench_factories();
+    bench_random();
+    bench_growable();
+    return 0;
+}
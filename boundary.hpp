@@ -0,0 +1,451 @@
+#pragma once
+#include <array>
+#include <stdexcept>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    /**
+     * How an array is extended past its edges, for an axis of length n:
+     *
+     * periodic:  index -1 reads n - 1, and n reads 0
+     * reflect:   mirrored about the edge element; -1 reads 1 (numpy 'reflect')
+     * symmetric: mirrored about the edge itself; -1 reads 0 (numpy 'symmetric')
+     * nearest:   the edge element is repeated
+     * constant:  a fixed value
+     */
+    enum class boundary { periodic, reflect, symmetric, nearest, constant };
+
+    template<typename T, int R> class padded_view;
+
+    template<typename T, int R>
+    static inline padded_view<T, R> pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline padded_view<T, R> pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline void fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline void fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value=T());
+
+    static inline int boundary_index(int index, int size, boundary mode);
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * Maps an index along an axis of the given size, which may be past either
+ * edge, to the index it reads from, for every mode except constant (for
+ * which out-of-range indexes have no source). Indexes may be any distance
+ * past the edge; the periodic and mirrored modes wrap as many times as
+ * needed.
+ */
+int nd::boundary_index(int index, int size, boundary mode) // ND_IMPL_START
+{
+    if (index >= 0 && index < size)
+    {
+        return index;
+    }
+
+    switch (mode)
+    {
+        case boundary::periodic:
+        {
+            int m = index % size;
+            return m < 0 ? m + size : m;
+        }
+        case boundary::reflect:
+        {
+            if (size == 1) return 0;
+            int period = 2 * size - 2;
+            int m = index % period;
+            m = m < 0 ? m + period : m;
+            return m < size ? m : period - m;
+        }
+        case boundary::symmetric:
+        {
+            int period = 2 * size;
+            int m = index % period;
+            m = m < 0 ? m + period : m;
+            return m < size ? m : period - 1 - m;
+        }
+        case boundary::nearest:
+        {
+            return index < 0 ? 0 : size - 1;
+        }
+        case boundary::constant: break;
+    }
+    throw std::out_of_range("boundary_index: constant boundaries have no source index");
+}
+
+
+
+
+/**
+ * A read-only view of an array extended by a halo of the given width on
+ * each side of every axis, with the halo computed on access from the
+ * boundary mode of its axis. Index (i, j, ...) of the view is index
+ * (i - width[0], j - width[1], ...) of the array. Where any constant axis
+ * is out of range the view reads the constant value; otherwise every axis
+ * is mapped with boundary_index.
+ *
+ * The view shares the array's memory, so later changes to the array are
+ * visible through it. materialize() creates the padded array itself,
+ * copying the array once and computing only the halo.
+ */
+template<typename T, int R>
+class nd::padded_view
+{
+public:
+    using value_type = T;
+    using index_type = std::array<int, R>;
+    using modes_type = std::array<boundary, R>;
+
+    padded_view(const ndarray<T, R>& A, index_type width, modes_type modes, T value=T())
+    : source(A.region(index_type(), A.shape()))
+    , width(width)
+    , modes(modes)
+    , value(value)
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            if (width[n] < 0)
+            {
+                throw std::invalid_argument("padded_view: width must be non-negative");
+            }
+            if (modes[n] != boundary::constant && width[n] > 0 && A.shape(n) == 0)
+            {
+                throw std::invalid_argument("padded_view: cannot pad an empty axis except with a constant");
+            }
+        }
+    }
+
+    std::array<int, R> shape() const
+    {
+        auto s = source.shape();
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] += 2 * width[n];
+        }
+        return s;
+    }
+
+    int shape(int axis) const
+    {
+        return source.shape(axis) + 2 * width[axis];
+    }
+
+    std::array<int, R> get_width() const
+    {
+        return width;
+    }
+
+    template<typename... Index>
+    T operator()(Index... index) const
+    {
+        static_assert(sizeof...(Index) == R, "padded_view: number of indexes must match rank");
+        return at({int(index)...});
+    }
+
+    /**
+     * The element at the given index of the view. Throws std::out_of_range
+     * if the index is outside the view.
+     */
+    T at(std::array<int, R> index) const
+    {
+        auto s = source.shape();
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (index[n] < 0 || index[n] >= s[n] + 2 * width[n])
+            {
+                throw std::out_of_range("padded_view: index out of range");
+            }
+        }
+
+        for (int n = 0; n < R; ++n)
+        {
+            index[n] -= width[n];
+
+            if (index[n] < 0 || index[n] >= s[n])
+            {
+                if (modes[n] == boundary::constant)
+                {
+                    return value;
+                }
+                index[n] = boundary_index(index[n], s[n], modes[n]);
+            }
+        }
+        return source.data()[source.data_offset() + shape::dot(index, source.get_strides())];
+    }
+
+    /**
+     * Returns a new array of the padded shape, holding the view's values.
+     */
+    ndarray<T, R> materialize() const
+    {
+        auto P = ndarray<T, R>(shape());
+        materialize(P);
+        return P;
+    }
+
+    /**
+     * Writes the view's values to an array of the padded shape, e.g. one
+     * which is reused between time steps. The array is copied into the
+     * interior, and fill_halo computes the rest. Throws
+     * std::invalid_argument if the target has the wrong shape.
+     */
+    void materialize(ndarray<T, R>& target) const
+    {
+        if (target.shape() != shape())
+        {
+            throw std::invalid_argument("padded_view: target has shape "
+                + shape::to_string(target.shape())
+                + " but the view has shape "
+                + shape::to_string(shape()));
+        }
+
+        auto inner = target.region(width, source.shape());
+        inner = source;
+        fill_halo(target, width, modes, value);
+    }
+
+private:
+    typename ndarray<T, R>::const_ref source;
+    std::array<int, R> width;
+    std::array<boundary, R> modes;
+    T value;
+};
+
+
+
+
+/**
+ * Returns a view of A extended by the given halo width, with the same
+ * boundary mode on every axis.
+ */
+template<typename T, int R>
+nd::padded_view<T, R> nd::pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value)
+{
+    auto modes = std::array<boundary, R>();
+    modes.fill(mode);
+    return padded_view<T, R>(A, width, modes, value);
+}
+
+/**
+ * Returns a view of A extended by the given halo width, with a boundary
+ * mode per axis.
+ */
+template<typename T, int R>
+nd::padded_view<T, R> nd::pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value)
+{
+    return padded_view<T, R>(A, width, modes, value);
+}
+
+
+
+
+/**
+ * Recomputes the halo of an array which already has one: the outer width
+ * elements on either side of each axis are set from the interior, as for
+ * padded_view, and the interior is not touched. This is the ghost-cell
+ * update for arrays which keep their halo between stencil steps, and
+ * costs only as much as the halo itself.
+ *
+ * Axes are filled in order. The halo of axis n is copied a hyperplane at
+ * a time, spanning the full (already filled) extent of the axes before n
+ * and the interior of the axes after it, so that corners come out as if
+ * each axis were mapped independently. Throws std::invalid_argument if
+ * the halo is wider than the array allows.
+ */
+template<typename T, int R>
+void nd::fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value)
+{
+    auto shape = A.shape();
+
+    for (int n = 0; n < R; ++n)
+    {
+        if (width[n] < 0 || shape[n] < 2 * width[n] || (modes[n] != boundary::constant && width[n] > 0 && shape[n] == 2 * width[n]))
+        {
+            throw std::invalid_argument("fill_halo: halo of width "
+                + shape::to_string(width)
+                + " does not fit array of shape "
+                + shape::to_string(shape));
+        }
+    }
+
+    for (int n = 0; n < R; ++n)
+    {
+        auto corner = width;
+        auto extent = shape;
+        int size = shape[n] - 2 * width[n];
+
+        for (int m = 0; m < R; ++m)
+        {
+            if (m < n)
+            {
+                corner[m] = 0;
+            }
+            else
+            {
+                extent[m] = shape[m] - 2 * width[m];
+            }
+        }
+        extent[n] = 1;
+
+        auto plane = [&] (int index)
+        {
+            auto c = corner;
+            c[n] = index;
+            return A.region(c, extent);
+        };
+
+        for (int j = 0; j < width[n]; ++j)
+        {
+            int lower = j;
+            int upper = shape[n] - 1 - j;
+
+            if (modes[n] == boundary::constant)
+            {
+                plane(lower) = value;
+                plane(upper) = value;
+            }
+            else
+            {
+                auto lo = plane(lower);
+                auto hi = plane(upper);
+                lo = plane(width[n] + boundary_index(j - width[n], size, modes[n]));
+                hi = plane(width[n] + boundary_index(size + width[n] - 1 - j, size, modes[n]));
+            }
+        }
+    }
+}
+
+/**
+ * Recomputes the halo of an array with the same boundary mode on every
+ * axis.
+ */
+template<typename T, int R>
+void nd::fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value)
+{
+    auto modes = std::array<boundary, R>();
+    modes.fill(mode);
+    fill_halo(A, width, modes, value);
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_BOUNDARY
+#include "catch.hpp"
+
+
+TEST_CASE("boundary_index maps indexes past the edges", "[boundary]")
+{
+    using nd::boundary;
+    using nd::boundary_index;
+
+    CHECK(boundary_index(-1, 5, boundary::periodic) == 4);
+    CHECK(boundary_index(7, 5, boundary::periodic) == 2);
+    CHECK(boundary_index(-11, 5, boundary::periodic) == 4);
+    CHECK(boundary_index(-1, 5, boundary::reflect) == 1);
+    CHECK(boundary_index(-2, 5, boundary::reflect) == 2);
+    CHECK(boundary_index(5, 5, boundary::reflect) == 3);
+    CHECK(boundary_index(9, 5, boundary::reflect) == 1);
+    CHECK(boundary_index(-3, 1, boundary::reflect) == 0);
+    CHECK(boundary_index(-1, 5, boundary::symmetric) == 0);
+    CHECK(boundary_index(5, 5, boundary::symmetric) == 4);
+    CHECK(boundary_index(11, 5, boundary::symmetric) == 1);
+    CHECK(boundary_index(-7, 5, boundary::nearest) == 0);
+    CHECK(boundary_index(9, 5, boundary::nearest) == 4);
+    CHECK(boundary_index(3, 5, boundary::constant) == 3);
+    CHECK_THROWS_AS(boundary_index(5, 5, boundary::constant), std::out_of_range);
+}
+
+
+TEST_CASE("padded views compute halos on access", "[boundary]")
+{
+    auto A = nd::arange<int>(12).reshape(3, 4);
+
+    SECTION("periodic")
+    {
+        auto P = nd::pad(A, {1, 2}, nd::boundary::periodic);
+        CHECK(P.shape() == std::array<int, 2>{5, 8});
+        CHECK(P(1, 2) == A(0, 0));
+        CHECK(P(0, 0) == A(2, 2));
+        CHECK(P(4, 7) == A(0, 1));
+        CHECK_THROWS_AS(P(5, 0), std::out_of_range);
+    }
+
+    SECTION("mixed, with a constant axis taking precedence in corners")
+    {
+        auto P = nd::pad(A, {1, 1}, {nd::boundary::constant, nd::boundary::reflect}, -1);
+        CHECK(P(0, 2) == -1);
+        CHECK(P(0, 0) == -1);
+        CHECK(P(1, 0) == A(0, 1));
+        CHECK(P(3, 5) == A(2, 2));
+    }
+
+    SECTION("the view shares the array's memory")
+    {
+        auto P = nd::pad(A, {1, 1}, nd::boundary::nearest);
+        A(0, 0) = 100;
+        CHECK(P(0, 0) == 100);
+
+        const auto& C = A;
+        auto Q = nd::pad(C, {1, 1}, nd::boundary::periodic);
+        A(2, 3) = 200;
+        CHECK(Q(0, 0) == 200);
+    }
+}
+
+
+TEST_CASE("materialized padded arrays match their views", "[boundary]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<double>(60).reshape(3, 4, 5).select(_, _|0|4, _|0|5|2).reverse<2>();
+    auto B = A.copy();
+    auto modes = {nd::boundary::periodic, nd::boundary::reflect, nd::boundary::symmetric, nd::boundary::nearest, nd::boundary::constant};
+
+    for (auto m0 : modes)
+    {
+        for (auto m2 : modes)
+        {
+            auto P = nd::pad(B, {2, 1, 3}, {m0, nd::boundary::periodic, m2}, 0.5);
+            auto Q = P.materialize();
+            bool same = true;
+
+            for (int i = 0; i < Q.shape(0); ++i)
+                for (int j = 0; j < Q.shape(1); ++j)
+                    for (int k = 0; k < Q.shape(2); ++k)
+                        same = same && Q(i, j, k) == P(i, j, k);
+
+            CHECK(same);
+        }
+    }
+
+    SECTION("fill_halo only writes the halo")
+    {
+        auto P = nd::ndarray<double, 2>(7, 8);
+        P = 9.0;
+        nd::fill_halo(P, {2, 1}, nd::boundary::constant, 0.0);
+        CHECK(P(2, 1) == 9.0);
+        CHECK(P(4, 6) == 9.0);
+        CHECK(P(1, 3) == 0.0);
+        CHECK(P(3, 7) == 0.0);
+        CHECK_THROWS_AS(nd::fill_halo(P, {4, 1}, nd::boundary::periodic, 0.0), std::invalid_argument);
+        CHECK_THROWS_AS(nd::pad(A, {1, 1, -1}, nd::boundary::periodic), std::invalid_argument);
+    }
+}
+
+#endif // TEST_BOUNDARY
@@ -1,4 +1,7 @@
 #pragma once
+#include <array>
+#include <memory>
+#include <functional>
 
 
 
@@ -7,6 +10,25 @@
 namespace nd // ND_API_START
 {
     template<typename T> class buffer;
+
+    /**
+     * Tag for buffers (and arrays) whose memory is allocated but not
+     * initialized, so that it is first written, and on NUMA machines
+     * placed, by whichever threads fill it. Elements of types with
+     * non-trivial constructors are still default-constructed.
+     */
+    struct uninitialized_t {};
+    static constexpr uninitialized_t uninitialized {};
+
+/**
+ * Buffers created by buffer<T>::make whose elements fit in this many bytes
+ * keep them in the same allocation as the buffer and its shared_ptr control
+ * block, so a small array costs a single allocation. Other buffers do not
+ * reserve this space. Define the macro to 0 to disable the inline storage.
+ */
+#ifndef ND_BUFFER_INLINE_BYTES
+#define ND_BUFFER_INLINE_BYTES 128
+#endif
 } // ND_API_END
 
 
@@ -18,14 +40,32 @@ class nd::buffer
 {
 public:
 
+    enum { inline_capacity = ND_BUFFER_INLINE_BYTES / sizeof(T) };
+
+    /**
+     * Returns a shared buffer of count elements, constructed as by
+     * buffer(count, args...). If they fit in the inline capacity, the
+     * elements are stored in the same allocation as the buffer and its
+     * control block; otherwise they are in a separate heap allocation.
+     */
+    template<typename... Args>
+    static std::shared_ptr<buffer<T>> make(std::size_t count, Args... args)
+    {
+        if (count <= inline_capacity)
+        {
+            return std::make_shared<compact>(count, args...);
+        }
+        return std::make_shared<buffer<T>>(count, args...);
+    }
+
     buffer() {}
 
     buffer(const buffer<T>& other)
     {
         count = other.count;
-        memory = new T[count];
+        memory = allocate(count);
 
-        for (int n = 0; n < count; ++n)
+        for (std::size_t n = 0; n < count; ++n)
         {
             memory[n] = other.memory[n];
         }
@@ -33,17 +73,12 @@ public:
 
     buffer(buffer<T>&& other)
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
-
-        other.memory = nullptr;
-        other.count = 0;
+        steal(other);
     }
 
     explicit buffer(std::size_t count, const T& value = T()) : count(count)
     {
-        memory = new T[count];
+        memory = allocate(count);
 
         for (std::size_t n = 0; n < count; ++n)
         {
@@ -51,6 +86,25 @@ public:
         }
     }
 
+    buffer(std::size_t count, uninitialized_t) : count(count)
+    {
+        memory = allocate(count);
+    }
+
+    /**
+     * Adopts count elements of memory allocated elsewhere, without copying
+     * them. The deleter is invoked on the memory when the buffer is
+     * destroyed. If the deleter is empty, the memory is only borrowed, and
+     * must outlive the buffer.
+     */
+    buffer(T* data, std::size_t count, std::function<void(T*)> deleter)
+    : memory(data)
+    , count(count)
+    , external(true)
+    , deleter(deleter)
+    {
+    }
+
     template< class InputIt >
     buffer(InputIt first, InputIt last)
     {
@@ -63,7 +117,7 @@ public:
                 ++it;
                 ++count;
             }
-            memory = new T[count];
+            memory = allocate(count);
         }
 
         {
@@ -81,17 +135,21 @@ public:
 
     ~buffer()
     {
-        delete [] memory;
+        release();
     }
 
     buffer<T>& operator=(const buffer<T>& other)
     {
-        delete [] memory;
+        if (this == &other)
+        {
+            return *this;
+        }
+        release();
 
         count = other.count;
-        memory = new T[count];
+        memory = allocate(count);
 
-        for (int n = 0; n < count; ++n)
+        for (std::size_t n = 0; n < count; ++n)
         {
             memory[n] = other.memory[n];
         }
@@ -100,12 +158,11 @@ public:
 
     buffer<T>& operator=(buffer<T>&& other)
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
-
-        other.memory = nullptr;
-        other.count = 0;
+        if (this != &other)
+        {
+            release();
+            steal(other);
+        }
         return *this;
     }
 
@@ -136,6 +193,16 @@ public:
         return count;
     }
 
+    bool is_inline() const
+    {
+        return local;
+    }
+
+    bool is_external() const
+    {
+        return external;
+    }
+
     const T* data() const
     {
         return memory;
@@ -163,8 +230,103 @@ public:
     const T* end() const { return memory + count; }
 
 private:
+    class compact;
+
+    T* allocate(std::size_t size)
+    {
+        return new T[size];
+    }
+
+    void release()
+    {
+        if (external)
+        {
+            if (deleter)
+            {
+                deleter(memory);
+            }
+        }
+        else if (! local)
+        {
+            delete [] memory;
+        }
+        memory = nullptr;
+        count = 0;
+        external = false;
+        local = false;
+        deleter = nullptr;
+    }
+
+    void steal(buffer<T>& other)
+    {
+        if (other.local)
+        {
+            memory = allocate(other.count);
+
+            for (std::size_t n = 0; n < other.count; ++n)
+            {
+                memory[n] = std::move(other.memory[n]);
+            }
+        }
+        else
+        {
+            memory = other.memory;
+        }
+        count = other.count;
+        external = other.external;
+        deleter = std::move(other.deleter);
+
+        other.memory = nullptr;
+        other.count = 0;
+        other.external = false;
+        other.local = false;
+        other.deleter = nullptr;
+    }
+
     T* memory = nullptr;
     std::size_t count = 0;
+    bool external = false;
+    bool local = false;
+    std::function<void(T*)> deleter;
+};
+
+
+
+
+/**
+ * A buffer followed by room for inline_capacity elements, which it uses as
+ * its memory. It is only created by buffer<T>::make, through
+ * std::make_shared, and is owned through shared_ptr<buffer<T>>. Copies and
+ * moves into a plain buffer put the elements on the heap.
+ */
+template<typename T>
+class nd::buffer<T>::compact : public buffer<T>
+{
+public:
+    compact(std::size_t count, const T& value = T())
+    {
+        adopt(count);
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            this->memory[n] = value;
+        }
+    }
+
+    compact(std::size_t count, uninitialized_t)
+    {
+        adopt(count);
+    }
+
+private:
+    void adopt(std::size_t count)
+    {
+        this->memory = storage.data();
+        this->count = count;
+        this->local = true;
+    }
+
+    std::array<T, inline_capacity> storage;
 }; // ND_IMPL_END
 
 
@@ -257,4 +419,76 @@ TEST_CASE("buffer can be constructed from", "[buffer]")
 }
 
 
+TEST_CASE("small buffers keep their elements inline", "[buffer]")
+{
+    SECTION("Small buffers share one allocation with their control block")
+    {
+        auto A = nd::buffer<double>::make(9, 1.5);
+        auto B = nd::buffer<double>::make(nd::buffer<double>::inline_capacity + 1, 1.5);
+        auto C = nd::buffer<double>::make(9, nd::uninitialized);
+        REQUIRE(A->is_inline());
+        REQUIRE(C->is_inline());
+        REQUIRE_FALSE(B->is_inline());
+        REQUIRE_FALSE(nd::buffer<double>(9, 1.5).is_inline());
+        REQUIRE((*A)[8] == 1.5);
+        REQUIRE(A->size() == 9);
+        REQUIRE(B->size() == nd::buffer<double>::inline_capacity + 1);
+    }
+
+    SECTION("Buffers do not reserve inline space they do not use")
+    {
+        REQUIRE(sizeof(nd::buffer<double>) < ND_BUFFER_INLINE_BYTES);
+        REQUIRE(sizeof(nd::buffer<double>) == sizeof(nd::buffer<char>));
+    }
+
+    SECTION("Inline buffers can be copied and moved")
+    {
+        auto A = nd::buffer<double>::make(9, 1.5);
+        nd::buffer<double> B = *A;
+        nd::buffer<double> C = std::move(*A);
+
+        REQUIRE(B == C);
+        REQUIRE_FALSE(C.is_inline());
+        REQUIRE(C.data() != B.data());
+        REQUIRE(A->size() == 0);
+        REQUIRE(A->data() == nullptr);
+
+        B = std::move(C);
+        REQUIRE(B.size() == 9);
+        REQUIRE(B[0] == 1.5);
+
+        *A = B;
+        REQUIRE(*A == B);
+        REQUIRE_FALSE(A->is_inline());
+    }
+}
+
+
+TEST_CASE("buffers can adopt external memory", "[buffer]")
+{
+    SECTION("The deleter is called once, when the buffer is destroyed")
+    {
+        auto calls = 0;
+        auto data = new double[4]{0, 1, 2, 3};
+        {
+            nd::buffer<double> A(data, 4, [&] (double* p) { delete [] p; ++calls; });
+            nd::buffer<double> B = std::move(A);
+            REQUIRE(B.is_external());
+            REQUIRE(B.data() == data);
+            REQUIRE(B[3] == 3);
+        }
+        REQUIRE(calls == 1);
+    }
+
+    SECTION("Borrowed memory is left alone, and copies own their memory")
+    {
+        double data[4] = {0, 1, 2, 3};
+        nd::buffer<double> A(data, 4, nullptr);
+        nd::buffer<double> B = A;
+        REQUIRE_FALSE(B.is_external());
+        REQUIRE(B.data() != data);
+        REQUIRE(B == A);
+    }
+}
+
 #endif // TEST_BUFFER
\ No newline at end of file
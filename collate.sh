@@ -8,6 +8,34 @@ cat << EOF
 #include <memory>
 #include <cstring>
 #include <functional>
+#include <tuple>
+#include <cstdlib>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <iterator>
+#include <initializer_list>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <cmath>
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 EOF
 
 
@@ -0,0 +1,675 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <stdexcept>
+#include "ndarray.hpp"
+#include "parallel.hpp"
+#include "boundary.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int R> class decomposition;
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * Splits an array into a grid of subdomains, one per worker thread, for
+ * solvers which would otherwise need MPI to use every core. The array
+ * keeps a halo of the given ghost width, as for fill_halo, and its
+ * interior is cut into blocks[n] nearly equal pieces along each axis.
+ * Subdomain k owns one box of the interior, and works on a private copy
+ * of it, local(k), which is padded by the ghost width and allocated by
+ * the thread that runs it, so its pages are first touched (and on NUMA
+ * machines, placed) near that thread's core.
+ *
+ * exchange() refreshes every ghost layer: ghosts facing another subdomain
+ * are copied from its interior, and ghosts on the array's edges either
+ * keep the array's halo (the default, e.g. for fixed boundary values) or
+ * are computed from a boundary mode per axis, as for padded_view; periodic
+ * axes exchange across the edge. run() drives a time loop: each worker
+ * updates its own subdomain, then the workers exchange ghosts, with
+ * barriers in between, until gather() writes the result back.
+ *
+ * For example, a Jacobi step over four subdomains:
+ *
+ * auto D = nd::decomposition<double, 2>(A, {1, 1}, {2, 2});
+ * D.run(100, [&] (int k, auto& U) { L.apply(U, tmp[k]); D.interior(k) = tmp[k]; });
+ * D.gather();
+ */
+template<typename T, int R> // ND_IMPL_START
+class nd::decomposition
+{
+public:
+    using value_type = T;
+    using index_type = std::array<int, R>;
+    using modes_type = std::array<boundary, R>;
+
+    /**
+     * Decomposes A into parallel::num_threads() subdomains, as chosen by
+     * partition(), keeping its halo fixed.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost)
+    : decomposition(A, ghost, partition(interior_shape(A, ghost), parallel::num_threads()))
+    {
+    }
+
+    /**
+     * Decomposes A into the given number of subdomains along each axis,
+     * keeping its halo fixed.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks)
+    : decomposition(A, ghost, blocks, modes_type(), T(), false)
+    {
+    }
+
+    /**
+     * Decomposes A into the given number of subdomains along each axis,
+     * computing the ghosts on its edges from the given boundary modes.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks, modes_type modes, T value=T())
+    : decomposition(A, ghost, blocks, modes, value, true)
+    {
+    }
+
+    /**
+     * Factors count into a number of subdomains along each axis of the
+     * given interior shape, giving each factor to the axis whose pieces
+     * are currently longest, which keeps subdomains compact and the ghost
+     * layers they exchange small.
+     */
+    static index_type partition(index_type shape, int count)
+    {
+        auto blocks = index_type();
+        auto factors = std::vector<int>();
+        blocks.fill(1);
+
+        for (int p = 2; p * p <= count; ++p)
+        {
+            while (count % p == 0)
+            {
+                factors.push_back(p);
+                count /= p;
+            }
+        }
+        if (count > 1)
+        {
+            factors.push_back(count);
+        }
+
+        for (auto f = factors.rbegin(); f != factors.rend(); ++f)
+        {
+            int axis = 0;
+
+            for (int n = 1; n < R; ++n)
+            {
+                if (long(shape[n]) * blocks[axis] > long(shape[axis]) * blocks[n])
+                {
+                    axis = n;
+                }
+            }
+            blocks[axis] *= *f;
+        }
+        return blocks;
+    }
+
+    int size() const
+    {
+        return int(locals.size());
+    }
+
+    index_type get_blocks() const
+    {
+        return blocks;
+    }
+
+    index_type get_ghost() const
+    {
+        return ghost;
+    }
+
+    /**
+     * The index in the decomposed array of the first element owned by
+     * subdomain k.
+     */
+    index_type lower(int k) const
+    {
+        auto c = coordinates(k);
+        auto index = index_type();
+
+        for (int n = 0; n < R; ++n)
+        {
+            index[n] = ghost[n] + offset(n, c[n]);
+        }
+        return index;
+    }
+
+    /**
+     * The shape of the box owned by subdomain k.
+     */
+    index_type shape(int k) const
+    {
+        auto c = coordinates(k);
+        auto s = index_type();
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = offset(n, c[n] + 1) - offset(n, c[n]);
+        }
+        return s;
+    }
+
+    /**
+     * The working array of subdomain k: its box, padded by the ghost width.
+     */
+    ndarray<T, R>& local(int k)
+    {
+        return locals.at(k);
+    }
+
+    /**
+     * A view of the box owned by subdomain k within its working array,
+     * i.e. local(k) without its ghosts.
+     */
+    ndarray<T, R> interior(int k)
+    {
+        auto& L = locals.at(k);
+        return L.region(ghost, shape(k));
+    }
+
+    /**
+     * A view of the box owned by subdomain k within the decomposed array.
+     */
+    ndarray<T, R> subdomain(int k)
+    {
+        return global.region(lower(k), shape(k));
+    }
+
+    auto subdomain(int k) const
+    {
+        return global.region(lower(k), shape(k));
+    }
+
+    /**
+     * Copies every subdomain, ghosts included, from the decomposed array.
+     */
+    void scatter()
+    {
+        for (int k = 0; k < size(); ++k)
+        {
+            scatter(k);
+        }
+    }
+
+    /**
+     * Copies every subdomain's interior back to the decomposed array.
+     */
+    void gather()
+    {
+        for (int k = 0; k < size(); ++k)
+        {
+            auto target = subdomain(k);
+            target = interior(k);
+        }
+    }
+
+    /**
+     * Refreshes the ghosts of every subdomain on the calling thread.
+     */
+    void exchange()
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            for (int k = 0; k < size(); ++k)
+            {
+                exchange(k, n);
+            }
+        }
+    }
+
+    /**
+     * Runs the given number of steps with one worker thread per subdomain.
+     * On each step, worker k calls f(k, local(k)), which should update the
+     * interior of its subdomain from the subdomain and its ghosts and must
+     * not touch other subdomains; then every ghost layer is exchanged. The
+     * workers synchronize on a barrier after the update, and after the
+     * exchange along each axis, because ghosts on later axes include the
+     * corners filled along earlier ones. If f throws, the other workers
+     * stop at their next barrier and the exception is rethrown here.
+     */
+    template<typename Function>
+    void run(int steps, Function f)
+    {
+        parallel::barrier sync(size());
+
+        parallel::for_each_worker(size(), [&] (int k)
+        {
+            try {
+                for (int s = 0; s < steps; ++s)
+                {
+                    f(k, locals[k]);
+
+                    if (! sync.wait())
+                    {
+                        return;
+                    }
+                    for (int n = 0; n < R; ++n)
+                    {
+                        exchange(k, n);
+
+                        if (! sync.wait())
+                        {
+                            return;
+                        }
+                    }
+                }
+            }
+            catch (...) {
+                sync.cancel();
+                throw;
+            }
+        });
+    }
+
+private:
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks, modes_type modes, T value, bool edges)
+    : global(A)
+    , ghost(ghost)
+    , blocks(blocks)
+    , modes(modes)
+    , value(value)
+    , edges(edges)
+    {
+        auto interior = interior_shape(A, ghost);
+        int count = 1;
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (blocks[n] < 1)
+            {
+                throw std::invalid_argument("decomposition: number of blocks must be positive");
+            }
+            count *= blocks[n];
+
+            for (int c = 0; c < blocks[n]; ++c)
+            {
+                int extent = offset(n, c + 1) - offset(n, c);
+                bool mirror = edges && (modes[n] == boundary::reflect) && (c == 0 || c == blocks[n] - 1);
+
+                if (extent < std::max(ghost[n] + mirror, 1))
+                {
+                    throw std::invalid_argument("decomposition: cannot split interior of shape "
+                        + shape::to_string(interior)
+                        + " into "
+                        + shape::to_string(blocks)
+                        + " blocks with ghost width "
+                        + shape::to_string(ghost));
+                }
+            }
+        }
+
+        locals.resize(count);
+
+        parallel::for_each_worker(count, [this] (int k)
+        {
+            auto padded = shape(k);
+
+            for (int n = 0; n < R; ++n)
+            {
+                padded[n] += 2 * this->ghost[n];
+            }
+            auto L = ndarray<T, R>(padded);
+            locals[k].become(L);
+            scatter(k);
+        });
+
+        if (edges)
+        {
+            exchange();
+        }
+    }
+
+    static index_type interior_shape(const ndarray<T, R>& A, index_type ghost)
+    {
+        auto s = A.shape();
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (ghost[n] < 0 || s[n] < 2 * ghost[n])
+            {
+                throw std::invalid_argument("decomposition: ghost width "
+                    + shape::to_string(ghost)
+                    + " does not fit array of shape "
+                    + shape::to_string(s));
+            }
+            s[n] -= 2 * ghost[n];
+        }
+        return s;
+    }
+
+    /**
+     * The interior index along axis n at which block c starts.
+     */
+    int offset(int n, int c) const
+    {
+        long size = global.shape(n) - 2 * ghost[n];
+        return int(size * c / blocks[n]);
+    }
+
+    index_type coordinates(int k) const
+    {
+        auto c = index_type();
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            c[n] = k % blocks[n];
+            k /= blocks[n];
+        }
+        return c;
+    }
+
+    int block(index_type c) const
+    {
+        int k = 0;
+
+        for (int n = 0; n < R; ++n)
+        {
+            k = k * blocks[n] + c[n];
+        }
+        return k;
+    }
+
+    void scatter(int k)
+    {
+        auto padded = shape(k);
+        auto start = lower(k);
+
+        for (int n = 0; n < R; ++n)
+        {
+            padded[n] += 2 * ghost[n];
+            start[n] -= ghost[n];
+        }
+        locals[k] = global.region(start, padded);
+    }
+
+    /**
+     * Fills the ghosts of subdomain k along axis n, spanning the full
+     * extent (ghosts included) of the axes before n and the interior of
+     * the axes after it, like fill_halo. The region read from a neighbour
+     * lies in its interior along axes n and later, so it is never written
+     * during the same phase.
+     */
+    void exchange(int k, int n)
+    {
+        if (ghost[n] == 0)
+        {
+            return;
+        }
+        auto c = coordinates(k);
+        auto s = shape(k);
+        auto corner = ghost;
+        auto extent = s;
+
+        for (int m = 0; m < n; ++m)
+        {
+            corner[m] = 0;
+            extent[m] += 2 * ghost[m];
+        }
+        extent[n] = ghost[n];
+
+        for (int side = 0; side < 2; ++side)
+        {
+            int neighbour = c[n] + (side ? 1 : -1);
+            bool edge = neighbour < 0 || neighbour >= blocks[n];
+            auto target = corner;
+            target[n] = side ? ghost[n] + s[n] : 0;
+
+            if (! edge || (edges && modes[n] == boundary::periodic))
+            {
+                auto d = c;
+                d[n] = (neighbour + blocks[n]) % blocks[n];
+                auto source = corner;
+                source[n] = side ? ghost[n] : shape(block(d))[n];
+                auto to = locals[k].region(target, extent);
+                to = locals[block(d)].region(source, extent);
+            }
+            else if (edges && modes[n] == boundary::constant)
+            {
+                locals[k].region(target, extent) = value;
+            }
+            else if (edges)
+            {
+                int size = global.shape(n) - 2 * ghost[n];
+                auto plane = extent;
+                plane[n] = 1;
+
+                for (int j = 0; j < ghost[n]; ++j)
+                {
+                    auto to = target;
+                    auto from = corner;
+                    to[n] += j;
+                    from[n] = ghost[n] - offset(n, c[n]) + boundary_index(side ? size + j : j - ghost[n], size, modes[n]);
+                    auto A = locals[k].region(to, plane);
+                    A = locals[k].region(from, plane);
+                }
+            }
+        }
+    }
+
+    ndarray<T, R> global;
+    index_type ghost;
+    index_type blocks;
+    modes_type modes;
+    T value;
+    bool edges;
+    std::vector<ndarray<T, R>> locals;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_DECOMPOSITION
+#include "catch.hpp"
+#include "stencil.hpp"
+
+
+static nd::ndarray<double, 2> decomposition_test_array(int ni, int nj)
+{
+    auto A = nd::ndarray<double, 2>(ni, nj);
+
+    for (int i = 0; i < ni; ++i)
+    {
+        for (int j = 0; j < nj; ++j)
+        {
+            A(i, j) = (i * 37 + j * 11) % 23 - 0.5 * j;
+        }
+    }
+    return A;
+}
+
+
+TEST_CASE("decomposition::partition gives factors to the longest axes", "[decomposition]")
+{
+    using D3 = nd::decomposition<double, 3>;
+    using D2 = nd::decomposition<double, 2>;
+
+    CHECK(D3::partition({100, 100, 100}, 8) == (std::array<int, 3>{2, 2, 2}));
+    CHECK(D3::partition({100, 100, 100}, 1) == (std::array<int, 3>{1, 1, 1}));
+    CHECK(D2::partition({1000, 10}, 4) == (std::array<int, 2>{4, 1}));
+    CHECK(D2::partition({100, 100}, 6) == (std::array<int, 2>{3, 2}));
+    CHECK(D2::partition({100, 100}, 7) == (std::array<int, 2>{7, 1}));
+}
+
+
+TEST_CASE("decomposition scatters and gathers subdomains", "[decomposition]")
+{
+    auto A = decomposition_test_array(12, 11);
+    auto B = nd::ndarray<double, 2>(A);
+    auto D = nd::decomposition<double, 2>(A, {1, 2}, {3, 2});
+
+    REQUIRE(D.size() == 6);
+    CHECK(D.lower(0) == (std::array<int, 2>{1, 2}));
+    CHECK(D.lower(5) == (std::array<int, 2>{7, 5}));
+    CHECK(D.shape(5) == (std::array<int, 2>{4, 4}));
+
+    for (int k = 0; k < D.size(); ++k)
+    {
+        auto lo = D.lower(k);
+        auto s = D.shape(k);
+
+        CHECK(D.local(k).shape() == (std::array<int, 2>{s[0] + 2, s[1] + 4}));
+
+        for (int i = 0; i < s[0] + 2; ++i)
+        {
+            for (int j = 0; j < s[1] + 4; ++j)
+            {
+                CHECK(D.local(k)(i, j) == A(lo[0] - 1 + i, lo[1] - 2 + j));
+            }
+        }
+        D.interior(k) = double(k);
+    }
+
+    SECTION("the locals do not share memory with the array")
+    {
+        CHECK((A == B).all());
+    }
+
+    SECTION("gather writes the interior only")
+    {
+        D.gather();
+
+        for (int k = 0; k < D.size(); ++k)
+        {
+            auto S = D.subdomain(k);
+            CHECK(std::all_of(S.begin(), S.end(), [k] (double x) { return x == k; }));
+            CHECK(S.shares(A));
+        }
+        const auto& C = D;
+        CHECK(C.subdomain(0).is_const_ref());
+        CHECK(C.subdomain(0).shares(A));
+        CHECK(C.subdomain(0)(0, 0) == 0.0);
+        auto _ = nd::axis::all();
+        CHECK((A.take<0>(_|0|1) == B.take<0>(_|0|1)).all());
+        CHECK((A.take<0>(_|11|12) == B.take<0>(_|11|12)).all());
+        CHECK((A.take<1>(_|0|2) == B.take<1>(_|0|2)).all());
+        CHECK((A.take<1>(_|9|11) == B.take<1>(_|9|11)).all());
+    }
+}
+
+
+TEST_CASE("decomposition ghosts match a halo filled with the same boundaries", "[decomposition]")
+{
+    using nd::boundary;
+
+    auto modes = {boundary::periodic, boundary::reflect, boundary::symmetric, boundary::nearest, boundary::constant};
+
+    for (auto m0 : modes)
+    {
+        for (auto m1 : modes)
+        {
+            auto A = decomposition_test_array(16, 13);
+            auto P = nd::ndarray<double, 2>(A);
+            nd::fill_halo(P, {2, 1}, {m0, m1}, -1.0);
+
+            auto D = nd::decomposition<double, 2>(A, {2, 1}, {3, 2}, {m0, m1}, -1.0);
+
+            for (int k = 0; k < D.size(); ++k)
+            {
+                auto lo = D.lower(k);
+                auto L = D.local(k);
+
+                for (int i = 0; i < L.shape(0); ++i)
+                {
+                    for (int j = 0; j < L.shape(1); ++j)
+                    {
+                        CHECK(L(i, j) == P(lo[0] - 2 + i, lo[1] - 1 + j));
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+TEST_CASE("decomposition::run matches a serial stencil sweep", "[decomposition]")
+{
+    auto L = nd::stencil<double, 2>::laplacian(0.2);
+    L.add({0, 0}, 1.0);
+
+    SECTION("fixed boundaries")
+    {
+        auto A = decomposition_test_array(40, 33);
+        auto expected = L.sweep(A, 7);
+        auto D = nd::decomposition<double, 2>(A, {1, 1}, {2, 2});
+        auto tmp = std::vector<nd::ndarray<double, 2>>(D.size());
+
+        for (int k = 0; k < D.size(); ++k)
+        {
+            auto B = nd::ndarray<double, 2>(D.shape(k));
+            tmp[k].become(B);
+        }
+        D.run(7, [&] (int k, nd::ndarray<double, 2>& U)
+        {
+            L.apply(U, tmp[k]);
+            D.interior(k) = tmp[k];
+        });
+        D.gather();
+        CHECK((A == expected).all());
+    }
+
+    SECTION("periodic boundaries")
+    {
+        auto A = decomposition_test_array(30, 27);
+        auto P = nd::ndarray<double, 2>(A);
+        auto D = nd::decomposition<double, 2>(A, {1, 1}, {3, 1}, {nd::boundary::periodic, nd::boundary::periodic});
+        auto _ = nd::axis::all();
+
+        for (int s = 0; s < 5; ++s)
+        {
+            nd::fill_halo(P, {1, 1}, nd::boundary::periodic);
+            auto B = L(P);
+            auto I = P.take<0>(_|1|29).take<1>(_|1|26);
+            I = B;
+        }
+        D.run(5, [&] (int k, nd::ndarray<double, 2>& U)
+        {
+            D.interior(k) = L(U);
+        });
+        D.gather();
+
+        auto I = A.take<0>(_|1|29).take<1>(_|1|26);
+        auto J = P.take<0>(_|1|29).take<1>(_|1|26);
+        CHECK((I == J).all());
+    }
+}
+
+
+TEST_CASE("decomposition::run stops every worker when one throws", "[decomposition]")
+{
+    auto A = decomposition_test_array(20, 20);
+    auto D = nd::decomposition<double, 2>(A, {1, 1}, {2, 2});
+    auto f = [] (int k, nd::ndarray<double, 2>&) { if (k == 3) throw std::runtime_error("step"); };
+
+    CHECK_THROWS_AS(D.run(3, f), std::runtime_error);
+}
+
+
+TEST_CASE("decomposition rejects blocks which do not fit", "[decomposition]")
+{
+    auto A = decomposition_test_array(8, 8);
+
+    CHECK_THROWS_AS((nd::decomposition<double, 2>(A, {5, 1}, {1, 1})), std::invalid_argument);
+    CHECK_THROWS_AS((nd::decomposition<double, 2>(A, {2, 1}, {3, 1})), std::invalid_argument);
+    CHECK_THROWS_AS((nd::decomposition<double, 2>(A, {1, 1}, {0, 1})), std::invalid_argument);
+    CHECK_THROWS_AS((nd::decomposition<double, 2>(A, {1, 1}, {1, 6}, {nd::boundary::reflect, nd::boundary::reflect})), std::invalid_argument);
+    CHECK_NOTHROW((nd::decomposition<double, 2>(A, {1, 1}, {1, 6})));
+}
+
+#endif // TEST_DECOMPOSITION
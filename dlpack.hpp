@@ -0,0 +1,401 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    /**
+     * Struct definitions which are binary compatible with those in dlpack.h
+     * (https://github.com/dmlc/dlpack), so that arrays can be handed to other
+     * in-process consumers (numpy, PyTorch, CuPy, ...) without copying and
+     * without a dependency on the DLPack headers. If you do include dlpack.h,
+     * pointers to these types may be reinterpret_cast to the ones there.
+     */
+    namespace dlpack
+    {
+        enum DLDeviceType : int32_t { kDLCPU = 1 };
+        enum DLDataTypeCode : uint8_t { kDLInt = 0, kDLUInt = 1, kDLFloat = 2, kDLBool = 6 };
+
+        struct DLDevice
+        {
+            int32_t device_type;
+            int32_t device_id;
+        };
+
+        struct DLDataType
+        {
+            uint8_t code;
+            uint8_t bits;
+            uint16_t lanes;
+        };
+
+        struct DLTensor
+        {
+            void* data;
+            DLDevice device;
+            int32_t ndim;
+            DLDataType dtype;
+            int64_t* shape;
+            int64_t* strides;
+            uint64_t byte_offset;
+        };
+
+        struct DLManagedTensor
+        {
+            DLTensor dl_tensor;
+            void* manager_ctx;
+            void (*deleter)(DLManagedTensor* self);
+        };
+
+        /**
+         * The DLPack 1.0 tensor, which carries a version and flags, among
+         * them whether the consumer may write to the memory.
+         */
+        static const uint64_t DLPACK_FLAG_BITMASK_READ_ONLY = 1;
+
+        struct DLPackVersion
+        {
+            uint32_t major;
+            uint32_t minor;
+        };
+
+        struct DLManagedTensorVersioned
+        {
+            DLPackVersion version;
+            void* manager_ctx;
+            void (*deleter)(DLManagedTensorVersioned* self);
+            uint64_t flags;
+            DLTensor dl_tensor;
+        };
+
+        template<typename T>
+        static inline DLDataType dtype();
+
+        static inline void set_flags(DLManagedTensor& tensor, bool read_only);
+        static inline void set_flags(DLManagedTensorVersioned& tensor, bool read_only);
+
+        template<typename Managed, typename T, int R>
+        static inline Managed* export_tensor(ndarray<T, R>& A, bool read_only);
+    }
+
+    template<typename T, int R> static inline dlpack::DLManagedTensor* to_dlpack(ndarray<T, R>& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensor* to_dlpack(const ndarray<T, R>& A);
+    template<typename View> static inline dlpack::DLManagedTensor* to_dlpack(const View& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(ndarray<T, R>& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(const ndarray<T, R>& A);
+    template<typename View> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(const View& A);
+    template<typename T, int R> static inline ndarray<T, R> from_dlpack(dlpack::DLManagedTensor* tensor);
+} // ND_API_END
+
+
+
+
+// ============================================================================
+template<typename T> // ND_IMPL_START
+nd::dlpack::DLDataType nd::dlpack::dtype()
+{
+    static_assert(std::is_arithmetic<T>::value, "dlpack: only arithmetic types can be exported");
+
+    auto code =
+    std::is_same<T, bool>::value ? kDLBool :
+    std::is_floating_point<T>::value ? kDLFloat :
+    std::is_signed<T>::value ? kDLInt : kDLUInt;
+
+    return {uint8_t(code), uint8_t(8 * sizeof(T)), 1};
+}
+
+
+
+
+/**
+ * Records whether the consumer may write to the tensor's memory, where the
+ * tensor type has a place for it.
+ */
+void nd::dlpack::set_flags(DLManagedTensor&, bool)
+{
+}
+
+void nd::dlpack::set_flags(DLManagedTensorVersioned& tensor, bool read_only)
+{
+    tensor.version = {1, 0};
+    tensor.flags = read_only ? DLPACK_FLAG_BITMASK_READ_ONLY : 0;
+}
+
+
+
+
+/**
+ * Builds a managed tensor (DLManagedTensor or DLManagedTensorVersioned)
+ * describing a view of the given array and sharing its memory. The tensor
+ * keeps the memory alive until its deleter is called by the consumer, even
+ * if every array using the memory is gone by then.
+ */
+template<typename Managed, typename T, int R>
+Managed* nd::dlpack::export_tensor(ndarray<T, R>& A, bool read_only)
+{
+    struct context
+    {
+        context(ndarray<T, R>& A) : array(A) {}
+        Managed tensor;
+        ndarray<T, R> array;
+        std::array<int64_t, R> shape;
+        std::array<int64_t, R> strides;
+    };
+
+    auto ctx = new context(A);
+    auto shape = A.shape();
+    auto strides = A.get_strides();
+
+    for (int n = 0; n < R; ++n)
+    {
+        ctx->shape[n] = shape[n];
+        ctx->strides[n] = strides[n];
+    }
+
+    auto& t = ctx->tensor.dl_tensor;
+    t.data = ctx->array.data();
+    t.device = {kDLCPU, 0};
+    t.ndim = R;
+    t.dtype = dtype<T>();
+    t.shape = ctx->shape.data();
+    t.strides = ctx->strides.data();
+    t.byte_offset = ctx->array.data_offset() * sizeof(T);
+
+    ctx->tensor.manager_ctx = ctx;
+    ctx->tensor.deleter = [] (Managed* self)
+    {
+        delete static_cast<context*>(self->manager_ctx);
+    };
+    set_flags(ctx->tensor, read_only);
+    return &ctx->tensor;
+}
+
+/**
+ * Exports a view of the given array as a DLPack managed tensor, sharing its
+ * memory (see dlpack::export_tensor). Const arrays and const views are
+ * exported read-only: the pre-1.0 DLManagedTensor has no flag to say so,
+ * so prefer to_dlpack_versioned for consumers that honor it.
+ */
+template<typename T, int R>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensor>(A, false);
+}
+
+template<typename T, int R>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(const ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensor>(const_cast<ndarray<T, R>&>(A), true);
+}
+
+template<typename View>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(const View& A)
+{
+    return to_dlpack(static_cast<const ndarray<typename View::dtype, View::rank>&>(A));
+}
+
+/**
+ * Exports a view of the given array as a DLPack 1.0 managed tensor, sharing
+ * its memory. Tensors of const arrays and const views have the read-only
+ * flag set.
+ */
+template<typename T, int R>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensorVersioned>(A, false);
+}
+
+template<typename T, int R>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(const ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensorVersioned>(const_cast<ndarray<T, R>&>(A), true);
+}
+
+template<typename View>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(const View& A)
+{
+    return to_dlpack_versioned(static_cast<const ndarray<typename View::dtype, View::rank>&>(A));
+}
+
+
+
+
+/**
+ * Imports a DLPack managed tensor as an array sharing its memory, taking
+ * ownership of the tensor: its deleter is called once the last array using
+ * the memory is gone. Throws std::invalid_argument, without taking
+ * ownership, if the tensor is not in host memory, or its rank or data type
+ * do not match the array.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::from_dlpack(dlpack::DLManagedTensor* tensor)
+{
+    const auto& t = tensor->dl_tensor;
+    const auto d = dlpack::dtype<T>();
+
+    if (t.device.device_type != dlpack::kDLCPU)
+        throw std::invalid_argument("from_dlpack: tensor is not in host memory");
+
+    if (t.ndim != R)
+        throw std::invalid_argument("from_dlpack: tensor has the wrong rank");
+
+    if (t.dtype.code != d.code || t.dtype.bits != d.bits || t.dtype.lanes != d.lanes)
+        throw std::invalid_argument("from_dlpack: tensor has the wrong data type");
+
+    if (t.byte_offset % sizeof(T) != 0)
+        throw std::invalid_argument("from_dlpack: tensor byte offset is not a multiple of the element size");
+
+    auto shape = std::array<int, R>();
+
+    for (int n = 0; n < R; ++n)
+    {
+        shape[n] = int(t.shape[n]);
+    }
+
+    auto strides = selector<R>(shape).strides();
+
+    if (t.strides != nullptr)
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            strides[n] = int(t.strides[n]);
+        }
+    }
+
+    auto data = reinterpret_cast<T*>(static_cast<char*>(t.data) + t.byte_offset);
+
+    return ndarray<T, R>(data, shape, strides, [tensor] (T*)
+    {
+        if (tensor->deleter)
+        {
+            tensor->deleter(tensor);
+        }
+    });
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_DLPACK
+#include "catch.hpp"
+
+
+TEST_CASE("dlpack data types match the DLPack codes", "[dlpack]")
+{
+    CHECK(nd::dlpack::dtype<double>().code == 2);
+    CHECK(nd::dlpack::dtype<double>().bits == 64);
+    CHECK(nd::dlpack::dtype<int>().code == 0);
+    CHECK(nd::dlpack::dtype<unsigned char>().code == 1);
+    CHECK(nd::dlpack::dtype<bool>().code == 6);
+    CHECK(nd::dlpack::dtype<bool>().bits == 8);
+    CHECK(sizeof(nd::dlpack::DLTensor) == 48);
+    CHECK(offsetof(nd::dlpack::DLManagedTensorVersioned, dl_tensor) == 32);
+}
+
+
+TEST_CASE("arrays can be exported to and imported from DLPack", "[dlpack]")
+{
+    SECTION("strided views are described by their strides and byte offset")
+    {
+        auto A = nd::arange<double>(12).reshape(3, 4);
+        auto B = A.transpose().take<0>(nd::axis::all()|1|3);
+        auto T = nd::to_dlpack(B);
+        auto& t = T->dl_tensor;
+
+        CHECK(t.ndim == 2);
+        CHECK(t.shape[0] == 2);
+        CHECK(t.shape[1] == 3);
+        CHECK(t.strides[0] == 1);
+        CHECK(t.strides[1] == 4);
+        CHECK(t.byte_offset == sizeof(double));
+        CHECK(static_cast<double*>(t.data) == A.data());
+        T->deleter(T);
+    }
+
+    SECTION("a round trip shares memory and keeps it alive")
+    {
+        auto B = nd::ndarray<int, 2>();
+        const int* data;
+        {
+            auto A = nd::arange<int>(6).reshape(2, 3);
+            auto T = nd::to_dlpack(A);
+            data = A.data();
+            B.become(nd::from_dlpack<int, 2>(T));
+            CHECK(B.data() == A.data());
+            A(1, 2) = 10;
+        }
+        CHECK(B.data() == data);
+        CHECK(B.shape() == std::array<int, 2>{2, 3});
+        CHECK(B(0, 1) == 1);
+        CHECK(B(1, 2) == 10);
+    }
+
+    SECTION("the producer's deleter is called when the import is destroyed")
+    {
+        struct probe
+        {
+            nd::dlpack::DLManagedTensor tensor;
+            nd::dlpack::DLManagedTensor* producer;
+            bool deleted;
+        };
+        auto A = nd::arange<int>(4);
+        auto T = nd::to_dlpack(A);
+        auto P = probe{*T, T, false};
+
+        P.tensor.deleter = [] (nd::dlpack::DLManagedTensor* self)
+        {
+            auto p = reinterpret_cast<probe*>(self);
+            p->deleted = true;
+            p->producer->deleter(p->producer);
+        };
+        {
+            auto B = nd::from_dlpack<int, 1>(&P.tensor);
+            CHECK(B.data() == A.data());
+            CHECK(B(3) == 3);
+            CHECK_FALSE(P.deleted);
+        }
+        CHECK(P.deleted);
+    }
+
+    SECTION("const arrays and views are exported read-only, sharing memory")
+    {
+        const auto A = nd::arange<double>(12).reshape(3, 4);
+        auto V = A.select(nd::axis::all()|1|3, nd::axis::all()|0|4|2);
+        auto T = nd::to_dlpack(A);
+        auto U = nd::to_dlpack_versioned(V);
+        auto W = nd::to_dlpack_versioned(const_cast<nd::ndarray<double, 2>&>(A));
+
+        CHECK(T->dl_tensor.data == A.data());
+        CHECK(U->dl_tensor.data == A.data());
+        CHECK(U->dl_tensor.byte_offset == 4 * sizeof(double));
+        CHECK(U->dl_tensor.strides[1] == 2);
+        CHECK(U->version.major == 1);
+        CHECK(U->flags == nd::dlpack::DLPACK_FLAG_BITMASK_READ_ONLY);
+        CHECK(W->flags == 0);
+
+        auto B = nd::from_dlpack<double, 2>(T);
+        CHECK(B.data() == A.data());
+        CHECK((B == A).all());
+        U->deleter(U);
+        W->deleter(W);
+    }
+
+    SECTION("mismatched tensors are rejected")
+    {
+        auto A = nd::arange<int>(4);
+        auto T = nd::to_dlpack(A);
+        CHECK_THROWS_AS((nd::from_dlpack<double, 1>(T)), std::invalid_argument);
+        CHECK_THROWS_AS((nd::from_dlpack<int, 2>(T)), std::invalid_argument);
+        T->deleter(T);
+    }
+}
+
+#endif // TEST_DLPACK
@@ -0,0 +1,365 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int R> class growable;
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * An array which grows along its first axis, e.g. a time series recorded
+ * one sample (row) at a time. Memory is reserved for more rows than are
+ * filled, and doubled when it runs out, so appending a row costs amortized
+ * constant time. array() returns the filled rows as an ordinary ndarray
+ * sharing the memory, without copying:
+ *
+ * auto G = nd::growable<double, 2>({3});
+ * G.append(x);                  // x has shape {3}
+ * G.append()(0) = 1.0;          // or fill a new row in place
+ * auto A = G.array();           // A.shape() == {2, 3}
+ *
+ * Appending never changes rows that are already filled, so earlier views
+ * stay valid. When the memory is reallocated, earlier views keep the old
+ * memory (and the values it had), and no longer see new rows.
+ */
+template<typename T, int R> // ND_IMPL_START
+class nd::growable
+{
+public:
+    static_assert(R >= 1, "growable: rank must be at least 1");
+
+    using row_shape_type = std::array<int, R - 1>;
+
+    /**
+     * Creates an empty array whose rows have the given shape, with room for
+     * the given number of rows.
+     */
+    growable(row_shape_type row_shape={}, int capacity=0)
+    : row_shape(row_shape)
+    , buf(buffer<T>::make(0))
+    {
+        for (int n = 0; n < R - 1; ++n)
+        {
+            if (row_shape[n] < 0)
+            {
+                throw std::invalid_argument("growable: row shape must be non-negative");
+            }
+        }
+        reserve(capacity);
+    }
+
+    /**
+     * Creates an array holding a copy of the rows of A.
+     */
+    template<typename U, typename = typename std::enable_if<std::is_same<U, T>::value>::type>
+    growable(const ndarray<U, R>& A) : growable(tail(A.shape()), A.shape(0))
+    {
+        extend(A);
+    }
+
+    std::array<int, R> shape() const
+    {
+        auto s = std::array<int, R>();
+        s[0] = rows;
+        std::copy(row_shape.begin(), row_shape.end(), s.begin() + 1);
+        return s;
+    }
+
+    int shape(int axis) const
+    {
+        return axis == 0 ? rows : row_shape[axis - 1];
+    }
+
+    std::size_t size() const
+    {
+        return std::size_t(rows) * row_size();
+    }
+
+    bool empty() const
+    {
+        return rows == 0;
+    }
+
+    /**
+     * The number of rows that fit before the memory is reallocated.
+     */
+    int capacity() const
+    {
+        return allocated;
+    }
+
+    /**
+     * Makes room for at least count rows in total.
+     */
+    void reserve(int count)
+    {
+        if (count > allocated)
+        {
+            reallocate(count);
+        }
+    }
+
+    /**
+     * Releases the memory reserved beyond the filled rows.
+     */
+    void shrink_to_fit()
+    {
+        if (allocated > rows)
+        {
+            reallocate(rows);
+        }
+    }
+
+    /**
+     * Removes every row, keeping the memory. Views of the array which were
+     * taken earlier see the rows appended afterwards overwrite theirs.
+     */
+    void clear()
+    {
+        rows = 0;
+    }
+
+    /**
+     * Returns the filled rows as an array sharing this one's memory.
+     */
+    ndarray<T, R> array() const
+    {
+        auto s = shape();
+        auto strides = selector<R>(s).strides();
+        auto b = buf;
+        return ndarray<T, R>(s, strides, 0, b);
+    }
+
+    /**
+     * Appends a row with every element set to T(), and returns it as an
+     * array sharing this one's memory, to be filled in place.
+     */
+    ndarray<T, R - 1> append()
+    {
+        grow(1);
+        auto row = std::array<int, R - 1>(row_shape);
+        auto strides = selector<R - 1>(row).strides();
+        auto offset = int(std::size_t(rows) * row_size());
+        std::fill(data() + offset, data() + offset + row_size(), T());
+        ++rows;
+        return ndarray<T, R - 1>(row, strides, offset, buf);
+    }
+
+    /**
+     * Appends a copy of the given row, which must have the row shape;
+     * otherwise std::invalid_argument is thrown.
+     */
+    template<int Rank = R, typename std::enable_if<Rank >= 2>::type* = nullptr>
+    void append(const ndarray<T, R - 1>& row)
+    {
+        if (row.shape() != row_shape)
+        {
+            throw std::invalid_argument("growable: row of shape "
+                + shape::to_string(row.shape())
+                + " does not match rows of shape "
+                + shape::to_string(row_shape));
+        }
+        grow(1);
+        auto to = strided::make_operand(data() + std::size_t(rows) * row_size(), selector<R - 1>(row_shape).strides());
+        auto from = strided::make_operand(row.data() + row.data_offset(), row.get_strides());
+        strided::copy(row_shape, to, from);
+        ++rows;
+    }
+
+    /**
+     * Appends a value to a one-dimensional array.
+     */
+    template<int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    void append(T value)
+    {
+        grow(1);
+        data()[rows] = value;
+        ++rows;
+    }
+
+    /**
+     * Appends copies of the rows of A, whose other extents must match the
+     * row shape; otherwise std::invalid_argument is thrown.
+     */
+    void extend(const ndarray<T, R>& A)
+    {
+        if (tail(A.shape()) != row_shape)
+        {
+            throw std::invalid_argument("growable: rows of shape "
+                + shape::to_string(tail(A.shape()))
+                + " do not match rows of shape "
+                + shape::to_string(row_shape));
+        }
+        grow(A.shape(0));
+        auto to = strided::make_operand(data() + std::size_t(rows) * row_size(), selector<R>(A.shape()).strides());
+        auto from = strided::make_operand(A.data() + A.data_offset(), A.get_strides());
+        strided::copy(A.shape(), to, from);
+        rows += A.shape(0);
+    }
+
+private:
+    static row_shape_type tail(std::array<int, R> s)
+    {
+        auto t = row_shape_type();
+        std::copy(s.begin() + 1, s.end(), t.begin());
+        return t;
+    }
+
+    std::size_t row_size() const
+    {
+        std::size_t size = 1;
+
+        for (int n = 0; n < R - 1; ++n)
+        {
+            size *= row_shape[n];
+        }
+        return size;
+    }
+
+    T* data() const
+    {
+        return buf->data();
+    }
+
+    /**
+     * Makes room for count more rows, at least doubling the capacity when
+     * it runs out.
+     */
+    void grow(int count)
+    {
+        if (rows + count > allocated)
+        {
+            reallocate(std::max(rows + count, 2 * allocated));
+        }
+    }
+
+    void reallocate(int count)
+    {
+        auto next = buffer<T>::make(std::size_t(count) * row_size(), uninitialized);
+        std::copy(data(), data() + size(), next->data());
+        buf = next;
+        allocated = count;
+    }
+
+    row_shape_type row_shape;
+    std::shared_ptr<buffer<T>> buf;
+    int rows = 0;
+    int allocated = 0;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_GROWABLE
+#include "catch.hpp"
+
+
+TEST_CASE("growable arrays append rows with amortized reallocation", "[growable]")
+{
+    auto G = nd::growable<double, 2>({3});
+    auto reallocations = 0;
+    auto capacity = G.capacity();
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto row = nd::full(double(i), 3);
+        G.append(row);
+
+        if (G.capacity() != capacity)
+        {
+            capacity = G.capacity();
+            ++reallocations;
+        }
+    }
+    CHECK(G.shape() == (std::array<int, 2>{1000, 3}));
+    CHECK(G.capacity() >= 1000);
+    CHECK(reallocations <= 11);
+
+    auto A = G.array();
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        CHECK((A[i] == double(i)).all());
+    }
+
+    SECTION("views share memory until the next reallocation")
+    {
+        G.shrink_to_fit();
+        auto B = G.array();
+        CHECK(G.capacity() == 1000);
+        CHECK(B.data() == G.array().data());
+        G.append(nd::zeros<double>(3));
+        CHECK(B.data() != G.array().data());
+        CHECK(B.shape(0) == 1000);
+        CHECK(B(999, 2) == 999.0);
+    }
+
+    SECTION("views do not see rows appended after them")
+    {
+        G.reserve(2000);
+        auto B = G.array();
+        G.append()(1) = -1.0;
+        CHECK(B.shape(0) == 1000);
+        CHECK(B.data() == G.array().data());
+        CHECK(G.array()(1000, 0) == 0.0);
+        CHECK(G.array()(1000, 1) == -1.0);
+    }
+
+    SECTION("clear keeps the memory")
+    {
+        G.clear();
+        CHECK(G.empty());
+        CHECK(G.capacity() >= 1000);
+        CHECK(G.array().size() == 0);
+    }
+}
+
+
+TEST_CASE("growable arrays can be extended by whole arrays", "[growable]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(4, 2, 3);
+    auto G = nd::growable<int, 3>(A);
+
+    G.extend(A.take<0>(_|1|4|2).reverse<2>());
+    G.append(A[0]);
+
+    REQUIRE(G.shape() == (std::array<int, 3>{7, 2, 3}));
+    CHECK((G.array().take<0>(_|0|4) == A).all());
+    CHECK((G.array()[4] == A[1].reverse<1>()).all());
+    CHECK((G.array()[5] == A[3].reverse<1>()).all());
+    CHECK((G.array()[6] == A[0]).all());
+
+    CHECK_THROWS_AS(G.extend(nd::arange<int>(1, 3, 2)), std::invalid_argument);
+    CHECK_THROWS_AS(G.append(nd::arange<int>(3, 2)), std::invalid_argument);
+    CHECK(G.shape(0) == 7);
+}
+
+
+TEST_CASE("growable arrays of rank one append values", "[growable]")
+{
+    auto G = nd::growable<float, 1>();
+
+    for (int i = 0; i < 100; ++i)
+    {
+        G.append(0.5f * i);
+    }
+    CHECK(G.size() == 100);
+    CHECK((G.array() == nd::arange<float>(100) * 0.5f).all());
+}
+
+#endif // TEST_GROWABLE
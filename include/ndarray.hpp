@@ -5,6 +5,34 @@
 #include <memory>
 #include <cstring>
 #include <functional>
+#include <tuple>
+#include <cstdlib>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <iterator>
+#include <initializer_list>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <cmath>
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 
 
@@ -14,6 +42,13 @@ namespace nd
 {
     template<int Rank, int Axis> struct selector;
 
+    /**
+     * Memory layouts that strides can be generated for. Row-major (C order)
+     * puts the last axis adjacent in memory, column-major (Fortran order)
+     * puts the first axis adjacent in memory.
+     */
+    enum class layout { row_major, column_major };
+
     /**
      * Creates a selector without count (memory extent) information, e.g:
      *
@@ -120,6 +155,23 @@ namespace nd
             }
             return res + "]";
         }
+
+
+        /**
+         * Inner product of an index with a set of strides, i.e. a memory
+         * offset.
+         */
+        template<std::size_t Size>
+        int static inline dot(const std::array<int, Size>& a, const std::array<int, Size>& b)
+        {
+            int m = 0;
+
+            for (std::size_t n = 0; n < Size; ++n)
+            {
+                m += a[n] * b[n];
+            }
+            return m;
+        }
     }
 } 
 
@@ -130,6 +182,25 @@ namespace nd
 namespace nd 
 {
     template<typename T> class buffer;
+
+    /**
+     * Tag for buffers (and arrays) whose memory is allocated but not
+     * initialized, so that it is first written, and on NUMA machines
+     * placed, by whichever threads fill it. Elements of types with
+     * non-trivial constructors are still default-constructed.
+     */
+    struct uninitialized_t {};
+    static constexpr uninitialized_t uninitialized {};
+
+/**
+ * Buffers created by buffer<T>::make whose elements fit in this many bytes
+ * keep them in the same allocation as the buffer and its shared_ptr control
+ * block, so a small array costs a single allocation. Other buffers do not
+ * reserve this space. Define the macro to 0 to disable the inline storage.
+ */
+#ifndef ND_BUFFER_INLINE_BYTES
+#define ND_BUFFER_INLINE_BYTES 128
+#endif
 } 
 
 
@@ -138,25 +209,40 @@ namespace nd
 // ============================================================================
 namespace nd 
 {
-    template<typename T, typename U, int R, typename Op> struct binary_op;
-    template<typename T, int R, typename Op> struct unary_op;
-    template<typename T, int R> class ndarray;
-    template<typename T> struct dtype_str;
+    namespace parallel
+    {
+        inline int num_threads();
+        inline int set_num_threads(int count);
 
-    template<typename T> ndarray<T, 1> static inline arange(int size);
-    template<typename T> ndarray<T, 1> static inline linspace(T start, T end, int size);
-    template<typename T> ndarray<T, 1> static inline ones(int size);
-    template<typename T> ndarray<T, 1> static inline zeros(int size);
+        inline bool& inside();
+        inline std::vector<int> allowed_cpus();
+        inline bool pin_this_thread(int cpu);
 
-    template<typename T, int R>
-    static inline nd::ndarray<T, R + 1> stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays);
+        class pool;
+
+        template<typename Function>
+        static inline void for_each_chunk(int size, Function f);
+
+        template<typename Function>
+        static inline void for_each_worker(int count, Function f);
+
+        class barrier;
+    }
 
 /**
- * Unless you define the following macro, an alias nd::array will be created
- * for you, to make your declarations a little cleaner.
+ * Kernels that support multithreading only use it when they touch at least
+ * this many elements; below that, the cost of waking threads dominates.
  */
-#ifndef ND_DONT_ALIAS_TO_ARRAY
-    template<typename T, int R> using array = ndarray<T, R>;
+#ifndef ND_PARALLEL_THRESHOLD
+#define ND_PARALLEL_THRESHOLD (1 << 18)
+#endif
+
+/**
+ * Number of times a thread polls a barrier before it starts yielding its
+ * core to other threads between polls.
+ */
+#ifndef ND_BARRIER_SPIN
+#define ND_BARRIER_SPIN 1024
 #endif
 } 
 
@@ -164,1449 +250,7485 @@ namespace nd
 
 
 // ============================================================================
-template<int Rank, int Axis = 0> 
-struct nd::selector
+namespace nd 
 {
-
-
-    enum { rank = Rank, axis = Axis };
-
-
-    // ========================================================================
-    selector()
+    namespace strided
     {
-        for (int n = 0; n < rank; ++n)
+        /**
+         * A pointer to the first element of an array view, together with its
+         * per-axis memory strides (in units of elements). This is the form in
+         * which the element-wise kernels see their operands.
+         */
+        template<typename T, int R>
+        struct operand
         {
-            count[n] = 1;
-            start[n] = 0;
-            final[n] = 1;
-            skips[n] = 1;
+            T* data;
+            std::array<int, R> strides;
+        };
+
+        template<typename T, std::size_t R>
+        static inline operand<T, int(R)> make_operand(T* data, std::array<int, R> strides)
+        {
+            return {data, strides};
         }
-    }
 
-    template<typename... Dims>
-    selector(Dims... dims) : selector(std::array<int, rank>{dims...})
-    {
-        static_assert(sizeof...(Dims) == rank,
-            "selector: number of count arguments must match rank");
-    }
+        /**
+         * A one-dimensional run of elements: a base pointer and a stride (in
+         * units of elements). Kernels receive one of these per operand for
+         * each inner loop, along with its length.
+         */
+        template<typename T>
+        struct run
+        {
+            T& operator[](int i) const { return data[i * stride]; }
+            T* data;
+            int stride;
+        };
 
-    selector(std::array<int, rank> count) : count(count)
-    {
-        for (int n = 0; n < rank; ++n)
+        template<std::size_t R>
+        static inline std::array<int, R> memory_order(std::array<int, R> shape, std::array<int, R> strides);
+
+        /**
+         * A loop nest over N operands that visits the same elements as an
+         * array of shape and strides, but with size-one axes dropped, the
+         * remaining axes ordered outermost first by the first operand's
+         * strides, and adjacent axes merged wherever every operand allows
+         * it. Only the first rank entries of shape and strides are used.
+         * Each operand's traversal starts at its data pointer plus start.
+         */
+        template<int R, int N>
+        struct loop_nest
         {
-            start[n] = 0;
-            final[n] = count[n];
-            skips[n] = 1;
-        }
-    }
+            int rank;
+            std::array<int, R> shape;
+            std::array<std::array<int, R>, N> strides;
+            std::array<int, N> start;
+        };
 
-    selector(
-        std::array<int, rank> count,
-        std::array<int, rank> start,
-        std::array<int, rank> final,
-        std::array<int, rank> skips)
-    : count(count)
-    , start(start)
-    , final(final)
-    , skips(skips)
-    {
-    }
+        template<std::size_t R, std::size_t N>
+        static inline loop_nest<int(R), int(N)> make_loop_nest(std::array<int, R> shape, std::array<std::array<int, R>, N> strides);
 
+        template<std::size_t R, typename Function, typename... T>
+        static inline void for_each(std::array<int, R> shape, Function f, operand<T, int(R)>... operands);
 
+        template<std::size_t R, std::size_t Q>
+        static inline bool reshape_strides(std::array<int, R> shape, std::array<int, R> strides, std::array<int, Q> new_shape, std::array<int, Q>& new_strides);
 
+        template<std::size_t R, typename Function, typename... T>
+        static inline void for_each_run(std::array<int, R> shape, Function f, operand<T, int(R)>... operands);
 
-    // ========================================================================
-  template <int R = rank, int A = axis, typename std::enable_if<A == rank - 1>::type* = nullptr>
-    selector<rank - 1, axis - 1> collapse() const
-    {
-        static_assert(rank > 0, "selector: cannot collapse zero-rank selector");
+        template<int R, int N, typename Function, typename... T>
+        static inline void walk(const loop_nest<R, N>& nest, Function f, T*... data);
 
-        std::array<int, rank - 1> _count;
-        std::array<int, rank - 1> _start;
-        std::array<int, rank - 1> _final;
-        std::array<int, rank - 1> _skips;
+        template<int R, int N, typename Function, typename... T>
+        static inline void walk_runs(const loop_nest<R, N>& nest, Function f, T*... data);
 
-        for (int n = 0; n < rank - 2; ++n)
-        {
-            _count[n] = count[n];
-            _start[n] = start[n];
-            _final[n] = final[n];
-            _skips[n] = skips[n];
-        }
+        template<int R, typename... T>
+        class nditer;
 
-        _count[axis - 1] = count[axis] * count[axis - 1];
-        _start[axis - 1] = count[axis] * start[axis - 1] + start[axis];
-        _final[axis - 1] = count[axis] * final[axis - 1] + start[axis];
-        _skips[axis - 1] = count[axis];
+        template<std::size_t R, typename T>
+        static inline std::array<T*, 2> extent(std::array<int, R> shape, operand<T, int(R)> a);
 
-        return {_count, _start, _final, _skips};
-    }
+        template<std::size_t R, typename T, typename U>
+        static inline bool overlaps(std::array<int, R> shape, operand<T, int(R)> a, operand<U, int(R)> b);
 
-    template <int R = rank, int A = axis, typename std::enable_if<A < rank - 1>::type* = nullptr>
-    selector<rank - 1, axis> collapse() const
-    {
-        static_assert(rank > 0, "selector: cannot collapse zero-rank selector");
+        template<std::size_t R, typename Function, typename T, typename U>
+        static inline void update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<U, int(R)> source);
 
-        std::array<int, rank - 1> _count;
-        std::array<int, rank - 1> _start;
-        std::array<int, rank - 1> _final;
-        std::array<int, rank - 1> _skips;
+        template<std::size_t R, typename Function, typename T>
+        static inline void update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<const T, int(R)> source);
 
-        for (int n = 0; n < axis; ++n)
-        {
-            _count[n] = count[n];
-            _start[n] = start[n];
-            _final[n] = final[n];
-            _skips[n] = skips[n];
-        }
+        template<std::size_t R, typename T, typename U>
+        static inline void copy(std::array<int, R> shape, operand<T, int(R)> target, operand<U, int(R)> source);
 
-        for (int n = axis + 1; n < rank - 1; ++n)
-        {
-            _count[n] = count[n + 1];
-            _start[n] = start[n + 1];
-            _final[n] = final[n + 1];
-            _skips[n] = skips[n + 1];
-        }
+        template<int R, typename T, typename U>
+        static inline void copy_nest(const loop_nest<R, 2>& nest, T* target, U* source);
 
-        _count[axis] = count[axis + 1] * count[axis];
-        _start[axis] = count[axis + 1] * start[axis] + start[axis + 1];
-        _final[axis] = count[axis + 1] * final[axis] + start[axis + 1];
-        _skips[axis] = 1;
+        template<typename T, typename U>
+        static inline void copy_run(int count, T* target, int target_stride, U* source, int source_stride);
 
-        return {_count, _start, _final, _skips};
+        template<typename T, typename U>
+        static inline void copy_tile(int rows, int cols, T* target, std::array<int, 2> target_strides, U* source, std::array<int, 2> source_strides);
     }
 
-    selector<rank, axis + 1> skip(int skips_index) const
-    {
-        return select(std::make_tuple(start[axis], final[axis], skips_index));
-    }
+/**
+ * Edge length of the square blocks in which strided::copy transposes data
+ * between views whose inner strides differ. A block of each operand should
+ * fit comfortably in the L1 cache.
+ */
+#ifndef ND_COPY_TILE
+#define ND_COPY_TILE 32
+#endif
+} 
 
-    selector<rank, axis + 1> slice(int lower_index, int upper_index, int skips_index) const
-    {
-        static_assert(axis < rank, "selector: cannot select on axis >= rank");
 
-        auto _count = count;
-        auto _start = start;
-        auto _final = final;
-        auto _skips = skips;
 
-        _start[axis] = start[axis] + lower_index;
-        _final[axis] = start[axis] + upper_index;
-        _skips[axis] = skips[axis] * skips_index;
 
-        return {_count, _start, _final, _skips};
-    }
+// ============================================================================
+namespace nd 
+{
+    template<typename T, typename U, int R, typename Op> struct binary_op;
+    template<typename T, int R, typename Op> struct unary_op;
+    template<typename T, int R> class ndarray;
+    template<typename T> struct dtype_str;
 
-    selector<rank, axis + 1> select(axis::selection selection) const
-    {
-        return slice(selection.lower, selection.upper, selection.skips);
-    }
+    template<typename T, std::size_t R, typename Function>
+    static inline ndarray<T, int(R)> generate(std::array<int, R> shape, Function f);
 
-    selector<rank, axis + 1> select(axis::range range) const
-    {
-        return slice(range.lower, range.upper, 1);
-    }
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> empty(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> zeros(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> ones(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> full(std::array<int, R> shape, T value);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> arange(std::array<int, R> shape);
 
-    auto select(axis::index index) const
-    {
-        return slice(index.lower);
-    }
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> empty(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> zeros(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> ones(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> full(T value, Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> arange(Dims... dims);
+    template<typename T> ndarray<T, 1> static inline linspace(T start, T end, int size);
 
-    selector<rank, axis + 1> select(axis::all) const
-    {
-        return {count, start, final, skips};
-    }
+    template<typename T, int R, typename Iterator>
+    static inline ndarray<T, R> concatenate(Iterator first, Iterator last, int axis=0);
 
-    selector<rank, axis + 1> select(std::tuple<int, int, int> selection) const
-    {
-        return slice(
-            std::get<0>(selection),
-            std::get<1>(selection),
-            std::get<2>(selection));
-    }
+    template<typename T, int R>
+    static inline ndarray<T, R> concatenate(const std::vector<ndarray<T, R>>& arrays, int axis=0);
 
-    selector<rank, axis + 1> select(std::tuple<int, int> range) const
-    {
-        return slice(std::get<0>(range), std::get<1>(range), 1);
-    }
+    template<typename T, int R>
+    static inline ndarray<T, R> concatenate(std::initializer_list<ndarray<T, R>> arrays, int axis=0);
 
-    auto select(int index) const
-    {
-        return slice(index, index + 1, 1).drop().collapse();
-    }
+    template<typename T, int R, typename Iterator>
+    static inline ndarray<T, R + 1> stack(Iterator first, Iterator last, int axis=0);
 
-    template<typename First, typename... Rest>
-    auto select(First first, Rest... rest) const
-    {
-        return select(first).select(rest...);
-    }
+    template<typename T, int R>
+    static inline ndarray<T, R + 1> stack(const std::vector<ndarray<T, R>>& arrays, int axis=0);
 
-    template<int new_axis>
-    selector<rank, new_axis> on() const
-    {
-        static_assert(new_axis >= 0 && new_axis < rank, "invalid selector axis");
-        return {count, start, final, skips};
-    }
+    template<typename T, int R>
+    static inline ndarray<T, R + 1> stack(std::initializer_list<ndarray<T, R>> arrays, int axis=0);
 
-    selector<rank> reset() const
-    {
-        return {count, start, final, skips};
-    }
+    template<typename T, int R, int Q, typename Iterator>
+    static inline void assemble(ndarray<T, Q>& target, Iterator first, Iterator last, int axis);
 
-    selector<rank, axis - 1> drop() const
-    {
-        static_assert(axis > 0, "invalid selector axis");
-        return {count, start, final, skips};
-    }
+    template<typename... Arrays>
+    static inline auto make_nditer(Arrays&&... arrays);
 
-    std::array<int, rank> strides() const
-    {
-        std::array<int, rank> s;
-        s[rank - 1] = 1;
+    template<typename Function, typename... Arrays>
+    static inline void for_each_run(Function f, Arrays&&... arrays);
 
-        for (int n = rank - 2; n >= 0; --n)
-        {
-            s[n] = s[n + 1] * count[n + 1];
-        }
-        return s;
-    }
+/**
+ * Unless you define the following macro, an alias nd::array will be created
+ * for you, to make your declarations a little cleaner.
+ */
+#ifndef ND_DONT_ALIAS_TO_ARRAY
+    template<typename T, int R> using array = ndarray<T, R>;
+#endif
+} 
 
-    std::array<int, rank> shape() const
-    {
-        std::array<int, rank> s;
 
-        for (int n = 0; n < rank; ++n)
-        {
-            s[n] = shape(n);
-        }
-        return s;
-    }
 
-    int shape(int axis) const
-    {
-        return final[axis] / skips[axis] - start[axis] / skips[axis];
-    }
 
-    bool empty() const
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int... Dims> class static_array;
+
+    /**
+     * Product of a list of extents, as a constant expression.
+     */
+    constexpr int static_size() { return 1; }
+
+    template<typename... Dims>
+    constexpr int static_size(int first, Dims... rest) { return first * static_size(rest...); }
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    /**
+     * Struct definitions which are binary compatible with those in dlpack.h
+     * (https://github.com/dmlc/dlpack), so that arrays can be handed to other
+     * in-process consumers (numpy, PyTorch, CuPy, ...) without copying and
+     * without a dependency on the DLPack headers. If you do include dlpack.h,
+     * pointers to these types may be reinterpret_cast to the ones there.
+     */
+    namespace dlpack
+    {
+        enum DLDeviceType : int32_t { kDLCPU = 1 };
+        enum DLDataTypeCode : uint8_t { kDLInt = 0, kDLUInt = 1, kDLFloat = 2, kDLBool = 6 };
+
+        struct DLDevice
+        {
+            int32_t device_type;
+            int32_t device_id;
+        };
+
+        struct DLDataType
+        {
+            uint8_t code;
+            uint8_t bits;
+            uint16_t lanes;
+        };
+
+        struct DLTensor
+        {
+            void* data;
+            DLDevice device;
+            int32_t ndim;
+            DLDataType dtype;
+            int64_t* shape;
+            int64_t* strides;
+            uint64_t byte_offset;
+        };
+
+        struct DLManagedTensor
+        {
+            DLTensor dl_tensor;
+            void* manager_ctx;
+            void (*deleter)(DLManagedTensor* self);
+        };
+
+        /**
+         * The DLPack 1.0 tensor, which carries a version and flags, among
+         * them whether the consumer may write to the memory.
+         */
+        static const uint64_t DLPACK_FLAG_BITMASK_READ_ONLY = 1;
+
+        struct DLPackVersion
+        {
+            uint32_t major;
+            uint32_t minor;
+        };
+
+        struct DLManagedTensorVersioned
+        {
+            DLPackVersion version;
+            void* manager_ctx;
+            void (*deleter)(DLManagedTensorVersioned* self);
+            uint64_t flags;
+            DLTensor dl_tensor;
+        };
+
+        template<typename T>
+        static inline DLDataType dtype();
+
+        static inline void set_flags(DLManagedTensor& tensor, bool read_only);
+        static inline void set_flags(DLManagedTensorVersioned& tensor, bool read_only);
+
+        template<typename Managed, typename T, int R>
+        static inline Managed* export_tensor(ndarray<T, R>& A, bool read_only);
+    }
+
+    template<typename T, int R> static inline dlpack::DLManagedTensor* to_dlpack(ndarray<T, R>& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensor* to_dlpack(const ndarray<T, R>& A);
+    template<typename View> static inline dlpack::DLManagedTensor* to_dlpack(const View& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(ndarray<T, R>& A);
+    template<typename T, int R> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(const ndarray<T, R>& A);
+    template<typename View> static inline dlpack::DLManagedTensorVersioned* to_dlpack_versioned(const View& A);
+    template<typename T, int R> static inline ndarray<T, R> from_dlpack(dlpack::DLManagedTensor* tensor);
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T> static inline T dot(const ndarray<T, 1>& a, const ndarray<T, 1>& b);
+    template<typename T> static inline ndarray<T, 1> matmul(const ndarray<T, 2>& A, const ndarray<T, 1>& x);
+    template<typename T> static inline ndarray<T, 1> matmul(const ndarray<T, 1>& x, const ndarray<T, 2>& A);
+    template<typename T> static inline ndarray<T, 2> matmul(const ndarray<T, 2>& A, const ndarray<T, 2>& B);
+
+    template<int M, int K, int N, typename T> static inline ndarray<T, 3> batch_matmul(const ndarray<T, 3>& A, const ndarray<T, 3>& B);
+    template<int M, int N, typename T> static inline ndarray<T, 2> batch_matvec(const ndarray<T, 3>& A, const ndarray<T, 2>& x);
+    template<int N, typename T> static inline ndarray<T, 1> batch_det(const ndarray<T, 3>& A);
+    template<int N, typename T> static inline ndarray<T, 3> batch_inverse(const ndarray<T, 3>& A);
+
+    /**
+     * Strided kernels behind dot and matmul. Matrices are given by a pointer
+     * to their (0, 0) element and a row and column stride (in elements, of
+     * either sign), so that transposed and strided views need no copies.
+     */
+    namespace linalg
+    {
+        /**
+         * Register and cache blocking for the matrix product. The micro-kernel
+         * keeps an MR x NR block of the product in registers; NR spans one
+         * cache line of T. Blocks of KC x NC of B and MC x KC of A are packed
+         * so as to stay resident in the L3 and L2 caches respectively.
+         */
+        template<typename T>
+        struct blocking
+        {
+            enum {
+                MR = 4,
+                NR = 64 / sizeof(T) < 4 ? 4 : 64 / sizeof(T) > 16 ? 16 : 64 / sizeof(T),
+                KC = 256,
+                MC = 96,
+                NC = 2048,
+            };
+        };
+
+        template<typename T> static inline T dot(int n, const T* x, int incx, const T* y, int incy);
+        template<typename T> static inline void gemv(int m, int n, const T* a, int rsa, int csa, const T* x, int incx, T* y, int incy);
+        template<typename T> static inline void gemm(int m, int n, int k, const T* a, int rsa, int csa, const T* b, int rsb, int csb, T* c, int rsc, int csc);
+        template<typename T> static inline void pack_a(int mc, int kc, const T* a, int rsa, int csa, T* packed);
+        template<typename T> static inline void pack_b(int kc, int nc, const T* b, int rsb, int csb, T* packed);
+        template<typename T> static inline void macro_kernel(int mc, int nc, int kc, const T* packed_a, const T* packed_b, T* c, int rsc, int csc);
+        template<typename T> static inline void micro_kernel(int kc, const T* a, const T* b, T* c, int rsc, int csc, int mr, int nr);
+
+        /**
+         * A block of W matrices of size M x N, stored lane-innermost so that
+         * the same element of every matrix in the block is contiguous. The
+         * batched kernels load a block of the batch into a tile, run an
+         * element-wise formula over the lanes (which the compiler turns into
+         * vector instructions), and store the result. W spans one cache line
+         * of T.
+         */
+        template<typename T, int M, int N>
+        struct tile
+        {
+            enum { W = 64 / sizeof(T) < 1 ? 1 : 64 / sizeof(T) > 16 ? 16 : 64 / sizeof(T) };
+            inline void load(const T* p, std::array<int, 3> strides, int lanes);
+            inline void store(T* p, std::array<int, 3> strides, int lanes) const;
+            T v[M][N][W];
+        };
+
+        template<typename T, typename Function>
+        static inline void for_each_batch(int count, int work, Function f);
+
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 1>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 2>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 3>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 4>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 1>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 2>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 3>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 4>);
+    }
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int R> class stencil;
+    template<typename T, int R> struct neighbours;
+
+    template<typename Function, typename T, typename U, int R>
+    static inline void apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<U, R>& source, ndarray<T, R>& target);
+
+    template<typename Function, typename T, int R>
+    static inline ndarray<T, R> apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<T, R>& source);
+
+    /**
+     * Cache-blocked traversal used by the stencil kernels. The last two axes
+     * of a shape are cut into tiles of ND_STENCIL_TILE_Y x ND_STENCIL_TILE_X
+     * elements, and every row of a tile (along the last axis) is visited,
+     * sweeping any leading axes inside the tile, before moving to the next
+     * tile. The rows of source data read by a tile then stay in cache while
+     * it is processed, including the neighbouring planes of 3D stencils.
+     */
+    namespace tiling
+    {
+        template<std::size_t R, typename Function>
+        static inline void for_each_row(std::array<int, R> shape, bool threaded, Function f);
+
+        template<typename T, typename U, int R>
+        static inline void check_interior(const char* caller, const ndarray<U, R>& source, const ndarray<T, R>& target, typename stencil<T, R>::offset_type shape);
+    }
+
+/**
+ * Extents of the tiles visited by tiling::for_each_row, along the last and
+ * second-to-last axes.
+ */
+#ifndef ND_STENCIL_TILE_X
+#define ND_STENCIL_TILE_X 256
+#endif
+
+#ifndef ND_STENCIL_TILE_Y
+#define ND_STENCIL_TILE_Y 32
+#endif
+
+/**
+ * Cache size, in bytes, that the planes kept in flight by a temporally
+ * blocked stencil::sweep should fit in; about the size of a per-core L2.
+ */
+#ifndef ND_STENCIL_CACHE
+#define ND_STENCIL_CACHE (1 << 20)
+#endif
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    /**
+     * How an array is extended past its edges, for an axis of length n:
+     *
+     * periodic:  index -1 reads n - 1, and n reads 0
+     * reflect:   mirrored about the edge element; -1 reads 1 (numpy 'reflect')
+     * symmetric: mirrored about the edge itself; -1 reads 0 (numpy 'symmetric')
+     * nearest:   the edge element is repeated
+     * constant:  a fixed value
+     */
+    enum class boundary { periodic, reflect, symmetric, nearest, constant };
+
+    template<typename T, int R> class padded_view;
+
+    template<typename T, int R>
+    static inline padded_view<T, R> pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline padded_view<T, R> pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline void fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value=T());
+
+    template<typename T, int R>
+    static inline void fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value=T());
+
+    static inline int boundary_index(int index, int size, boundary mode);
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int R> class decomposition;
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+#if defined(__unix__) || defined(__APPLE__)
+    template<typename T, int R> class shared_array;
+#endif
+
+/**
+ * How long, in milliseconds, shared_array::attach waits by default for a
+ * segment that another process is still creating.
+ */
+#ifndef ND_SHM_ATTACH_MS
+#define ND_SHM_ATTACH_MS 1000
+#endif
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    class philox;
+
+    template<typename T, typename... Dims>
+    static inline ndarray<T, sizeof...(Dims)> random_uniform(philox& generator, Dims... dims);
+
+    template<typename T, typename... Dims>
+    static inline ndarray<T, sizeof...(Dims)> random_normal(philox& generator, Dims... dims);
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int R> class growable;
+} 
+
+
+
+
+// ============================================================================
+template<int Rank, int Axis = 0> 
+struct nd::selector
+{
+
+
+    enum { rank = Rank, axis = Axis };
+
+
+    // ========================================================================
+    selector()
+    {
+        for (int n = 0; n < rank; ++n)
+        {
+            count[n] = 1;
+            start[n] = 0;
+            final[n] = 1;
+            skips[n] = 1;
+        }
+    }
+
+    template<typename... Dims>
+    selector(Dims... dims) : selector(std::array<int, rank>{dims...})
+    {
+        static_assert(sizeof...(Dims) == rank,
+            "selector: number of count arguments must match rank");
+    }
+
+    selector(std::array<int, rank> count) : count(count)
+    {
+        for (int n = 0; n < rank; ++n)
+        {
+            start[n] = 0;
+            final[n] = count[n];
+            skips[n] = 1;
+        }
+    }
+
+    selector(
+        std::array<int, rank> count,
+        std::array<int, rank> start,
+        std::array<int, rank> final,
+        std::array<int, rank> skips)
+    : count(count)
+    , start(start)
+    , final(final)
+    , skips(skips)
+    {
+    }
+
+
+
+
+    // ========================================================================
+  template <int R = rank, int A = axis, typename std::enable_if<A == rank - 1>::type* = nullptr>
+    selector<rank - 1, axis - 1> collapse() const
+    {
+        static_assert(rank > 0, "selector: cannot collapse zero-rank selector");
+
+        std::array<int, rank - 1> _count;
+        std::array<int, rank - 1> _start;
+        std::array<int, rank - 1> _final;
+        std::array<int, rank - 1> _skips;
+
+        for (int n = 0; n < rank - 2; ++n)
+        {
+            _count[n] = count[n];
+            _start[n] = start[n];
+            _final[n] = final[n];
+            _skips[n] = skips[n];
+        }
+
+        _count[axis - 1] = count[axis] * count[axis - 1];
+        _start[axis - 1] = count[axis] * start[axis - 1] + start[axis];
+        _final[axis - 1] = count[axis] * final[axis - 1] + start[axis];
+        _skips[axis - 1] = count[axis];
+
+        return {_count, _start, _final, _skips};
+    }
+
+    template <int R = rank, int A = axis, typename std::enable_if<A < rank - 1>::type* = nullptr>
+    selector<rank - 1, axis> collapse() const
+    {
+        static_assert(rank > 0, "selector: cannot collapse zero-rank selector");
+
+        std::array<int, rank - 1> _count;
+        std::array<int, rank - 1> _start;
+        std::array<int, rank - 1> _final;
+        std::array<int, rank - 1> _skips;
+
+        for (int n = 0; n < axis; ++n)
+        {
+            _count[n] = count[n];
+            _start[n] = start[n];
+            _final[n] = final[n];
+            _skips[n] = skips[n];
+        }
+
+        for (int n = axis + 1; n < rank - 1; ++n)
+        {
+            _count[n] = count[n + 1];
+            _start[n] = start[n + 1];
+            _final[n] = final[n + 1];
+            _skips[n] = skips[n + 1];
+        }
+
+        _count[axis] = count[axis + 1] * count[axis];
+        _start[axis] = count[axis + 1] * start[axis] + start[axis + 1];
+        _final[axis] = count[axis + 1] * final[axis] + start[axis + 1];
+        _skips[axis] = 1;
+
+        return {_count, _start, _final, _skips};
+    }
+
+    selector<rank, axis + 1> skip(int skips_index) const
+    {
+        return select(std::make_tuple(start[axis], final[axis], skips_index));
+    }
+
+    selector<rank, axis + 1> slice(int lower_index, int upper_index, int skips_index) const
+    {
+        static_assert(axis < rank, "selector: cannot select on axis >= rank");
+
+        auto _count = count;
+        auto _start = start;
+        auto _final = final;
+        auto _skips = skips;
+
+        _start[axis] = start[axis] + lower_index;
+        _final[axis] = start[axis] + upper_index;
+        _skips[axis] = skips[axis] * skips_index;
+
+        return {_count, _start, _final, _skips};
+    }
+
+    selector<rank, axis + 1> select(axis::selection selection) const
+    {
+        return slice(selection.lower, selection.upper, selection.skips);
+    }
+
+    selector<rank, axis + 1> select(axis::range range) const
+    {
+        return slice(range.lower, range.upper, 1);
+    }
+
+    auto select(axis::index index) const
+    {
+        return slice(index.lower);
+    }
+
+    selector<rank, axis + 1> select(axis::all) const
+    {
+        return {count, start, final, skips};
+    }
+
+    selector<rank, axis + 1> select(std::tuple<int, int, int> selection) const
+    {
+        return slice(
+            std::get<0>(selection),
+            std::get<1>(selection),
+            std::get<2>(selection));
+    }
+
+    selector<rank, axis + 1> select(std::tuple<int, int> range) const
+    {
+        return slice(std::get<0>(range), std::get<1>(range), 1);
+    }
+
+    auto select(int index) const
+    {
+        return slice(index, index + 1, 1).drop().collapse();
+    }
+
+    template<typename First, typename... Rest>
+    auto select(First first, Rest... rest) const
+    {
+        return select(first).select(rest...);
+    }
+
+    template<int new_axis>
+    selector<rank, new_axis> on() const
+    {
+        static_assert(new_axis >= 0 && new_axis < rank, "invalid selector axis");
+        return {count, start, final, skips};
+    }
+
+    selector<rank> reset() const
+    {
+        return {count, start, final, skips};
+    }
+
+    selector<rank, axis - 1> drop() const
+    {
+        static_assert(axis > 0, "invalid selector axis");
+        return {count, start, final, skips};
+    }
+
+    std::array<int, rank> strides(layout order = layout::row_major) const
+    {
+        std::array<int, rank> s;
+        int stride = 1;
+
+        if (order == layout::column_major)
+        {
+            for (int n = 0; n < rank; ++n)
+            {
+                s[n] = stride;
+                stride *= count[n];
+            }
+            return s;
+        }
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            s[n] = stride;
+            stride *= count[n];
+        }
+        return s;
+    }
+
+    std::array<int, rank> shape() const
+    {
+        std::array<int, rank> s;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            s[n] = shape(n);
+        }
+        return s;
+    }
+
+    int shape(int axis) const
+    {
+        return std::max(final[axis] - start[axis] + skips[axis] - 1, 0) / skips[axis];
+    }
+
+    bool empty() const
+    {
+        for (int n = 0; n < rank; ++n)
+        {
+            if (count[n] == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool contiguous() const
+    {
+        for (int n = 0; n < rank; ++n)
+        {
+            if (start[n] != 0 || final[n] != count[n] || skips[n] != 1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::size_t size() const
+    {
+        auto s = shape();
+        return std::accumulate(s.begin(), s.end(), 1, std::multiplies<int>());
+    }
+
+    bool operator==(const selector<rank, axis>& other) const
+    {
+        return count == other.count &&
+        start == other.start &&
+        final == other.final &&
+        skips == other.skips;
+    }
+
+    bool operator!=(const selector<rank, axis>& other) const
+    {
+        return count != other.count ||
+        start != other.start ||
+        final != other.final ||
+        skips != other.skips;
+    }
+
+    bool next(std::array<int, rank>& index) const
+    {
+        int n = rank - 1;
+
+        index[n] += skips[n];
+
+        while (index[n] >= final[n])
+        {
+            if (n == 0)
+            {
+                index = final;
+                return false;
+            }
+            index[n] = start[n];
+
+            --n;
+
+            index[n] += skips[n];
+        }
+        return true;
+    }
+
+    /**
+     * Returns the row-major position of the given index among those visited
+     * by next(), starting from 0 at start. The final index, where next()
+     * stops, maps to size().
+     */
+    int position(const std::array<int, rank>& index) const
+    {
+        if (index == final)
+        {
+            return int(size());
+        }
+
+        int m = 0;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m = m * shape(n) + (index[n] - start[n]) / skips[n];
+        }
+        return m;
+    }
+
+    /**
+     * The inverse of position: unflattens a position in [0, size()] into the
+     * index visited at that step.
+     */
+    std::array<int, rank> index_at(int position) const
+    {
+        if (position >= int(size()))
+        {
+            return final;
+        }
+
+        std::array<int, rank> index;
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            int s = shape(n);
+            index[n] = start[n] + (position % s) * skips[n];
+            position /= s;
+        }
+        return index;
+    }
+
+    template<typename... Index>
+    bool contains(Index... index) const
+    {
+        static_assert(sizeof...(Index) == rank, "selector: index size must match rank");
+
+        auto S = shape::make_shape(index...);
+
+        for (int n = 0; n < rank; ++n)
+        {
+            auto start_index = std::get<0>(S[n]);
+            auto final_index = std::get<1>(S[n]);
+
+            if (start_index < 0 || final_index > shape(n))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    selector<rank, axis> shift(int dist) const
+    {
+        auto sel = *this;
+        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], 0);
+        sel.final[axis] = std::min(sel.final[axis] + dist * skips[axis], sel.count[axis]);
+        return sel;
+    }
+
+    /**
+     * Removes this axis from the selector altogether, leaving the remaining
+     * axes untouched. Unlike collapse, this makes no assumption about how
+     * the axes are laid out in memory; the caller is responsible for
+     * accounting for the memory offset of the selected index.
+     */
+    selector<rank - 1> erase() const
+    {
+        static_assert(axis < rank, "selector: cannot erase axis >= rank");
+
+        auto sel = selector<rank - 1>();
+
+        for (int n = 0; n < rank - 1; ++n)
+        {
+            int m = n < axis ? n : n + 1;
+            sel.count[n] = count[m];
+            sel.start[n] = start[m];
+            sel.final[n] = final[m];
+            sel.skips[n] = skips[m];
+        }
+        return sel;
+    }
+
+    /**
+     * Mirrors this axis within its count, so that index i of the new
+     * selector refers to position count - 1 - i of the old one. The
+     * selected elements are then visited in reverse order, provided the
+     * memory stride along this axis is negated as well.
+     */
+    selector<rank, axis> reverse() const
+    {
+        auto sel = *this;
+        auto last = start[axis] + skips[axis] * (shape(axis) - 1);
+
+        if (shape(axis) > 0)
+        {
+            sel.start[axis] = count[axis] - 1 - last;
+            sel.final[axis] = count[axis] - start[axis];
+        }
+        return sel;
+    }
+
+    /**
+     * Returns a selector with the order of the axes reversed.
+     */
+    selector<rank> transpose() const
+    {
+        auto sel = selector<rank>();
+
+        for (int n = 0; n < rank; ++n)
+        {
+            sel.count[n] = count[rank - 1 - n];
+            sel.start[n] = start[rank - 1 - n];
+            sel.final[n] = final[rank - 1 - n];
+            sel.skips[n] = skips[rank - 1 - n];
+        }
+        return sel;
+    }
+
+
+
+
+    // ========================================================================
+    /**
+     * Random-access iterator over the indexes visited by next(). It keeps a
+     * linear count alongside the index, so comparisons and differences are
+     * O(1). Stepping by one is incremental; any other jump unflattens the new
+     * position through the selector (see index_at), which is O(rank).
+     */
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::array<int, rank>;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        iterator() {}
+        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind), pos(sel.position(ind)) {}
+        iterator& operator++() { sel.next(ind); ++pos; return *this; }
+        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        iterator& operator--() { return *this += -1; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { pos += int(n); ind = sel.index_at(pos); return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret += -n; }
+        friend iterator operator+(difference_type n, iterator a) { return a += n; }
+        difference_type operator-(const iterator& other) const { return position() - other.position(); }
+        bool operator==(const iterator& other) const { return pos == other.pos; }
+        bool operator!=(const iterator& other) const { return pos != other.pos; }
+        bool operator< (const iterator& other) const { return position() <  other.position(); }
+        bool operator> (const iterator& other) const { return position() >  other.position(); }
+        bool operator<=(const iterator& other) const { return position() <= other.position(); }
+        bool operator>=(const iterator& other) const { return position() >= other.position(); }
+        value_type operator[](difference_type n) const { return *(*this + n); }
+        const std::array<int, rank>& operator*() const { return ind; }
+        difference_type position() const { return pos; }
+    private:
+        selector<rank> sel;
+        std::array<int, rank> ind;
+        int pos = 0;
+    };
+
+    iterator begin() const { return {reset(), start}; }
+    iterator end() const { return {reset(), final}; }
+
+
+
+
+    // ========================================================================
+    std::array<int, rank> count;
+    std::array<int, rank> start;
+    std::array<int, rank> final;
+    std::array<int, rank> skips;
+
+
+
+
+    // ========================================================================
+    template<int other_rank, int other_axis>
+    friend struct selector;
+}; 
+
+
+
+
+// ============================================================================
+template<unsigned long rank> 
+std::array<std::tuple<int, int>, rank> nd::shape::promote(std::array<std::tuple<int, int>, rank> shape)
+{
+    return shape;
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int, int> selection)
+{
+    return {std::make_tuple(std::get<0>(selection), std::get<1>(selection))};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int> range)
+{
+    return {range};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(int start_index)
+{
+    return {std::make_tuple(start_index, start_index + 1)};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::selection selection)
+{
+    return {std::make_tuple(selection.lower, selection.upper)};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::range range)
+{
+    return {std::make_tuple(range.lower, range.upper)};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::index index)
+{
+    return {std::make_tuple(index.lower, index.lower + 1)};
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::all)
+{
+    return {std::make_tuple(0, -1)};
+}
+
+template<typename First>
+auto nd::shape::make_shape(First first)
+{
+    return promote(first);
+}
+
+template<typename First, typename Second>
+auto nd::shape::make_shape(First first, Second second)
+{
+    auto s1 = promote(first);
+    auto s2 = promote(second);
+    auto res = std::array<std::tuple<int, int>, s1.size() + s2.size()>();
+
+    for (std::size_t n = 0; n < s1.size(); ++n)
+        res[n] = s1[n];
+
+    for (std::size_t n = 0; n < s2.size(); ++n)
+        res[n + s1.size()] = s2[n];
+
+    return res;
+}
+
+template<typename First, typename... Rest>
+auto nd::shape::make_shape(First first, Rest... rest)
+{
+    return make_shape(first, make_shape(rest...));
+} 
+
+
+
+
+// ============================================================================
+template<typename T> 
+class nd::buffer
+{
+public:
+
+    enum { inline_capacity = ND_BUFFER_INLINE_BYTES / sizeof(T) };
+
+    /**
+     * Returns a shared buffer of count elements, constructed as by
+     * buffer(count, args...). If they fit in the inline capacity, the
+     * elements are stored in the same allocation as the buffer and its
+     * control block; otherwise they are in a separate heap allocation.
+     */
+    template<typename... Args>
+    static std::shared_ptr<buffer<T>> make(std::size_t count, Args... args)
+    {
+        if (count <= inline_capacity)
+        {
+            return std::make_shared<compact>(count, args...);
+        }
+        return std::make_shared<buffer<T>>(count, args...);
+    }
+
+    buffer() {}
+
+    buffer(const buffer<T>& other)
+    {
+        count = other.count;
+        memory = allocate(count);
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            memory[n] = other.memory[n];
+        }
+    }
+
+    buffer(buffer<T>&& other)
+    {
+        steal(other);
+    }
+
+    explicit buffer(std::size_t count, const T& value = T()) : count(count)
+    {
+        memory = allocate(count);
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            memory[n] = value;
+        }
+    }
+
+    buffer(std::size_t count, uninitialized_t) : count(count)
+    {
+        memory = allocate(count);
+    }
+
+    /**
+     * Adopts count elements of memory allocated elsewhere, without copying
+     * them. The deleter is invoked on the memory when the buffer is
+     * destroyed. If the deleter is empty, the memory is only borrowed, and
+     * must outlive the buffer.
+     */
+    buffer(T* data, std::size_t count, std::function<void(T*)> deleter)
+    : memory(data)
+    , count(count)
+    , external(true)
+    , deleter(deleter)
+    {
+    }
+
+    template< class InputIt >
+    buffer(InputIt first, InputIt last)
+    {
+        {
+            auto it = first;
+            count = 0;
+
+            while (it != last)
+            {
+                ++it;
+                ++count;
+            }
+            memory = allocate(count);
+        }
+
+        {
+            auto it = first;
+            auto n = 0;
+
+            while (it != last)
+            {
+                memory[n] = *it;
+                ++it;
+                ++n;
+            }
+        }
+    }
+
+    ~buffer()
+    {
+        release();
+    }
+
+    buffer<T>& operator=(const buffer<T>& other)
+    {
+        if (this == &other)
+        {
+            return *this;
+        }
+        release();
+
+        count = other.count;
+        memory = allocate(count);
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            memory[n] = other.memory[n];
+        }
+        return *this;
+    }
+
+    buffer<T>& operator=(buffer<T>&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    bool operator==(const buffer<T>& other) const
+    {
+        if (count != other.count)
+        {
+            return false;
+        }
+
+        for (std::size_t n = 0; n < size(); ++n)
+        {
+            if (memory[n] != other.memory[n])            
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const buffer<T>& other) const
+    {
+        return ! operator==(other);
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    bool is_inline() const
+    {
+        return local;
+    }
+
+    bool is_external() const
+    {
+        return external;
+    }
+
+    const T* data() const
+    {
+        return memory;
+    }
+
+    T* data()
+    {
+        return memory;
+    }
+
+    const T& operator[](std::size_t offset) const
+    {
+        return memory[offset];
+    }
+
+    T& operator[](std::size_t offset)
+    {
+        return memory[offset];
+    }
+
+    T* begin() { return memory; }
+    T* end() { return memory + count; }
+
+    const T* begin() const { return memory; }
+    const T* end() const { return memory + count; }
+
+private:
+    class compact;
+
+    T* allocate(std::size_t size)
+    {
+        return new T[size];
+    }
+
+    void release()
+    {
+        if (external)
+        {
+            if (deleter)
+            {
+                deleter(memory);
+            }
+        }
+        else if (! local)
+        {
+            delete [] memory;
+        }
+        memory = nullptr;
+        count = 0;
+        external = false;
+        local = false;
+        deleter = nullptr;
+    }
+
+    void steal(buffer<T>& other)
+    {
+        if (other.local)
+        {
+            memory = allocate(other.count);
+
+            for (std::size_t n = 0; n < other.count; ++n)
+            {
+                memory[n] = std::move(other.memory[n]);
+            }
+        }
+        else
+        {
+            memory = other.memory;
+        }
+        count = other.count;
+        external = other.external;
+        deleter = std::move(other.deleter);
+
+        other.memory = nullptr;
+        other.count = 0;
+        other.external = false;
+        other.local = false;
+        other.deleter = nullptr;
+    }
+
+    T* memory = nullptr;
+    std::size_t count = 0;
+    bool external = false;
+    bool local = false;
+    std::function<void(T*)> deleter;
+};
+
+
+
+
+/**
+ * A buffer followed by room for inline_capacity elements, which it uses as
+ * its memory. It is only created by buffer<T>::make, through
+ * std::make_shared, and is owned through shared_ptr<buffer<T>>. Copies and
+ * moves into a plain buffer put the elements on the heap.
+ */
+template<typename T>
+class nd::buffer<T>::compact : public buffer<T>
+{
+public:
+    compact(std::size_t count, const T& value = T())
+    {
+        adopt(count);
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            this->memory[n] = value;
+        }
+    }
+
+    compact(std::size_t count, uninitialized_t)
+    {
+        adopt(count);
+    }
+
+private:
+    void adopt(std::size_t count)
+    {
+        this->memory = storage.data();
+        this->count = count;
+        this->local = true;
+    }
+
+    std::array<T, inline_capacity> storage;
+}; 
+
+
+
+
+// ============================================================================
+int nd::parallel::num_threads() 
+{
+    return set_num_threads(0);
+}
+
+/**
+ * Sets the number of threads used by multithreaded kernels, and returns the
+ * previous value. A count of 1 disables multithreading; counts less than 1
+ * leave the setting unchanged. This is not synchronized with kernels that
+ * are already running.
+ */
+int nd::parallel::set_num_threads(int count)
+{
+    static std::atomic<int> threads(std::max(int(std::thread::hardware_concurrency()), 1));
+
+    if (count > 0)
+    {
+        return threads.exchange(count);
+    }
+    return threads.load();
+}
+
+/**
+ * Whether the calling thread is running inside a multithreaded kernel or
+ * a worker started by for_each_worker. Kernels called from such a thread
+ * run serially on it, rather than starting threads of their own and
+ * oversubscribing the machine.
+ */
+bool& nd::parallel::inside()
+{
+    static thread_local bool flag = false;
+    return flag;
+}
+
+/**
+ * The CPUs the calling thread may run on, e.g. as restricted by taskset or
+ * a cgroup. Where the platform does not report them, these are taken to be
+ * all hardware threads.
+ */
+std::vector<int> nd::parallel::allowed_cpus()
+{
+    auto cpus = std::vector<int>();
+#ifdef __linux__
+    auto set = cpu_set_t();
+    CPU_ZERO(&set);
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty())
+    {
+        for (int cpu = 0; cpu < std::max(int(std::thread::hardware_concurrency()), 1); ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Restricts the calling thread to the given CPU (see allowed_cpus). Returns
+ * false if the platform does not support thread affinity or the request
+ * fails; the thread is then left unpinned.
+ */
+bool nd::parallel::pin_this_thread(int cpu)
+{
+#ifdef __linux__
+    auto set = cpu_set_t();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+
+
+
+/**
+ * A set of worker threads which are started the first time a kernel needs
+ * them, and then wait for work for the life of the process, so that large
+ * kernels do not pay for starting and joining threads on every call. Worker
+ * k is pinned to the k-th CPU the process may run on (see allowed_cpus),
+ * when there is one, so a given worker always runs near the same memory.
+ * The pool is never destroyed: its threads simply end with the process.
+ */
+class nd::parallel::pool
+{
+public:
+    /**
+     * The process-wide pool.
+     */
+    static pool& instance()
+    {
+        static pool* shared = new pool();
+        return *shared;
+    }
+
+    /**
+     * Invokes f(k) on worker k for every k in [0, count), starting workers
+     * as needed, and returns once they have all finished. f must not throw.
+     * Calls from different threads take turns. In a child process created
+     * by fork, which has none of the workers, the calls are made serially
+     * on the calling thread.
+     */
+    template<typename Function>
+    void run(int count, Function& f)
+    {
+        if (forked())
+        {
+            for (int k = 0; k < count; ++k)
+            {
+                f(k);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> turn(busy);
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (int(threads.size()) < count)
+        {
+            int k = int(threads.size());
+            threads.emplace_back([this, k, seen = generation] () { work(k, seen); });
+        }
+        task = [] (void* context, int k) { (*static_cast<Function*>(context))(k); };
+        context = &f;
+        active = count;
+        remaining = count;
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [this] { return remaining == 0; });
+    }
+
+private:
+    pool() : cpus(allowed_cpus())
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        owner = getpid();
+#endif
+    }
+
+    bool forked() const
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        return getpid() != owner;
+#else
+        return false;
+#endif
+    }
+
+    void work(int k, int seen)
+    {
+        inside() = true;
+
+        if (k < int(cpus.size()))
+        {
+            pin_this_thread(cpus[k]);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            wake.wait(lock, [this, seen] { return generation != seen; });
+            seen = generation;
+
+            if (k < active)
+            {
+                auto call = task;
+                auto data = context;
+                lock.unlock();
+                call(data, k);
+                lock.lock();
+
+                if (--remaining == 0)
+                {
+                    done.notify_one();
+                }
+            }
+        }
+    }
+
+    std::vector<int> cpus;
+    std::vector<std::thread> threads;
+    std::mutex busy;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    void (*task)(void*, int) = nullptr;
+    void* context = nullptr;
+    int generation = 0;
+    int active = 0;
+    int remaining = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    pid_t owner;
+#endif
+};
+
+
+
+
+/**
+ * Splits the range [0, size) into contiguous chunks, one per thread, and
+ * invokes f(lower, upper) on each chunk concurrently, on the workers of the
+ * shared pool; the calling thread waits. The partitioning depends only on
+ * size and num_threads(), and chunk k always runs on pool worker k, so
+ * chunk k of equal-sized ranges is always processed by the same (pinned)
+ * thread. Exceptions thrown by f are rethrown on the calling thread.
+ */
+template<typename Function>
+void nd::parallel::for_each_chunk(int size, Function f)
+{
+    int count = std::min(num_threads(), size);
+
+    if (count <= 1 || inside())
+    {
+        f(0, size);
+        return;
+    }
+
+    auto errors = std::vector<std::exception_ptr>(count);
+    auto chunk = [&] (int k)
+    {
+        try {
+            f(int(long(size) * k / count), int(long(size) * (k + 1) / count));
+        }
+        catch (...) {
+            errors[k] = std::current_exception();
+        }
+    };
+
+    pool::instance().run(count, chunk);
+
+    for (auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+
+
+/**
+ * Invokes f(k) for every k in [0, count), each on its own thread, and
+ * waits for them all. Unlike for_each_chunk, the number of threads is
+ * exactly count, so workers may synchronize with each other (e.g. through
+ * a barrier) for as long as they run. When the calling thread may run on
+ * at least count CPUs, worker k pins itself to the k-th of them before it
+ * calls f(k), so the memory it first touches stays local to it. The first
+ * exception thrown by a worker is rethrown on the calling thread.
+ */
+template<typename Function>
+void nd::parallel::for_each_worker(int count, Function f)
+{
+    auto errors = std::vector<std::exception_ptr>(count);
+    auto threads = std::vector<std::thread>();
+    auto cpus = allowed_cpus();
+    bool pin = count <= int(cpus.size());
+
+    for (int k = 0; k < count; ++k)
+    {
+        threads.emplace_back([&f, &errors, &cpus, pin, k] ()
+        {
+            inside() = true;
+
+            if (pin)
+            {
+                pin_this_thread(cpus[k]);
+            }
+
+            try {
+                f(k);
+            }
+            catch (...) {
+                errors[k] = std::current_exception();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    for (auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+
+
+/**
+ * A reusable barrier for a fixed number of threads, which spin on an
+ * atomic generation count instead of blocking in the kernel; threads
+ * yield while they wait once they have polled ND_BARRIER_SPIN times. A
+ * thread that fails may cancel the barrier, which releases every waiting
+ * thread now and in future with a return value of false, so that its
+ * peers can stop instead of waiting forever.
+ */
+class nd::parallel::barrier
+{
+public:
+    barrier(int count) : count(count)
+    {
+    }
+
+    /**
+     * Blocks until count threads have called wait since the barrier last
+     * opened. Returns false if the barrier has been cancelled.
+     */
+    bool wait()
+    {
+        int generation = opened.load(std::memory_order_acquire);
+
+        if (cancelled.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) == count - 1)
+        {
+            arrived.store(0, std::memory_order_relaxed);
+            opened.fetch_add(1, std::memory_order_release);
+            return true;
+        }
+        for (int spin = 0; opened.load(std::memory_order_acquire) == generation; ++spin)
+        {
+            if (spin >= ND_BARRIER_SPIN)
+            {
+                std::this_thread::yield();
+            }
+        }
+        return ! cancelled.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Releases all waiting threads, and makes every later wait return
+     * false immediately.
+     */
+    void cancel()
+    {
+        cancelled.store(true, std::memory_order_release);
+        opened.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    int count;
+    std::atomic<int> arrived {0};
+    std::atomic<int> opened {0};
+    std::atomic<bool> cancelled {false};
+}; 
+
+
+
+
+// ============================================================================
+template<std::size_t R> 
+std::array<int, R> nd::strided::memory_order(std::array<int, R> shape, std::array<int, R> strides)
+{
+    std::array<int, R> order;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        order[n] = n;
+    }
+
+    auto key = [&] (int n) { return shape[n] == 1 ? 0 : std::abs(strides[n]); };
+
+    std::stable_sort(order.begin(), order.end(), [&] (int a, int b)
+    {
+        return key(a) > key(b);
+    });
+    return order;
+}
+
+
+
+/**
+ * Builds the loop nest for the given shape and per-operand strides. Axes
+ * along which the first operand has a negative stride are flipped, as in
+ * for_each. An empty shape yields a nest of rank one and length zero.
+ */
+template<std::size_t R, std::size_t N>
+nd::strided::loop_nest<int(R), int(N)> nd::strided::make_loop_nest(std::array<int, R> shape, std::array<std::array<int, R>, N> strides)
+{
+    auto nest = loop_nest<int(R), int(N)>{};
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
+        {
+            nest.rank = 1;
+            return nest;
+        }
+        if (strides[0][n] < 0)
+        {
+            for (int k = 0; k < int(N); ++k)
+            {
+                nest.start[k] += (shape[n] - 1) * strides[k][n];
+                strides[k][n] = -strides[k][n];
+            }
+        }
+    }
+
+    for (int a : memory_order(shape, strides[0]))
+    {
+        if (shape[a] == 1)
+        {
+            continue;
+        }
+
+        int m = nest.rank - 1;
+        bool merge = m >= 0;
+
+        for (int k = 0; k < int(N) && merge; ++k)
+        {
+            merge = nest.strides[k][m] == strides[k][a] * shape[a];
+        }
+
+        if (! merge)
+        {
+            m = nest.rank++;
+            nest.shape[m] = 1;
+        }
+
+        nest.shape[m] *= shape[a];
+
+        for (int k = 0; k < int(N); ++k)
+        {
+            nest.strides[k][m] = strides[k][a];
+        }
+    }
+    return nest;
+}
+
+
+
+
+/**
+ * Finds strides under which the memory of a view with the given shape and
+ * strides can be read in the given new shape, in row-major order, without
+ * copying. This is possible when each group of old axes that is merged or
+ * split into new axes is itself laid out like a row-major block, e.g. when
+ * taking a range of rows from a larger array, or splitting an axis of a
+ * strided selection. Returns false if no such strides exist. Axes of length
+ * one are ignored, and empty views can always be reshaped. The sizes of the
+ * two shapes must agree.
+ */
+template<std::size_t R, std::size_t Q>
+bool nd::strided::reshape_strides(std::array<int, R> shape, std::array<int, R> strides, std::array<int, Q> new_shape, std::array<int, Q>& new_strides)
+{
+    std::array<int, R> old_shape;
+    std::array<int, R> old_strides;
+    int rank = 0;
+    int size = 1;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        size *= shape[n];
+
+        if (shape[n] != 1)
+        {
+            old_shape[rank] = shape[n];
+            old_strides[rank] = strides[n];
+            ++rank;
+        }
+    }
+
+    new_strides.fill(1);
+
+    if (size == 0)
+    {
+        for (int n = int(Q) - 2; n >= 0; --n)
+        {
+            new_strides[n] = new_strides[n + 1] * std::max(new_shape[n + 1], 1);
+        }
+        return true;
+    }
+
+    int oi = 0, oj = 1;
+    int ni = 0, nj = 1;
+
+    while (ni < int(Q) && oi < rank)
+    {
+        int np = new_shape[ni];
+        int op = old_shape[oi];
+
+        while (np != op)
+        {
+            if (np < op && nj < int(Q))
+            {
+                np *= new_shape[nj++];
+            }
+            else if (np > op && oj < rank)
+            {
+                op *= old_shape[oj++];
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        // k < R follows from oj <= rank; it is spelled out for -Warray-bounds
+        for (int k = oi + 1; k < oj && k < int(R); ++k)
+        {
+            if (old_strides[k - 1] != old_shape[k] * old_strides[k])
+            {
+                return false;
+            }
+        }
+
+        new_strides[nj - 1] = old_strides[oj - 1];
+
+        for (int k = nj - 1; k > ni; --k)
+        {
+            new_strides[k - 1] = new_strides[k] * new_shape[k];
+        }
+
+        ni = nj++;
+        oi = oj++;
+    }
+    return true;
+}
+
+
+
+
+/**
+ * Invokes f(a, b, ...) with references to the elements of each operand at
+ * every index of the given shape. The loop nest is first reduced (see
+ * make_loop_nest): size-one axes are dropped, the rest are walked in the
+ * memory order of the first operand with the smallest stride innermost, and
+ * axes are merged wherever every operand's strides allow it. A contiguous
+ * view of any rank is then a single loop. Axes along which the first
+ * operand has a negative stride are walked backwards, so that it is always
+ * traversed toward increasing addresses. Since all operands visit the same
+ * logical indexes, the traversal order is invisible to element-wise
+ * operations.
+ */
+template<std::size_t R, typename Function, typename... T>
+void nd::strided::for_each(std::array<int, R> shape, Function f, operand<T, int(R)>... operands)
+{
+    walk(make_loop_nest<R, sizeof...(T)>(shape, {operands.strides...}), f, operands.data...);
+}
+
+
+
+
+
+/**
+ * Invokes f(count, a, b, ...) once for every inner loop of the reduced loop
+ * nest (see for_each), where a, b, ... are strided::run's of the operands and
+ * count is the length of the runs. Runs are visited in the memory order of
+ * the first operand, and the first operand's stride is never negative. For
+ * contiguous operands there is a single run covering all elements. Empty
+ * shapes produce no runs.
+ */
+template<std::size_t R, typename Function, typename... T>
+void nd::strided::for_each_run(std::array<int, R> shape, Function f, operand<T, int(R)>... operands)
+{
+    walk_runs(make_loop_nest<R, sizeof...(T)>(shape, {operands.strides...}), f, operands.data...);
+}
+
+
+
+
+
+
+
+/**
+ * Invokes f(a, b, ...) at every index of a loop nest, exactly as given: no
+ * axes are flipped or reordered. Each operand's traversal begins at its data
+ * pointer plus the nest's start offset.
+ */
+template<int R, int N, typename Function, typename... T>
+void nd::strided::walk(const loop_nest<R, N>& nest, Function f, T*... data)
+{
+    walk_runs(nest, [&f] (int count, run<T>... runs)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            f(runs[i]...);
+        }
+    }, data...);
+}
+
+
+
+
+/**
+ * Invokes f(count, a, b, ...) for each inner loop of a loop nest, exactly
+ * as given, where a, b, ... are strided::run's of the operands. Each
+ * operand's traversal begins at its data pointer plus the nest's start
+ * offset. A nest of rank zero is a single run of length one.
+ */
+template<int R, int N, typename Function, typename... T>
+void nd::strided::walk_runs(const loop_nest<R, N>& nest, Function f, T*... data)
+{
+    static_assert(sizeof...(T) == N, "walk: wrong number of operands for loop nest");
+    nditer<R, T...>(nest, data...).for_each_run(f);
+}
+
+
+
+
+/**
+ * An iterator over several operands of the same shape in lockstep, possibly
+ * of different types, e.g. two inputs and an output. The loop nest is
+ * reduced once up front (see make_loop_nest), and the iterator then keeps a
+ * single multi-index: each step advances every operand's pointer by its own
+ * stride, with no per-operand index or offset computation. Usage:
+ *
+ * for (auto it = nditer<2, double, const int>(shape, C, A); ! it.done(); it.next())
+ * {
+ *     it.get<0>() = 2 * it.get<1>();
+ * }
+ *
+ * Elements are visited in the memory order of the first operand. Kernels
+ * may instead step a whole inner loop at a time, with count(), inner<K>()
+ * and next_run().
+ */
+template<int R, typename... T>
+class nd::strided::nditer
+{
+public:
+    enum { operands = sizeof...(T) };
+
+    nditer(std::array<int, R> shape, operand<T, R>... operands)
+    : nditer(make_loop_nest<std::size_t(R), sizeof...(T)>(shape, {operands.strides...}), operands.data...)
+    {
+    }
+
+    nditer(const loop_nest<R, sizeof...(T)>& nest, T*... data) : nest(nest), data(data...)
+    {
+        advance_all(std::index_sequence_for<T...>());
+        index.fill(0);
+
+        for (int n = 0; n < nest.rank; ++n)
+        {
+            if (nest.shape[n] == 0)
+            {
+                finished = true;
+            }
+        }
+    }
+
+    /** True once every element has been visited. */
+    bool done() const
+    {
+        return finished;
+    }
+
+    /** The length of the current inner loop. */
+    int count() const
+    {
+        return nest.rank == 0 ? 1 : nest.shape[nest.rank - 1];
+    }
+
+    /** The current inner loop of operand K, from its first element. */
+    template<int K>
+    auto inner() const
+    {
+        using U = typename std::tuple_element<K, std::tuple<T...>>::type;
+        return run<U>{std::get<K>(data), nest.rank == 0 ? 0 : nest.strides[K][nest.rank - 1]};
+    }
+
+    /** The current element of operand K. */
+    template<int K>
+    auto& get() const
+    {
+        return inner<K>()[position];
+    }
+
+    /** Advances to the next element. */
+    nditer& next()
+    {
+        if (++position == count())
+        {
+            position = 0;
+            next_run();
+        }
+        return *this;
+    }
+
+    /** Advances to the start of the next inner loop. */
+    nditer& next_run()
+    {
+        for (int k = nest.rank - 2; k >= 0; --k)
+        {
+            advance(k, 1, std::index_sequence_for<T...>());
+
+            if (++index[k] < nest.shape[k])
+            {
+                return *this;
+            }
+            advance(k, -nest.shape[k], std::index_sequence_for<T...>());
+            index[k] = 0;
+        }
+        finished = true;
+        return *this;
+    }
+
+    /**
+     * Invokes f(count, a, b, ...) on each remaining inner loop, with a, b, ...
+     * the operands' runs, leaving the iterator done.
+     */
+    template<typename Function>
+    void for_each_run(Function f)
+    {
+        for_each_run(f, std::index_sequence_for<T...>());
+    }
+
+private:
+    template<typename Function, std::size_t... K>
+    void for_each_run(Function f, std::index_sequence<K...>)
+    {
+        for (; ! finished; next_run())
+        {
+            f(count() - position, run<T>{std::get<K>(data) + position * inner<K>().stride, inner<K>().stride}...);
+            position = 0;
+        }
+    }
+
+    template<std::size_t... K>
+    void advance_all(std::index_sequence<K...>)
+    {
+        int expand[] = {0, (std::get<K>(data) += nest.start[K], 0)...};
+        (void) expand;
+    }
+
+    template<std::size_t... K>
+    void advance(int axis, int steps, std::index_sequence<K...>)
+    {
+        int expand[] = {0, (std::get<K>(data) += steps * nest.strides[K][axis], 0)...};
+        (void) expand;
+    }
+
+    loop_nest<R, sizeof...(T)> nest;
+    std::tuple<T*...> data;
+    std::array<int, R> index;
+    int position = 0;
+    bool finished = false;
+};
+
+
+
+
+/**
+ * Returns pointers to the lowest and highest addressed elements of a
+ * non-empty operand with the given shape.
+ */
+template<std::size_t R, typename T>
+std::array<T*, 2> nd::strided::extent(std::array<int, R> shape, operand<T, int(R)> a)
+{
+    auto lower = a.data;
+    auto upper = a.data;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        auto d = (shape[n] - 1) * a.strides[n];
+        (d < 0 ? lower : upper) += d;
+    }
+    return {lower, upper};
+}
+
+
+
+
+/**
+ * Returns true if the address ranges spanned by two operands of the given
+ * shape intersect. They may still have no element in common, e.g. when one
+ * interleaves with the other.
+ */
+template<std::size_t R, typename T, typename U>
+bool nd::strided::overlaps(std::array<int, R> shape, operand<T, int(R)> a, operand<U, int(R)> b)
+{
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
+        {
+            return false;
+        }
+    }
+
+    auto x = extent(shape, a);
+    auto y = extent(shape, b);
+    auto before = std::less<const void*>();
+
+    return before(x[0], y[1] + 1) && before(y[0], x[1] + 1);
+}
+
+
+
+
+/**
+ * Invokes f(a, b) over the elements of target and source, with the result
+ * being as if the source had been read in full before the target was
+ * written. Operands of different types cannot share memory, so this is
+ * for_each unless the types match (see the overload below).
+ */
+template<std::size_t R, typename Function, typename T, typename U>
+void nd::strided::update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<U, int(R)> source)
+{
+    for_each(shape, f, target, source);
+}
+
+/**
+ * If the operands overlap and have equal strides, each target element is a
+ * fixed distance in memory from its source element. When in addition the
+ * reduced loop nest visits addresses in increasing order (each axis' stride
+ * spans the full extent of the axes inside it), a traversal which moves
+ * away from the source (like memmove) never overwrites an element before it
+ * is read. Interleaved views, e.g. strides {3, 2} over shape {2, 3}, revisit
+ * lower addresses and are not walked this way. Otherwise only the part of the source's address range
+ * which falls inside the target's is staged in a temporary buffer, and the
+ * rest of the source is read in place.
+ */
+template<std::size_t R, typename Function, typename T>
+void nd::strided::update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<const T, int(R)> source)
+{
+    if (! overlaps(shape, target, source))
+    {
+        for_each(shape, f, target, source);
+        return;
+    }
+
+    auto nest = make_loop_nest<R, 2>(shape, {target.strides, source.strides});
+    bool monotonic = true;
+
+    for (int n = 0; n + 1 < nest.rank; ++n)
+    {
+        monotonic = monotonic && nest.strides[0][n] >= nest.strides[0][n + 1] * nest.shape[n + 1];
+    }
+
+    if (target.strides == source.strides && monotonic)
+    {
+        if (std::less<const T*>()(source.data, target.data))
+        {
+            for (int n = 0; n < nest.rank; ++n)
+            {
+                for (int k = 0; k < 2; ++k)
+                {
+                    nest.start[k] += (nest.shape[n] - 1) * nest.strides[k][n];
+                    nest.strides[k][n] = -nest.strides[k][n];
+                }
+            }
+        }
+        walk(nest, f, target.data, source.data);
+        return;
+    }
+
+    auto t = extent(shape, target);
+    auto s = extent(shape, source);
+    const T* lower = std::max<const T*>(t[0], s[0], std::less<const T*>());
+    const T* upper = std::min<const T*>(t[1], s[1], std::less<const T*>());
+    auto stage = std::unique_ptr<T[]>(new T[upper - lower + 1]);
+
+    std::copy(lower, upper + 1, stage.get());
+
+    for_each(shape, [&] (T& a, const T& b)
+    {
+        auto p = &b;
+        f(a, lower <= p && p <= upper ? stage[p - lower] : b);
+    }, target, source);
+}
+
+/**
+ * Copies the elements of source into target, which have the given shape.
+ * Axes are coalesced so that the inner loop is as long as possible, and
+ * inner runs which are contiguous on both sides become a single memcpy when
+ * the element types match and are trivially copyable. When the source is
+ * not contiguous along the target's inner axis, but is along another one,
+ * the two axes are copied in square tiles so that neither side streams
+ * through the cache a single element per line. Large copies are split
+ * across threads along the outermost axis. Overlapping operands are instead
+ * copied serially by update.
+ */
+template<std::size_t R, typename T, typename U>
+void nd::strided::copy(std::array<int, R> shape, operand<T, int(R)> target, operand<U, int(R)> source)
+{
+    if (overlaps(shape, target, source))
+    {
+        update(shape, [] (auto& a, const auto& b) { a = b; }, target, source);
+        return;
+    }
+
+    auto nest = make_loop_nest<R, 2>(shape, {target.strides, source.strides});
+    auto t = target.data + nest.start[0];
+    auto s = source.data + nest.start[1];
+    auto& ss = nest.strides[1];
+    int r = nest.rank;
+    int size = 1;
+
+    if (r == 0)
+    {
+        *t = *s;
+        return;
+    }
+
+    for (int n = 0; n < r; ++n)
+    {
+        size *= nest.shape[n];
+    }
+
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (r >= 2 && std::abs(ss[r - 1]) != 1)
+    {
+        int j = r - 2;
+
+        for (int n = 0; n < r - 1; ++n)
+        {
+            if (std::abs(ss[n]) < std::abs(ss[j]))
+            {
+                j = n;
+            }
+        }
+
+        if (std::abs(ss[j]) < std::abs(ss[r - 1]))
+        {
+            for (; j < r - 2; ++j)
+            {
+                std::swap(nest.shape[j], nest.shape[j + 1]);
+                std::swap(nest.strides[0][j], nest.strides[0][j + 1]);
+                std::swap(nest.strides[1][j], nest.strides[1][j + 1]);
+            }
+        }
+    }
+
+    auto block = [&] (int lower, int upper)
+    {
+        auto part = nest;
+        part.shape[0] = upper - lower;
+        copy_nest(part, t + lower * nest.strides[0][0], s + lower * nest.strides[1][0]);
+    };
+
+    if (size >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(nest.shape[0], block);
+    }
+    else
+    {
+        block(0, nest.shape[0]);
+    }
+}
+
+
+
+
+/**
+ * Copies over a two-operand loop nest, of rank at least one. The innermost
+ * axis is copied as a run, or the innermost two as tiles if the source is
+ * more contiguous along the second-innermost axis than along the innermost.
+ */
+template<int R, typename T, typename U>
+void nd::strided::copy_nest(const loop_nest<R, 2>& nest, T* target, U* source)
+{
+    const int r = nest.rank;
+    const auto& shape = nest.shape;
+    const auto& ts = nest.strides[0];
+    const auto& ss = nest.strides[1];
+    const bool tile = r >= 2 && std::abs(ss[r - 2]) < std::abs(ss[r - 1]);
+    const int outer = tile ? r - 2 : r - 1;
+    auto index = std::array<int, R>();
+    index.fill(0);
+
+    while (true)
+    {
+        if (tile)
+        {
+            copy_tile(shape[r - 2], shape[r - 1], target, {ts[r - 2], ts[r - 1]}, source, {ss[r - 2], ss[r - 1]});
+        }
+        else
+        {
+            copy_run(shape[r - 1], target, ts[r - 1], source, ss[r - 1]);
+        }
+
+        int k = outer - 1;
+
+        for (; k >= 0; --k)
+        {
+            target += ts[k];
+            source += ss[k];
+
+            if (++index[k] < shape[k])
+            {
+                break;
+            }
+            target -= ts[k] * shape[k];
+            source -= ss[k] * shape[k];
+            index[k] = 0;
+        }
+
+        if (k < 0)
+        {
+            return;
+        }
+    }
+}
+
+
+
+
+/**
+ * Copies a one-dimensional run between non-overlapping operands.
+ */
+template<typename T, typename U>
+void nd::strided::copy_run(int count, T* target, int target_stride, U* source, int source_stride)
+{
+    using V = typename std::remove_const<U>::type;
+
+    if (std::is_same<T, V>::value && std::is_trivially_copyable<T>::value && target_stride == 1 && source_stride == 1)
+    {
+        std::memcpy(target, source, count * sizeof(T));
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        target[i * target_stride] = source[i * source_stride];
+    }
+}
+
+
+
+
+/**
+ * Copies a two-dimensional block in square tiles of ND_COPY_TILE elements on
+ * a side.
+ */
+template<typename T, typename U>
+void nd::strided::copy_tile(int rows, int cols, T* target, std::array<int, 2> ts, U* source, std::array<int, 2> ss)
+{
+    for (int i0 = 0; i0 < rows; i0 += ND_COPY_TILE)
+    {
+        for (int j0 = 0; j0 < cols; j0 += ND_COPY_TILE)
+        {
+            int i1 = std::min(i0 + ND_COPY_TILE, rows);
+            int j1 = std::min(j0 + ND_COPY_TILE, cols);
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    target[i * ts[0] + j * ts[1]] = source[i * ss[0] + j * ss[1]];
+                }
+            }
+        }
+    }
+} 
+
+
+
+
+// ============================================================================
+template<typename T, std::size_t R, typename Function> 
+nd::ndarray<T, int(R)> nd::generate(std::array<int, R> shape, Function f)
+{
+    static_assert(R >= 1, "generate: rank must be at least 1");
+
+    auto size = std::accumulate(shape.begin(), shape.end(), 1L, std::multiplies<long>());
+    auto buf = buffer<T>::make(std::size_t(size), uninitialized);
+    auto data = buf->data();
+
+    auto fill = [&] (int lower, int upper)
+    {
+        for (int i = lower; i < upper; ++i)
+        {
+            data[i] = f(i);
+        }
+    };
+
+    if (size >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(int(size), fill);
+    }
+    else
+    {
+        fill(0, int(size));
+    }
+    return ndarray<T, int(R)>(shape, buf);
+}
+
+/**
+ * Returns a new array whose memory is allocated but not initialized.
+ */
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::empty(std::array<int, R> shape)
+{
+    static_assert(R >= 1, "empty: rank must be at least 1");
+
+    auto size = std::accumulate(shape.begin(), shape.end(), 1L, std::multiplies<long>());
+    auto buf = buffer<T>::make(std::size_t(size), uninitialized);
+    return ndarray<T, int(R)>(shape, buf);
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::zeros(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int) { return T(0); });
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::ones(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int) { return T(1); });
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::full(std::array<int, R> shape, T value)
+{
+    return generate<T>(shape, [value] (int) { return value; });
+}
+
+/**
+ * Returns a new array holding 0, 1, 2, ... in row-major order.
+ */
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::arange(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int i) { return T(i); });
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::empty(Dims... dims)
+{
+    return empty<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::zeros(Dims... dims)
+{
+    return zeros<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::ones(Dims... dims)
+{
+    return ones<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+/**
+ * Returns a new array of the given extents with every element set to value,
+ * e.g. nd::full(0.5, 100, 200).
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::full(T value, Dims... dims)
+{
+    return full(std::array<int, sizeof...(Dims)>{{int(dims)...}}, value);
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::arange(Dims... dims)
+{
+    return arange<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+template<typename T> nd::ndarray<T, 1> nd::linspace(T start, T end, int size)
+{
+    auto h = (end - start) / (size - 1);
+    return generate<T>(std::array<int, 1>{{size}}, [start, h] (int i) { return start + h * i; });
+}
+
+/**
+ * Visits one or more arrays of the same shape in lockstep, as a sequence of
+ * one-dimensional runs, by calling f(count, a, b, ...) where a, b, ... are
+ * strided::run's (base pointer and stride) and count is the run length:
+ *
+ * nd::for_each_run([] (int n, auto a, auto b)
+ * {
+ *     for (int i = 0; i < n; ++i) a[i] = 2 * b[i];
+ * }, A, B.select(...));
+ *
+ * The library handles the outer loops; the inner loop is left to the caller,
+ * so it can be written for the compiler to vectorize. Runs come in the
+ * memory order of the first array, with the axes reduced as in
+ * strided::for_each, so a contiguous array of any rank is one run. Runs of
+ * const arrays point to const data. Throws std::invalid_argument if the
+ * shapes differ.
+ */
+template<typename Function, typename... Arrays>
+void nd::for_each_run(Function f, Arrays&&... arrays)
+{
+    make_nditer(std::forward<Arrays>(arrays)...).for_each_run(f);
+}
+
+
+
+
+/**
+ * Returns a strided::nditer over one or more arrays of the same shape, e.g.
+ *
+ * for (auto it = nd::make_nditer(C, A, B); ! it.done(); it.next())
+ * {
+ *     it.get<0>() = it.get<1>() * it.get<2>();
+ * }
+ *
+ * The iterator refers to the arrays' memory without owning it. Throws
+ * std::invalid_argument if the shapes differ.
+ */
+template<typename... Arrays>
+auto nd::make_nditer(Arrays&&... arrays)
+{
+    const auto& first = std::get<0>(std::forward_as_tuple(arrays...));
+    const auto shape = first.shape();
+    const bool matches[] = {arrays.shape() == shape...};
+
+    for (bool match : matches)
+    {
+        if (! match)
+            throw std::invalid_argument("nditer: arrays must all have the same shape");
+    }
+
+    using iterator = strided::nditer<std::decay_t<decltype(first)>::rank, std::remove_pointer_t<decltype(arrays.data())>...>;
+    return iterator(shape, strided::make_operand(arrays.data() + arrays.data_offset(), arrays.get_strides())...);
+}
+
+/**
+ * Returns a new array holding the arrays in [first, last) one after another
+ * along an existing axis, like numpy.concatenate. The range is traversed
+ * more than once, so it must be given by forward iterators (e.g. of a
+ * std::list). The arrays must have the same shape on every other axis, and
+ * there must be at least one; otherwise std::invalid_argument is thrown.
+ */
+template<typename T, int R, typename Iterator>
+nd::ndarray<T, R> nd::concatenate(Iterator first, Iterator last, int axis)
+{
+    static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value,
+        "concatenate: arrays must be given by forward iterators");
+
+    if (first == last)
+        throw std::invalid_argument("concatenate: need at least one array");
+
+    if (axis < 0 || axis >= R)
+        throw std::invalid_argument("concatenate: axis out of range");
+
+    auto shape = first->shape();
+    shape[axis] = 0;
+
+    for (auto it = first; it != last; ++it)
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            if (n != axis && it->shape(n) != shape[n])
+            {
+                throw std::invalid_argument("concatenate: array of shape "
+                    + shape::to_string(it->shape())
+                    + " does not match "
+                    + shape::to_string(first->shape())
+                    + " off axis "
+                    + std::to_string(axis));
+            }
+        }
+        shape[axis] += it->shape(axis);
+    }
+    auto target = empty<T>(shape);
+    assemble<T, R>(target, first, last, axis);
+    return target;
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::concatenate(const std::vector<ndarray<T, R>>& arrays, int axis)
+{
+    return concatenate<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::concatenate(std::initializer_list<ndarray<T, R>> arrays, int axis)
+{
+    return concatenate<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+/**
+ * Returns a new array holding the arrays in [first, last), which must all
+ * have the same shape, as slices along a new axis at the given position,
+ * like numpy.stack. As for concatenate, the iterators must be forward
+ * iterators. Throws std::invalid_argument if there are no arrays or their
+ * shapes differ.
+ */
+template<typename T, int R, typename Iterator>
+nd::ndarray<T, R + 1> nd::stack(Iterator first, Iterator last, int axis)
+{
+    static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value,
+        "stack: arrays must be given by forward iterators");
+
+    if (first == last)
+        throw std::invalid_argument("stack: need at least one array");
+
+    if (axis < 0 || axis > R)
+        throw std::invalid_argument("stack: axis out of range");
+
+    auto slice = first->shape();
+    auto shape = std::array<int, R + 1>();
+
+    for (auto it = first; it != last; ++it)
+    {
+        if (it->shape() != slice)
+        {
+            throw std::invalid_argument("stack: array of shape "
+                + shape::to_string(it->shape())
+                + " does not match "
+                + shape::to_string(slice));
+        }
+    }
+    for (int n = 0; n < R + 1; ++n)
+    {
+        shape[n] = n < axis ? slice[n] : n > axis ? slice[n - 1] : int(std::distance(first, last));
+    }
+    auto target = empty<T>(shape);
+    assemble<T, R>(target, first, last, axis);
+    return target;
+}
+
+template<typename T, int R>
+nd::ndarray<T, R + 1> nd::stack(const std::vector<ndarray<T, R>>& arrays, int axis)
+{
+    return stack<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R + 1> nd::stack(std::initializer_list<ndarray<T, R>> arrays, int axis)
+{
+    return stack<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+/**
+ * Copies the arrays in [first, last) into consecutive slabs of target
+ * along the given axis. If the arrays have the target's rank (Q == R),
+ * each fills as many indexes of the axis as its own extent there;
+ * otherwise (Q == R + 1) each fills one index, as a slice. The shapes are
+ * assumed to have been checked. The range is walked once, with any
+ * forward iterator, to collect the arrays. Each copy is a strided::copy,
+ * which moves contiguous runs in bulk. With at least as many arrays as
+ * threads, and enough elements in total, whole arrays are copied in
+ * parallel; otherwise they are copied in turn, and each large copy is
+ * parallel.
+ */
+template<typename T, int R, int Q, typename Iterator>
+void nd::assemble(ndarray<T, Q>& target, Iterator first, Iterator last, int axis)
+{
+    static_assert(Q == R || Q == R + 1, "assemble: target must have the rank of the arrays, or one more");
+
+    auto arrays = std::vector<const ndarray<T, R>*>();
+
+    for (auto it = first; it != last; ++it)
+    {
+        arrays.push_back(&static_cast<const ndarray<T, R>&>(*it));
+    }
+
+    int count = int(arrays.size());
+    auto offsets = std::vector<int>(count + 1, 0);
+    auto ts = target.get_strides();
+    auto base = target.data() + target.data_offset();
+    long total = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+        offsets[k + 1] = offsets[k] + (Q == R ? arrays[k]->shape(axis) : 1);
+        total += long(arrays[k]->size());
+    }
+
+    auto strides = std::array<int, R>();
+
+    for (int n = 0; n < R; ++n)
+    {
+        strides[n] = Q == R ? ts[n] : ts[n < axis ? n : n + 1];
+    }
+
+    auto range = [&] (int lower, int upper)
+    {
+        for (int k = lower; k < upper; ++k)
+        {
+            const auto& A = *arrays[k];
+            auto to = strided::make_operand(base + long(offsets[k]) * ts[axis], strides);
+            auto from = strided::make_operand(A.data() + A.data_offset(), A.get_strides());
+            strided::copy(A.shape(), to, from);
+        }
+    };
+
+    if (total >= ND_PARALLEL_THRESHOLD && count >= parallel::num_threads())
+    {
+        parallel::for_each_chunk(count, range);
+    }
+    else
+    {
+        range(0, count);
+    }
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R, typename Op>
+struct nd::unary_op
+{
+    static auto perform(const ndarray<T, R>& A)
+    {
+        auto op = Op();
+        auto B = A.template allocate_like<decltype(op(T()))>();
+
+        strided::for_each(A.shape(), [op] (auto& b, const T& a) { b = op(a); }, B.operand(), A.operand());
+
+        return B;
+    }
+};
+
+
+
+
+// ============================================================================
+template<typename T, typename U, int R, typename Op>
+struct nd::binary_op
+{
+    static auto perform(const ndarray<T, R>& A, const ndarray<U, R>& B)
+    {
+        if (A.shape() != B.shape())
+            throw std::invalid_argument("incompatible shapes for binary operation");
+
+        auto op = Op();
+        auto C = A.template allocate_like<decltype(op(T(), U()))>();
+
+        strided::for_each(A.shape(), [op] (auto& c, const T& a, const U& b) { c = op(a, b); }, C.operand(), A.operand(), B.operand());
+
+        return C;
+    }
+
+    static auto perform(const ndarray<T, R>& A, U b)
+    {
+        auto op = Op();
+        auto C = A.template allocate_like<decltype(op(T(), U()))>();
+
+        strided::for_each(A.shape(), [op, b] (auto& c, const T& a) { c = op(a, b); }, C.operand(), A.operand());
+
+        return C;
+    }
+
+    static void perform(ndarray<T, R>& A, const ndarray<U, R>& B)
+    {
+        if (A.shape() != B.shape())
+            throw std::invalid_argument("incompatible shapes for binary operation");
+
+        auto op = Op();
+
+        strided::update(A.shape(), [op] (T& a, const U& b) { a = op(a, b); }, A.operand(), B.operand());
+    }
+};
+
+
+
+
+// ============================================================================
+/**
+ * This block can be expanded to accommodate new data types. Note: gcc requires
+ * these template specializations to be declared directly inside the namespace.
+ */
+namespace nd {
+  template<> struct dtype_str<bool  > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<float > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<double> { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<int   > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<long  > { static inline std::array<char, 8> value(); };
+
+  std::array<char, 8> dtype_str<bool  >::value() { return {'b','1',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<float >::value() { return {'f','4',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<double>::value() { return {'f','8',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<int   >::value() { return {'i','4',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<long  >::value() { return {'i','8',  0,  0,  0,  0,  0,  0}; }
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R>
+class nd::ndarray
+{
+public:
+
+
+    using dtype = T;
+    enum { rank = R };
+
+
+
+
+    /**
+     * Wrapper class for constant arrays. Can be trivially converted back to
+     * const nd::array&.
+     */
+    // ========================================================================
+    class const_ref
+    {
+    public:
+
+        using dtype = T;
+        enum { rank = R };
+
+        const_ref(selector<R> sel, std::shared_ptr<buffer<T>> buf) : A(sel, buf) {}
+        const_ref(ndarray<T, R> other) : A(other) {}
+        template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
+        template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
+        template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
+        template<typename... Args> auto size(const Args&... args) const { return A.size(args...); }
+        template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
+        template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
+        template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
+        template<typename... Args> auto region(const Args&... args) const { return A.region(args...); }
+        template<int Axis> auto reverse() const { return A.reverse<Axis>(); }
+        auto transpose() const { return A.transpose(); }
+        const T* data() const { return A.data(); }
+        int data_offset() const { return A.data_offset(); }
+        std::array<int, R> get_strides() const { return A.get_strides(); }
+
+        operator const ndarray<T, R>&() const { return A; }
+        bool is_const_ref() const { return true; }
+
+        auto begin() const { return A.begin(); }
+        auto end() const { return A.end(); }
+
+    private:
+        friend class ndarray;
+        ndarray<T, R> A;
+    };
+
+
+
+
+    /**
+     * Constructors
+     * 
+     */
+    // ========================================================================
+    /**
+     * Rank-0 arrays constructed from a value keep it inline, without a memory
+     * buffer, so they never touch the heap. Copies of such an array hold
+     * their own value, rather than sharing it.
+     */
+    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
+    ndarray(T value=T())
+    : offset(0)
+    {
+        scalar_value[0] = value;
+    }
+
+    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
+    ndarray(int offset, std::shared_ptr<buffer<T>>& buf)
+    : offset(offset)
+    , buf(buf)
+    {
+    }
+
+    template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
+    ndarray(std::initializer_list<T> elements)
+    : sel(std::array<int, 1>{int(elements.size())})
+    , strides(sel.strides())
+    , buf(std::make_shared<buffer<T>>(elements.begin(), elements.end()))
+    {
+    }
+
+    template<typename... Dims, typename = typename std::enable_if<std::is_same<
+        std::integer_sequence<bool, true, std::is_convertible<Dims, int>::value...>,
+        std::integer_sequence<bool, std::is_convertible<Dims, int>::value..., true>>::value>::type>
+    ndarray(Dims... dims) : ndarray(std::array<int, R>({int(dims)...}))
+    {
+        static_assert(sizeof...(dims) == rank,
+          "Number of arguments to ndarray constructor must match rank");
+    }
+
+    /**
+     * Wraps memory owned by someone else (an MPI receive buffer, a shared
+     * memory segment, etc.) without copying it. Element (i, j, ...) is at
+     * data[i * strides[0] + j * strides[1] + ...], where the strides default
+     * to row-major. The deleter is invoked on data once the last array
+     * referring to the memory is gone. If the deleter is empty (the default)
+     * the memory is only borrowed, and must outlive every array using it.
+     */
+    ndarray(T* data, std::array<int, R> dim_sizes, std::function<void(T*)> deleter = nullptr)
+    : ndarray(data, dim_sizes, selector<R>(dim_sizes).strides(), deleter)
+    {
+    }
+
+    ndarray(
+        T* data,
+        std::array<int, R> dim_sizes,
+        std::array<int, R> strides,
+        std::function<void(T*)> deleter = nullptr)
+    : sel(dim_sizes)
+    , strides(strides)
+    {
+        auto lower = 0;
+        auto upper = 0;
+
+        for (int n = 0; n < R; ++n)
+        {
+            auto extent = (dim_sizes[n] - 1) * strides[n];
+            assert_valid_argument(dim_sizes[n] >= 0, "ndarray dim sizes must be non-negative");
+            lower += std::min(extent, 0);
+            upper += std::max(extent, 0);
+        }
+        auto count = size() == 0 ? 0 : upper - lower + 1;
+        auto release = deleter ? [deleter, data] (T*) { deleter(data); } : std::function<void(T*)>();
+
+        offset = -lower;
+        buf = std::make_shared<buffer<T>>(data + lower, count, release);
+    }
+
+    template<typename SelectorType>
+    ndarray(SelectorType sel, std::shared_ptr<buffer<T>>& buf)
+    : sel(sel)
+    , strides(sel.strides())
+    , buf(buf)
+    {
+    }
+
+    ndarray() : ndarray(constant_array<rank>(0))
+    {
+    }
+
+    ndarray(std::array<int, R> dim_sizes)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(R == 0 ? nullptr : buffer<T>::make(sel.size()))
+    {
+    }
+
+    ndarray(std::array<int, R> dim_sizes, std::shared_ptr<buffer<T>>& buf)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(buf)
+    {
+        assert_valid_argument(buf->size() == sel.size(),
+            "Size of data buffer is not the product of dim sizes");
+    }
+
+    /**
+     * Creates a new array whose memory is laid out in the given order, e.g.
+     * ndarray<double, 2>({3, 4}, nd::layout::column_major). The layout does
+     * not affect indexing or iteration order; it only determines the memory
+     * strides.
+     */
+    ndarray(std::array<int, R> dim_sizes, layout order)
+    : sel(dim_sizes)
+    , strides(sel.strides(order))
+    , buf(R == 0 ? nullptr : buffer<T>::make(sel.size()))
+    {
+    }
+
+    /**
+     * Creates a view of an existing buffer with arbitrary memory strides,
+     * which may be negative. Element (i, j, ...) is found at offset + i *
+     * strides[0] + j * strides[1] + ... in the buffer. Throws if any element
+     * would fall outside the buffer.
+     */
+    ndarray(
+        std::array<int, R> dim_sizes,
+        std::array<int, R> strides,
+        int offset,
+        std::shared_ptr<buffer<T>>& buf)
+    : offset(offset)
+    , sel(dim_sizes)
+    , strides(strides)
+    , buf(buf)
+    {
+        auto lower = offset;
+        auto upper = offset;
+
+        for (int n = 0; n < R; ++n)
+        {
+            auto extent = (dim_sizes[n] - 1) * strides[n];
+            assert_valid_argument(dim_sizes[n] >= 0, "ndarray dim sizes must be non-negative");
+            lower += std::min(extent, 0);
+            upper += std::max(extent, 0);
+        }
+        assert_valid_argument(size() == 0 || (lower >= 0 && upper < int(buf->size())),
+            "Strides and offset address memory outside the data buffer");
+    }
+
+    ndarray(const ndarray<T, R>& other)
+    : sel(other.sel.shape())
+    , strides(sel.strides())
+    , buf(R == 0 ? nullptr : buffer<T>::make(size()))
+    {
+        copy_internal(*this, other);
+    }
+
+    ndarray(ndarray<T, R>& other)
+    {
+        offset = other.offset;
+        scalar_value = other.scalar_value;
+        strides = other.strides;
+        sel = other.sel;
+        buf = other.buf;
+    }
+
+
+
+
+    /**
+     * Assignment operators
+     * 
+     */
+    // ========================================================================
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    ndarray<T, R>& operator=(T value)
+    {
+        memory()[offset] = value;
+        return *this;
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
+    ndarray<T, R>& operator=(T value)
+    {
+        strided::for_each(shape(), [value] (T& a) { a = value; }, operand());
+        return *this;
+    }
+
+    ndarray<T, R>& operator=(const ndarray<T, R>& other)
+    {
+        copy_internal(*this, other);
+        return *this;
+    }
+
+    void become(ndarray<T, R> other)
+    {
+        offset = other.offset;
+        scalar_value = other.scalar_value;
+        strides = other.strides;
+        sel = other.sel;
+        buf = other.buf;
+    }
+
+    template<typename... Sizes>
+    auto reshape(Sizes... sizes)
+    {
+        return reshape(std::array<int, sizeof...(Sizes)>{int(sizes)...});
+    }
+
+    template<typename... Sizes>
+    const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
+    {
+        return reshape(std::array<int, sizeof...(Sizes)>{int(sizes)...});
+    }
+
+    /**
+     * Returns an array with the same elements in row-major order, but the
+     * given shape. The result is a view sharing this array's memory whenever
+     * the strides allow one (see strided::reshape_strides), including for
+     * many non-contiguous views; otherwise the elements are copied. If
+     * copied is given, it is set to whether a copy was made, e.g.
+     * A.reshape({3, 4}, &copied). Throws
+     * std::invalid_argument if the new shape has a different size.
+     */
+    template<std::size_t Q>
+    ndarray<T, int(Q)> reshape(std::array<int, Q> new_shape, bool* copied=nullptr)
+    {
+        auto new_strides = std::array<int, Q>();
+        auto new_size = std::accumulate(new_shape.begin(), new_shape.end(), 1, std::multiplies<int>());
+
+        if (new_size != int(size()))
+        {
+            throw std::invalid_argument("incompatible reshape from "
+                + shape::to_string(shape())
+                + " to "
+                + shape::to_string(new_shape));
+        }
+
+        auto view = buf && strided::reshape_strides(shape(), get_strides(), new_shape, new_strides);
+
+        if (copied)
+        {
+            *copied = ! view;
+        }
+
+        if (! view)
+        {
+            // A copy goes to a fresh buffer, since a rank-0 array may keep
+            // its value inline rather than in buf.
+            auto fresh = buffer<T>::make(size(), uninitialized);
+            auto to = strided::make_operand(fresh->data(), selector<R>(shape()).strides());
+            strided::copy(shape(), to, operand());
+            return {fresh, selector<Q>(new_shape), selector<Q>(new_shape).strides(), 0};
+        }
+        return {buf, selector<Q>(new_shape), new_strides, data_offset()};
+    }
+
+    template<std::size_t Q>
+    const ndarray<T, int(Q)> reshape(std::array<int, Q> new_shape, bool* copied=nullptr) const
+    {
+        return const_cast<ndarray<T, R>&>(*this).reshape(new_shape, copied);
+    }
+
+    template<std::size_t Q>
+    ndarray<T, int(Q)> reshape(const int (&new_shape)[Q], bool* copied=nullptr)
+    {
+        return reshape(to_array(new_shape, std::make_index_sequence<Q>()), copied);
+    }
+
+    template<std::size_t Q>
+    const ndarray<T, int(Q)> reshape(const int (&new_shape)[Q], bool* copied=nullptr) const
+    {
+        return reshape(to_array(new_shape, std::make_index_sequence<Q>()), copied);
+    }
+
+
+
+
+    /**
+     * Shape and size query methods
+     * 
+     */
+    // ========================================================================
+    auto size() const { return sel.size(); }
+    bool empty() const { return sel.empty(); }
+    auto shape() const { return sel.shape(); }
+    auto shape(int axis) const { return sel.shape(axis); }
+
+    /**
+     * Returns true if this array spans its whole memory buffer, in row-major
+     * order.
+     */
+    bool contiguous() const
+    {
+        return sel.contiguous()
+        && strides == sel.strides()
+        && offset == 0
+        && buf && buf->size() == size();
+    }
+
+
+
+
+    /**
+     * Data accessors and selection methods
+     * 
+     */
+    // ========================================================================
+    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    ndarray<T, R - 1> operator[](int index)
+    {
+        if (index < 0 || index >= sel.shape(0))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {offset_relative({index}), buf};
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    const ndarray<T, R - 1> operator[](int index) const
+    {
+        if (index < 0 || index >= sel.shape(0))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {offset_relative({index}), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    ndarray<T, R - 1> operator[](int index)
+    {
+        if (index < 0 || index >= sel.shape(0))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return select_axis<0>(index);
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    const ndarray<T, R - 1> operator[](int index) const
+    {
+        if (index < 0 || index >= sel.shape(0))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return select_axis<0>(index);
+    }
+
+    template<typename... Index>
+    T& operator()(Index... index)
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return buf->operator[](offset_relative({int(index)...}));
+    }
+
+    template<typename... Index>
+    const T& operator()(Index... index) const
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        return buf->operator[](offset_relative({int(index)...}));
+    }
+
+    template<typename... Index>
+    auto select(Index... index)
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        return select_axes<0>(index...);
+    }
+
+    template<typename... Index>
+    auto select(Index... index) const
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        auto A = select_axes<0>(index...);
+        return typename decltype(A)::const_ref(A);
+    }
+
+    template<int Axis, typename Slice>
+    auto take(Slice slice)
+    {
+        auto taken_sel = sel.template on<Axis>().select(slice).reset();
+        return ndarray<T, R>(buf, taken_sel, strides, offset);
+    }
+
+    template<int Axis, typename Slice>
+    auto take(Slice slice) const
+    {
+        auto S = sel.template on<Axis>().select(slice).reset();
+        return const_ref(ndarray<T, R>(buf, S, strides, offset));
+    }
+
+    /**
+     * Returns a view of the block of this array with the given lower corner
+     * and shape. Throws std::out_of_range if the block does not fit.
+     */
+    auto region(std::array<int, R> lower, std::array<int, R> extent)
+    {
+        return ndarray<T, R>(buf, region_selector(lower, extent), strides, offset);
+    }
+
+    auto region(std::array<int, R> lower, std::array<int, R> extent) const
+    {
+        return const_ref(ndarray<T, R>(buf, region_selector(lower, extent), strides, offset));
+    }
+
+    template<int Axis>
+    auto shift(int distance)
+    {
+        auto shifted_sel = sel.template on<Axis>().shift(distance).reset();
+        return ndarray<T, R>(buf, shifted_sel, strides, offset);
+    }
+
+    template<int Axis>
+    auto shift(int distance) const
+    {
+        auto S = sel.template on<Axis>().shift(distance).reset();
+        return const_ref(ndarray<T, R>(buf, S, strides, offset));
+    }
+
+    /**
+     * Returns a view of this array with the given axis reversed, by means of
+     * a negative memory stride.
+     */
+    template<int Axis>
+    auto reverse()
+    {
+        return reversed<Axis>();
+    }
+
+    template<int Axis>
+    auto reverse() const
+    {
+        return const_ref(reversed<Axis>());
+    }
+
+    /**
+     * Returns a view of this array with the order of its axes reversed. The
+     * transpose of a row-major array is a column-major view of the same
+     * memory.
+     */
+    auto transpose()
+    {
+        return transposed();
+    }
+
+    auto transpose() const
+    {
+        return const_ref(transposed());
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    operator T() const
+    {
+        // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
+        return memory()[offset];
+    }
+
+    ndarray<T, R> copy() const
+    {
+        auto A = ndarray<T, R>(shape());
+        strided::copy(shape(), A.operand(), operand());
+        return A;
+    }
+
+    template<typename new_type>
+    ndarray<new_type, R> astype() const
+    {
+        auto A = ndarray<new_type, R>(shape());
+        strided::copy(shape(), A.operand(), operand());
+        return A;
+    }
+
+    const T* data() const
+    {
+        return memory();
+    }
+
+    T* data()
+    {
+        return memory();
+    }
+
+    selector<R> get_selector() const
+    {
+        return sel;
+    }
+
+    /**
+     * Returns the distance in memory, in units of elements, between
+     * neighboring elements along each axis of this view.
+     */
+    std::array<int, R> get_strides() const
+    {
+        std::array<int, R> s;
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = sel.skips[n] * strides[n];
+        }
+        return s;
+    }
+
+    /**
+     * Returns the distance in memory between neighbors along the given axis.
+     */
+    int memory_stride(int axis) const
+    {
+        return sel.skips[axis] * strides[axis];
+    }
+
+    /**
+     * Returns the offset of this view's first element from data().
+     */
+    int data_offset() const
+    {
+        int m = offset;
+
+        for (int n = 0; n < R; ++n)
+        {
+            m += sel.start[n] * strides[n];
+        }
+        return m;
+    }
+
+    bool is_const_ref() const
+    {
+        return false;
+    }
+
+
+
+
+    /**
+     * Operations
+     * 
+     */
+    // ========================================================================
+    template<typename U> struct OpEquals     { auto operator()(T a, U b) const { return a == b; } };
+    template<typename U> struct OpNotEquals  { auto operator()(T a, U b) const { return a != b; } };
+    template<typename U> struct OpGreaterEq  { auto operator()(T a, U b) const { return a >= b; } };
+    template<typename U> struct OpLessEq     { auto operator()(T a, U b) const { return a <= b; } };
+    template<typename U> struct OpGreater    { auto operator()(T a, U b) const { return a > b; } };
+    template<typename U> struct OpLess       { auto operator()(T a, U b) const { return a < b; } };
+    template<typename U> struct OpPlus       { auto operator()(T a, U b) const { return a + b; } };
+    template<typename U> struct OpMinus      { auto operator()(T a, U b) const { return a - b; } };
+    template<typename U> struct OpMultiplies { auto operator()(T a, U b) const { return a * b; } };
+    template<typename U> struct OpDivides    { auto operator()(T a, U b) const { return a / b; } };
+    struct OpIdentity { auto operator()(T a) const { return a; } };
+    struct OpNegate   { auto operator()(T a) const { return ! a; } };
+
+
+
+
+    /**
+     * Arithmetic operations
+     * 
+     */
+    // ========================================================================
+    template<typename U> auto& operator+=(U b) { strided::for_each(shape(), [b] (T& a) { a += b; }, operand()); return *this; }
+    template<typename U> auto& operator-=(U b) { strided::for_each(shape(), [b] (T& a) { a -= b; }, operand()); return *this; }
+    template<typename U> auto& operator*=(U b) { strided::for_each(shape(), [b] (T& a) { a *= b; }, operand()); return *this; }
+    template<typename U> auto& operator/=(U b) { strided::for_each(shape(), [b] (T& a) { a /= b; }, operand()); return *this; }
+    template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
+
+    template<typename U> auto operator+(U b) const { auto A = copy_like(); A += b; return A; }
+    template<typename U> auto operator-(U b) const { auto A = copy_like(); A -= b; return A; }
+    template<typename U> auto operator*(U b) const { auto A = copy_like(); A *= b; return A; }
+    template<typename U> auto operator/(U b) const { auto A = copy_like(); A /= b; return A; }
+    template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
+    template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
+    template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
+    template<typename U> auto operator/(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); }
+
+
+
+
+    /**
+     * Comparison/equality methods and operators
+     * 
+     */
+    // ========================================================================
+    template<typename U> auto operator==(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, B); }
+    template<typename U> auto operator!=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, B); }
+    template<typename U> auto operator>=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, B); }
+    template<typename U> auto operator<=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, B); }
+    template<typename U> auto operator> (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, B); }
+    template<typename U> auto operator< (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, B); }
+
+    template<typename U> auto operator==(U b) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, b); }
+    template<typename U> auto operator!=(U b) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, b); }
+    template<typename U> auto operator>=(U b) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, b); }
+    template<typename U> auto operator<=(U b) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, b); }
+    template<typename U> auto operator> (U b) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, b); }
+    template<typename U> auto operator< (U b) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, b); }
+
+    auto operator!() const { return unary_op<T, R, OpNegate>::perform(*this); }
+    bool any() const { for (auto x : *this) if (x) return true; return false; }
+    bool all() const { for (auto x : *this) if (! x) return false; return true; }
+
+    bool is(const ndarray<T, R>& other) const
+    {
+        return (offset == other.offset
+        && strides == other.strides
+        && sel == other.sel
+        && buf == other.buf
+        && (buf || this == &other));
+    }
+
+    template<int other_rank>
+    bool shares(const ndarray<T, other_rank>& other) const
+    {
+        return buf && buf == other.buf;
+    }
+
+
+
+
+    // ========================================================================
+    /**
+     * Iterators visit the elements in logical (row-major) order, whatever
+     * the memory layout. Their state is a pointer to the current element, a
+     * linear count of elements visited, the count left in the current row,
+     * and copies of the first element's address and of the extents and
+     * memory strides, so they stay valid while the memory is, even after
+     * the view they came from is gone (e.g. auto it = A[0].begin()). Steps
+     * and jumps within a row only move the pointer; the other extents are
+     * read only when a row ends. Comparisons (including against end()) look
+     * only at the linear count. They are random-access, so that e.g.
+     * std::sort and std::nth_element work on strided views in place; jumps
+     * of more than one element unflatten the new count through the shape.
+     */
+    template<typename V>
+    class basic_iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+        using pointer = V*;
+        using reference = V&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        basic_iterator() {}
+        basic_iterator(const ndarray* array, int position)
+        : base(const_cast<V*>(array->memory() + array->data_offset()))
+        {
+            for (int n = 0; n < R; ++n)
+            {
+                shape[n] = array->sel.shape(n);
+                strides[n] = array->memory_stride(n);
+            }
+            seek(position);
+        }
+
+        basic_iterator& operator++()
+        {
+            ++position;
+            current += strides[R - 1];
+
+            if (--left == 0)
+            {
+                seek(position);
+            }
+            return *this;
+        }
+
+        basic_iterator& operator--()
+        {
+            if (left == shape[R - 1])
+            {
+                seek(position - 1);
+            }
+            else
+            {
+                --position;
+                ++left;
+                current -= strides[R - 1];
+            }
+            return *this;
+        }
+
+        basic_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        basic_iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        basic_iterator& operator+=(difference_type n) { return jump(int(n)); }
+        basic_iterator& operator-=(difference_type n) { return jump(int(-n)); }
+        basic_iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        basic_iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        friend basic_iterator operator+(difference_type n, basic_iterator a) { return a += n; }
+        difference_type operator-(const basic_iterator& other) const { return position - other.position; }
+        bool operator==(const basic_iterator& other) const { return position == other.position; }
+        bool operator!=(const basic_iterator& other) const { return position != other.position; }
+        bool operator< (const basic_iterator& other) const { return position <  other.position; }
+        bool operator> (const basic_iterator& other) const { return position >  other.position; }
+        bool operator<=(const basic_iterator& other) const { return position <= other.position; }
+        bool operator>=(const basic_iterator& other) const { return position >= other.position; }
+        V& operator[](difference_type n) const { return *(*this + n); }
+        V& operator*() const { return *current; }
+
+    private:
+        basic_iterator& jump(int n)
+        {
+            if (n < left && n >= left - shape[R - 1])
+            {
+                position += n;
+                left -= n;
+                current += n * strides[R - 1];
+            }
+            else
+            {
+                seek(position + n);
+            }
+            return *this;
+        }
+
+        void seek(int new_position)
+        {
+            position = new_position;
+            current = base;
+            left = 0;
+
+            for (int n = R - 1; n >= 0; --n)
+            {
+                if (shape[n] == 0)
+                {
+                    return;
+                }
+                int i = new_position % shape[n];
+                new_position /= shape[n];
+                current += i * strides[n];
+
+                if (n == R - 1)
+                {
+                    left = shape[n] - i;
+                }
+            }
+        }
+        V* current = nullptr;
+        V* base = nullptr;
+        int position = 0;
+        int left = 0;
+        std::array<int, R> shape;
+        std::array<int, R> strides;
+    };
+
+    using iterator = basic_iterator<T>;
+    using const_iterator = basic_iterator<const T>;
+
+    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {this, 0}; }
+    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {this, int(size())}; }
+    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {this, 0}; }
+    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {this, int(size())}; }
+
+
+
+
+    /**
+     * Basic serialization operations
+     * 
+     */
+    // ========================================================================
+    std::string dumps() const
+    {
+        // dtype ... 8 char's
+        // rank  ... 1 int
+        // shape ... rank int's
+        // data  ... size T's
+
+        auto D = dtype_str<T>::value();
+        auto Q = int(rank);
+        auto S = shape();
+        auto str = std::string();
+
+        str.insert(str.end(), (char*)&D, (char*)(&D + 1));
+        str.insert(str.end(), (char*)&Q, (char*)(&Q + 1));
+        str.insert(str.end(), (char*)&S, (char*)(&S + 1));
+
+        for (const auto& x : *this)
+        {
+            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
+        }
+        return str;
+    }
+
+    static ndarray<T, R> loads(const std::string& str)
+    {
+        auto it = str.begin();
+        auto D = std::array<char, 8>();
+        auto Q = int();
+        auto S = constant_array<rank>(0);
+
+        assert_valid_argument(it + sizeof(D) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&D, &*it, sizeof(D));
+        it += sizeof(D);
+
+        assert_valid_argument(it + sizeof(Q) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&Q, &*it, sizeof(Q));
+        it += sizeof(Q);
+
+        assert_valid_argument(it + sizeof(S) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&S, &*it, sizeof(S));
+        it += sizeof(S);
+
+        assert_valid_argument(D == dtype_str<T>::value(), "ndarray string has wrong data type");
+        assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
+
+        auto size = std::accumulate(S.begin(), S.end(), 1, std::multiplies<int>());
+        auto wbuf = buffer<T>::make(size);
+        auto dest = wbuf->begin();
+
+        while (it != str.end())
+        {
+            assert_valid_argument(dest != wbuf->end(), "unexpected end of ndarray data string");
+            std::memcpy(&*dest, &*it, sizeof(T));
+            ++dest;
+            it += sizeof(T);
+        }
+
+        return {S, wbuf};
+    }
+
+
+private:
+    /**
+     * Private utility methods
+     * 
+     */
+    // ========================================================================
+    const T* memory() const
+    {
+        return buf ? buf->data() : scalar_value.data();
+    }
+
+    T* memory()
+    {
+        return buf ? buf->data() : scalar_value.data();
+    }
+
+    strided::operand<const T, R> operand() const
+    {
+        return {memory() + data_offset(), get_strides()};
+    }
+
+    strided::operand<T, R> operand()
+    {
+        return {memory() + data_offset(), get_strides()};
+    }
+
+    /**
+     * Returns a new array of the same shape, whose memory is laid out
+     * compactly in the memory order of this one. Element-wise operations
+     * then traverse both arrays sequentially.
+     */
+    template<typename U>
+    ndarray<U, R> allocate_like() const
+    {
+        auto shape = sel.shape();
+        auto order = strided::memory_order(shape, get_strides());
+        auto new_strides = std::array<int, R>();
+        int stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            new_strides[order[n]] = stride;
+            stride *= shape[order[n]];
+        }
+        return {buffer<U>::make(size()), selector<R>(shape), new_strides, 0};
+    }
+
+    ndarray<T, R> copy_like() const
+    {
+        auto A = allocate_like<T>();
+        copy_internal(A, *this);
+        return A;
+    }
+
+    ndarray(std::shared_ptr<buffer<T>> buf, selector<R> sel, std::array<int, R> strides, int offset)
+    : offset(offset)
+    , sel(sel)
+    , strides(strides)
+    , buf(buf)
+    {
+    }
+
+    selector<R> region_selector(std::array<int, R> lower, std::array<int, R> extent) const
+    {
+        auto start = sel.start;
+        auto final = sel.final;
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (lower[n] < 0 || extent[n] < 0 || lower[n] + extent[n] > sel.shape(n))
+            {
+                throw std::out_of_range("ndarray: region out of range");
+            }
+            start[n] += lower[n] * sel.skips[n];
+            final[n] = start[n] + std::max(extent[n] - 1, 0) * sel.skips[n] + (extent[n] > 0);
+        }
+        return {sel.count, start, final, sel.skips};
+    }
+
+    template<int Axis, typename Slice>
+    ndarray<T, R> select_axis(Slice slice) const
+    {
+        return {buf, sel.template on<Axis>().select(slice).reset(), strides, offset};
+    }
+
+    template<int Axis>
+    ndarray<T, R - 1> select_axis(int index) const
+    {
+        auto new_strides = std::array<int, R - 1>();
+
+        for (int n = 0; n < R - 1; ++n)
+        {
+            new_strides[n] = strides[n < Axis ? n : n + 1];
+        }
+        auto new_offset = offset + (sel.start[Axis] + sel.skips[Axis] * index) * strides[Axis];
+        return {buf, sel.template on<Axis>().erase(), new_strides, new_offset};
+    }
+
+    template<int Axis>
+    ndarray<T, R> select_axes() const
+    {
+        return {buf, sel, strides, offset};
+    }
+
+    template<int Axis, typename First, typename... Rest>
+    auto select_axes(First first, Rest... rest) const
+    {
+        auto A = select_axis<Axis>(first);
+        return A.template select_axes<Axis + (decltype(A)::rank == R)>(rest...);
+    }
+
+    template<int Axis>
+    ndarray<T, R> reversed() const
+    {
+        auto new_strides = strides;
+        auto new_offset = offset + (sel.count[Axis] - 1) * strides[Axis];
+        new_strides[Axis] = -strides[Axis];
+        return {buf, sel.template on<Axis>().reverse().reset(), new_strides, new_offset};
+    }
+
+    ndarray<T, R> transposed() const
+    {
+        auto new_strides = strides;
+        std::reverse(new_strides.begin(), new_strides.end());
+        return {buf, sel.transpose(), new_strides, offset};
+    }
+
+    int offset_relative(std::array<int, R> index) const
+    {
+        for (int n = 0; n < rank; ++n)
+        {
+            index[n] = sel.start[n] + sel.skips[n] * index[n];
+        }
+        return offset_absolute(index);
+    }
+
+    int offset_absolute(std::array<int, R> index) const
+    {
+        return offset + shape::dot(index, strides);
+    }
+
+    template<std::size_t Q, std::size_t... I>
+    static std::array<int, Q> to_array(const int (&values)[Q], std::index_sequence<I...>)
+    {
+        return {values[I]...};
+    }
+
+    template<int length>
+    static std::array<int, length> constant_array(T value)
+    {
+        std::array<int, length> A;
+        for (auto& a : A) a = value;
+        return A;
+    }
+
+    static void assert_valid_argument(bool condition, const char* message)
+    {
+        if (! condition)
+        {
+            throw std::invalid_argument(message);
+        }
+    }
+
+    template<typename TT, int TR>
+    static void copy_internal(ndarray<TT, TR>& target, const ndarray<T, R>& source)
+    {
+        if (target.size() != source.size())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(source.shape())
+                + " to "
+                + shape::to_string(target.shape()));
+        }
+
+        auto a = target.begin();
+        auto b = source.begin();
+
+        for (; a != target.end(); ++a, ++b)
+        {
+            *a = *b;
+        }
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+    {
+        target.memory()[target.offset] = source.memory()[source.offset];
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
+    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+    {
+        if (target.shape() != source.shape())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(source.shape())
+                + " to "
+                + shape::to_string(target.shape()));
+        }
+        strided::copy(target.shape(), target.operand(), source.operand());
+    }
+
+
+
+    /**
+     * Data members
+     *
+     */
+    // ========================================================================
+    int offset = 0;
+    selector<R> sel;
+    std::array<int, R> strides;
+    std::shared_ptr<buffer<T>> buf;
+    std::array<T, R == 0 ? 1 : 0> scalar_value;
+
+
+
+
+    /**
+     * Grant friendship to ndarray's of other ranks.
+     *
+     */
+    template<typename, int>
+    friend class ndarray;
+    template<typename, typename, int, typename>
+    friend struct binary_op;
+    template<typename, int, typename>
+    friend struct unary_op;
+}; 
+
+
+
+
+// ============================================================================
+template<typename T, int... Dims> 
+class nd::static_array
+{
+public:
+
+
+    using dtype = T;
+    enum { rank = sizeof...(Dims) };
+
+
+
+
+    /**
+     * Compile-time shape queries
+     *
+     */
+    // ========================================================================
+    static constexpr std::array<int, rank> shape()
+    {
+        return {Dims...};
+    }
+
+    static constexpr int shape(int axis)
+    {
+        const std::array<int, rank> s = {Dims...};
+        return s[axis];
+    }
+
+    static constexpr int size()
+    {
+        return static_size(Dims...);
+    }
+
+    static constexpr std::array<int, rank> strides()
+    {
+        return strides(std::make_index_sequence<rank>());
+    }
+
+    static constexpr int strides(int axis)
+    {
+        int stride = 1;
+
+        for (int n = axis + 1; n < rank; ++n)
+        {
+            stride *= shape(n);
+        }
+        return stride;
+    }
+
+    template<typename... Index>
+    static constexpr int offset(Index... index)
+    {
+        static_assert(sizeof...(Index) == rank, "static_array: index size must match rank");
+
+        const std::array<int, rank> i = {int(index)...};
+        int m = 0;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m += i[n] * strides(n);
+        }
+        return m;
+    }
+
+    template<typename... Index>
+    static constexpr bool contains(Index... index)
+    {
+        const std::array<int, rank> i = {int(index)...};
+
+        for (int n = 0; n < rank; ++n)
+        {
+            if (i[n] < 0 || i[n] >= shape(n))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+
+
+    /**
+     * Constructors
+     *
+     */
+    // ========================================================================
+    static_array()
+    {
+        memory.fill(T());
+    }
+
+    explicit static_array(T value)
+    {
+        memory.fill(value);
+    }
+
+    static_array(std::initializer_list<T> elements)
+    {
+        if (elements.size() != std::size_t(size()))
+            throw std::invalid_argument("static_array: wrong number of elements in initializer list");
+
+        std::copy(elements.begin(), elements.end(), memory.begin());
+    }
+
+    explicit static_array(const ndarray<T, rank>& A)
+    {
+        if (A.shape() != shape())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(A.shape())
+                + " to "
+                + shape::to_string(shape()));
+        }
+        std::copy(A.begin(), A.end(), memory.begin());
+    }
+
+    operator ndarray<T, rank>() const
+    {
+        auto A = ndarray<T, rank>(shape());
+        std::copy(begin(), end(), A.begin());
+        return A;
+    }
+
+
+
+
+    /**
+     * Data accessors
+     *
+     */
+    // ========================================================================
+    template<typename... Index>
+    T& operator()(Index... index)
+    {
+        if (! contains(index...))
+            throw std::out_of_range("static_array: index out of range");
+
+        return memory[offset(index...)];
+    }
+
+    template<typename... Index>
+    const T& operator()(Index... index) const
+    {
+        if (! contains(index...))
+            throw std::out_of_range("static_array: index out of range");
+
+        return memory[offset(index...)];
+    }
+
+    T* data() { return memory.data(); }
+    const T* data() const { return memory.data(); }
+
+    T* begin() { return memory.data(); }
+    T* end() { return memory.data() + size(); }
+    const T* begin() const { return memory.data(); }
+    const T* end() const { return memory.data() + size(); }
+
+
+
+
+    /**
+     * Arithmetic and comparison operators
+     *
+     */
+    // ========================================================================
+    template<typename U> auto& operator+=(U b) { apply([&] (int n) { memory[n] += b; }); return *this; }
+    template<typename U> auto& operator-=(U b) { apply([&] (int n) { memory[n] -= b; }); return *this; }
+    template<typename U> auto& operator*=(U b) { apply([&] (int n) { memory[n] *= b; }); return *this; }
+    template<typename U> auto& operator/=(U b) { apply([&] (int n) { memory[n] /= b; }); return *this; }
+    template<typename U, int... D> auto& operator+=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] += B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator-=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] -= B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator*=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] *= B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator/=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] /= B.memory[n]; }); return *this; }
+
+    template<typename U> auto operator+(U b) const { return map([&] (T a) { return a + b; }); }
+    template<typename U> auto operator-(U b) const { return map([&] (T a) { return a - b; }); }
+    template<typename U> auto operator*(U b) const { return map([&] (T a) { return a * b; }); }
+    template<typename U> auto operator/(U b) const { return map([&] (T a) { return a / b; }); }
+    template<typename U, int... D> auto operator+(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a + b; }); }
+    template<typename U, int... D> auto operator-(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a - b; }); }
+    template<typename U, int... D> auto operator*(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a * b; }); }
+    template<typename U, int... D> auto operator/(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a / b; }); }
+
+    template<typename U, int... D> auto operator==(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a == b; }); }
+    template<typename U, int... D> auto operator!=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a != b; }); }
+    template<typename U, int... D> auto operator>=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a >= b; }); }
+    template<typename U, int... D> auto operator<=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a <= b; }); }
+    template<typename U, int... D> auto operator> (const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a >  b; }); }
+    template<typename U, int... D> auto operator< (const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a <  b; }); }
+
+    template<typename U> auto operator==(U b) const { return map([&] (T a) { return a == b; }); }
+    template<typename U> auto operator!=(U b) const { return map([&] (T a) { return a != b; }); }
+    template<typename U> auto operator>=(U b) const { return map([&] (T a) { return a >= b; }); }
+    template<typename U> auto operator<=(U b) const { return map([&] (T a) { return a <= b; }); }
+    template<typename U> auto operator> (U b) const { return map([&] (T a) { return a >  b; }); }
+    template<typename U> auto operator< (U b) const { return map([&] (T a) { return a <  b; }); }
+
+    auto operator!() const { return map([] (T a) { return ! a; }); }
+    bool any() const { for (auto x : memory) if (x) return true; return false; }
+    bool all() const { for (auto x : memory) if (! x) return false; return true; }
+
+
+private:
+    /**
+     * Private utility methods
+     *
+     */
+    // ========================================================================
+    template<std::size_t... I>
+    static constexpr std::array<int, rank> strides(std::index_sequence<I...>)
+    {
+        return {strides(int(I))...};
+    }
+
+    template<typename Function, std::size_t... I>
+    static void apply(Function f, std::index_sequence<I...>)
+    {
+        int expand[] = {0, (f(int(I)), 0)...};
+        (void) expand;
+    }
+
+    template<typename Function>
+    static void apply(Function f)
+    {
+        apply(f, std::make_index_sequence<size()>());
+    }
+
+    template<typename Function>
+    auto map(Function f) const
+    {
+        auto C = static_array<decltype(f(T())), Dims...>();
+        apply([&] (int n) { C.memory[n] = f(memory[n]); });
+        return C;
+    }
+
+    template<typename U, int... D, typename Function>
+    auto zip(const static_array<U, D...>& B, Function f) const
+    {
+        check_shape(B);
+        auto C = static_array<decltype(f(T(), U())), Dims...>();
+        apply([&] (int n) { C.memory[n] = f(memory[n], B.memory[n]); });
+        return C;
+    }
+
+    template<typename U, int... D>
+    static void check_shape(const static_array<U, D...>&)
+    {
+        static_assert(std::is_same<std::integer_sequence<int, Dims...>, std::integer_sequence<int, D...>>::value,
+            "incompatible shapes for binary operation");
+    }
+
+
+
+
+    /**
+     * Data members
+     *
+     */
+    // ========================================================================
+    std::array<T, static_size(Dims...)> memory;
+
+
+
+
+    /**
+     * Grant friendship to static arrays of other types and shapes.
+     *
+     */
+    template<typename, int...>
+    friend class static_array;
+}; 
+
+
+
+
+// ============================================================================
+template<typename T> 
+nd::dlpack::DLDataType nd::dlpack::dtype()
+{
+    static_assert(std::is_arithmetic<T>::value, "dlpack: only arithmetic types can be exported");
+
+    auto code =
+    std::is_same<T, bool>::value ? kDLBool :
+    std::is_floating_point<T>::value ? kDLFloat :
+    std::is_signed<T>::value ? kDLInt : kDLUInt;
+
+    return {uint8_t(code), uint8_t(8 * sizeof(T)), 1};
+}
+
+
+
+
+/**
+ * Records whether the consumer may write to the tensor's memory, where the
+ * tensor type has a place for it.
+ */
+void nd::dlpack::set_flags(DLManagedTensor&, bool)
+{
+}
+
+void nd::dlpack::set_flags(DLManagedTensorVersioned& tensor, bool read_only)
+{
+    tensor.version = {1, 0};
+    tensor.flags = read_only ? DLPACK_FLAG_BITMASK_READ_ONLY : 0;
+}
+
+
+
+
+/**
+ * Builds a managed tensor (DLManagedTensor or DLManagedTensorVersioned)
+ * describing a view of the given array and sharing its memory. The tensor
+ * keeps the memory alive until its deleter is called by the consumer, even
+ * if every array using the memory is gone by then.
+ */
+template<typename Managed, typename T, int R>
+Managed* nd::dlpack::export_tensor(ndarray<T, R>& A, bool read_only)
+{
+    struct context
+    {
+        context(ndarray<T, R>& A) : array(A) {}
+        Managed tensor;
+        ndarray<T, R> array;
+        std::array<int64_t, R> shape;
+        std::array<int64_t, R> strides;
+    };
+
+    auto ctx = new context(A);
+    auto shape = A.shape();
+    auto strides = A.get_strides();
+
+    for (int n = 0; n < R; ++n)
+    {
+        ctx->shape[n] = shape[n];
+        ctx->strides[n] = strides[n];
+    }
+
+    auto& t = ctx->tensor.dl_tensor;
+    t.data = ctx->array.data();
+    t.device = {kDLCPU, 0};
+    t.ndim = R;
+    t.dtype = dtype<T>();
+    t.shape = ctx->shape.data();
+    t.strides = ctx->strides.data();
+    t.byte_offset = ctx->array.data_offset() * sizeof(T);
+
+    ctx->tensor.manager_ctx = ctx;
+    ctx->tensor.deleter = [] (Managed* self)
+    {
+        delete static_cast<context*>(self->manager_ctx);
+    };
+    set_flags(ctx->tensor, read_only);
+    return &ctx->tensor;
+}
+
+/**
+ * Exports a view of the given array as a DLPack managed tensor, sharing its
+ * memory (see dlpack::export_tensor). Const arrays and const views are
+ * exported read-only: the pre-1.0 DLManagedTensor has no flag to say so,
+ * so prefer to_dlpack_versioned for consumers that honor it.
+ */
+template<typename T, int R>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensor>(A, false);
+}
+
+template<typename T, int R>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(const ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensor>(const_cast<ndarray<T, R>&>(A), true);
+}
+
+template<typename View>
+nd::dlpack::DLManagedTensor* nd::to_dlpack(const View& A)
+{
+    return to_dlpack(static_cast<const ndarray<typename View::dtype, View::rank>&>(A));
+}
+
+/**
+ * Exports a view of the given array as a DLPack 1.0 managed tensor, sharing
+ * its memory. Tensors of const arrays and const views have the read-only
+ * flag set.
+ */
+template<typename T, int R>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensorVersioned>(A, false);
+}
+
+template<typename T, int R>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(const ndarray<T, R>& A)
+{
+    return dlpack::export_tensor<dlpack::DLManagedTensorVersioned>(const_cast<ndarray<T, R>&>(A), true);
+}
+
+template<typename View>
+nd::dlpack::DLManagedTensorVersioned* nd::to_dlpack_versioned(const View& A)
+{
+    return to_dlpack_versioned(static_cast<const ndarray<typename View::dtype, View::rank>&>(A));
+}
+
+
+
+
+/**
+ * Imports a DLPack managed tensor as an array sharing its memory, taking
+ * ownership of the tensor: its deleter is called once the last array using
+ * the memory is gone. Throws std::invalid_argument, without taking
+ * ownership, if the tensor is not in host memory, or its rank or data type
+ * do not match the array.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::from_dlpack(dlpack::DLManagedTensor* tensor)
+{
+    const auto& t = tensor->dl_tensor;
+    const auto d = dlpack::dtype<T>();
+
+    if (t.device.device_type != dlpack::kDLCPU)
+        throw std::invalid_argument("from_dlpack: tensor is not in host memory");
+
+    if (t.ndim != R)
+        throw std::invalid_argument("from_dlpack: tensor has the wrong rank");
+
+    if (t.dtype.code != d.code || t.dtype.bits != d.bits || t.dtype.lanes != d.lanes)
+        throw std::invalid_argument("from_dlpack: tensor has the wrong data type");
+
+    if (t.byte_offset % sizeof(T) != 0)
+        throw std::invalid_argument("from_dlpack: tensor byte offset is not a multiple of the element size");
+
+    auto shape = std::array<int, R>();
+
+    for (int n = 0; n < R; ++n)
+    {
+        shape[n] = int(t.shape[n]);
+    }
+
+    auto strides = selector<R>(shape).strides();
+
+    if (t.strides != nullptr)
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            strides[n] = int(t.strides[n]);
+        }
+    }
+
+    auto data = reinterpret_cast<T*>(static_cast<char*>(t.data) + t.byte_offset);
+
+    return ndarray<T, R>(data, shape, strides, [tensor] (T*)
+    {
+        if (tensor->deleter)
+        {
+            tensor->deleter(tensor);
+        }
+    });
+} 
+
+
+
+
+// ============================================================================
+template<typename T> 
+T nd::dot(const ndarray<T, 1>& a, const ndarray<T, 1>& b)
+{
+    if (a.shape() != b.shape())
+    {
+        throw std::invalid_argument("dot: incompatible shapes "
+            + shape::to_string(a.shape())
+            + " and "
+            + shape::to_string(b.shape()));
+    }
+
+    int n = a.shape(0);
+    auto x = a.data() + a.data_offset();
+    auto y = b.data() + b.data_offset();
+    int incx = a.get_strides()[0];
+    int incy = b.get_strides()[0];
+
+    if (n < ND_PARALLEL_THRESHOLD)
+    {
+        return linalg::dot(n, x, incx, y, incy);
+    }
+
+    int chunks = parallel::num_threads();
+    auto partial = std::vector<T>(chunks);
+
+    parallel::for_each_chunk(chunks, [&] (int lower, int upper)
+    {
+        for (int c = lower; c < upper; ++c)
+        {
+            int i0 = int(long(n) * c / chunks);
+            int i1 = int(long(n) * (c + 1) / chunks);
+            partial[c] = linalg::dot(i1 - i0, x + i0 * incx, incx, y + i0 * incy, incy);
+        }
+    });
+
+    auto result = T();
+
+    for (auto p : partial)
+    {
+        result += p;
+    }
+    return result;
+}
+
+
+
+
+/**
+ * Matrix-vector product A x. The loop order follows A's layout: rows are
+ * reduced with dot products when they are the contiguous axis, and columns
+ * are accumulated otherwise.
+ */
+template<typename T>
+nd::ndarray<T, 1> nd::matmul(const ndarray<T, 2>& A, const ndarray<T, 1>& x)
+{
+    if (A.shape(1) != x.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(x.shape()));
+    }
+
+    auto y = ndarray<T, 1>(A.shape(0));
+    auto sa = A.get_strides();
+
+    linalg::gemv(A.shape(0), A.shape(1),
+        A.data() + A.data_offset(), sa[0], sa[1],
+        x.data() + x.data_offset(), x.get_strides()[0],
+        y.data(), 1);
+
+    return y;
+}
+
+
+
+
+/**
+ * Vector-matrix product x A, i.e. the matrix-vector product with A's
+ * transpose.
+ */
+template<typename T>
+nd::ndarray<T, 1> nd::matmul(const ndarray<T, 1>& x, const ndarray<T, 2>& A)
+{
+    if (x.shape(0) != A.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(x.shape())
+            + " and "
+            + shape::to_string(A.shape()));
+    }
+
+    auto y = ndarray<T, 1>(A.shape(1));
+    auto sa = A.get_strides();
+
+    linalg::gemv(A.shape(1), A.shape(0),
+        A.data() + A.data_offset(), sa[1], sa[0],
+        x.data() + x.data_offset(), x.get_strides()[0],
+        y.data(), 1);
+
+    return y;
+}
+
+
+
+
+/**
+ * Matrix product A B, as a new row-major array. Either operand may be any
+ * strided view, e.g. a transpose or a selection; they are packed into
+ * contiguous panels as part of the blocked algorithm, so no separate copy
+ * is made. Large products are split across threads by rows of the output.
+ */
+template<typename T>
+nd::ndarray<T, 2> nd::matmul(const ndarray<T, 2>& A, const ndarray<T, 2>& B)
+{
+    if (A.shape(1) != B.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(B.shape()));
+    }
+
+    auto C = ndarray<T, 2>(A.shape(0), B.shape(1));
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+
+    linalg::gemm(A.shape(0), B.shape(1), A.shape(1),
+        A.data() + A.data_offset(), sa[0], sa[1],
+        B.data() + B.data_offset(), sb[0], sb[1],
+        C.data(), B.shape(1), 1);
+
+    return C;
+}
+
+
+
+
+/**
+ * Strided inner product, with four independent accumulators so that the
+ * additions can overlap.
+ */
+template<typename T>
+T nd::linalg::dot(int n, const T* x, int incx, const T* y, int incy)
+{
+    T s0 = T(), s1 = T(), s2 = T(), s3 = T();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 += x[(i + 0) * incx] * y[(i + 0) * incy];
+        s1 += x[(i + 1) * incx] * y[(i + 1) * incy];
+        s2 += x[(i + 2) * incx] * y[(i + 2) * incy];
+        s3 += x[(i + 3) * incx] * y[(i + 3) * incy];
+    }
+    for (; i < n; ++i)
+    {
+        s0 += x[i * incx] * y[i * incy];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+
+
+
+/**
+ * y += A x, for an m x n matrix A. Rows of y are split across threads when
+ * the matrix is large.
+ */
+template<typename T>
+void nd::linalg::gemv(int m, int n, const T* a, int rsa, int csa, const T* x, int incx, T* y, int incy)
+{
+    auto rows = [&] (int lower, int upper)
+    {
+        if (std::abs(csa) <= std::abs(rsa))
+        {
+            for (int i = lower; i < upper; ++i)
+            {
+                y[i * incy] += dot(n, a + i * rsa, csa, x, incx);
+            }
+        }
+        else
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                auto xj = x[j * incx];
+                auto aj = a + j * csa;
+
+                for (int i = lower; i < upper; ++i)
+                {
+                    y[i * incy] += aj[i * rsa] * xj;
+                }
+            }
+        }
+    };
+
+    if (long(m) * n >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(m, rows);
+    }
+    else
+    {
+        rows(0, m);
+    }
+}
+
+
+
+
+/**
+ * C += A B, for an m x k matrix A and a k x n matrix B. This follows the
+ * usual five-loop structure of a blocked matrix product: for each block of
+ * NC columns of B and KC of its rows, the block is packed into panels of NR
+ * columns; then for each block of MC rows of A, that block is packed into
+ * panels of MR rows, and the macro-kernel multiplies the packed panels. The
+ * output rows are split across threads, in whole MR-row panels, each
+ * thread packing its own blocks of A.
+ */
+template<typename T>
+void nd::linalg::gemm(int m, int n, int k, const T* a, int rsa, int csa, const T* b, int rsb, int csb, T* c, int rsc, int csc)
+{
+    using B = blocking<T>;
+
+    if (m == 0 || n == 0 || k == 0)
+    {
+        return;
+    }
+
+    int panels = (m + B::MR - 1) / B::MR;
+    bool threaded = double(m) * n * k >= 64.0 * ND_PARALLEL_THRESHOLD;
+    auto packed_b = std::vector<T>(std::size_t(B::KC) * ((std::min(n, int(B::NC)) + B::NR - 1) / B::NR) * B::NR);
+
+    for (int jc = 0; jc < n; jc += B::NC)
+    {
+        int nc = std::min(int(B::NC), n - jc);
+
+        for (int pc = 0; pc < k; pc += B::KC)
+        {
+            int kc = std::min(int(B::KC), k - pc);
+
+            pack_b(kc, nc, b + pc * rsb + jc * csb, rsb, csb, packed_b.data());
+
+            auto rows = [&] (int lower, int upper)
+            {
+                auto packed_a = std::vector<T>(std::size_t(B::MC) * B::KC);
+                int i1 = std::min(upper * int(B::MR), m);
+
+                for (int ic = lower * B::MR; ic < i1; ic += B::MC)
+                {
+                    int mc = std::min(int(B::MC), i1 - ic);
+                    pack_a(mc, kc, a + ic * rsa + pc * csa, rsa, csa, packed_a.data());
+                    macro_kernel(mc, nc, kc, packed_a.data(), packed_b.data(), c + ic * rsc + jc * csc, rsc, csc);
+                }
+            };
+
+            if (threaded)
+            {
+                parallel::for_each_chunk(panels, rows);
+            }
+            else
+            {
+                rows(0, panels);
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Packs an mc x kc block of A into panels of MR rows; each panel stores its
+ * MR elements of each column together, padded with zeros past row mc.
+ */
+template<typename T>
+void nd::linalg::pack_a(int mc, int kc, const T* a, int rsa, int csa, T* packed)
+{
+    const int MR = blocking<T>::MR;
+
+    for (int ir = 0; ir < mc; ir += MR)
+    {
+        int mr = std::min(MR, mc - ir);
+
+        for (int p = 0; p < kc; ++p)
+        {
+            for (int i = 0; i < MR; ++i)
+            {
+                *packed++ = i < mr ? a[(ir + i) * rsa + p * csa] : T();
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Packs a kc x nc block of B into panels of NR columns; each panel stores
+ * its NR elements of each row together, padded with zeros past column nc.
+ */
+template<typename T>
+void nd::linalg::pack_b(int kc, int nc, const T* b, int rsb, int csb, T* packed)
+{
+    const int NR = blocking<T>::NR;
+
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+        int nr = std::min(NR, nc - jr);
+
+        for (int p = 0; p < kc; ++p)
+        {
+            for (int j = 0; j < NR; ++j)
+            {
+                *packed++ = j < nr ? b[p * rsb + (jr + j) * csb] : T();
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Multiplies a packed mc x kc block of A by a packed kc x nc block of B,
+ * one MR x NR tile of C at a time.
+ */
+template<typename T>
+void nd::linalg::macro_kernel(int mc, int nc, int kc, const T* packed_a, const T* packed_b, T* c, int rsc, int csc)
+{
+    const int MR = blocking<T>::MR;
+    const int NR = blocking<T>::NR;
+
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+        for (int ir = 0; ir < mc; ir += MR)
+        {
+            micro_kernel(kc,
+                packed_a + ir * kc,
+                packed_b + jr * kc,
+                c + ir * rsc + jr * csc, rsc, csc,
+                std::min(MR, mc - ir),
+                std::min(NR, nc - jr));
+        }
+    }
+}
+
+
+
+
+/**
+ * Accumulates the product of an MR-row panel of A and an NR-column panel of
+ * B into an mr x nr tile of C. The full MR x NR tile is computed in a local
+ * array, which the compiler keeps in vector registers: the inner loop is a
+ * broadcast of one element of A against a contiguous row of NR elements of
+ * B, and is written to auto-vectorize rather than with intrinsics.
+ */
+template<typename T>
+void nd::linalg::micro_kernel(int kc, const T* a, const T* b, T* c, int rsc, int csc, int mr, int nr)
+{
+    const int MR = blocking<T>::MR;
+    const int NR = blocking<T>::NR;
+    T ab[MR][NR] = {};
+
+    for (int p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        for (int i = 0; i < MR; ++i)
+        {
+            for (int j = 0; j < NR; ++j)
+            {
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+    }
+
+    for (int i = 0; i < mr; ++i)
+    {
+        for (int j = 0; j < nr; ++j)
+        {
+            c[i * rsc + j * csc] += ab[i][j];
+        }
+    }
+}
+
+
+
+
+/**
+ * Batched matrix product C[b] = A[b] B[b], for arrays of shape (count, M, K)
+ * and (count, K, N). Throws std::invalid_argument if the shapes differ from
+ * these. The inner sizes are compile-time constants, so the products are
+ * fully unrolled, and are vectorized across the batch rather than within
+ * each matrix; large batches are split across threads.
+ */
+template<int M, int K, int N, typename T>
+nd::ndarray<T, 3> nd::batch_matmul(const ndarray<T, 3>& A, const ndarray<T, 3>& B)
+{
+    if (A.shape() != std::array<int, 3>{A.shape(0), M, K} || B.shape() != std::array<int, 3>{A.shape(0), K, N})
+    {
+        throw std::invalid_argument("batch_matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(B.shape()));
+    }
+
+    auto C = ndarray<T, 3>(A.shape(0), M, N);
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+    auto sc = C.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pb = B.data() + B.data_offset();
+    auto pc = C.data();
+
+    linalg::for_each_batch<T>(A.shape(0), M * N * K, [&] (int start, int lanes)
+    {
+        linalg::tile<T, M, K> a;
+        linalg::tile<T, K, N> b;
+        linalg::tile<T, M, N> c = {};
+        const int W = c.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+        b.load(pb + start * sb[0], sb, lanes);
+
+        for (int i = 0; i < M; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int k = 0; k < K; ++k)
+                    for (int w = 0; w < W; ++w)
+                        c.v[i][j][w] += a.v[i][k][w] * b.v[k][j][w];
+
+        c.store(pc + start * sc[0], sc, lanes);
+    });
+    return C;
+}
+
+
+
+
+/**
+ * Batched matrix-vector product y[b] = A[b] x[b], for arrays of shape
+ * (count, M, N) and (count, N).
+ */
+template<int M, int N, typename T>
+nd::ndarray<T, 2> nd::batch_matvec(const ndarray<T, 3>& A, const ndarray<T, 2>& x)
+{
+    if (A.shape() != std::array<int, 3>{A.shape(0), M, N} || x.shape() != std::array<int, 2>{A.shape(0), N})
+    {
+        throw std::invalid_argument("batch_matvec: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(x.shape()));
+    }
+
+    auto y = ndarray<T, 2>(A.shape(0), M);
+    auto sa = A.get_strides();
+    auto sx = std::array<int, 3>{x.get_strides()[0], x.get_strides()[1], 0};
+    auto sy = std::array<int, 3>{M, 1, 0};
+    auto pa = A.data() + A.data_offset();
+    auto px = x.data() + x.data_offset();
+    auto py = y.data();
+
+    linalg::for_each_batch<T>(A.shape(0), M * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, M, N> a;
+        linalg::tile<T, N, 1> b;
+        linalg::tile<T, M, 1> c = {};
+        const int W = c.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+        b.load(px + start * sx[0], sx, lanes);
+
+        for (int i = 0; i < M; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int w = 0; w < W; ++w)
+                    c.v[i][0][w] += a.v[i][j][w] * b.v[j][0][w];
+
+        c.store(py + start * sy[0], sy, lanes);
+    });
+    return y;
+}
+
+
+
+
+/**
+ * Determinants of a batch of N x N matrices, of shape (count, N, N), for N
+ * up to 4. The determinants are computed in closed form.
+ */
+template<int N, typename T>
+nd::ndarray<T, 1> nd::batch_det(const ndarray<T, 3>& A)
+{
+    static_assert(N >= 1 && N <= 4, "batch_det: only matrices up to 4 x 4 are supported");
+
+    if (A.shape() != std::array<int, 3>{A.shape(0), N, N})
+    {
+        throw std::invalid_argument("batch_det: expected a batch of "
+            + std::to_string(N) + " x " + std::to_string(N)
+            + " matrices, got shape "
+            + shape::to_string(A.shape()));
+    }
+
+    auto D = ndarray<T, 1>(A.shape(0));
+    auto sa = A.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pd = D.data();
+
+    linalg::for_each_batch<T>(A.shape(0), N * N * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, N, N> a;
+        linalg::tile<T, 1, 1> d;
+        const int W = d.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+
+        for (int w = 0; w < W; ++w)
+        {
+            d.v[0][0][w] = linalg::det([&] (int i, int j) { return a.v[i][j][w]; }, std::integral_constant<int, N>());
+        }
+        d.store(pd + start, {1, 0, 0}, lanes);
+    });
+    return D;
+}
+
+
+
+
+/**
+ * Inverses of a batch of N x N matrices, of shape (count, N, N), for N up to
+ * 4, computed from the adjugate. Singular matrices are not detected: their
+ * inverses contain infinities or NaNs.
+ */
+template<int N, typename T>
+nd::ndarray<T, 3> nd::batch_inverse(const ndarray<T, 3>& A)
+{
+    static_assert(N >= 1 && N <= 4, "batch_inverse: only matrices up to 4 x 4 are supported");
+    static_assert(std::is_floating_point<T>::value, "batch_inverse: requires a floating point type");
+
+    if (A.shape() != std::array<int, 3>{A.shape(0), N, N})
+    {
+        throw std::invalid_argument("batch_inverse: expected a batch of "
+            + std::to_string(N) + " x " + std::to_string(N)
+            + " matrices, got shape "
+            + shape::to_string(A.shape()));
+    }
+
+    auto B = ndarray<T, 3>(A.shape(0), N, N);
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pb = B.data();
+
+    linalg::for_each_batch<T>(A.shape(0), N * N * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, N, N> a;
+        linalg::tile<T, N, N> b;
+        const int W = b.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+
+        for (int w = 0; w < W; ++w)
+        {
+            linalg::inverse(
+                [&] (int i, int j) { return a.v[i][j][w]; },
+                [&] (int i, int j) -> T& { return b.v[i][j][w]; },
+                std::integral_constant<int, N>());
+        }
+        b.store(pb + start * sb[0], sb, lanes);
+    });
+    return B;
+}
+
+
+
+
+/**
+ * Loads the given number of matrices, starting at p and separated by
+ * strides[0], into the tile's lanes. Unused lanes repeat the last matrix,
+ * so that kernels never see uninitialized (or, for inverses, singular)
+ * values.
+ */
+template<typename T, int M, int N>
+void nd::linalg::tile<T, M, N>::load(const T* p, std::array<int, 3> strides, int lanes)
+{
+    for (int i = 0; i < M; ++i)
+        for (int j = 0; j < N; ++j)
+            for (int w = 0; w < W; ++w)
+                v[i][j][w] = p[std::min(w, lanes - 1) * strides[0] + i * strides[1] + j * strides[2]];
+}
+
+template<typename T, int M, int N>
+void nd::linalg::tile<T, M, N>::store(T* p, std::array<int, 3> strides, int lanes) const
+{
+    for (int i = 0; i < M; ++i)
+        for (int j = 0; j < N; ++j)
+            for (int w = 0; w < lanes; ++w)
+                p[w * strides[0] + i * strides[1] + j * strides[2]] = v[i][j][w];
+}
+
+
+
+
+/**
+ * Invokes f(start, lanes) on consecutive blocks of a batch of the given
+ * count, each block holding one tile's worth of lanes (fewer for the last).
+ * Blocks are split across threads when count times the work per item
+ * reaches ND_PARALLEL_THRESHOLD.
+ */
+template<typename T, typename Function>
+void nd::linalg::for_each_batch(int count, int work, Function f)
+{
+    const int W = tile<T, 1, 1>::W;
+    int blocks = (count + W - 1) / W;
+
+    auto range = [&] (int lower, int upper)
+    {
+        for (int n = lower; n < upper; ++n)
+        {
+            f(n * W, std::min(int(W), count - n * W));
+        }
+    };
+
+    if (long(count) * work >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(blocks, range);
+    }
+    else
+    {
+        range(0, blocks);
+    }
+}
+
+
+
+
+/**
+ * Closed-form determinants of small matrices, given an accessor a(i, j).
+ */
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 1>)
+{
+    return a(0, 0);
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 2>)
+{
+    return a(0, 0) * a(1, 1) - a(0, 1) * a(1, 0);
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 3>)
+{
+    return
+    a(0, 0) * (a(1, 1) * a(2, 2) - a(1, 2) * a(2, 1)) -
+    a(0, 1) * (a(1, 0) * a(2, 2) - a(1, 2) * a(2, 0)) +
+    a(0, 2) * (a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0));
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 4>)
+{
+    auto s0 = a(0, 0) * a(1, 1) - a(1, 0) * a(0, 1);
+    auto s1 = a(0, 0) * a(1, 2) - a(1, 0) * a(0, 2);
+    auto s2 = a(0, 0) * a(1, 3) - a(1, 0) * a(0, 3);
+    auto s3 = a(0, 1) * a(1, 2) - a(1, 1) * a(0, 2);
+    auto s4 = a(0, 1) * a(1, 3) - a(1, 1) * a(0, 3);
+    auto s5 = a(0, 2) * a(1, 3) - a(1, 2) * a(0, 3);
+    auto c5 = a(2, 2) * a(3, 3) - a(3, 2) * a(2, 3);
+    auto c4 = a(2, 1) * a(3, 3) - a(3, 1) * a(2, 3);
+    auto c3 = a(2, 1) * a(3, 2) - a(3, 1) * a(2, 2);
+    auto c2 = a(2, 0) * a(3, 3) - a(3, 0) * a(2, 3);
+    auto c1 = a(2, 0) * a(3, 2) - a(3, 0) * a(2, 2);
+    auto c0 = a(2, 0) * a(3, 1) - a(3, 0) * a(2, 1);
+    return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+}
+
+
+
+
+/**
+ * Closed-form inverses of small matrices, given an accessor a(i, j) and a
+ * writable accessor b(i, j) for the result.
+ */
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 1>)
+{
+    b(0, 0) = 1 / a(0, 0);
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 2>)
+{
+    auto r = 1 / det(a, std::integral_constant<int, 2>());
+    b(0, 0) =  a(1, 1) * r;
+    b(0, 1) = -a(0, 1) * r;
+    b(1, 0) = -a(1, 0) * r;
+    b(1, 1) =  a(0, 0) * r;
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 3>)
+{
+    auto r = 1 / det(a, std::integral_constant<int, 3>());
+    b(0, 0) = (a(1, 1) * a(2, 2) - a(1, 2) * a(2, 1)) * r;
+    b(0, 1) = (a(0, 2) * a(2, 1) - a(0, 1) * a(2, 2)) * r;
+    b(0, 2) = (a(0, 1) * a(1, 2) - a(0, 2) * a(1, 1)) * r;
+    b(1, 0) = (a(1, 2) * a(2, 0) - a(1, 0) * a(2, 2)) * r;
+    b(1, 1) = (a(0, 0) * a(2, 2) - a(0, 2) * a(2, 0)) * r;
+    b(1, 2) = (a(0, 2) * a(1, 0) - a(0, 0) * a(1, 2)) * r;
+    b(2, 0) = (a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0)) * r;
+    b(2, 1) = (a(0, 1) * a(2, 0) - a(0, 0) * a(2, 1)) * r;
+    b(2, 2) = (a(0, 0) * a(1, 1) - a(0, 1) * a(1, 0)) * r;
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 4>)
+{
+    auto s0 = a(0, 0) * a(1, 1) - a(1, 0) * a(0, 1);
+    auto s1 = a(0, 0) * a(1, 2) - a(1, 0) * a(0, 2);
+    auto s2 = a(0, 0) * a(1, 3) - a(1, 0) * a(0, 3);
+    auto s3 = a(0, 1) * a(1, 2) - a(1, 1) * a(0, 2);
+    auto s4 = a(0, 1) * a(1, 3) - a(1, 1) * a(0, 3);
+    auto s5 = a(0, 2) * a(1, 3) - a(1, 2) * a(0, 3);
+    auto c5 = a(2, 2) * a(3, 3) - a(3, 2) * a(2, 3);
+    auto c4 = a(2, 1) * a(3, 3) - a(3, 1) * a(2, 3);
+    auto c3 = a(2, 1) * a(3, 2) - a(3, 1) * a(2, 2);
+    auto c2 = a(2, 0) * a(3, 3) - a(3, 0) * a(2, 3);
+    auto c1 = a(2, 0) * a(3, 2) - a(3, 0) * a(2, 2);
+    auto c0 = a(2, 0) * a(3, 1) - a(3, 0) * a(2, 1);
+    auto r = 1 / (s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0);
+
+    b(0, 0) = ( a(1, 1) * c5 - a(1, 2) * c4 + a(1, 3) * c3) * r;
+    b(0, 1) = (-a(0, 1) * c5 + a(0, 2) * c4 - a(0, 3) * c3) * r;
+    b(0, 2) = ( a(3, 1) * s5 - a(3, 2) * s4 + a(3, 3) * s3) * r;
+    b(0, 3) = (-a(2, 1) * s5 + a(2, 2) * s4 - a(2, 3) * s3) * r;
+    b(1, 0) = (-a(1, 0) * c5 + a(1, 2) * c2 - a(1, 3) * c1) * r;
+    b(1, 1) = ( a(0, 0) * c5 - a(0, 2) * c2 + a(0, 3) * c1) * r;
+    b(1, 2) = (-a(3, 0) * s5 + a(3, 2) * s2 - a(3, 3) * s1) * r;
+    b(1, 3) = ( a(2, 0) * s5 - a(2, 2) * s2 + a(2, 3) * s1) * r;
+    b(2, 0) = ( a(1, 0) * c4 - a(1, 1) * c2 + a(1, 3) * c0) * r;
+    b(2, 1) = (-a(0, 0) * c4 + a(0, 1) * c2 - a(0, 3) * c0) * r;
+    b(2, 2) = ( a(3, 0) * s4 - a(3, 1) * s2 + a(3, 3) * s0) * r;
+    b(2, 3) = (-a(2, 0) * s4 + a(2, 1) * s2 - a(2, 3) * s0) * r;
+    b(3, 0) = (-a(1, 0) * c3 + a(1, 1) * c1 - a(1, 2) * c0) * r;
+    b(3, 1) = ( a(0, 0) * c3 - a(0, 1) * c1 + a(0, 2) * c0) * r;
+    b(3, 2) = (-a(3, 0) * s3 + a(3, 1) * s1 - a(3, 2) * s0) * r;
+    b(3, 3) = ( a(2, 0) * s3 - a(2, 1) * s1 + a(2, 2) * s0) * r;
+} 
+
+
+
+
+// ============================================================================
+template<typename T, int R> 
+struct nd::neighbours
+{
+    template<typename... Offsets>
+    const T& operator()(Offsets... offsets) const
     {
-        for (int n = 0; n < rank; ++n)
+        static_assert(sizeof...(Offsets) == R, "neighbours: number of offsets must match rank");
+        return center[shape::dot(std::array<int, R>{offsets...}, strides)];
+    }
+
+    const T* center;
+    std::array<int, R> strides;
+};
+
+
+
+
+/**
+ * A linear stencil: a list of offsets and coefficients. Applying it to a
+ * source array computes, for every point at least radius() away from the
+ * source's edges,
+ *
+ *     target(i) = sum_k coefficient_k * source(i + radius + offset_k)
+ *
+ * in a single pass, instead of one temporary per term as with sums of
+ * shifted views. The target has the interior shape, shape - 2 * radius.
+ */
+template<typename T, int R>
+class nd::stencil
+{
+public:
+    using offset_type = std::array<int, R>;
+
+    /**
+     * Creates a stencil from a list of {offset, coefficient} pairs, e.g.
+     *
+     * auto d2 = nd::stencil<double, 1>{{{-1}, 1.0}, {{0}, -2.0}, {{1}, 1.0}};
+     */
+    stencil(std::initializer_list<std::pair<offset_type, T>> terms={}) : terms(terms)
+    {
+    }
+
+    /**
+     * The standard 2R + 1 point Laplacian, scaled by the given factor (e.g.
+     * one over the squared grid spacing).
+     */
+    static stencil laplacian(T scale=T(1))
+    {
+        auto L = stencil();
+        L.add(offset_type(), -2 * R * scale);
+
+        for (int n = 0; n < R; ++n)
         {
-            if (count[n] == 0)
-            {
-                return true;
-            }
+            auto offset = offset_type();
+            offset[n] = -1;
+            L.add(offset, scale);
+            offset[n] = +1;
+            L.add(offset, scale);
         }
-        return false;
+        return L;
     }
 
-    bool contiguous() const
+    /**
+     * Adds a term to the stencil.
+     */
+    stencil& add(offset_type offset, T coefficient)
     {
-        for (int n = 0; n < rank; ++n)
+        terms.emplace_back(offset, coefficient);
+        return *this;
+    }
+
+    /**
+     * The largest absolute offset along each axis.
+     */
+    offset_type radius() const
+    {
+        auto r = offset_type();
+
+        for (const auto& term : terms)
         {
-            if (start[n] != 0 || final[n] != count[n] || skips[n] != 1)
+            for (int n = 0; n < R; ++n)
             {
-                return false;
+                r[n] = std::max(r[n], std::abs(term.first[n]));
             }
         }
-        return true;
+        return r;
     }
 
-    std::size_t size() const
+    /**
+     * The shape of the region updated when the stencil is applied to a
+     * source of the given shape.
+     */
+    offset_type interior(offset_type shape) const
     {
-        auto s = shape();
-        return std::accumulate(s.begin(), s.end(), 1, std::multiplies<int>());
+        auto r = radius();
+
+        for (int n = 0; n < R; ++n)
+        {
+            shape[n] = std::max(shape[n] - 2 * r[n], 0);
+        }
+        return shape;
     }
 
-    bool operator==(const selector<rank, axis>& other) const
+    /**
+     * Applies the stencil to the source, writing the interior shape of the
+     * target. The target may be any view (e.g. the interior of another
+     * array), but must not overlap the source. Throws std::invalid_argument
+     * if the target has the wrong shape or overlaps the source.
+     */
+    template<typename U>
+    void apply(const ndarray<U, R>& source, ndarray<T, R>& target) const
     {
-        return count == other.count &&
-        start == other.start &&
-        final == other.final &&
-        skips == other.skips;
+        auto shape = interior(source.shape());
+        tiling::check_interior("stencil::apply", source, target, shape);
+        apply_rows(source, target, long(target.size()) * std::max(int(terms.size()), 1) >= ND_PARALLEL_THRESHOLD);
     }
 
-    bool operator!=(const selector<rank, axis>& other) const
+    /**
+     * Applies the stencil to the source, returning a new array of the
+     * interior shape.
+     */
+    template<typename U>
+    ndarray<T, R> operator()(const ndarray<U, R>& source) const
     {
-        return count != other.count ||
-        start != other.start ||
-        final != other.final ||
-        skips != other.skips;
+        auto target = ndarray<T, R>(interior(source.shape()));
+        apply(source, target);
+        return target;
     }
 
-    bool next(std::array<int, rank>& index) const
+    /**
+     * Applies the stencil the given number of times, holding the points
+     * within radius() of the edges fixed, and returns the result.
+     *
+     * With a time_block of 1, each step is a full sweep over the array,
+     * which streams it through memory once per step. Larger time blocks
+     * advance that many steps per pass, as a wavefront along the first
+     * axis: plane p is taken to step k as soon as planes p +- radius()[0]
+     * are at step k - 1, so each intermediate step only needs a ring of
+     * 2 * radius()[0] + 1 planes, which stays in cache. The array is then
+     * read and written once per time_block steps rather than once per
+     * step, and the results are identical. To keep the ring in cache for
+     * large planes, the second axis is cut into slabs which recompute a
+     * halo of time_block * radius()[1] rows; slabs are split across
+     * threads. Rank-1 arrays always use full sweeps.
+     */
+    ndarray<T, R> sweep(const ndarray<T, R>& A, int steps, int time_block=1) const
     {
-        int n = rank - 1;
+        if (steps < 0 || time_block < 1)
+        {
+            throw std::invalid_argument("stencil::sweep: steps must be non-negative and time_block positive");
+        }
 
-        index[n] += skips[n];
+        auto r = radius();
+        auto source = A.copy();
+        auto target = source.copy();
+        auto swap = ndarray<T, R>();
 
-        while (index[n] >= final[n])
+        for (int done = 0, s = 0; done < steps; done += s)
         {
-            if (n == 0)
+            s = R == 1 ? 1 : std::min(time_block, steps - done);
+
+            if (s == 1)
             {
-                index = final;
-                return false;
+                auto inner = target.region(r, interior(A.shape()));
+                apply(source, inner);
             }
-            index[n] = start[n];
-
-            --n;
-
-            index[n] += skips[n];
+            else
+            {
+                sweep_wavefront(source, target, s, std::integral_constant<bool, (R > 1)>());
+            }
+            swap.become(source);
+            source.become(target);
+            target.become(swap);
         }
-        return true;
+        return source;
     }
 
-    template<typename... Index>
-    bool contains(Index... index) const
+    const std::vector<std::pair<offset_type, T>>& get_terms() const
     {
-        static_assert(sizeof...(Index) == rank, "selector: index size must match rank");
+        return terms;
+    }
 
-        auto S = shape::make_shape(index...);
+private:
+    /**
+     * Writes the interior of target from that of source, s steps on (see
+     * sweep). The second axis is cut into slabs, sized so that the planes
+     * a slab keeps in flight fit in ND_STENCIL_CACHE bytes, and each slab
+     * runs its own wavefront over a halo of s * radius()[1] extra rows on
+     * either side; slabs are split across threads.
+     */
+    void sweep_wavefront(const ndarray<T, R>& source, ndarray<T, R>& target, int s, std::true_type) const
+    {
+        auto r = radius();
+        auto shape = source.shape();
+        auto inner = interior(shape);
 
-        for (int n = 0; n < rank; ++n)
+        if (std::find(inner.begin(), inner.end(), 0) != inner.end())
         {
-            auto start_index = std::get<0>(S[n]);
-            auto final_index = std::get<1>(S[n]);
+            return;
+        }
+
+        int halo = s * r[1];
+        int slots = 2 * r[0] + 1;
+        long row = long(source.size() / (long(shape[0]) * shape[1])) * sizeof(T);
+        long fit = ND_STENCIL_CACHE / ((s + 1) * slots * row) - 2 * halo;
+        int threads = parallel::num_threads();
+        int height = int(std::max(std::min(fit, long(inner[1] + threads - 1) / threads), long(std::max(2 * halo, 1))));
+        int slabs = (inner[1] + height - 1) / height;
 
-            if (start_index < 0 || final_index > final[n] / skips[n] - start[n] / skips[n])
+        auto run = [&] (int lower, int upper)
+        {
+            auto ring = std::vector<T>();
+
+            for (int n = lower; n < upper; ++n)
             {
-                return false;
+                int c0 = r[1] + n * height;
+                int c1 = std::min(c0 + height, r[1] + inner[1]);
+                int l0 = std::max(c0 - halo, 0);
+                int l1 = std::min(c1 + halo, shape[1]);
+                auto corner = offset_type();
+                auto extent = shape;
+                corner[1] = l0;
+                extent[1] = l1 - l0;
+
+                auto a = source.region(corner, extent);
+                auto b = target.region(corner, extent);
+                wavefront(a, b, s, c0 - l0, c1 - l0, ring);
             }
+        };
+
+        if (slabs > 1 && long(source.size()) * s >= ND_PARALLEL_THRESHOLD)
+        {
+            parallel::for_each_chunk(slabs, run);
+        }
+        else
+        {
+            run(0, slabs);
         }
-        return true;
     }
 
-    selector<rank, axis> shift(int dist) const
+    void sweep_wavefront(const ndarray<T, R>&, ndarray<T, R>&, int, std::false_type) const
     {
-        auto sel = *this;
-        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], 0);
-        sel.final[axis] = std::min(sel.final[axis] + dist * skips[axis], sel.count[axis]);
-        return sel;
     }
 
+    /**
+     * Advances source by s steps, writing rows [c0, c1) of the second axis
+     * of target. Plane p (an index along the first axis) is taken to step
+     * k as soon as planes p +- radius()[0] are at step k - 1, so the
+     * intermediate steps only need a ring of 2 * radius()[0] + 1 planes
+     * each. Boundary planes are copied into the ring, and so is the
+     * boundary of each plane before its interior is computed; rows outside
+     * [c0, c1) may be inexact, as they depend on rows outside the source.
+     */
+    template<int Q = R>
+    void wavefront(const ndarray<T, R>& source, ndarray<T, R>& target, int s, int c0, int c1, std::vector<T>& ring) const
+    {
+        using plane_type = std::array<int, Q - 1>;
 
+        auto r = radius();
+        auto shape = source.shape();
+        auto ps = plane_type();
+        auto pr = plane_type();
+        auto ss = plane_type();
+        auto ts = plane_type();
 
+        for (int n = 1; n < R; ++n)
+        {
+            ps[n - 1] = shape[n];
+            pr[n - 1] = r[n];
+            ss[n - 1] = source.get_strides()[n];
+            ts[n - 1] = target.get_strides()[n];
+        }
 
-    // ========================================================================
-    class iterator
-    {
-    public:
-        iterator() {}
-        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind) {}
-        iterator& operator++() { sel.next(ind); return *this; }
-        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return ind == other.ind; }
-        bool operator!=(iterator other) const { return ind != other.ind; }
-        const std::array<int, rank>& operator*() const { return ind; }
-    private:
-        selector<rank> sel;
-        std::array<int, rank> ind;
-    };
+        int n0 = shape[0];
+        int r0 = r[0];
+        int slots = 2 * r0 + 1;
+        int size = int(source.size() / n0);
+        auto rs = selector<Q - 1>(ps).strides();
+        auto s0 = source.data() + source.data_offset();
+        auto t0 = target.data() + target.data_offset();
+        auto all0 = pr;
+        auto all1 = ps;
+        auto core0 = pr;
+        auto core1 = ps;
+
+        for (int n = 0; n < R - 1; ++n)
+        {
+            all1[n] -= pr[n];
+            core1[n] -= pr[n];
+        }
+        core0[0] = c0;
+        core1[0] = c1;
+        ring.resize(std::size_t(s - 1) * slots * size);
 
-    iterator begin() const { return {reset(), start}; }
-    iterator end() const { return {reset(), final}; }
+        auto slot = [&] (int k, int p)
+        {
+            return ring.data() + (std::size_t(k - 1) * slots + p % slots) * size;
+        };
 
+        auto copy_plane = [&] (int k, int p, bool boundary_only)
+        {
+            auto from = strided::make_operand(s0 + p * source.get_strides()[0], ss);
+            auto to = strided::make_operand(slot(k, p), rs);
 
+            if (! boundary_only)
+            {
+                strided::copy(ps, to, from);
+                return;
+            }
 
+            tiling::for_each_row(ps, false, [&] (const plane_type& index, int count)
+            {
+                bool edge = false;
+
+                for (int n = 0; n < R - 2; ++n)
+                {
+                    edge = edge || index[n] < pr[n] || index[n] >= ps[n] - pr[n];
+                }
+
+                auto a = to.data + shape::dot(index, rs);
+                auto b = from.data + shape::dot(index, ss);
+                int x = index[R - 2];
+                int x0 = edge ? count : std::min(std::max(pr[R - 2] - x, 0), count);
+                int x1 = edge ? count : std::max(std::min(ps[R - 2] - pr[R - 2] - x, count), x0);
+
+                for (int i = 0; i < count; ++i)
+                {
+                    if (i == x0) i = x1;
+                    if (i < count) a[i * rs[R - 2]] = b[i * ss[R - 2]];
+                }
+            });
+        };
 
-    // ========================================================================
-    std::array<int, rank> count;
-    std::array<int, rank> start;
-    std::array<int, rank> final;
-    std::array<int, rank> skips;
+        auto planes = std::vector<const T*>(slots);
+
+        for (int z = 0; z < n0 + (s - 1) * r0; ++z)
+        {
+            for (int k = 1; k <= s; ++k)
+            {
+                int p = z - (k - 1) * r0;
+
+                if (p < 0 || p >= n0)
+                {
+                    continue;
+                }
+                if (p < r0 || p >= n0 - r0)
+                {
+                    if (k < s) copy_plane(k, p, false);
+                    continue;
+                }
+                if (k < s)
+                {
+                    copy_plane(k, p, true);
+                }
+
+                for (int q = 0; q < slots; ++q)
+                {
+                    planes[q] = k == 1 ? s0 + (p - r0 + q) * source.get_strides()[0] : slot(k - 1, p - r0 + q);
+                }
+
+                if (k < s)
+                {
+                    apply_plane(planes.data(), k == 1 ? ss : rs, slot(k, p), rs, all0, all1);
+                }
+                else
+                {
+                    apply_plane(planes.data(), k == 1 ? ss : rs, t0 + p * target.get_strides()[0], ts, core0, core1);
+                }
+            }
+        }
+    }
 
+    /**
+     * Computes the points [lower, upper) of one plane (an index along the
+     * first axis), given the planes at offsets -radius()[0] ...
+     * radius()[0] from it, with strides is, into a plane with strides os.
+     */
+    template<std::size_t P>
+    void apply_plane(const T* const* planes, std::array<int, P> is, T* out, std::array<int, P> os, std::array<int, P> lower, std::array<int, P> upper) const
+    {
+        int r0 = radius()[0];
+        int k1 = int(terms.size());
+        auto shape = std::array<int, P>();
+        auto offsets = std::vector<int>();
+        auto coefficients = std::vector<T>();
 
+        for (int n = 0; n < int(P); ++n)
+        {
+            shape[n] = std::max(upper[n] - lower[n], 0);
+        }
 
+        for (const auto& term : terms)
+        {
+            auto d = std::array<int, P>();
+            std::copy(term.first.begin() + 1, term.first.end(), d.begin());
+            offsets.push_back(int(planes[r0 + term.first[0]] - planes[r0]) + shape::dot(d, is));
+            coefficients.push_back(term.second);
+        }
 
-    // ========================================================================
-    template<int other_rank, int other_axis>
-    friend struct selector;
-}; 
+        auto s0 = planes[r0] + shape::dot(lower, is);
+        auto t0 = out + shape::dot(lower, os);
 
+        tiling::for_each_row(shape, false, [&] (const std::array<int, P>& index, int count)
+        {
+            auto t = t0 + shape::dot(index, os);
+            auto s = s0 + shape::dot(index, is);
 
+            if (k1 == 0)
+            {
+                for (int i = 0; i < count; ++i) t[i * os[P - 1]] = T();
+            }
+            else
+            {
+                row(count, t, os[P - 1], s, is[P - 1], offsets.data(), coefficients.data(), k1);
+            }
+        });
+    }
 
+    /**
+     * Applies the stencil to source, writing the target, which must have
+     * the interior shape.
+     */
+    template<typename U>
+    void apply_rows(const ndarray<U, R>& source, ndarray<T, R>& target, bool threaded) const
+    {
+        auto shape = target.shape();
+        auto ss = source.get_strides();
+        auto ts = target.get_strides();
+        auto s0 = source.data() + source.data_offset() + shape::dot(radius(), ss);
+        auto t0 = target.data() + target.data_offset();
+        auto offsets = std::vector<int>();
+        auto coefficients = std::vector<T>();
+
+        for (const auto& term : terms)
+        {
+            offsets.push_back(shape::dot(term.first, ss));
+            coefficients.push_back(term.second);
+        }
 
-// ============================================================================
-template<unsigned long rank> 
-std::array<std::tuple<int, int>, rank> nd::shape::promote(std::array<std::tuple<int, int>, rank> shape)
-{
-    return shape;
-}
+        int k1 = int(terms.size());
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int, int> selection)
-{
-    return {std::make_tuple(std::get<0>(selection), std::get<1>(selection))};
-}
+        tiling::for_each_row(shape, threaded, [&] (const offset_type& index, int count)
+        {
+            auto t = t0 + shape::dot(index, ts);
+            auto s = s0 + shape::dot(index, ss);
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int> range)
-{
-    return {range};
-}
+            if (k1 == 0)
+            {
+                for (int i = 0; i < count; ++i) t[i * ts[R - 1]] = T();
+            }
+            else if (ts[R - 1] == 1 && ss[R - 1] == 1)
+            {
+                row(count, t, 1, s, 1, offsets.data(), coefficients.data(), k1);
+            }
+            else
+            {
+                row(count, t, ts[R - 1], s, ss[R - 1], offsets.data(), coefficients.data(), k1);
+            }
+        });
+    }
+
+    /**
+     * Evaluates the stencil along one row. Terms are taken in groups of up
+     * to eight, each group in a single loop over the row with its count
+     * fixed at compile time, so that the group's sum is formed in registers
+     * and the loop vectorizes. The row of the target is short enough
+     * (ND_STENCIL_TILE_X) to stay in L1 between groups.
+     */
+    template<typename U>
+    static void row(int count, T* t, int ts, const U* s, int ss, const int* offsets, const T* coefficients, int terms)
+    {
+        for (int k = 0; k < terms; k += 8)
+        {
+            switch (std::min(terms - k, 8))
+            {
+                case 1: row_group<1>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 2: row_group<2>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 3: row_group<3>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 4: row_group<4>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 5: row_group<5>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 6: row_group<6>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 7: row_group<7>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 8: row_group<8>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+            }
+        }
+    }
+
+    template<int K, typename U>
+    static void row_group(int count, T* t, int ts, const U* s, int ss, const int* offsets, const T* coefficients, bool first)
+    {
+        const U* p[K];
+        T c[K];
+
+        for (int k = 0; k < K; ++k)
+        {
+            p[k] = s + offsets[k];
+            c[k] = coefficients[k];
+        }
+
+        if (ts == 1 && ss == 1)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                T a = first ? T() : t[i];
+
+                for (int k = 0; k < K; ++k)
+                {
+                    a += c[k] * p[k][i];
+                }
+                t[i] = a;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                T a = first ? T() : t[i * ts];
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(int start_index)
-{
-    return {std::make_tuple(start_index, start_index + 1)};
-}
+                for (int k = 0; k < K; ++k)
+                {
+                    a += c[k] * p[k][i * ss];
+                }
+                t[i * ts] = a;
+            }
+        }
+    }
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::selection selection)
-{
-    return {std::make_tuple(selection.lower, selection.upper)};
-}
+    std::vector<std::pair<offset_type, T>> terms;
+};
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::range range)
-{
-    return {std::make_tuple(range.lower, range.upper)};
-}
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::index index)
-{
-    return {std::make_tuple(index.lower, index.lower + 1)};
-}
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(axis::all)
-{
-    return {std::make_tuple(0, -1)};
-}
 
-template<typename First>
-auto nd::shape::make_shape(First first)
+/**
+ * Applies a user function over the interior of the source, in a single
+ * tiled and multithreaded pass:
+ *
+ *     target(i) = f(n), where n(d...) == source(i + radius + d...)
+ *
+ * The function receives a neighbours accessor, and may read offsets of up
+ * to radius along each axis. The target must have shape
+ * source.shape() - 2 * radius and must not overlap the source; otherwise
+ * std::invalid_argument is thrown. For example,
+ *
+ * nd::apply_stencil([] (auto n) { return n(-1, 0) + n(1, 0) + n(0, -1) + n(0, 1) - 4 * n(0, 0); }, {1, 1}, A, B);
+ */
+template<typename Function, typename T, typename U, int R>
+void nd::apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<U, R>& source, ndarray<T, R>& target)
 {
-    return promote(first);
-}
+    auto shape = source.shape();
 
-template<typename First, typename Second>
-auto nd::shape::make_shape(First first, Second second)
-{
-    auto s1 = promote(first);
-    auto s2 = promote(second);
-    auto res = std::array<std::tuple<int, int>, s1.size() + s2.size()>();
+    for (int n = 0; n < R; ++n)
+    {
+        if (radius[n] < 0)
+        {
+            throw std::invalid_argument("apply_stencil: radius must be non-negative");
+        }
+        shape[n] = std::max(shape[n] - 2 * radius[n], 0);
+    }
+    tiling::check_interior("apply_stencil", source, target, shape);
 
-    for (std::size_t n = 0; n < s1.size(); ++n)
-        res[n] = s1[n];
+    auto ss = source.get_strides();
+    auto ts = target.get_strides();
+    auto s0 = source.data() + source.data_offset() + shape::dot(radius, ss);
+    auto t0 = target.data() + target.data_offset();
+    bool threaded = long(target.size()) * 4 >= ND_PARALLEL_THRESHOLD;
 
-    for (std::size_t n = 0; n < s2.size(); ++n)
-        res[n + s1.size()] = s2[n];
+    tiling::for_each_row(shape, threaded, [&] (const std::array<int, R>& index, int count)
+    {
+        auto t = t0 + shape::dot(index, ts);
+        auto n = neighbours<U, R>{s0 + shape::dot(index, ss), ss};
 
-    return res;
+        for (int i = 0; i < count; ++i)
+        {
+            t[i * ts[R - 1]] = f(n);
+            n.center += ss[R - 1];
+        }
+    });
 }
 
-template<typename First, typename... Rest>
-auto nd::shape::make_shape(First first, Rest... rest)
-{
-    return make_shape(first, make_shape(rest...));
-} 
-
 
 
 
-// ============================================================================
-template<typename T> 
-class nd::buffer
+/**
+ * Applies a user function over the interior of the source, returning a new
+ * array of shape source.shape() - 2 * radius.
+ */
+template<typename Function, typename T, int R>
+nd::ndarray<T, R> nd::apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<T, R>& source)
 {
-public:
-
-    buffer() {}
+    auto shape = source.shape();
 
-    buffer(const buffer<T>& other)
+    for (int n = 0; n < R; ++n)
     {
-        count = other.count;
-        memory = new T[count];
-
-        for (int n = 0; n < count; ++n)
-        {
-            memory[n] = other.memory[n];
-        }
+        shape[n] = std::max(shape[n] - 2 * radius[n], 0);
     }
 
-    buffer(buffer<T>&& other)
-    {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
+    auto target = ndarray<T, R>(shape);
+    apply_stencil(f, radius, source, target);
+    return target;
+}
 
-        other.memory = nullptr;
-        other.count = 0;
-    }
 
-    explicit buffer(std::size_t count, const T& value = T()) : count(count)
-    {
-        memory = new T[count];
 
-        for (std::size_t n = 0; n < count; ++n)
+
+/**
+ * Invokes f(index, count) for every row of the given shape, where index is
+ * the first element of the row and count its length; a row is a run of at
+ * most ND_STENCIL_TILE_X elements along the last axis. Rows are visited
+ * tile by tile (see tiling), and whole tiles are split across threads when
+ * threaded is true.
+ */
+template<std::size_t R, typename Function>
+void nd::tiling::for_each_row(std::array<int, R> shape, bool threaded, Function f)
+{
+    static_assert(R >= 1, "tiling: rank must be at least 1");
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
         {
-            memory[n] = value;
+            return;
         }
     }
 
-    template< class InputIt >
-    buffer(InputIt first, InputIt last)
+    const int X = ND_STENCIL_TILE_X;
+    const int Y = ND_STENCIL_TILE_Y;
+    const int y = R >= 2 ? int(R) - 2 : 0;
+    int nx = (shape[R - 1] + X - 1) / X;
+    int ny = R >= 2 ? (shape[y] + Y - 1) / Y : 1;
+
+    auto tiles = [&] (int lower, int upper)
     {
+        for (int tile = lower; tile < upper; ++tile)
         {
-            auto it = first;
-            count = 0;
+            auto start = std::array<int, R>();
+            auto final = shape;
+            auto skips = std::array<int, R>();
+            std::fill(skips.begin(), skips.end(), 1);
 
-            while (it != last)
+            int x0 = (tile % nx) * X;
+            start[R - 1] = x0;
+            final[R - 1] = x0 + 1;
+
+            if (R >= 2)
             {
-                ++it;
-                ++count;
+                start[y] = (tile / nx) * Y;
+                final[y] = std::min(start[y] + Y, shape[y]);
             }
-            memory = new T[count];
-        }
 
-        {
-            auto it = first;
-            auto n = 0;
+            auto sel = selector<int(R)>(shape, start, final, skips);
+            auto index = start;
+            int count = std::min(X, shape[R - 1] - x0);
 
-            while (it != last)
-            {
-                memory[n] = *it;
-                ++it;
-                ++n;
-            }
+            do {
+                f(index, count);
+            } while (sel.next(index));
         }
-    }
+    };
 
-    ~buffer()
+    if (threaded)
     {
-        delete [] memory;
+        parallel::for_each_chunk(nx * ny, tiles);
     }
-
-    buffer<T>& operator=(const buffer<T>& other)
+    else
     {
-        delete [] memory;
+        tiles(0, nx * ny);
+    }
+}
 
-        count = other.count;
-        memory = new T[count];
 
-        for (int n = 0; n < count; ++n)
-        {
-            memory[n] = other.memory[n];
-        }
-        return *this;
+
+
+/**
+ * Throws std::invalid_argument if the target of a stencil does not have the
+ * given interior shape, or if it overlaps the source.
+ */
+template<typename T, typename U, int R>
+void nd::tiling::check_interior(const char* caller, const ndarray<U, R>& source, const ndarray<T, R>& target, typename stencil<T, R>::offset_type shape)
+{
+    if (target.shape() != shape)
+    {
+        throw std::invalid_argument(std::string(caller)
+            + ": target has shape "
+            + shape::to_string(target.shape())
+            + " but the interior of the source has shape "
+            + shape::to_string(shape));
+    }
+    if (source.size() == 0 || target.size() == 0)
+    {
+        return;
     }
 
-    buffer<T>& operator=(buffer<T>&& other)
+    auto x = strided::extent(source.shape(), strided::make_operand(source.data() + source.data_offset(), source.get_strides()));
+    auto y = strided::extent(target.shape(), strided::make_operand(target.data() + target.data_offset(), target.get_strides()));
+    auto before = std::less<const void*>();
+
+    if (before(x[0], y[1] + 1) && before(y[0], x[1] + 1))
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
+        throw std::invalid_argument(std::string(caller) + ": target must not overlap the source");
+    }
+} 
 
-        other.memory = nullptr;
-        other.count = 0;
-        return *this;
+
+
+
+// ============================================================================
+int nd::boundary_index(int index, int size, boundary mode) 
+{
+    if (index >= 0 && index < size)
+    {
+        return index;
     }
 
-    bool operator==(const buffer<T>& other) const
+    switch (mode)
     {
-        if (count != other.count)
+        case boundary::periodic:
         {
-            return false;
+            int m = index % size;
+            return m < 0 ? m + size : m;
+        }
+        case boundary::reflect:
+        {
+            if (size == 1) return 0;
+            int period = 2 * size - 2;
+            int m = index % period;
+            m = m < 0 ? m + period : m;
+            return m < size ? m : period - m;
+        }
+        case boundary::symmetric:
+        {
+            int period = 2 * size;
+            int m = index % period;
+            m = m < 0 ? m + period : m;
+            return m < size ? m : period - 1 - m;
+        }
+        case boundary::nearest:
+        {
+            return index < 0 ? 0 : size - 1;
         }
+        case boundary::constant: break;
+    }
+    throw std::out_of_range("boundary_index: constant boundaries have no source index");
+}
 
-        for (std::size_t n = 0; n < size(); ++n)
+
+
+
+/**
+ * A read-only view of an array extended by a halo of the given width on
+ * each side of every axis, with the halo computed on access from the
+ * boundary mode of its axis. Index (i, j, ...) of the view is index
+ * (i - width[0], j - width[1], ...) of the array. Where any constant axis
+ * is out of range the view reads the constant value; otherwise every axis
+ * is mapped with boundary_index.
+ *
+ * The view shares the array's memory, so later changes to the array are
+ * visible through it. materialize() creates the padded array itself,
+ * copying the array once and computing only the halo.
+ */
+template<typename T, int R>
+class nd::padded_view
+{
+public:
+    using value_type = T;
+    using index_type = std::array<int, R>;
+    using modes_type = std::array<boundary, R>;
+
+    padded_view(const ndarray<T, R>& A, index_type width, modes_type modes, T value=T())
+    : source(A.region(index_type(), A.shape()))
+    , width(width)
+    , modes(modes)
+    , value(value)
+    {
+        for (int n = 0; n < R; ++n)
         {
-            if (memory[n] != other.memory[n])            
+            if (width[n] < 0)
             {
-                return false;
+                throw std::invalid_argument("padded_view: width must be non-negative");
+            }
+            if (modes[n] != boundary::constant && width[n] > 0 && A.shape(n) == 0)
+            {
+                throw std::invalid_argument("padded_view: cannot pad an empty axis except with a constant");
             }
         }
-        return true;
     }
 
-    bool operator!=(const buffer<T>& other) const
+    std::array<int, R> shape() const
     {
-        return ! operator==(other);
+        auto s = source.shape();
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] += 2 * width[n];
+        }
+        return s;
     }
 
-    std::size_t size() const
+    int shape(int axis) const
     {
-        return count;
+        return source.shape(axis) + 2 * width[axis];
     }
 
-    const T* data() const
+    std::array<int, R> get_width() const
     {
-        return memory;
+        return width;
     }
 
-    T* data()
+    template<typename... Index>
+    T operator()(Index... index) const
     {
-        return memory;
+        static_assert(sizeof...(Index) == R, "padded_view: number of indexes must match rank");
+        return at({int(index)...});
     }
 
-    const T& operator[](std::size_t offset) const
+    /**
+     * The element at the given index of the view. Throws std::out_of_range
+     * if the index is outside the view.
+     */
+    T at(std::array<int, R> index) const
     {
-        return memory[offset];
+        auto s = source.shape();
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (index[n] < 0 || index[n] >= s[n] + 2 * width[n])
+            {
+                throw std::out_of_range("padded_view: index out of range");
+            }
+        }
+
+        for (int n = 0; n < R; ++n)
+        {
+            index[n] -= width[n];
+
+            if (index[n] < 0 || index[n] >= s[n])
+            {
+                if (modes[n] == boundary::constant)
+                {
+                    return value;
+                }
+                index[n] = boundary_index(index[n], s[n], modes[n]);
+            }
+        }
+        return source.data()[source.data_offset() + shape::dot(index, source.get_strides())];
     }
 
-    T& operator[](std::size_t offset)
+    /**
+     * Returns a new array of the padded shape, holding the view's values.
+     */
+    ndarray<T, R> materialize() const
     {
-        return memory[offset];
+        auto P = ndarray<T, R>(shape());
+        materialize(P);
+        return P;
     }
 
-    T* begin() { return memory; }
-    T* end() { return memory + count; }
+    /**
+     * Writes the view's values to an array of the padded shape, e.g. one
+     * which is reused between time steps. The array is copied into the
+     * interior, and fill_halo computes the rest. Throws
+     * std::invalid_argument if the target has the wrong shape.
+     */
+    void materialize(ndarray<T, R>& target) const
+    {
+        if (target.shape() != shape())
+        {
+            throw std::invalid_argument("padded_view: target has shape "
+                + shape::to_string(target.shape())
+                + " but the view has shape "
+                + shape::to_string(shape()));
+        }
 
-    const T* begin() const { return memory; }
-    const T* end() const { return memory + count; }
+        auto inner = target.region(width, source.shape());
+        inner = source;
+        fill_halo(target, width, modes, value);
+    }
 
 private:
-    T* memory = nullptr;
-    std::size_t count = 0;
-}; 
+    typename ndarray<T, R>::const_ref source;
+    std::array<int, R> width;
+    std::array<boundary, R> modes;
+    T value;
+};
 
 
 
 
-// ============================================================================
-template<typename T> nd::ndarray<T, 1> nd::arange(int size) 
+/**
+ * Returns a view of A extended by the given halo width, with the same
+ * boundary mode on every axis.
+ */
+template<typename T, int R>
+nd::padded_view<T, R> nd::pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    auto x = T();
-    for (auto& a : A) a = x++;
-    return A;
+    auto modes = std::array<boundary, R>();
+    modes.fill(mode);
+    return padded_view<T, R>(A, width, modes, value);
 }
 
-template<typename T> nd::ndarray<T, 1> nd::linspace(T start, T end, int size)
+/**
+ * Returns a view of A extended by the given halo width, with a boundary
+ * mode per axis.
+ */
+template<typename T, int R>
+nd::padded_view<T, R> nd::pad(const ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    auto h = (end - start) / (size - 1);
-    auto x = start - h;
-    for (auto& a : A) a = (x += h);
-    return A;
+    return padded_view<T, R>(A, width, modes, value);
 }
 
-template<typename T> nd::ndarray<T, 1> nd::ones(int size)
+
+
+
+/**
+ * Recomputes the halo of an array which already has one: the outer width
+ * elements on either side of each axis are set from the interior, as for
+ * padded_view, and the interior is not touched. This is the ghost-cell
+ * update for arrays which keep their halo between stencil steps, and
+ * costs only as much as the halo itself.
+ *
+ * Axes are filled in order. The halo of axis n is copied a hyperplane at
+ * a time, spanning the full (already filled) extent of the axes before n
+ * and the interior of the axes after it, so that corners come out as if
+ * each axis were mapped independently. Throws std::invalid_argument if
+ * the halo is wider than the array allows.
+ */
+template<typename T, int R>
+void nd::fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, typename padded_view<T, R>::modes_type modes, typename padded_view<T, R>::value_type value)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 1;
-    return A;
+    auto shape = A.shape();
+
+    for (int n = 0; n < R; ++n)
+    {
+        if (width[n] < 0 || shape[n] < 2 * width[n] || (modes[n] != boundary::constant && width[n] > 0 && shape[n] == 2 * width[n]))
+        {
+            throw std::invalid_argument("fill_halo: halo of width "
+                + shape::to_string(width)
+                + " does not fit array of shape "
+                + shape::to_string(shape));
+        }
+    }
+
+    for (int n = 0; n < R; ++n)
+    {
+        auto corner = width;
+        auto extent = shape;
+        int size = shape[n] - 2 * width[n];
+
+        for (int m = 0; m < R; ++m)
+        {
+            if (m < n)
+            {
+                corner[m] = 0;
+            }
+            else
+            {
+                extent[m] = shape[m] - 2 * width[m];
+            }
+        }
+        extent[n] = 1;
+
+        auto plane = [&] (int index)
+        {
+            auto c = corner;
+            c[n] = index;
+            return A.region(c, extent);
+        };
+
+        for (int j = 0; j < width[n]; ++j)
+        {
+            int lower = j;
+            int upper = shape[n] - 1 - j;
+
+            if (modes[n] == boundary::constant)
+            {
+                plane(lower) = value;
+                plane(upper) = value;
+            }
+            else
+            {
+                auto lo = plane(lower);
+                auto hi = plane(upper);
+                lo = plane(width[n] + boundary_index(j - width[n], size, modes[n]));
+                hi = plane(width[n] + boundary_index(size + width[n] - 1 - j, size, modes[n]));
+            }
+        }
+    }
 }
 
-template<typename T> nd::ndarray<T, 1> nd::zeros(int size)
+/**
+ * Recomputes the halo of an array with the same boundary mode on every
+ * axis.
+ */
+template<typename T, int R>
+void nd::fill_halo(ndarray<T, R>& A, typename padded_view<T, R>::index_type width, boundary mode, typename padded_view<T, R>::value_type value)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 0;
-    return A;
-}
+    auto modes = std::array<boundary, R>();
+    modes.fill(mode);
+    fill_halo(A, width, modes, value);
+} 
 
-template<typename T, int R> /* UNTESTED */
-nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays)
-{
-    if (arrays.size() == 0)
-    {
-        return nd::ndarray<T, R>();            
-    }
 
-    auto required_shape = arrays.begin()->shape();
 
-    std::array<int, R> dim_sizes;
-    dim_sizes[0] = arrays.size();
 
-    for (int n = 1; n < R; ++n)
+// ============================================================================
+template<typename T, int R> 
+class nd::decomposition
+{
+public:
+    using value_type = T;
+    using index_type = std::array<int, R>;
+    using modes_type = std::array<boundary, R>;
+
+    /**
+     * Decomposes A into parallel::num_threads() subdomains, as chosen by
+     * partition(), keeping its halo fixed.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost)
+    : decomposition(A, ghost, partition(interior_shape(A, ghost), parallel::num_threads()))
     {
-        dim_sizes[n] = required_shape[n - 1];
     }
-    auto A = nd::ndarray<T, R>(dim_sizes);
-    auto n = 0;
 
-    for (const auto& array : arrays)
+    /**
+     * Decomposes A into the given number of subdomains along each axis,
+     * keeping its halo fixed.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks)
+    : decomposition(A, ghost, blocks, modes_type(), T(), false)
     {
-        A[n] = array;
-        ++n;
     }
-    return A;
-}
 
-
-
-
-// ============================================================================
-template<typename T, int R, typename Op>
-struct nd::unary_op
-{
-    static auto perform(const ndarray<T, R>& A)
+    /**
+     * Decomposes A into the given number of subdomains along each axis,
+     * computing the ghosts on its edges from the given boundary modes.
+     */
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks, modes_type modes, T value=T())
+    : decomposition(A, ghost, blocks, modes, value, true)
     {
-        auto op = Op();
-        auto B = ndarray<decltype(op(T())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
-
-        for (; a != A.end(); ++a, ++b)
-            *b = op(*a);
-
-        return B;
     }
-};
-
 
-
-
-// ============================================================================
-template<typename T, typename U, int R, typename Op>
-struct nd::binary_op
-{
-    static auto perform(const ndarray<T, R>& A, const ndarray<U, R>& B)
+    /**
+     * Factors count into a number of subdomains along each axis of the
+     * given interior shape, giving each factor to the axis whose pieces
+     * are currently longest, which keeps subdomains compact and the ghost
+     * layers they exchange small.
+     */
+    static index_type partition(index_type shape, int count)
     {
-        if (A.shape() != B.shape())
-            throw std::invalid_argument("incompatible shapes for binary operation");
+        auto blocks = index_type();
+        auto factors = std::vector<int>();
+        blocks.fill(1);
 
-        auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
-        auto c = C.begin();
+        for (int p = 2; p * p <= count; ++p)
+        {
+            while (count % p == 0)
+            {
+                factors.push_back(p);
+                count /= p;
+            }
+        }
+        if (count > 1)
+        {
+            factors.push_back(count);
+        }
 
-        for (; a != A.end(); ++a, ++b, ++c)
-            *c = op(*a, *b);
+        for (auto f = factors.rbegin(); f != factors.rend(); ++f)
+        {
+            int axis = 0;
 
-        return C;
+            for (int n = 1; n < R; ++n)
+            {
+                if (long(shape[n]) * blocks[axis] > long(shape[axis]) * blocks[n])
+                {
+                    axis = n;
+                }
+            }
+            blocks[axis] *= *f;
+        }
+        return blocks;
     }
 
-    static auto perform(const ndarray<T, R>& A, U b)
+    int size() const
     {
-        auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto c = C.begin();
-
-        for (; a != A.end(); ++a, ++c)
-            *c = op(*a, b);
-
-        return C;
+        return int(locals.size());
     }
 
-    static void perform(ndarray<T, R>& A, const ndarray<U, R>& B)
+    index_type get_blocks() const
     {
-        if (A.shape() != B.shape())
-            throw std::invalid_argument("incompatible shapes for binary operation");
-
-        auto op = Op();
-        auto a = A.begin();
-        auto b = B.begin();
-
-        for (; a != A.end(); ++a, ++b)
-            *a = op(*a, *b);
+        return blocks;
     }
-};
-
 
+    index_type get_ghost() const
+    {
+        return ghost;
+    }
 
+    /**
+     * The index in the decomposed array of the first element owned by
+     * subdomain k.
+     */
+    index_type lower(int k) const
+    {
+        auto c = coordinates(k);
+        auto index = index_type();
 
-// ============================================================================
-/**
- * This block can be expanded to accommodate new data types. Note: gcc requires
- * these template specializations to be declared directly inside the namespace.
- */
-namespace nd {
-  template<> struct dtype_str<bool  > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<float > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<double> { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<int   > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<long  > { static inline std::array<char, 8> value(); };
-
-  std::array<char, 8> dtype_str<bool  >::value() { return {'b','1',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<float >::value() { return {'f','4',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<double>::value() { return {'f','8',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<int   >::value() { return {'i','4',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<long  >::value() { return {'i','8',  0,  0,  0,  0,  0,  0}; }
-}
-
+        for (int n = 0; n < R; ++n)
+        {
+            index[n] = ghost[n] + offset(n, c[n]);
+        }
+        return index;
+    }
 
+    /**
+     * The shape of the box owned by subdomain k.
+     */
+    index_type shape(int k) const
+    {
+        auto c = coordinates(k);
+        auto s = index_type();
 
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = offset(n, c[n] + 1) - offset(n, c[n]);
+        }
+        return s;
+    }
 
-// ============================================================================
-template<typename T, int R>
-class nd::ndarray
-{
-public:
+    /**
+     * The working array of subdomain k: its box, padded by the ghost width.
+     */
+    ndarray<T, R>& local(int k)
+    {
+        return locals.at(k);
+    }
 
+    /**
+     * A view of the box owned by subdomain k within its working array,
+     * i.e. local(k) without its ghosts.
+     */
+    ndarray<T, R> interior(int k)
+    {
+        auto& L = locals.at(k);
+        return L.region(ghost, shape(k));
+    }
 
-    using dtype = T;
-    enum { rank = R };
+    /**
+     * A view of the box owned by subdomain k within the decomposed array.
+     */
+    ndarray<T, R> subdomain(int k)
+    {
+        return global.region(lower(k), shape(k));
+    }
 
+    auto subdomain(int k) const
+    {
+        return global.region(lower(k), shape(k));
+    }
 
+    /**
+     * Copies every subdomain, ghosts included, from the decomposed array.
+     */
+    void scatter()
+    {
+        for (int k = 0; k < size(); ++k)
+        {
+            scatter(k);
+        }
+    }
 
+    /**
+     * Copies every subdomain's interior back to the decomposed array.
+     */
+    void gather()
+    {
+        for (int k = 0; k < size(); ++k)
+        {
+            auto target = subdomain(k);
+            target = interior(k);
+        }
+    }
 
     /**
-     * Wrapper class for constant arrays. Can be trivially converted back to
-     * const nd::array&.
+     * Refreshes the ghosts of every subdomain on the calling thread.
      */
-    // ========================================================================
-    class const_ref
+    void exchange()
     {
-    public:
+        for (int n = 0; n < R; ++n)
+        {
+            for (int k = 0; k < size(); ++k)
+            {
+                exchange(k, n);
+            }
+        }
+    }
 
-        using dtype = T;
-        enum { rank = R };
+    /**
+     * Runs the given number of steps with one worker thread per subdomain.
+     * On each step, worker k calls f(k, local(k)), which should update the
+     * interior of its subdomain from the subdomain and its ghosts and must
+     * not touch other subdomains; then every ghost layer is exchanged. The
+     * workers synchronize on a barrier after the update, and after the
+     * exchange along each axis, because ghosts on later axes include the
+     * corners filled along earlier ones. If f throws, the other workers
+     * stop at their next barrier and the exception is rethrown here.
+     */
+    template<typename Function>
+    void run(int steps, Function f)
+    {
+        parallel::barrier sync(size());
 
-        const_ref(selector<R> sel, std::shared_ptr<buffer<T>> buf) : A(sel, buf) {}
-        template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
-        template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
-        template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
-        template<typename... Args> auto size(const Args&... args) const { return A.size(args...); }
-        template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
-        template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
-        template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
+        parallel::for_each_worker(size(), [&] (int k)
+        {
+            try {
+                for (int s = 0; s < steps; ++s)
+                {
+                    f(k, locals[k]);
+
+                    if (! sync.wait())
+                    {
+                        return;
+                    }
+                    for (int n = 0; n < R; ++n)
+                    {
+                        exchange(k, n);
+
+                        if (! sync.wait())
+                        {
+                            return;
+                        }
+                    }
+                }
+            }
+            catch (...) {
+                sync.cancel();
+                throw;
+            }
+        });
+    }
 
-        operator const ndarray<T, R>&() const { return A; }
-        bool is_const_ref() const { return true; }
+private:
+    decomposition(ndarray<T, R>& A, index_type ghost, index_type blocks, modes_type modes, T value, bool edges)
+    : global(A)
+    , ghost(ghost)
+    , blocks(blocks)
+    , modes(modes)
+    , value(value)
+    , edges(edges)
+    {
+        auto interior = interior_shape(A, ghost);
+        int count = 1;
 
-        auto begin() const { return A.begin(); }
-        auto end() const { return A.end(); }
+        for (int n = 0; n < R; ++n)
+        {
+            if (blocks[n] < 1)
+            {
+                throw std::invalid_argument("decomposition: number of blocks must be positive");
+            }
+            count *= blocks[n];
 
-    private:
-        friend class ndarray;
-        ndarray<T, R> A;
-    };
+            for (int c = 0; c < blocks[n]; ++c)
+            {
+                int extent = offset(n, c + 1) - offset(n, c);
+                bool mirror = edges && (modes[n] == boundary::reflect) && (c == 0 || c == blocks[n] - 1);
+
+                if (extent < std::max(ghost[n] + mirror, 1))
+                {
+                    throw std::invalid_argument("decomposition: cannot split interior of shape "
+                        + shape::to_string(interior)
+                        + " into "
+                        + shape::to_string(blocks)
+                        + " blocks with ghost width "
+                        + shape::to_string(ghost));
+                }
+            }
+        }
 
+        locals.resize(count);
 
+        parallel::for_each_worker(count, [this] (int k)
+        {
+            auto padded = shape(k);
 
+            for (int n = 0; n < R; ++n)
+            {
+                padded[n] += 2 * this->ghost[n];
+            }
+            auto L = ndarray<T, R>(padded);
+            locals[k].become(L);
+            scatter(k);
+        });
 
-    /**
-     * Constructors
-     * 
-     */
-    // ========================================================================
-    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(T value=T())
-    : scalar_offset(0)
-    , buf(std::make_shared<buffer<T>>(1, value))
-    {
+        if (edges)
+        {
+            exchange();
+        }
     }
 
-    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(int scalar_offset, std::shared_ptr<buffer<T>>& buf)
-    : scalar_offset(scalar_offset)
-    , buf(buf)
+    static index_type interior_shape(const ndarray<T, R>& A, index_type ghost)
     {
-    }
+        auto s = A.shape();
 
-    template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
-    ndarray(std::initializer_list<T> elements)
-    : sel({elements.size()})
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(elements.begin(), elements.end()))
-    {
+        for (int n = 0; n < R; ++n)
+        {
+            if (ghost[n] < 0 || s[n] < 2 * ghost[n])
+            {
+                throw std::invalid_argument("decomposition: ghost width "
+                    + shape::to_string(ghost)
+                    + " does not fit array of shape "
+                    + shape::to_string(s));
+            }
+            s[n] -= 2 * ghost[n];
+        }
+        return s;
     }
 
-    template<typename... Dims>
-    ndarray(Dims... dims) : ndarray(std::array<int, R>({int(dims)...}))
+    /**
+     * The interior index along axis n at which block c starts.
+     */
+    int offset(int n, int c) const
     {
-        static_assert(sizeof...(dims) == rank,
-          "Number of arguments to ndarray constructor must match rank");
+        long size = global.shape(n) - 2 * ghost[n];
+        return int(size * c / blocks[n]);
     }
 
-    template<typename SelectorType>
-    ndarray(SelectorType sel, std::shared_ptr<buffer<T>>& buf)
-    : sel(sel)
-    , strides(sel.strides())
-    , buf(buf)
+    index_type coordinates(int k) const
     {
-    }
+        auto c = index_type();
 
-    ndarray() : ndarray(constant_array<rank>(0))
-    {
+        for (int n = R - 1; n >= 0; --n)
+        {
+            c[n] = k % blocks[n];
+            k /= blocks[n];
+        }
+        return c;
     }
 
-    ndarray(std::array<int, R> dim_sizes)
-    : sel(dim_sizes)
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(sel.size()))
+    int block(index_type c) const
     {
+        int k = 0;
+
+        for (int n = 0; n < R; ++n)
+        {
+            k = k * blocks[n] + c[n];
+        }
+        return k;
     }
 
-    ndarray(std::array<int, R> dim_sizes, std::shared_ptr<buffer<T>>& buf)
-    : sel(dim_sizes)
-    , strides(sel.strides())
-    , buf(buf)
+    void scatter(int k)
     {
-        assert_valid_argument(buf->size() == sel.size(),
-            "Size of data buffer is not the product of dim sizes");
+        auto padded = shape(k);
+        auto start = lower(k);
+
+        for (int n = 0; n < R; ++n)
+        {
+            padded[n] += 2 * ghost[n];
+            start[n] -= ghost[n];
+        }
+        locals[k] = global.region(start, padded);
     }
 
-    ndarray(const ndarray<T, R>& other)
-    : sel(other.sel.shape())
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(size()))
+    /**
+     * Fills the ghosts of subdomain k along axis n, spanning the full
+     * extent (ghosts included) of the axes before n and the interior of
+     * the axes after it, like fill_halo. The region read from a neighbour
+     * lies in its interior along axes n and later, so it is never written
+     * during the same phase.
+     */
+    void exchange(int k, int n)
     {
-        copy_internal(*this, other);
+        if (ghost[n] == 0)
+        {
+            return;
+        }
+        auto c = coordinates(k);
+        auto s = shape(k);
+        auto corner = ghost;
+        auto extent = s;
+
+        for (int m = 0; m < n; ++m)
+        {
+            corner[m] = 0;
+            extent[m] += 2 * ghost[m];
+        }
+        extent[n] = ghost[n];
+
+        for (int side = 0; side < 2; ++side)
+        {
+            int neighbour = c[n] + (side ? 1 : -1);
+            bool edge = neighbour < 0 || neighbour >= blocks[n];
+            auto target = corner;
+            target[n] = side ? ghost[n] + s[n] : 0;
+
+            if (! edge || (edges && modes[n] == boundary::periodic))
+            {
+                auto d = c;
+                d[n] = (neighbour + blocks[n]) % blocks[n];
+                auto source = corner;
+                source[n] = side ? ghost[n] : shape(block(d))[n];
+                auto to = locals[k].region(target, extent);
+                to = locals[block(d)].region(source, extent);
+            }
+            else if (edges && modes[n] == boundary::constant)
+            {
+                locals[k].region(target, extent) = value;
+            }
+            else if (edges)
+            {
+                int size = global.shape(n) - 2 * ghost[n];
+                auto plane = extent;
+                plane[n] = 1;
+
+                for (int j = 0; j < ghost[n]; ++j)
+                {
+                    auto to = target;
+                    auto from = corner;
+                    to[n] += j;
+                    from[n] = ghost[n] - offset(n, c[n]) + boundary_index(side ? size + j : j - ghost[n], size, modes[n]);
+                    auto A = locals[k].region(to, plane);
+                    A = locals[k].region(from, plane);
+                }
+            }
+        }
     }
 
-    ndarray(ndarray<T, R>& other)
-    {
-        strides = other.strides;
-        sel = other.sel;
-        buf = other.buf;
-    }
+    ndarray<T, R> global;
+    index_type ghost;
+    index_type blocks;
+    modes_type modes;
+    T value;
+    bool edges;
+    std::vector<ndarray<T, R>> locals;
+}; 
+
 
 
 
+// ============================================================================
+#if defined(__unix__) || defined(__APPLE__) 
+
+/**
+ * An array in a named POSIX shared memory segment, which other processes
+ * on the same machine can attach to and use without copying. The segment
+ * starts with a small header recording the data type and shape, which
+ * attach() checks, followed by the elements in row-major order.
+ *
+ * The header also holds a sequence number for a seqlock: a writer wraps
+ * each update in write(), which makes the number odd while the update is
+ * in progress, and readers take consistent copies with snapshot(), which
+ * retries until the number was even and unchanged across the copy. There
+ * must be one writer at a time; readers never block it. Arrays returned by
+ * array() are zero-copy views of the segment, but reading them while the
+ * writer is active may see a mixture of old and new values.
+ *
+ * For example, in the producer:
+ *
+ * auto S = nd::shared_array<double, 2>::create("/frames", {480, 640});
+ * S.write([&] (auto A) { A = frame; });
+ *
+ * and in each consumer:
+ *
+ * auto S = nd::shared_array<double, 2>::attach("/frames");
+ * auto B = S.snapshot();
+ *
+ * Segments persist until unlink() is called on their name, and the memory
+ * until every process has released it.
+ */
+template<typename T, int R>
+class nd::shared_array
+{
+public:
+    static_assert(R <= 8, "shared_array: rank must be at most 8");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared_array: needs lock-free 64-bit atomics");
 
     /**
-     * Assignment operators
-     * 
+     * Creates a new segment with the given name (which should start with
+     * a slash) and shape, with zeroed elements. Throws std::system_error
+     * if the segment already exists or cannot be created; a segment that
+     * was created but could not be set up is removed again. The header's
+     * magic number is written last, so attach() never accepts a segment
+     * whose header is incomplete.
      */
-    // ========================================================================
-    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
-    ndarray<T, R>& operator=(T value)
+    static shared_array create(const std::string& name, std::array<int, R> shape)
     {
-        buf->operator[](scalar_offset) = value;
-        return *this;
-    }
+        std::size_t size = 1;
 
-    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
-    ndarray<T, R>& operator=(T value)
-    {
-        for (auto& a : *this)
-            a = value;
+        for (int n = 0; n < R; ++n)
+        {
+            if (shape[n] < 0)
+            {
+                throw std::invalid_argument("shared_array: shape must be non-negative");
+            }
+            size *= shape[n];
+        }
 
-        return *this;
-    }
+        int fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0600);
 
-    ndarray<T, R>& operator=(const ndarray<T, R>& other)
-    {
-        copy_internal(*this, other);
-        return *this;
-    }
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "shared_array: cannot create " + name);
+        }
 
-    void become(ndarray<T, R> other)
-    {
-        strides = other.strides;
-        sel = other.sel;
-        buf = other.buf;
-    }
+        auto bytes = header_bytes + size * sizeof(T);
 
-    template<typename... Sizes>
-    auto reshape(Sizes... sizes)
-    {
-        if (! contiguous())
+        if (ftruncate(fd, off_t(bytes)) == -1)
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
+            int error = errno;
+            close(fd);
+            shm_unlink(name.data());
+            throw std::system_error(error, std::generic_category(), "shared_array: cannot resize " + name);
         }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, buf);
-    }
 
-    template<typename... Sizes>
-    const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
-    {
-        if (! contiguous())
+        auto S = map_created(fd, bytes, name);
+        auto dtype = dtype_str<T>::value();
+
+        std::memcpy(S.head->dtype, dtype.data(), sizeof(S.head->dtype));
+        S.head->rank = R;
+
+        for (int n = 0; n < R; ++n)
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
+            S.head->shape[n] = shape[n];
         }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<std::shared_ptr<buffer<T>>&>(buf));
+        S.head->sequence.store(0, std::memory_order_relaxed);
+        S.head->magic.store(magic(), std::memory_order_release);
+        return S;
     }
 
+    /**
+     * Maps an existing segment. A segment which another process is still
+     * creating (too small to hold a header, or without its magic number
+     * yet) is retried for up to wait_ms milliseconds. Throws
+     * std::system_error if it cannot be opened, and std::invalid_argument
+     * if it was not created by shared_array, is still incomplete when the
+     * wait ends, or holds a different data type or rank.
+     */
+    static shared_array attach(const std::string& name, int wait_ms=ND_SHM_ATTACH_MS)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
 
+        while (true)
+        {
+            int fd = shm_open(name.data(), O_RDWR, 0);
 
+            if (fd == -1)
+            {
+                throw std::system_error(errno, std::generic_category(), "shared_array: cannot open " + name);
+            }
 
-    /**
-     * Shape and size query methods
-     * 
-     */
-    // ========================================================================
-    auto size() const { return sel.size(); }
-    bool empty() const { return sel.empty(); }
-    auto shape() const { return sel.shape(); }
-    auto shape(int axis) const { return sel.shape(axis); }
-    bool contiguous() const { return sel.contiguous(); }
+            struct stat info;
 
+            if (fstat(fd, &info) == -1)
+            {
+                int error = errno;
+                close(fd);
+                throw std::system_error(error, std::generic_category(), "shared_array: cannot stat " + name);
+            }
 
+            if (std::size_t(info.st_size) >= header_bytes)
+            {
+                auto S = shared_array(fd, info.st_size, name);
+                auto m = S.head->magic.load(std::memory_order_acquire);
+
+                if (m == magic())
+                {
+                    S.check(std::size_t(info.st_size));
+                    return S;
+                }
+                if (m != 0)
+                {
+                    throw std::invalid_argument("shared_array: " + name + " was not created by shared_array");
+                }
+            }
+            else
+            {
+                close(fd);
+            }
 
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                throw std::invalid_argument("shared_array: " + name + " is incomplete; it may still be being created");
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
 
     /**
-     * Data accessors and selection methods
-     * 
+     * Removes the name of a segment, so that it can no longer be attached
+     * to; processes which have it mapped keep their memory. Returns false
+     * if there was no such segment.
      */
-    // ========================================================================
-    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
-    ndarray<T, R - 1> operator[](int index)
+    static bool unlink(const std::string& name)
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
-
-        return {offset_relative({index}), buf};
+        return shm_unlink(name.data()) == 0;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
-    const ndarray<T, R - 1> operator[](int index) const
+    const std::string& get_name() const
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
-
-        return {offset_relative({index}), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        return name;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
-    ndarray<T, R - 1> operator[](int index)
+    std::array<int, R> shape() const
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
+        auto s = std::array<int, R>();
 
-        return {sel.select(index), buf};
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = int(head->shape[n]);
+        }
+        return s;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
-    const ndarray<T, R - 1> operator[](int index) const
+    std::size_t size() const
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
+        std::size_t size = 1;
 
-        return {sel.select(index), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        for (int n = 0; n < R; ++n)
+        {
+            size *= std::size_t(head->shape[n]);
+        }
+        return size;
     }
 
-    template<typename... Index>
-    T& operator()(Index... index)
+    /**
+     * An array sharing the segment's memory, which keeps it mapped for as
+     * long as the array (or any view of it) exists.
+     */
+    ndarray<T, R> array() const
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: index out of range");
-
-        return buf->operator[](offset_relative({int(index)...}));
+        auto keep = mapping;
+        return ndarray<T, R>(data(), shape(), [keep] (T*) {});
     }
 
-    template<typename... Index>
-    const T& operator()(Index... index) const
+    /**
+     * The current sequence number: even when no write is in progress, and
+     * advanced by two for every completed write. Readers may poll it to
+     * see whether there is anything new.
+     */
+    std::uint64_t sequence() const
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
-
-        return buf->operator[](offset_relative({int(index)...}));
+        return head->sequence.load(std::memory_order_acquire);
     }
 
-    template<typename... Index>
-    auto select(Index... index)
+    /**
+     * Invokes f(A) with an array sharing the segment's memory, marking the
+     * segment as being written for the duration, and returns the sequence
+     * number the write completed with. Only one process or thread may
+     * write at a time. If f throws, the write is still marked complete, so
+     * readers may see it partly done.
+     */
+    template<typename Function>
+    std::uint64_t write(Function f)
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
+        auto A = array();
+        auto s = head->sequence.load(std::memory_order_relaxed);
+
+        head->sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
 
-        auto S = sel.select(index...);
-        return ndarray<T, S.rank>(S.reset(), buf);
+        try {
+            f(A);
+        }
+        catch (...) {
+            head->sequence.store(s + 2, std::memory_order_release);
+            throw;
+        }
+        head->sequence.store(s + 2, std::memory_order_release);
+        return s + 2;
     }
 
-    template<typename... Index>
-    auto select(Index... index) const
+    /**
+     * Copies a consistent version of the segment into target, which must
+     * have the segment's shape, and returns its sequence number. Retries
+     * while a write is in progress, or if one started during the copy.
+     */
+    std::uint64_t snapshot(ndarray<T, R>& target) const
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
+        if (target.shape() != shape())
+        {
+            throw std::invalid_argument("shared_array: snapshot target has shape "
+                + shape::to_string(target.shape())
+                + " but the segment has shape "
+                + shape::to_string(shape()));
+        }
 
-        auto S = sel.select(index...);
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
-    }
+        auto source = array();
 
-    template<int Axis, typename Slice>
-    auto take(Slice slice)
-    {
-        auto taken_sel = sel.template on<Axis>().select(slice).reset();
-        return ndarray<T, R>(taken_sel, buf);
+        for (int attempt = 0; ; ++attempt)
+        {
+            auto before = head->sequence.load(std::memory_order_acquire);
+
+            if (before % 2 == 0)
+            {
+                target = source;
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (head->sequence.load(std::memory_order_relaxed) == before)
+                {
+                    return before;
+                }
+            }
+            if (attempt >= 16)
+            {
+                std::this_thread::yield();
+            }
+        }
     }
 
-    template<int Axis, typename Slice>
-    auto take(Slice slice) const
+    /**
+     * Returns a new array holding a consistent copy of the segment.
+     */
+    ndarray<T, R> snapshot() const
     {
-        auto S = sel.template on<Axis>().select(slice).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        auto A = ndarray<T, R>(shape());
+        snapshot(A);
+        return A;
     }
 
-    template<int Axis>
-    auto shift(int distance)
+private:
+    struct header
     {
-        auto shifted_sel = sel.template on<Axis>().shift(distance).reset();
-        return ndarray<T, R>(shifted_sel, buf);
-    }
+        std::atomic<std::uint64_t> magic;
+        char dtype[8];
+        std::int32_t rank;
+        std::int32_t unused;
+        std::int64_t shape[8];
+        std::atomic<std::uint64_t> sequence;
+    };
 
-    template<int Axis>
-    auto shift(int distance) const
+    /**
+     * Elements start at this offset into the segment, so that they are
+     * aligned to a cache line and never share one with the header.
+     */
+    static constexpr std::size_t header_bytes = 128;
+
+    static std::uint64_t magic()
     {
-        auto S = sel.template on<Axis>().shift(distance).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        std::uint64_t m;
+        std::memcpy(&m, "ndshm01", sizeof(m));
+        return m;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
-    operator T() const
+    /**
+     * Maps a segment just created under the given name, removing the name
+     * again if that fails.
+     */
+    static shared_array map_created(int fd, std::size_t bytes, const std::string& name)
     {
-        // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
-        return buf->operator[](scalar_offset);
+        try {
+            return shared_array(fd, bytes, name);
+        }
+        catch (...) {
+            shm_unlink(name.data());
+            throw;
+        }
     }
 
-    ndarray<T, R> copy() const
+    /**
+     * Checks the rest of a published header against this type.
+     */
+    void check(std::size_t bytes) const
     {
-        auto d = std::make_shared<buffer<T>>(begin(), end());
-        return {shape(), d};
+        auto dtype = dtype_str<T>::value();
+
+        if (std::memcmp(head->dtype, dtype.data(), sizeof(head->dtype)) != 0)
+            throw std::invalid_argument("shared_array: " + name + " has the wrong data type");
+
+        if (head->rank != R)
+            throw std::invalid_argument("shared_array: " + name + " has the wrong rank");
+
+        if (header_bytes + size() * sizeof(T) > bytes)
+            throw std::invalid_argument("shared_array: " + name + " is smaller than its shape");
     }
 
-    template<typename new_type>
-    ndarray<new_type, R> astype() const
+    shared_array(int fd, std::size_t bytes, const std::string& name) : name(name)
     {
-        auto d = std::make_shared<buffer<new_type>>(begin(), end());
-        return {shape(), d};
+        static_assert(sizeof(header) <= header_bytes, "shared_array: header does not fit");
+
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        close(fd);
+
+        if (memory == MAP_FAILED)
+        {
+            throw std::system_error(error, std::generic_category(), "shared_array: cannot map " + name);
+        }
+        mapping = std::shared_ptr<void>(memory, [bytes] (void* memory) { munmap(memory, bytes); });
+        head = static_cast<header*>(memory);
     }
 
-    const T* data() const
+    T* data() const
     {
-        return buf->data();
+        return reinterpret_cast<T*>(static_cast<char*>(mapping.get()) + header_bytes);
     }
 
-    T* data()
+    std::string name;
+    std::shared_ptr<void> mapping;
+    header* head;
+};
+
+template<typename T, int R>
+constexpr std::size_t nd::shared_array<T, R>::header_bytes;
+
+#endif 
+
+
+
+
+// ============================================================================
+class nd::philox 
+{
+public:
+    using block_type = std::array<std::uint32_t, 4>;
+    using key_type = std::array<std::uint32_t, 2>;
+
+    philox(std::uint64_t seed=0, std::uint64_t stream=0) : seed(seed), stream(stream)
     {
-        return buf->data();
     }
 
-    selector<R> get_selector() const
+    /**
+     * The Philox4x32-10 bijection of a 128-bit counter, under a 64-bit key.
+     */
+    static block_type block(block_type counter, key_type key)
     {
-        return sel;
+        std::uint32_t c[4][1] = {{counter[0]}, {counter[1]}, {counter[2]}, {counter[3]}};
+        rounds<1>(c, key);
+        return {c[0][0], c[1][0], c[2][0], c[3][0]};
     }
 
-    bool is_const_ref() const
+    /**
+     * Block n of this generator's stream, independently of its position.
+     */
+    block_type operator()(std::uint64_t n) const
     {
-        return false;
+        return block(counter(n), key());
     }
 
-
-
+    std::uint64_t get_seed() const { return seed; }
+    std::uint64_t get_stream() const { return stream; }
+    std::uint64_t get_position() const { return position; }
 
     /**
-     * Operations
-     * 
+     * Sets the index of the next block a fill will use, e.g. to regenerate
+     * an earlier fill.
      */
-    // ========================================================================
-    template<typename U> struct OpEquals     { auto operator()(T a, U b) const { return a == b; } };
-    template<typename U> struct OpNotEquals  { auto operator()(T a, U b) const { return a != b; } };
-    template<typename U> struct OpGreaterEq  { auto operator()(T a, U b) const { return a >= b; } };
-    template<typename U> struct OpLessEq     { auto operator()(T a, U b) const { return a <= b; } };
-    template<typename U> struct OpGreater    { auto operator()(T a, U b) const { return a > b; } };
-    template<typename U> struct OpLess       { auto operator()(T a, U b) const { return a < b; } };
-    template<typename U> struct OpPlus       { auto operator()(T a, U b) const { return a + b; } };
-    template<typename U> struct OpMinus      { auto operator()(T a, U b) const { return a - b; } };
-    template<typename U> struct OpMultiplies { auto operator()(T a, U b) const { return a * b; } };
-    template<typename U> struct OpDivides    { auto operator()(T a, U b) const { return a / b; } };
-    struct OpIdentity { auto operator()(T a) const { return a; } };
-    struct OpNegate   { auto operator()(T a) const { return ! a; } };
-
+    void set_position(std::uint64_t new_position)
+    {
+        position = new_position;
+    }
 
+    /**
+     * Fills A with values uniformly distributed in [low, high). Each value
+     * uses 53 random bits for double and 24 for float.
+     */
+    template<typename T, int R>
+    void uniform(ndarray<T, R>& A, T low=T(0), T high=T(1))
+    {
+        auto scale = high - low;
 
+        fill(A, [low, scale] (const std::uint32_t* x, T* out)
+        {
+            for (int j = 0; j < values_per_block<T>(); ++j)
+            {
+                out[j] = low + scale * unit<T>(x, j);
+            }
+        });
+    }
 
     /**
-     * Arithmetic operations
-     * 
+     * Fills A with normally distributed values, by the Box-Muller transform
+     * of pairs of uniform values from the same block.
      */
-    // ========================================================================
-    template<typename U> auto& operator+=(U b) { for (auto& a : *this) { a += b; } return *this; }
-    template<typename U> auto& operator-=(U b) { for (auto& a : *this) { a -= b; } return *this; }
-    template<typename U> auto& operator*=(U b) { for (auto& a : *this) { a *= b; } return *this; }
-    template<typename U> auto& operator/=(U b) { for (auto& a : *this) { a /= b; } return *this; }
-    template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
-
-    template<typename U> auto operator+(U b) const { auto A = copy(); for (auto& a : A) { a += b; } return A; }
-    template<typename U> auto operator-(U b) const { auto A = copy(); for (auto& a : A) { a -= b; } return A; }
-    template<typename U> auto operator*(U b) const { auto A = copy(); for (auto& a : A) { a *= b; } return A; }
-    template<typename U> auto operator/(U b) const { auto A = copy(); for (auto& a : A) { a /= b; } return A; }
-    template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
-    template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
-    template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
-    template<typename U> auto operator/(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); }
+    template<typename T, int R>
+    void normal(ndarray<T, R>& A, T mean=T(0), T stddev=T(1))
+    {
+        fill(A, [mean, stddev] (const std::uint32_t* x, T* out)
+        {
+            const T two_pi = T(6.283185307179586476925);
 
+            for (int j = 0; j < values_per_block<T>(); j += 2)
+            {
+                auto r = stddev * std::sqrt(T(-2) * std::log(T(1) - unit<T>(x, j)));
+                auto a = two_pi * unit<T>(x, j + 1);
+                out[j + 0] = mean + r * std::cos(a);
+                out[j + 1] = mean + r * std::sin(a);
+            }
+        });
+    }
 
+private:
+    /**
+     * Number of blocks generated together. The rounds are a chain of
+     * dependent multiplies, so interleaving two counters keeps the
+     * multiplier busy; wider batches run out of registers.
+     */
+    enum { batch = 2 };
 
+    template<typename T>
+    static constexpr int values_per_block()
+    {
+        static_assert(std::is_floating_point<T>::value && sizeof(T) <= 8, "philox: only float and double are supported");
+        return sizeof(T) > 4 ? 2 : 4;
+    }
 
     /**
-     * Comparison/equality methods and operators
-     * 
+     * The j-th value in [0, 1) from a block.
      */
-    // ========================================================================
-    template<typename U> auto operator==(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, B); }
-    template<typename U> auto operator!=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, B); }
-    template<typename U> auto operator>=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, B); }
-    template<typename U> auto operator<=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, B); }
-    template<typename U> auto operator> (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, B); }
-    template<typename U> auto operator< (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, B); }
+    template<typename T>
+    static T unit(const std::uint32_t* x, int j)
+    {
+        if (sizeof(T) > 4)
+        {
+            auto bits = (std::uint64_t(x[2 * j]) << 32 | x[2 * j + 1]) >> 11;
+            return T(std::int64_t(bits)) * T(1.0 / 9007199254740992.0);
+        }
+        return T(std::int32_t(x[j] >> 8)) * T(1.0 / 16777216.0);
+    }
 
-    template<typename U> auto operator==(U b) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, b); }
-    template<typename U> auto operator!=(U b) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, b); }
-    template<typename U> auto operator>=(U b) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, b); }
-    template<typename U> auto operator<=(U b) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, b); }
-    template<typename U> auto operator> (U b) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, b); }
-    template<typename U> auto operator< (U b) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, b); }
+    template<int W>
+    static void rounds(std::uint32_t (&c)[4][W], key_type key)
+    {
+        std::uint32_t k0 = key[0];
+        std::uint32_t k1 = key[1];
 
-    auto operator!() const { return unary_op<T, R, OpNegate>::perform(*this); }
-    bool any() const { for (auto x : *this) if (x) return true; return false; }
-    bool all() const { for (auto x : *this) if (! x) return false; return true; }
+        for (int r = 0; r < 10; ++r)
+        {
+            for (int b = 0; b < W; ++b)
+            {
+                auto p0 = std::uint64_t(0xD2511F53) * c[0][b];
+                auto p1 = std::uint64_t(0xCD9E8D57) * c[2][b];
+                auto x0 = std::uint32_t(p1 >> 32) ^ c[1][b] ^ k0;
+                auto x2 = std::uint32_t(p0 >> 32) ^ c[3][b] ^ k1;
+                c[0][b] = x0;
+                c[1][b] = std::uint32_t(p1);
+                c[2][b] = x2;
+                c[3][b] = std::uint32_t(p0);
+            }
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+    }
 
-    bool is(const ndarray<T, R>& other) const
+    block_type counter(std::uint64_t n) const
     {
-        return (scalar_offset == other.scalar_offset
-        && strides == other.strides
-        && sel == other.sel
-        && buf == other.buf);
+        return {std::uint32_t(n), std::uint32_t(n >> 32), std::uint32_t(stream), std::uint32_t(stream >> 32)};
     }
 
-    template<int other_rank>
-    bool shares(const ndarray<T, other_rank>& other) const
+    key_type key() const
     {
-        return buf == other.buf;
+        return {std::uint32_t(seed), std::uint32_t(seed >> 32)};
     }
 
+    /**
+     * Writes the values of blocks position + [0, blocks) to A, where
+     * transform(x, out) turns the four words of a block into the values
+     * for consecutive elements. Whole blocks are split across threads.
+     */
+    template<typename T, int R, typename Transform>
+    void fill(ndarray<T, R>& A, Transform transform)
+    {
+        static_assert(R >= 1, "philox: cannot fill a scalar");
 
+        const int k = values_per_block<T>();
+        auto size = long(A.size());
+        auto blocks = (size + k - 1) / k;
+        auto first = position;
+        auto dense = A.get_strides() == selector<R>(A.shape()).strides();
+        auto base = A.data() + A.data_offset();
 
+        auto range = [&] (int lower, int upper)
+        {
+            std::uint32_t c[4][batch];
+            T values[batch * k];
+            auto it = A.begin() + long(lower) * k;
 
-    // ========================================================================
-    class iterator
-    {
-    public:
-        using difference_type = std::ptrdiff_t;
-        using value_type = T;
-        using pointer = T*;
-        using reference = T&;
-        using iterator_category = std::forward_iterator_tag;
+            for (long b = lower; b < upper; b += batch)
+            {
+                for (int j = 0; j < batch; ++j)
+                {
+                    auto ctr = counter(first + b + j);
+                    c[0][j] = ctr[0];
+                    c[1][j] = ctr[1];
+                    c[2][j] = ctr[2];
+                    c[3][j] = ctr[3];
+                }
+                rounds<batch>(c, key());
+
+                for (int j = 0; j < batch; ++j)
+                {
+                    std::uint32_t x[4] = {c[0][j], c[1][j], c[2][j], c[3][j]};
+                    transform(x, values + j * k);
+                }
+
+                auto start = b * k;
+                auto count = std::min(std::min(long(upper) - b, long(batch)) * k, size - start);
+
+                if (dense)
+                {
+                    std::copy(values, values + count, base + start);
+                }
+                else
+                {
+                    for (long i = 0; i < count; ++i)
+                    {
+                        *it = values[i];
+                        ++it;
+                    }
+                }
+            }
+        };
 
-        iterator() {}
-        iterator(ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+        if (size >= ND_PARALLEL_THRESHOLD)
         {
+            parallel::for_each_chunk(int(blocks), range);
         }
-
-        iterator& operator++() { it.operator++(); return *this; }
-        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(iterator other) const { return mem != other.mem || it != other.it; }
-        T& operator*() { return mem[offset_absolute(*it)]; }
-
-    private:
-        int offset_absolute(std::array<int, R> index) const
+        else
         {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
+            range(0, int(blocks));
         }
-        T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
-    };
-
-    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+        position += blocks;
+    }
 
+    std::uint64_t seed;
+    std::uint64_t stream;
+    std::uint64_t position = 0;
+};
 
 
 
-    // ========================================================================
-    class const_iterator
-    {
-    public:
-        using difference_type = std::ptrdiff_t;
-        using value_type = T;
-        using pointer = const T*;
-        using reference = const T&;
-        using iterator_category = std::forward_iterator_tag;
 
-        const_iterator() {}
-        const_iterator(const ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
-        {
-        }
+/**
+ * Returns a new array of the given shape with values uniformly distributed
+ * in [0, 1), drawn from the generator.
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::random_uniform(philox& generator, Dims... dims)
+{
+    auto A = ndarray<T, sizeof...(Dims)>(dims...);
+    generator.uniform(A);
+    return A;
+}
 
-        const_iterator& operator++() { it.operator++(); return *this; }
-        const_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(const_iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(const_iterator other) const { return mem != other.mem || it != other.it; }
-        const T& operator*() { return mem[offset_absolute(*it)]; }
+/**
+ * Returns a new array of the given shape with standard normally distributed
+ * values, drawn from the generator.
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::random_normal(philox& generator, Dims... dims)
+{
+    auto A = ndarray<T, sizeof...(Dims)>(dims...);
+    generator.normal(A);
+    return A;
+} 
 
-    private:
-        int offset_absolute(std::array<int, R> index) const
-        {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
-        }
-        const T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
-    };
 
-    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
 
 
+// ============================================================================
+template<typename T, int R> 
+class nd::growable
+{
+public:
+    static_assert(R >= 1, "growable: rank must be at least 1");
 
+    using row_shape_type = std::array<int, R - 1>;
 
     /**
-     * Basic serialization operations
-     * 
+     * Creates an empty array whose rows have the given shape, with room for
+     * the given number of rows.
      */
-    // ========================================================================
-    std::string dumps() const
+    growable(row_shape_type row_shape={}, int capacity=0)
+    : row_shape(row_shape)
+    , buf(buffer<T>::make(0))
     {
-        // dtype ... 8 char's
-        // rank  ... 1 int
-        // shape ... rank int's
-        // data  ... size T's
-
-        auto D = dtype_str<T>::value();
-        auto Q = int(rank);
-        auto S = shape();
-        auto str = std::string();
-
-        str.insert(str.end(), (char*)&D, (char*)(&D + 1));
-        str.insert(str.end(), (char*)&Q, (char*)(&Q + 1));
-        str.insert(str.end(), (char*)&S, (char*)(&S + 1));
-
-        for (const auto& x : *this)
+        for (int n = 0; n < R - 1; ++n)
         {
-            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
+            if (row_shape[n] < 0)
+            {
+                throw std::invalid_argument("growable: row shape must be non-negative");
+            }
         }
-        return str;
+        reserve(capacity);
     }
 
-    static ndarray<T, R> loads(const std::string& str)
+    /**
+     * Creates an array holding a copy of the rows of A.
+     */
+    template<typename U, typename = typename std::enable_if<std::is_same<U, T>::value>::type>
+    growable(const ndarray<U, R>& A) : growable(tail(A.shape()), A.shape(0))
     {
-        auto it = str.begin();
-        auto D = std::array<char, 8>();
-        auto Q = int();
-        auto S = constant_array<rank>(0);
+        extend(A);
+    }
 
-        assert_valid_argument(it + sizeof(D) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&D, &*it, sizeof(D));
-        it += sizeof(D);
+    std::array<int, R> shape() const
+    {
+        auto s = std::array<int, R>();
+        s[0] = rows;
+        std::copy(row_shape.begin(), row_shape.end(), s.begin() + 1);
+        return s;
+    }
 
-        assert_valid_argument(it + sizeof(Q) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&Q, &*it, sizeof(Q));
-        it += sizeof(Q);
+    int shape(int axis) const
+    {
+        return axis == 0 ? rows : row_shape[axis - 1];
+    }
 
-        assert_valid_argument(it + sizeof(S) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&S, &*it, sizeof(S));
-        it += sizeof(S);
+    std::size_t size() const
+    {
+        return std::size_t(rows) * row_size();
+    }
 
-        assert_valid_argument(D == dtype_str<T>::value(), "ndarray string has wrong data type");
-        assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
+    bool empty() const
+    {
+        return rows == 0;
+    }
 
-        auto size = std::accumulate(S.begin(), S.end(), 1, std::multiplies<int>());
-        auto wbuf = std::make_shared<buffer<T>>(size);
-        auto dest = wbuf->begin();
+    /**
+     * The number of rows that fit before the memory is reallocated.
+     */
+    int capacity() const
+    {
+        return allocated;
+    }
 
-        while (it != str.end())
+    /**
+     * Makes room for at least count rows in total.
+     */
+    void reserve(int count)
+    {
+        if (count > allocated)
         {
-            assert_valid_argument(dest != wbuf->end(), "unexpected end of ndarray data string");
-            std::memcpy(&*dest, &*it, sizeof(T));
-            ++dest;
-            it += sizeof(T);
+            reallocate(count);
         }
-
-        return {S, wbuf};
     }
 
-
-private:
     /**
-     * Private utility methods
-     * 
+     * Releases the memory reserved beyond the filled rows.
      */
-    // ========================================================================
-    int offset_relative(std::array<int, R> index) const
+    void shrink_to_fit()
     {
-        int m = scalar_offset;
-
-        for (int n = 0; n < rank; ++n)
+        if (allocated > rows)
         {
-            m += (sel.start[n] + sel.skips[n] * index[n]) * strides[n];
+            reallocate(rows);
         }
-        return m;
     }
 
-    int offset_absolute(std::array<int, R> index) const
+    /**
+     * Removes every row, keeping the memory. Views of the array which were
+     * taken earlier see the rows appended afterwards overwrite theirs.
+     */
+    void clear()
     {
-        int m = scalar_offset;
-
-        for (int n = 0; n < rank; ++n)
-        {
-            m += index[n] * strides[n];
-        }
-        return m;
+        rows = 0;
     }
 
-    template<int length>
-    static std::array<int, length> constant_array(T value)
+    /**
+     * Returns the filled rows as an array sharing this one's memory.
+     */
+    ndarray<T, R> array() const
     {
-        std::array<int, length> A;
-        for (auto& a : A) a = value;
-        return A;
+        auto s = shape();
+        auto strides = selector<R>(s).strides();
+        auto b = buf;
+        return ndarray<T, R>(s, strides, 0, b);
     }
 
-    static void assert_valid_argument(bool condition, const char* message)
+    /**
+     * Appends a row with every element set to T(), and returns it as an
+     * array sharing this one's memory, to be filled in place.
+     */
+    ndarray<T, R - 1> append()
     {
-        if (! condition)
-        {
-            throw std::invalid_argument(message);
-        }
+        grow(1);
+        auto row = std::array<int, R - 1>(row_shape);
+        auto strides = selector<R - 1>(row).strides();
+        auto offset = int(std::size_t(rows) * row_size());
+        std::fill(data() + offset, data() + offset + row_size(), T());
+        ++rows;
+        return ndarray<T, R - 1>(row, strides, offset, buf);
     }
 
-    template<typename TT, int TR>
-    static void copy_internal(ndarray<TT, TR>& target, const ndarray<T, R>& source)
+    /**
+     * Appends a copy of the given row, which must have the row shape;
+     * otherwise std::invalid_argument is thrown.
+     */
+    template<int Rank = R, typename std::enable_if<Rank >= 2>::type* = nullptr>
+    void append(const ndarray<T, R - 1>& row)
     {
-        if (target.size() != source.size())
+        if (row.shape() != row_shape)
         {
-            throw std::invalid_argument("incompatible assignment from "
-                + shape::to_string(source.shape())
-                + " to "
-                + shape::to_string(target.shape()));
+            throw std::invalid_argument("growable: row of shape "
+                + shape::to_string(row.shape())
+                + " does not match rows of shape "
+                + shape::to_string(row_shape));
         }
+        grow(1);
+        auto to = strided::make_operand(data() + std::size_t(rows) * row_size(), selector<R - 1>(row_shape).strides());
+        auto from = strided::make_operand(row.data() + row.data_offset(), row.get_strides());
+        strided::copy(row_shape, to, from);
+        ++rows;
+    }
 
-        auto a = target.begin();
-        auto b = source.begin();
+    /**
+     * Appends a value to a one-dimensional array.
+     */
+    template<int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    void append(T value)
+    {
+        grow(1);
+        data()[rows] = value;
+        ++rows;
+    }
 
-        for (; a != target.end(); ++a, ++b)
+    /**
+     * Appends copies of the rows of A, whose other extents must match the
+     * row shape; otherwise std::invalid_argument is thrown.
+     */
+    void extend(const ndarray<T, R>& A)
+    {
+        if (tail(A.shape()) != row_shape)
         {
-            *a = *b;
+            throw std::invalid_argument("growable: rows of shape "
+                + shape::to_string(tail(A.shape()))
+                + " do not match rows of shape "
+                + shape::to_string(row_shape));
         }
+        grow(A.shape(0));
+        auto to = strided::make_operand(data() + std::size_t(rows) * row_size(), selector<R>(A.shape()).strides());
+        auto from = strided::make_operand(A.data() + A.data_offset(), A.get_strides());
+        strided::copy(A.shape(), to, from);
+        rows += A.shape(0);
     }
 
-    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+private:
+    static row_shape_type tail(std::array<int, R> s)
     {
-        if (target.shape() != source.shape())
-        {
-            throw std::invalid_argument("incompatible assignment from "
-                + shape::to_string(source.shape())
-                + " to "
-                + shape::to_string(target.shape()));
-        }
+        auto t = row_shape_type();
+        std::copy(s.begin() + 1, s.end(), t.begin());
+        return t;
+    }
 
-        auto a = target.begin();
-        auto b = source.begin();
+    std::size_t row_size() const
+    {
+        std::size_t size = 1;
 
-        for (; a != target.end(); ++a, ++b)
+        for (int n = 0; n < R - 1; ++n)
         {
-            *a = *b;
+            size *= row_shape[n];
         }
+        return size;
     }
 
-
+    T* data() const
+    {
+        return buf->data();
+    }
 
     /**
-     * Data members
-     *
+     * Makes room for count more rows, at least doubling the capacity when
+     * it runs out.
      */
-    // ========================================================================
-    int scalar_offset = 0;
-    selector<R> sel;
-    std::array<int, R> strides;
-    std::shared_ptr<buffer<T>> buf;
-
-
+    void grow(int count)
+    {
+        if (rows + count > allocated)
+        {
+            reallocate(std::max(rows + count, 2 * allocated));
+        }
+    }
 
+    void reallocate(int count)
+    {
+        auto next = buffer<T>::make(std::size_t(count) * row_size(), uninitialized);
+        std::copy(data(), data() + size(), next->data());
+        buf = next;
+        allocated = count;
+    }
 
-    /**
-     * Grant friendship to ndarray's of other ranks.
-     *
-     */
-    template<typename, int>
-    friend class ndarray;
-    friend class iterator;
+    row_shape_type row_shape;
+    std::shared_ptr<buffer<T>> buf;
+    int rows = 0;
+    int allocated = 0;
 }; 
@@ -0,0 +1,1020 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include "ndarray.hpp"
+#include "parallel.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T> static inline T dot(const ndarray<T, 1>& a, const ndarray<T, 1>& b);
+    template<typename T> static inline ndarray<T, 1> matmul(const ndarray<T, 2>& A, const ndarray<T, 1>& x);
+    template<typename T> static inline ndarray<T, 1> matmul(const ndarray<T, 1>& x, const ndarray<T, 2>& A);
+    template<typename T> static inline ndarray<T, 2> matmul(const ndarray<T, 2>& A, const ndarray<T, 2>& B);
+
+    template<int M, int K, int N, typename T> static inline ndarray<T, 3> batch_matmul(const ndarray<T, 3>& A, const ndarray<T, 3>& B);
+    template<int M, int N, typename T> static inline ndarray<T, 2> batch_matvec(const ndarray<T, 3>& A, const ndarray<T, 2>& x);
+    template<int N, typename T> static inline ndarray<T, 1> batch_det(const ndarray<T, 3>& A);
+    template<int N, typename T> static inline ndarray<T, 3> batch_inverse(const ndarray<T, 3>& A);
+
+    /**
+     * Strided kernels behind dot and matmul. Matrices are given by a pointer
+     * to their (0, 0) element and a row and column stride (in elements, of
+     * either sign), so that transposed and strided views need no copies.
+     */
+    namespace linalg
+    {
+        /**
+         * Register and cache blocking for the matrix product. The micro-kernel
+         * keeps an MR x NR block of the product in registers; NR spans one
+         * cache line of T. Blocks of KC x NC of B and MC x KC of A are packed
+         * so as to stay resident in the L3 and L2 caches respectively.
+         */
+        template<typename T>
+        struct blocking
+        {
+            enum {
+                MR = 4,
+                NR = 64 / sizeof(T) < 4 ? 4 : 64 / sizeof(T) > 16 ? 16 : 64 / sizeof(T),
+                KC = 256,
+                MC = 96,
+                NC = 2048,
+            };
+        };
+
+        template<typename T> static inline T dot(int n, const T* x, int incx, const T* y, int incy);
+        template<typename T> static inline void gemv(int m, int n, const T* a, int rsa, int csa, const T* x, int incx, T* y, int incy);
+        template<typename T> static inline void gemm(int m, int n, int k, const T* a, int rsa, int csa, const T* b, int rsb, int csb, T* c, int rsc, int csc);
+        template<typename T> static inline void pack_a(int mc, int kc, const T* a, int rsa, int csa, T* packed);
+        template<typename T> static inline void pack_b(int kc, int nc, const T* b, int rsb, int csb, T* packed);
+        template<typename T> static inline void macro_kernel(int mc, int nc, int kc, const T* packed_a, const T* packed_b, T* c, int rsc, int csc);
+        template<typename T> static inline void micro_kernel(int kc, const T* a, const T* b, T* c, int rsc, int csc, int mr, int nr);
+
+        /**
+         * A block of W matrices of size M x N, stored lane-innermost so that
+         * the same element of every matrix in the block is contiguous. The
+         * batched kernels load a block of the batch into a tile, run an
+         * element-wise formula over the lanes (which the compiler turns into
+         * vector instructions), and store the result. W spans one cache line
+         * of T.
+         */
+        template<typename T, int M, int N>
+        struct tile
+        {
+            enum { W = 64 / sizeof(T) < 1 ? 1 : 64 / sizeof(T) > 16 ? 16 : 64 / sizeof(T) };
+            inline void load(const T* p, std::array<int, 3> strides, int lanes);
+            inline void store(T* p, std::array<int, 3> strides, int lanes) const;
+            T v[M][N][W];
+        };
+
+        template<typename T, typename Function>
+        static inline void for_each_batch(int count, int work, Function f);
+
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 1>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 2>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 3>);
+        template<typename A> static inline auto det(A a, std::integral_constant<int, 4>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 1>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 2>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 3>);
+        template<typename A, typename B> static inline void inverse(A a, B b, std::integral_constant<int, 4>);
+    }
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * Inner product of two vectors of equal length. Throws std::invalid_argument
+ * if the lengths differ. Long vectors are split across threads, in a fixed
+ * partition so that the result does not vary between runs.
+ */
+template<typename T> // ND_IMPL_START
+T nd::dot(const ndarray<T, 1>& a, const ndarray<T, 1>& b)
+{
+    if (a.shape() != b.shape())
+    {
+        throw std::invalid_argument("dot: incompatible shapes "
+            + shape::to_string(a.shape())
+            + " and "
+            + shape::to_string(b.shape()));
+    }
+
+    int n = a.shape(0);
+    auto x = a.data() + a.data_offset();
+    auto y = b.data() + b.data_offset();
+    int incx = a.get_strides()[0];
+    int incy = b.get_strides()[0];
+
+    if (n < ND_PARALLEL_THRESHOLD)
+    {
+        return linalg::dot(n, x, incx, y, incy);
+    }
+
+    int chunks = parallel::num_threads();
+    auto partial = std::vector<T>(chunks);
+
+    parallel::for_each_chunk(chunks, [&] (int lower, int upper)
+    {
+        for (int c = lower; c < upper; ++c)
+        {
+            int i0 = int(long(n) * c / chunks);
+            int i1 = int(long(n) * (c + 1) / chunks);
+            partial[c] = linalg::dot(i1 - i0, x + i0 * incx, incx, y + i0 * incy, incy);
+        }
+    });
+
+    auto result = T();
+
+    for (auto p : partial)
+    {
+        result += p;
+    }
+    return result;
+}
+
+
+
+
+/**
+ * Matrix-vector product A x. The loop order follows A's layout: rows are
+ * reduced with dot products when they are the contiguous axis, and columns
+ * are accumulated otherwise.
+ */
+template<typename T>
+nd::ndarray<T, 1> nd::matmul(const ndarray<T, 2>& A, const ndarray<T, 1>& x)
+{
+    if (A.shape(1) != x.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(x.shape()));
+    }
+
+    auto y = ndarray<T, 1>(A.shape(0));
+    auto sa = A.get_strides();
+
+    linalg::gemv(A.shape(0), A.shape(1),
+        A.data() + A.data_offset(), sa[0], sa[1],
+        x.data() + x.data_offset(), x.get_strides()[0],
+        y.data(), 1);
+
+    return y;
+}
+
+
+
+
+/**
+ * Vector-matrix product x A, i.e. the matrix-vector product with A's
+ * transpose.
+ */
+template<typename T>
+nd::ndarray<T, 1> nd::matmul(const ndarray<T, 1>& x, const ndarray<T, 2>& A)
+{
+    if (x.shape(0) != A.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(x.shape())
+            + " and "
+            + shape::to_string(A.shape()));
+    }
+
+    auto y = ndarray<T, 1>(A.shape(1));
+    auto sa = A.get_strides();
+
+    linalg::gemv(A.shape(1), A.shape(0),
+        A.data() + A.data_offset(), sa[1], sa[0],
+        x.data() + x.data_offset(), x.get_strides()[0],
+        y.data(), 1);
+
+    return y;
+}
+
+
+
+
+/**
+ * Matrix product A B, as a new row-major array. Either operand may be any
+ * strided view, e.g. a transpose or a selection; they are packed into
+ * contiguous panels as part of the blocked algorithm, so no separate copy
+ * is made. Large products are split across threads by rows of the output.
+ */
+template<typename T>
+nd::ndarray<T, 2> nd::matmul(const ndarray<T, 2>& A, const ndarray<T, 2>& B)
+{
+    if (A.shape(1) != B.shape(0))
+    {
+        throw std::invalid_argument("matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(B.shape()));
+    }
+
+    auto C = ndarray<T, 2>(A.shape(0), B.shape(1));
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+
+    linalg::gemm(A.shape(0), B.shape(1), A.shape(1),
+        A.data() + A.data_offset(), sa[0], sa[1],
+        B.data() + B.data_offset(), sb[0], sb[1],
+        C.data(), B.shape(1), 1);
+
+    return C;
+}
+
+
+
+
+/**
+ * Strided inner product, with four independent accumulators so that the
+ * additions can overlap.
+ */
+template<typename T>
+T nd::linalg::dot(int n, const T* x, int incx, const T* y, int incy)
+{
+    T s0 = T(), s1 = T(), s2 = T(), s3 = T();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 += x[(i + 0) * incx] * y[(i + 0) * incy];
+        s1 += x[(i + 1) * incx] * y[(i + 1) * incy];
+        s2 += x[(i + 2) * incx] * y[(i + 2) * incy];
+        s3 += x[(i + 3) * incx] * y[(i + 3) * incy];
+    }
+    for (; i < n; ++i)
+    {
+        s0 += x[i * incx] * y[i * incy];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+
+
+
+/**
+ * y += A x, for an m x n matrix A. Rows of y are split across threads when
+ * the matrix is large.
+ */
+template<typename T>
+void nd::linalg::gemv(int m, int n, const T* a, int rsa, int csa, const T* x, int incx, T* y, int incy)
+{
+    auto rows = [&] (int lower, int upper)
+    {
+        if (std::abs(csa) <= std::abs(rsa))
+        {
+            for (int i = lower; i < upper; ++i)
+            {
+                y[i * incy] += dot(n, a + i * rsa, csa, x, incx);
+            }
+        }
+        else
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                auto xj = x[j * incx];
+                auto aj = a + j * csa;
+
+                for (int i = lower; i < upper; ++i)
+                {
+                    y[i * incy] += aj[i * rsa] * xj;
+                }
+            }
+        }
+    };
+
+    if (long(m) * n >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(m, rows);
+    }
+    else
+    {
+        rows(0, m);
+    }
+}
+
+
+
+
+/**
+ * C += A B, for an m x k matrix A and a k x n matrix B. This follows the
+ * usual five-loop structure of a blocked matrix product: for each block of
+ * NC columns of B and KC of its rows, the block is packed into panels of NR
+ * columns; then for each block of MC rows of A, that block is packed into
+ * panels of MR rows, and the macro-kernel multiplies the packed panels. The
+ * output rows are split across threads, in whole MR-row panels, each
+ * thread packing its own blocks of A.
+ */
+template<typename T>
+void nd::linalg::gemm(int m, int n, int k, const T* a, int rsa, int csa, const T* b, int rsb, int csb, T* c, int rsc, int csc)
+{
+    using B = blocking<T>;
+
+    if (m == 0 || n == 0 || k == 0)
+    {
+        return;
+    }
+
+    int panels = (m + B::MR - 1) / B::MR;
+    bool threaded = double(m) * n * k >= 64.0 * ND_PARALLEL_THRESHOLD;
+    auto packed_b = std::vector<T>(std::size_t(B::KC) * ((std::min(n, int(B::NC)) + B::NR - 1) / B::NR) * B::NR);
+
+    for (int jc = 0; jc < n; jc += B::NC)
+    {
+        int nc = std::min(int(B::NC), n - jc);
+
+        for (int pc = 0; pc < k; pc += B::KC)
+        {
+            int kc = std::min(int(B::KC), k - pc);
+
+            pack_b(kc, nc, b + pc * rsb + jc * csb, rsb, csb, packed_b.data());
+
+            auto rows = [&] (int lower, int upper)
+            {
+                auto packed_a = std::vector<T>(std::size_t(B::MC) * B::KC);
+                int i1 = std::min(upper * int(B::MR), m);
+
+                for (int ic = lower * B::MR; ic < i1; ic += B::MC)
+                {
+                    int mc = std::min(int(B::MC), i1 - ic);
+                    pack_a(mc, kc, a + ic * rsa + pc * csa, rsa, csa, packed_a.data());
+                    macro_kernel(mc, nc, kc, packed_a.data(), packed_b.data(), c + ic * rsc + jc * csc, rsc, csc);
+                }
+            };
+
+            if (threaded)
+            {
+                parallel::for_each_chunk(panels, rows);
+            }
+            else
+            {
+                rows(0, panels);
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Packs an mc x kc block of A into panels of MR rows; each panel stores its
+ * MR elements of each column together, padded with zeros past row mc.
+ */
+template<typename T>
+void nd::linalg::pack_a(int mc, int kc, const T* a, int rsa, int csa, T* packed)
+{
+    const int MR = blocking<T>::MR;
+
+    for (int ir = 0; ir < mc; ir += MR)
+    {
+        int mr = std::min(MR, mc - ir);
+
+        for (int p = 0; p < kc; ++p)
+        {
+            for (int i = 0; i < MR; ++i)
+            {
+                *packed++ = i < mr ? a[(ir + i) * rsa + p * csa] : T();
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Packs a kc x nc block of B into panels of NR columns; each panel stores
+ * its NR elements of each row together, padded with zeros past column nc.
+ */
+template<typename T>
+void nd::linalg::pack_b(int kc, int nc, const T* b, int rsb, int csb, T* packed)
+{
+    const int NR = blocking<T>::NR;
+
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+        int nr = std::min(NR, nc - jr);
+
+        for (int p = 0; p < kc; ++p)
+        {
+            for (int j = 0; j < NR; ++j)
+            {
+                *packed++ = j < nr ? b[p * rsb + (jr + j) * csb] : T();
+            }
+        }
+    }
+}
+
+
+
+
+/**
+ * Multiplies a packed mc x kc block of A by a packed kc x nc block of B,
+ * one MR x NR tile of C at a time.
+ */
+template<typename T>
+void nd::linalg::macro_kernel(int mc, int nc, int kc, const T* packed_a, const T* packed_b, T* c, int rsc, int csc)
+{
+    const int MR = blocking<T>::MR;
+    const int NR = blocking<T>::NR;
+
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+        for (int ir = 0; ir < mc; ir += MR)
+        {
+            micro_kernel(kc,
+                packed_a + ir * kc,
+                packed_b + jr * kc,
+                c + ir * rsc + jr * csc, rsc, csc,
+                std::min(MR, mc - ir),
+                std::min(NR, nc - jr));
+        }
+    }
+}
+
+
+
+
+/**
+ * Accumulates the product of an MR-row panel of A and an NR-column panel of
+ * B into an mr x nr tile of C. The full MR x NR tile is computed in a local
+ * array, which the compiler keeps in vector registers: the inner loop is a
+ * broadcast of one element of A against a contiguous row of NR elements of
+ * B, and is written to auto-vectorize rather than with intrinsics.
+ */
+template<typename T>
+void nd::linalg::micro_kernel(int kc, const T* a, const T* b, T* c, int rsc, int csc, int mr, int nr)
+{
+    const int MR = blocking<T>::MR;
+    const int NR = blocking<T>::NR;
+    T ab[MR][NR] = {};
+
+    for (int p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        for (int i = 0; i < MR; ++i)
+        {
+            for (int j = 0; j < NR; ++j)
+            {
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+    }
+
+    for (int i = 0; i < mr; ++i)
+    {
+        for (int j = 0; j < nr; ++j)
+        {
+            c[i * rsc + j * csc] += ab[i][j];
+        }
+    }
+}
+
+
+
+
+/**
+ * Batched matrix product C[b] = A[b] B[b], for arrays of shape (count, M, K)
+ * and (count, K, N). Throws std::invalid_argument if the shapes differ from
+ * these. The inner sizes are compile-time constants, so the products are
+ * fully unrolled, and are vectorized across the batch rather than within
+ * each matrix; large batches are split across threads.
+ */
+template<int M, int K, int N, typename T>
+nd::ndarray<T, 3> nd::batch_matmul(const ndarray<T, 3>& A, const ndarray<T, 3>& B)
+{
+    if (A.shape() != std::array<int, 3>{A.shape(0), M, K} || B.shape() != std::array<int, 3>{A.shape(0), K, N})
+    {
+        throw std::invalid_argument("batch_matmul: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(B.shape()));
+    }
+
+    auto C = ndarray<T, 3>(A.shape(0), M, N);
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+    auto sc = C.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pb = B.data() + B.data_offset();
+    auto pc = C.data();
+
+    linalg::for_each_batch<T>(A.shape(0), M * N * K, [&] (int start, int lanes)
+    {
+        linalg::tile<T, M, K> a;
+        linalg::tile<T, K, N> b;
+        linalg::tile<T, M, N> c = {};
+        const int W = c.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+        b.load(pb + start * sb[0], sb, lanes);
+
+        for (int i = 0; i < M; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int k = 0; k < K; ++k)
+                    for (int w = 0; w < W; ++w)
+                        c.v[i][j][w] += a.v[i][k][w] * b.v[k][j][w];
+
+        c.store(pc + start * sc[0], sc, lanes);
+    });
+    return C;
+}
+
+
+
+
+/**
+ * Batched matrix-vector product y[b] = A[b] x[b], for arrays of shape
+ * (count, M, N) and (count, N).
+ */
+template<int M, int N, typename T>
+nd::ndarray<T, 2> nd::batch_matvec(const ndarray<T, 3>& A, const ndarray<T, 2>& x)
+{
+    if (A.shape() != std::array<int, 3>{A.shape(0), M, N} || x.shape() != std::array<int, 2>{A.shape(0), N})
+    {
+        throw std::invalid_argument("batch_matvec: incompatible shapes "
+            + shape::to_string(A.shape())
+            + " and "
+            + shape::to_string(x.shape()));
+    }
+
+    auto y = ndarray<T, 2>(A.shape(0), M);
+    auto sa = A.get_strides();
+    auto sx = std::array<int, 3>{x.get_strides()[0], x.get_strides()[1], 0};
+    auto sy = std::array<int, 3>{M, 1, 0};
+    auto pa = A.data() + A.data_offset();
+    auto px = x.data() + x.data_offset();
+    auto py = y.data();
+
+    linalg::for_each_batch<T>(A.shape(0), M * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, M, N> a;
+        linalg::tile<T, N, 1> b;
+        linalg::tile<T, M, 1> c = {};
+        const int W = c.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+        b.load(px + start * sx[0], sx, lanes);
+
+        for (int i = 0; i < M; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int w = 0; w < W; ++w)
+                    c.v[i][0][w] += a.v[i][j][w] * b.v[j][0][w];
+
+        c.store(py + start * sy[0], sy, lanes);
+    });
+    return y;
+}
+
+
+
+
+/**
+ * Determinants of a batch of N x N matrices, of shape (count, N, N), for N
+ * up to 4. The determinants are computed in closed form.
+ */
+template<int N, typename T>
+nd::ndarray<T, 1> nd::batch_det(const ndarray<T, 3>& A)
+{
+    static_assert(N >= 1 && N <= 4, "batch_det: only matrices up to 4 x 4 are supported");
+
+    if (A.shape() != std::array<int, 3>{A.shape(0), N, N})
+    {
+        throw std::invalid_argument("batch_det: expected a batch of "
+            + std::to_string(N) + " x " + std::to_string(N)
+            + " matrices, got shape "
+            + shape::to_string(A.shape()));
+    }
+
+    auto D = ndarray<T, 1>(A.shape(0));
+    auto sa = A.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pd = D.data();
+
+    linalg::for_each_batch<T>(A.shape(0), N * N * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, N, N> a;
+        linalg::tile<T, 1, 1> d;
+        const int W = d.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+
+        for (int w = 0; w < W; ++w)
+        {
+            d.v[0][0][w] = linalg::det([&] (int i, int j) { return a.v[i][j][w]; }, std::integral_constant<int, N>());
+        }
+        d.store(pd + start, {1, 0, 0}, lanes);
+    });
+    return D;
+}
+
+
+
+
+/**
+ * Inverses of a batch of N x N matrices, of shape (count, N, N), for N up to
+ * 4, computed from the adjugate. Singular matrices are not detected: their
+ * inverses contain infinities or NaNs.
+ */
+template<int N, typename T>
+nd::ndarray<T, 3> nd::batch_inverse(const ndarray<T, 3>& A)
+{
+    static_assert(N >= 1 && N <= 4, "batch_inverse: only matrices up to 4 x 4 are supported");
+    static_assert(std::is_floating_point<T>::value, "batch_inverse: requires a floating point type");
+
+    if (A.shape() != std::array<int, 3>{A.shape(0), N, N})
+    {
+        throw std::invalid_argument("batch_inverse: expected a batch of "
+            + std::to_string(N) + " x " + std::to_string(N)
+            + " matrices, got shape "
+            + shape::to_string(A.shape()));
+    }
+
+    auto B = ndarray<T, 3>(A.shape(0), N, N);
+    auto sa = A.get_strides();
+    auto sb = B.get_strides();
+    auto pa = A.data() + A.data_offset();
+    auto pb = B.data();
+
+    linalg::for_each_batch<T>(A.shape(0), N * N * N, [&] (int start, int lanes)
+    {
+        linalg::tile<T, N, N> a;
+        linalg::tile<T, N, N> b;
+        const int W = b.W;
+
+        a.load(pa + start * sa[0], sa, lanes);
+
+        for (int w = 0; w < W; ++w)
+        {
+            linalg::inverse(
+                [&] (int i, int j) { return a.v[i][j][w]; },
+                [&] (int i, int j) -> T& { return b.v[i][j][w]; },
+                std::integral_constant<int, N>());
+        }
+        b.store(pb + start * sb[0], sb, lanes);
+    });
+    return B;
+}
+
+
+
+
+/**
+ * Loads the given number of matrices, starting at p and separated by
+ * strides[0], into the tile's lanes. Unused lanes repeat the last matrix,
+ * so that kernels never see uninitialized (or, for inverses, singular)
+ * values.
+ */
+template<typename T, int M, int N>
+void nd::linalg::tile<T, M, N>::load(const T* p, std::array<int, 3> strides, int lanes)
+{
+    for (int i = 0; i < M; ++i)
+        for (int j = 0; j < N; ++j)
+            for (int w = 0; w < W; ++w)
+                v[i][j][w] = p[std::min(w, lanes - 1) * strides[0] + i * strides[1] + j * strides[2]];
+}
+
+template<typename T, int M, int N>
+void nd::linalg::tile<T, M, N>::store(T* p, std::array<int, 3> strides, int lanes) const
+{
+    for (int i = 0; i < M; ++i)
+        for (int j = 0; j < N; ++j)
+            for (int w = 0; w < lanes; ++w)
+                p[w * strides[0] + i * strides[1] + j * strides[2]] = v[i][j][w];
+}
+
+
+
+
+/**
+ * Invokes f(start, lanes) on consecutive blocks of a batch of the given
+ * count, each block holding one tile's worth of lanes (fewer for the last).
+ * Blocks are split across threads when count times the work per item
+ * reaches ND_PARALLEL_THRESHOLD.
+ */
+template<typename T, typename Function>
+void nd::linalg::for_each_batch(int count, int work, Function f)
+{
+    const int W = tile<T, 1, 1>::W;
+    int blocks = (count + W - 1) / W;
+
+    auto range = [&] (int lower, int upper)
+    {
+        for (int n = lower; n < upper; ++n)
+        {
+            f(n * W, std::min(int(W), count - n * W));
+        }
+    };
+
+    if (long(count) * work >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(blocks, range);
+    }
+    else
+    {
+        range(0, blocks);
+    }
+}
+
+
+
+
+/**
+ * Closed-form determinants of small matrices, given an accessor a(i, j).
+ */
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 1>)
+{
+    return a(0, 0);
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 2>)
+{
+    return a(0, 0) * a(1, 1) - a(0, 1) * a(1, 0);
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 3>)
+{
+    return
+    a(0, 0) * (a(1, 1) * a(2, 2) - a(1, 2) * a(2, 1)) -
+    a(0, 1) * (a(1, 0) * a(2, 2) - a(1, 2) * a(2, 0)) +
+    a(0, 2) * (a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0));
+}
+
+template<typename A>
+auto nd::linalg::det(A a, std::integral_constant<int, 4>)
+{
+    auto s0 = a(0, 0) * a(1, 1) - a(1, 0) * a(0, 1);
+    auto s1 = a(0, 0) * a(1, 2) - a(1, 0) * a(0, 2);
+    auto s2 = a(0, 0) * a(1, 3) - a(1, 0) * a(0, 3);
+    auto s3 = a(0, 1) * a(1, 2) - a(1, 1) * a(0, 2);
+    auto s4 = a(0, 1) * a(1, 3) - a(1, 1) * a(0, 3);
+    auto s5 = a(0, 2) * a(1, 3) - a(1, 2) * a(0, 3);
+    auto c5 = a(2, 2) * a(3, 3) - a(3, 2) * a(2, 3);
+    auto c4 = a(2, 1) * a(3, 3) - a(3, 1) * a(2, 3);
+    auto c3 = a(2, 1) * a(3, 2) - a(3, 1) * a(2, 2);
+    auto c2 = a(2, 0) * a(3, 3) - a(3, 0) * a(2, 3);
+    auto c1 = a(2, 0) * a(3, 2) - a(3, 0) * a(2, 2);
+    auto c0 = a(2, 0) * a(3, 1) - a(3, 0) * a(2, 1);
+    return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+}
+
+
+
+
+/**
+ * Closed-form inverses of small matrices, given an accessor a(i, j) and a
+ * writable accessor b(i, j) for the result.
+ */
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 1>)
+{
+    b(0, 0) = 1 / a(0, 0);
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 2>)
+{
+    auto r = 1 / det(a, std::integral_constant<int, 2>());
+    b(0, 0) =  a(1, 1) * r;
+    b(0, 1) = -a(0, 1) * r;
+    b(1, 0) = -a(1, 0) * r;
+    b(1, 1) =  a(0, 0) * r;
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 3>)
+{
+    auto r = 1 / det(a, std::integral_constant<int, 3>());
+    b(0, 0) = (a(1, 1) * a(2, 2) - a(1, 2) * a(2, 1)) * r;
+    b(0, 1) = (a(0, 2) * a(2, 1) - a(0, 1) * a(2, 2)) * r;
+    b(0, 2) = (a(0, 1) * a(1, 2) - a(0, 2) * a(1, 1)) * r;
+    b(1, 0) = (a(1, 2) * a(2, 0) - a(1, 0) * a(2, 2)) * r;
+    b(1, 1) = (a(0, 0) * a(2, 2) - a(0, 2) * a(2, 0)) * r;
+    b(1, 2) = (a(0, 2) * a(1, 0) - a(0, 0) * a(1, 2)) * r;
+    b(2, 0) = (a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0)) * r;
+    b(2, 1) = (a(0, 1) * a(2, 0) - a(0, 0) * a(2, 1)) * r;
+    b(2, 2) = (a(0, 0) * a(1, 1) - a(0, 1) * a(1, 0)) * r;
+}
+
+template<typename A, typename B>
+void nd::linalg::inverse(A a, B b, std::integral_constant<int, 4>)
+{
+    auto s0 = a(0, 0) * a(1, 1) - a(1, 0) * a(0, 1);
+    auto s1 = a(0, 0) * a(1, 2) - a(1, 0) * a(0, 2);
+    auto s2 = a(0, 0) * a(1, 3) - a(1, 0) * a(0, 3);
+    auto s3 = a(0, 1) * a(1, 2) - a(1, 1) * a(0, 2);
+    auto s4 = a(0, 1) * a(1, 3) - a(1, 1) * a(0, 3);
+    auto s5 = a(0, 2) * a(1, 3) - a(1, 2) * a(0, 3);
+    auto c5 = a(2, 2) * a(3, 3) - a(3, 2) * a(2, 3);
+    auto c4 = a(2, 1) * a(3, 3) - a(3, 1) * a(2, 3);
+    auto c3 = a(2, 1) * a(3, 2) - a(3, 1) * a(2, 2);
+    auto c2 = a(2, 0) * a(3, 3) - a(3, 0) * a(2, 3);
+    auto c1 = a(2, 0) * a(3, 2) - a(3, 0) * a(2, 2);
+    auto c0 = a(2, 0) * a(3, 1) - a(3, 0) * a(2, 1);
+    auto r = 1 / (s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0);
+
+    b(0, 0) = ( a(1, 1) * c5 - a(1, 2) * c4 + a(1, 3) * c3) * r;
+    b(0, 1) = (-a(0, 1) * c5 + a(0, 2) * c4 - a(0, 3) * c3) * r;
+    b(0, 2) = ( a(3, 1) * s5 - a(3, 2) * s4 + a(3, 3) * s3) * r;
+    b(0, 3) = (-a(2, 1) * s5 + a(2, 2) * s4 - a(2, 3) * s3) * r;
+    b(1, 0) = (-a(1, 0) * c5 + a(1, 2) * c2 - a(1, 3) * c1) * r;
+    b(1, 1) = ( a(0, 0) * c5 - a(0, 2) * c2 + a(0, 3) * c1) * r;
+    b(1, 2) = (-a(3, 0) * s5 + a(3, 2) * s2 - a(3, 3) * s1) * r;
+    b(1, 3) = ( a(2, 0) * s5 - a(2, 2) * s2 + a(2, 3) * s1) * r;
+    b(2, 0) = ( a(1, 0) * c4 - a(1, 1) * c2 + a(1, 3) * c0) * r;
+    b(2, 1) = (-a(0, 0) * c4 + a(0, 1) * c2 - a(0, 3) * c0) * r;
+    b(2, 2) = ( a(3, 0) * s4 - a(3, 1) * s2 + a(3, 3) * s0) * r;
+    b(2, 3) = (-a(2, 0) * s4 + a(2, 1) * s2 - a(2, 3) * s0) * r;
+    b(3, 0) = (-a(1, 0) * c3 + a(1, 1) * c1 - a(1, 2) * c0) * r;
+    b(3, 1) = ( a(0, 0) * c3 - a(0, 1) * c1 + a(0, 2) * c0) * r;
+    b(3, 2) = (-a(3, 0) * s3 + a(3, 1) * s1 - a(3, 2) * s0) * r;
+    b(3, 3) = ( a(2, 0) * s3 - a(2, 1) * s1 + a(2, 2) * s0) * r;
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_LINALG
+#include "catch.hpp"
+
+
+template<typename T>
+static nd::ndarray<T, 2> naive_matmul(const nd::ndarray<T, 2>& A, const nd::ndarray<T, 2>& B)
+{
+    auto C = nd::ndarray<T, 2>(A.shape(0), B.shape(1));
+
+    for (int i = 0; i < A.shape(0); ++i)
+        for (int j = 0; j < B.shape(1); ++j)
+            for (int k = 0; k < A.shape(1); ++k)
+                C(i, j) += A(i, k) * B(k, j);
+
+    return C;
+}
+
+
+template<typename T>
+static nd::ndarray<T, 2> test_matrix(int rows, int cols, int seed)
+{
+    auto A = nd::ndarray<T, 2>(rows, cols);
+    int n = seed;
+
+    for (auto& a : A)
+    {
+        a = T((n = (n * 37 + 11) % 101) - 50);
+    }
+    return A;
+}
+
+
+TEST_CASE("dot computes inner products of strided vectors", "[linalg]")
+{
+    auto _ = nd::axis::all();
+    auto a = nd::arange<double>(10);
+    auto b = nd::arange<double>(20).select(_|0|20|2).reverse<0>();
+
+    CHECK(nd::dot(a, a) == 285.0);
+    CHECK(nd::dot(a, b) == 2 * (0 * 9 + 1 * 8 + 2 * 7 + 3 * 6 + 4 * 5) * 2);
+    CHECK_THROWS_AS(nd::dot(a, nd::arange<double>(9)), std::invalid_argument);
+}
+
+
+TEST_CASE("matmul agrees with the naive product", "[linalg]")
+{
+    SECTION("sizes which are not multiples of the blocking")
+    {
+        for (auto shape : {std::array<int, 3>{1, 1, 1}, {5, 3, 7}, {13, 300, 9}, {100, 17, 33}})
+        {
+            auto A = test_matrix<double>(shape[0], shape[1], 1);
+            auto B = test_matrix<double>(shape[1], shape[2], 2);
+            CHECK((nd::matmul(A, B) == naive_matmul(A, B)).all());
+        }
+    }
+
+    SECTION("transposed, reversed, and strided views")
+    {
+        auto _ = nd::axis::all();
+        auto A = test_matrix<int>(30, 40, 3);
+        auto B = test_matrix<int>(40, 60, 4);
+        auto At = nd::ndarray<int, 2>(A.transpose()).copy().transpose();
+        auto Bs = B.select(_|0|40, _|0|60|3).reverse<1>();
+
+        CHECK((nd::matmul(At, B) == naive_matmul(A, B)).all());
+        CHECK((nd::matmul(A, Bs) == naive_matmul(A, Bs.copy())).all());
+        CHECK((nd::matmul(B.transpose(), A.transpose()) == naive_matmul(A, B).transpose()).all());
+    }
+
+    SECTION("matrix-vector products in both layouts")
+    {
+        auto A = test_matrix<double>(7, 5, 5);
+        auto x = nd::arange<double>(5);
+        auto y = nd::arange<double>(7);
+        auto Ax = nd::matmul(A, x);
+        auto yA = nd::matmul(y, A);
+        auto Atx = nd::matmul(A.transpose(), y);
+
+        for (int i = 0; i < 7; ++i)
+        {
+            double s = 0;
+            for (int j = 0; j < 5; ++j) s += A(i, j) * x(j);
+            CHECK(Ax(i) == s);
+        }
+        CHECK((yA == Atx).all());
+        CHECK_THROWS_AS(nd::matmul(A, y), std::invalid_argument);
+        CHECK_THROWS_AS(nd::matmul(A, A), std::invalid_argument);
+    }
+
+    SECTION("large products are split across threads")
+    {
+        auto threads = nd::parallel::set_num_threads(3);
+        auto A = test_matrix<double>(257, 256, 6);
+        auto B = test_matrix<double>(256, 258, 7);
+        CHECK((nd::matmul(A, B) == naive_matmul(A, B)).all());
+        nd::parallel::set_num_threads(threads);
+    }
+}
+
+TEST_CASE("batched kernels agree with per-matrix computations", "[linalg]")
+{
+    auto A = test_matrix<double>(1000, 16, 8).reshape(250, 4, 16).select(nd::axis::all(), nd::axis::all(), nd::axis::all()|0|16|4);
+    auto B = test_matrix<double>(1000, 4, 9).reshape(250, 4, 4);
+    auto x = test_matrix<double>(250, 4, 10);
+
+    for (int i = 0; i < 250; ++i)
+    {
+        B(i, i % 4, i % 4) += 200.0; // keep the matrices well conditioned
+    }
+
+    SECTION("batch_matmul and batch_matvec")
+    {
+        auto C = nd::batch_matmul<4, 4, 4>(A, B);
+        auto y = nd::batch_matvec<4, 4>(A, x);
+
+        for (int n = 0; n < 250; n += 7)
+        {
+            CHECK((C[n] == naive_matmul(A[n].copy(), B[n].copy())).all());
+            CHECK((y[n] == nd::matmul(A[n].copy(), x[n].copy())).all());
+        }
+        CHECK_THROWS_AS((nd::batch_matmul<4, 4, 3>(A, B)), std::invalid_argument);
+        CHECK_THROWS_AS((nd::batch_matvec<4, 4>(A, x.select(nd::axis::all()|0|10, nd::axis::all()))), std::invalid_argument);
+    }
+
+    SECTION("batch_det and batch_inverse, sizes 1 to 4")
+    {
+        auto D2 = nd::batch_det<2>(B.select(nd::axis::all(), nd::axis::all()|0|2, nd::axis::all()|0|2));
+        auto D3 = nd::batch_det<3>(B.select(nd::axis::all(), nd::axis::all()|1|4, nd::axis::all()|1|4));
+        auto D4 = nd::batch_det<4>(B);
+        auto I1 = nd::batch_inverse<1>(B.select(nd::axis::all(), nd::axis::all()|0|1, nd::axis::all()|0|1));
+        auto I3 = nd::batch_inverse<3>(B.select(nd::axis::all(), nd::axis::all()|1|4, nd::axis::all()|1|4));
+        auto I4 = nd::batch_inverse<4>(B);
+
+        for (int n = 0; n < 250; ++n)
+        {
+            auto b = [&] (int i, int j) { return B(n, i, j); };
+            auto b1 = [&] (int i, int j) { return B(n, i + 1, j + 1); };
+            CHECK(D2(n) == B(n, 0, 0) * B(n, 1, 1) - B(n, 0, 1) * B(n, 1, 0));
+            CHECK(D3(n) == nd::linalg::det(b1, std::integral_constant<int, 3>()));
+            CHECK(D4(n) == nd::linalg::det(b, std::integral_constant<int, 4>()));
+            CHECK(I1(n, 0, 0) == 1 / B(n, 0, 0));
+
+            auto P3 = nd::matmul(I3[n].copy(), B[n].select(nd::axis::all()|1|4, nd::axis::all()|1|4).copy());
+            auto P4 = nd::matmul(I4[n].copy(), B[n].copy());
+
+            for (int i = 0; i < 4; ++i)
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    CHECK(std::abs(P4(i, j) - (i == j)) < 1e-12);
+                    if (i < 3 && j < 3) CHECK(std::abs(P3(i, j) - (i == j)) < 1e-12);
+                }
+            }
+        }
+        CHECK_THROWS_AS(nd::batch_det<3>(B), std::invalid_argument);
+    }
+
+    SECTION("large batches are split across threads")
+    {
+        auto threads = nd::parallel::set_num_threads(3);
+        auto M = test_matrix<double>(3 * 20000, 3, 11).reshape(20000, 3, 3);
+        auto D = nd::batch_det<3>(M);
+
+        for (int n = 0; n < 20000; n += 997)
+        {
+            CHECK(D(n) == nd::linalg::det([&] (int i, int j) { return M(n, i, j); }, std::integral_constant<int, 3>()));
+        }
+        nd::parallel::set_num_threads(threads);
+    }
+}
+
+#endif // TEST_LINALG
@@ -3,9 +3,13 @@
 #include <memory>
 #include <numeric>
 #include <cstring>
+#include <vector>
+#include <iterator>
+#include <initializer_list>
 #include "shape.hpp"
 #include "selector.hpp"
 #include "buffer.hpp"
+#include "strided.hpp"
 
 
 
@@ -18,13 +22,48 @@ namespace nd // ND_API_START
     template<typename T, int R> class ndarray;
     template<typename T> struct dtype_str;
 
-    template<typename T> ndarray<T, 1> static inline arange(int size);
+    template<typename T, std::size_t R, typename Function>
+    static inline ndarray<T, int(R)> generate(std::array<int, R> shape, Function f);
+
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> empty(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> zeros(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> ones(std::array<int, R> shape);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> full(std::array<int, R> shape, T value);
+    template<typename T, std::size_t R> static inline ndarray<T, int(R)> arange(std::array<int, R> shape);
+
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> empty(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> zeros(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> ones(Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> full(T value, Dims... dims);
+    template<typename T, typename... Dims> static inline ndarray<T, sizeof...(Dims)> arange(Dims... dims);
     template<typename T> ndarray<T, 1> static inline linspace(T start, T end, int size);
-    template<typename T> ndarray<T, 1> static inline ones(int size);
-    template<typename T> ndarray<T, 1> static inline zeros(int size);
+
+    template<typename T, int R, typename Iterator>
+    static inline ndarray<T, R> concatenate(Iterator first, Iterator last, int axis=0);
+
+    template<typename T, int R>
+    static inline ndarray<T, R> concatenate(const std::vector<ndarray<T, R>>& arrays, int axis=0);
+
+    template<typename T, int R>
+    static inline ndarray<T, R> concatenate(std::initializer_list<ndarray<T, R>> arrays, int axis=0);
+
+    template<typename T, int R, typename Iterator>
+    static inline ndarray<T, R + 1> stack(Iterator first, Iterator last, int axis=0);
 
     template<typename T, int R>
-    static inline nd::ndarray<T, R + 1> stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays);
+    static inline ndarray<T, R + 1> stack(const std::vector<ndarray<T, R>>& arrays, int axis=0);
+
+    template<typename T, int R>
+    static inline ndarray<T, R + 1> stack(std::initializer_list<ndarray<T, R>> arrays, int axis=0);
+
+    template<typename T, int R, int Q, typename Iterator>
+    static inline void assemble(ndarray<T, Q>& target, Iterator first, Iterator last, int axis);
+
+    template<typename... Arrays>
+    static inline auto make_nditer(Arrays&&... arrays);
+
+    template<typename Function, typename... Arrays>
+    static inline void for_each_run(Function f, Arrays&&... arrays);
 
 /**
  * Unless you define the following macro, an alias nd::array will be created
@@ -39,63 +78,348 @@ namespace nd // ND_API_START
 
 
 // ============================================================================
-template<typename T> nd::ndarray<T, 1> nd::arange(int size) // ND_IMPL_START
+/**
+ * Returns a new row-major array of the given shape whose element at flat
+ * index i (in row-major order) is f(i), writing each element once: the
+ * memory is not initialized beforehand. Large arrays are filled by
+ * parallel::for_each_chunk over the flat index, and chunk k always runs on
+ * the same pinned pool worker. Parallel kernels over a contiguous array of
+ * the same size split it into (up to rounding at row boundaries) the same
+ * chunks, so while num_threads() is unchanged each page is first touched,
+ * and on NUMA machines placed, near the worker that later processes it.
+ */
+template<typename T, std::size_t R, typename Function> // ND_IMPL_START
+nd::ndarray<T, int(R)> nd::generate(std::array<int, R> shape, Function f)
+{
+    static_assert(R >= 1, "generate: rank must be at least 1");
+
+    auto size = std::accumulate(shape.begin(), shape.end(), 1L, std::multiplies<long>());
+    auto buf = buffer<T>::make(std::size_t(size), uninitialized);
+    auto data = buf->data();
+
+    auto fill = [&] (int lower, int upper)
+    {
+        for (int i = lower; i < upper; ++i)
+        {
+            data[i] = f(i);
+        }
+    };
+
+    if (size >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(int(size), fill);
+    }
+    else
+    {
+        fill(0, int(size));
+    }
+    return ndarray<T, int(R)>(shape, buf);
+}
+
+/**
+ * Returns a new array whose memory is allocated but not initialized.
+ */
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::empty(std::array<int, R> shape)
+{
+    static_assert(R >= 1, "empty: rank must be at least 1");
+
+    auto size = std::accumulate(shape.begin(), shape.end(), 1L, std::multiplies<long>());
+    auto buf = buffer<T>::make(std::size_t(size), uninitialized);
+    return ndarray<T, int(R)>(shape, buf);
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::zeros(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int) { return T(0); });
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::ones(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int) { return T(1); });
+}
+
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::full(std::array<int, R> shape, T value)
+{
+    return generate<T>(shape, [value] (int) { return value; });
+}
+
+/**
+ * Returns a new array holding 0, 1, 2, ... in row-major order.
+ */
+template<typename T, std::size_t R>
+nd::ndarray<T, int(R)> nd::arange(std::array<int, R> shape)
+{
+    return generate<T>(shape, [] (int i) { return T(i); });
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::empty(Dims... dims)
+{
+    return empty<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::zeros(Dims... dims)
+{
+    return zeros<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::ones(Dims... dims)
+{
+    return ones<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
+}
+
+/**
+ * Returns a new array of the given extents with every element set to value,
+ * e.g. nd::full(0.5, 100, 200).
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::full(T value, Dims... dims)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    auto x = T();
-    for (auto& a : A) a = x++;
-    return A;
+    return full(std::array<int, sizeof...(Dims)>{{int(dims)...}}, value);
+}
+
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::arange(Dims... dims)
+{
+    return arange<T>(std::array<int, sizeof...(Dims)>{{int(dims)...}});
 }
 
 template<typename T> nd::ndarray<T, 1> nd::linspace(T start, T end, int size)
 {
-    auto A = nd::ndarray<T, 1>(size);
     auto h = (end - start) / (size - 1);
-    auto x = start - h;
-    for (auto& a : A) a = (x += h);
-    return A;
+    return generate<T>(std::array<int, 1>{{size}}, [start, h] (int i) { return start + h * i; });
+}
+
+/**
+ * Visits one or more arrays of the same shape in lockstep, as a sequence of
+ * one-dimensional runs, by calling f(count, a, b, ...) where a, b, ... are
+ * strided::run's (base pointer and stride) and count is the run length:
+ *
+ * nd::for_each_run([] (int n, auto a, auto b)
+ * {
+ *     for (int i = 0; i < n; ++i) a[i] = 2 * b[i];
+ * }, A, B.select(...));
+ *
+ * The library handles the outer loops; the inner loop is left to the caller,
+ * so it can be written for the compiler to vectorize. Runs come in the
+ * memory order of the first array, with the axes reduced as in
+ * strided::for_each, so a contiguous array of any rank is one run. Runs of
+ * const arrays point to const data. Throws std::invalid_argument if the
+ * shapes differ.
+ */
+template<typename Function, typename... Arrays>
+void nd::for_each_run(Function f, Arrays&&... arrays)
+{
+    make_nditer(std::forward<Arrays>(arrays)...).for_each_run(f);
+}
+
+
+
+
+/**
+ * Returns a strided::nditer over one or more arrays of the same shape, e.g.
+ *
+ * for (auto it = nd::make_nditer(C, A, B); ! it.done(); it.next())
+ * {
+ *     it.get<0>() = it.get<1>() * it.get<2>();
+ * }
+ *
+ * The iterator refers to the arrays' memory without owning it. Throws
+ * std::invalid_argument if the shapes differ.
+ */
+template<typename... Arrays>
+auto nd::make_nditer(Arrays&&... arrays)
+{
+    const auto& first = std::get<0>(std::forward_as_tuple(arrays...));
+    const auto shape = first.shape();
+    const bool matches[] = {arrays.shape() == shape...};
+
+    for (bool match : matches)
+    {
+        if (! match)
+            throw std::invalid_argument("nditer: arrays must all have the same shape");
+    }
+
+    using iterator = strided::nditer<std::decay_t<decltype(first)>::rank, std::remove_pointer_t<decltype(arrays.data())>...>;
+    return iterator(shape, strided::make_operand(arrays.data() + arrays.data_offset(), arrays.get_strides())...);
+}
+
+/**
+ * Returns a new array holding the arrays in [first, last) one after another
+ * along an existing axis, like numpy.concatenate. The range is traversed
+ * more than once, so it must be given by forward iterators (e.g. of a
+ * std::list). The arrays must have the same shape on every other axis, and
+ * there must be at least one; otherwise std::invalid_argument is thrown.
+ */
+template<typename T, int R, typename Iterator>
+nd::ndarray<T, R> nd::concatenate(Iterator first, Iterator last, int axis)
+{
+    static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value,
+        "concatenate: arrays must be given by forward iterators");
+
+    if (first == last)
+        throw std::invalid_argument("concatenate: need at least one array");
+
+    if (axis < 0 || axis >= R)
+        throw std::invalid_argument("concatenate: axis out of range");
+
+    auto shape = first->shape();
+    shape[axis] = 0;
+
+    for (auto it = first; it != last; ++it)
+    {
+        for (int n = 0; n < R; ++n)
+        {
+            if (n != axis && it->shape(n) != shape[n])
+            {
+                throw std::invalid_argument("concatenate: array of shape "
+                    + shape::to_string(it->shape())
+                    + " does not match "
+                    + shape::to_string(first->shape())
+                    + " off axis "
+                    + std::to_string(axis));
+            }
+        }
+        shape[axis] += it->shape(axis);
+    }
+    auto target = empty<T>(shape);
+    assemble<T, R>(target, first, last, axis);
+    return target;
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::concatenate(const std::vector<ndarray<T, R>>& arrays, int axis)
+{
+    return concatenate<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::concatenate(std::initializer_list<ndarray<T, R>> arrays, int axis)
+{
+    return concatenate<T, R>(arrays.begin(), arrays.end(), axis);
+}
+
+/**
+ * Returns a new array holding the arrays in [first, last), which must all
+ * have the same shape, as slices along a new axis at the given position,
+ * like numpy.stack. As for concatenate, the iterators must be forward
+ * iterators. Throws std::invalid_argument if there are no arrays or their
+ * shapes differ.
+ */
+template<typename T, int R, typename Iterator>
+nd::ndarray<T, R + 1> nd::stack(Iterator first, Iterator last, int axis)
+{
+    static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value,
+        "stack: arrays must be given by forward iterators");
+
+    if (first == last)
+        throw std::invalid_argument("stack: need at least one array");
+
+    if (axis < 0 || axis > R)
+        throw std::invalid_argument("stack: axis out of range");
+
+    auto slice = first->shape();
+    auto shape = std::array<int, R + 1>();
+
+    for (auto it = first; it != last; ++it)
+    {
+        if (it->shape() != slice)
+        {
+            throw std::invalid_argument("stack: array of shape "
+                + shape::to_string(it->shape())
+                + " does not match "
+                + shape::to_string(slice));
+        }
+    }
+    for (int n = 0; n < R + 1; ++n)
+    {
+        shape[n] = n < axis ? slice[n] : n > axis ? slice[n - 1] : int(std::distance(first, last));
+    }
+    auto target = empty<T>(shape);
+    assemble<T, R>(target, first, last, axis);
+    return target;
 }
 
-template<typename T> nd::ndarray<T, 1> nd::ones(int size)
+template<typename T, int R>
+nd::ndarray<T, R + 1> nd::stack(const std::vector<ndarray<T, R>>& arrays, int axis)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 1;
-    return A;
+    return stack<T, R>(arrays.begin(), arrays.end(), axis);
 }
 
-template<typename T> nd::ndarray<T, 1> nd::zeros(int size)
+template<typename T, int R>
+nd::ndarray<T, R + 1> nd::stack(std::initializer_list<ndarray<T, R>> arrays, int axis)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 0;
-    return A;
+    return stack<T, R>(arrays.begin(), arrays.end(), axis);
 }
 
-template<typename T, int R> /* UNTESTED */
-nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays)
+/**
+ * Copies the arrays in [first, last) into consecutive slabs of target
+ * along the given axis. If the arrays have the target's rank (Q == R),
+ * each fills as many indexes of the axis as its own extent there;
+ * otherwise (Q == R + 1) each fills one index, as a slice. The shapes are
+ * assumed to have been checked. The range is walked once, with any
+ * forward iterator, to collect the arrays. Each copy is a strided::copy,
+ * which moves contiguous runs in bulk. With at least as many arrays as
+ * threads, and enough elements in total, whole arrays are copied in
+ * parallel; otherwise they are copied in turn, and each large copy is
+ * parallel.
+ */
+template<typename T, int R, int Q, typename Iterator>
+void nd::assemble(ndarray<T, Q>& target, Iterator first, Iterator last, int axis)
 {
-    if (arrays.size() == 0)
+    static_assert(Q == R || Q == R + 1, "assemble: target must have the rank of the arrays, or one more");
+
+    auto arrays = std::vector<const ndarray<T, R>*>();
+
+    for (auto it = first; it != last; ++it)
     {
-        return nd::ndarray<T, R>();            
+        arrays.push_back(&static_cast<const ndarray<T, R>&>(*it));
     }
 
-    auto required_shape = arrays.begin()->shape();
+    int count = int(arrays.size());
+    auto offsets = std::vector<int>(count + 1, 0);
+    auto ts = target.get_strides();
+    auto base = target.data() + target.data_offset();
+    long total = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+        offsets[k + 1] = offsets[k] + (Q == R ? arrays[k]->shape(axis) : 1);
+        total += long(arrays[k]->size());
+    }
 
-    std::array<int, R> dim_sizes;
-    dim_sizes[0] = arrays.size();
+    auto strides = std::array<int, R>();
 
-    for (int n = 1; n < R; ++n)
+    for (int n = 0; n < R; ++n)
     {
-        dim_sizes[n] = required_shape[n - 1];
+        strides[n] = Q == R ? ts[n] : ts[n < axis ? n : n + 1];
     }
-    auto A = nd::ndarray<T, R>(dim_sizes);
-    auto n = 0;
 
-    for (const auto& array : arrays)
+    auto range = [&] (int lower, int upper)
+    {
+        for (int k = lower; k < upper; ++k)
+        {
+            const auto& A = *arrays[k];
+            auto to = strided::make_operand(base + long(offsets[k]) * ts[axis], strides);
+            auto from = strided::make_operand(A.data() + A.data_offset(), A.get_strides());
+            strided::copy(A.shape(), to, from);
+        }
+    };
+
+    if (total >= ND_PARALLEL_THRESHOLD && count >= parallel::num_threads())
+    {
+        parallel::for_each_chunk(count, range);
+    }
+    else
     {
-        A[n] = array;
-        ++n;
+        range(0, count);
     }
-    return A;
 }
 
 
@@ -108,12 +432,9 @@ struct nd::unary_op
     static auto perform(const ndarray<T, R>& A)
     {
         auto op = Op();
-        auto B = ndarray<decltype(op(T())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
+        auto B = A.template allocate_like<decltype(op(T()))>();
 
-        for (; a != A.end(); ++a, ++b)
-            *b = op(*a);
+        strided::for_each(A.shape(), [op] (auto& b, const T& a) { b = op(a); }, B.operand(), A.operand());
 
         return B;
     }
@@ -132,13 +453,9 @@ struct nd::binary_op
             throw std::invalid_argument("incompatible shapes for binary operation");
 
         auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
-        auto c = C.begin();
+        auto C = A.template allocate_like<decltype(op(T(), U()))>();
 
-        for (; a != A.end(); ++a, ++b, ++c)
-            *c = op(*a, *b);
+        strided::for_each(A.shape(), [op] (auto& c, const T& a, const U& b) { c = op(a, b); }, C.operand(), A.operand(), B.operand());
 
         return C;
     }
@@ -146,12 +463,9 @@ struct nd::binary_op
     static auto perform(const ndarray<T, R>& A, U b)
     {
         auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto c = C.begin();
+        auto C = A.template allocate_like<decltype(op(T(), U()))>();
 
-        for (; a != A.end(); ++a, ++c)
-            *c = op(*a, b);
+        strided::for_each(A.shape(), [op, b] (auto& c, const T& a) { c = op(a, b); }, C.operand(), A.operand());
 
         return C;
     }
@@ -162,11 +476,8 @@ struct nd::binary_op
             throw std::invalid_argument("incompatible shapes for binary operation");
 
         auto op = Op();
-        auto a = A.begin();
-        auto b = B.begin();
 
-        for (; a != A.end(); ++a, ++b)
-            *a = op(*a, *b);
+        strided::update(A.shape(), [op] (T& a, const U& b) { a = op(a, b); }, A.operand(), B.operand());
     }
 };
 
@@ -221,6 +532,7 @@ public:
         enum { rank = R };
 
         const_ref(selector<R> sel, std::shared_ptr<buffer<T>> buf) : A(sel, buf) {}
+        const_ref(ndarray<T, R> other) : A(other) {}
         template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
         template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
         template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
@@ -228,6 +540,12 @@ public:
         template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
         template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
         template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
+        template<typename... Args> auto region(const Args&... args) const { return A.region(args...); }
+        template<int Axis> auto reverse() const { return A.reverse<Axis>(); }
+        auto transpose() const { return A.transpose(); }
+        const T* data() const { return A.data(); }
+        int data_offset() const { return A.data_offset(); }
+        std::array<int, R> get_strides() const { return A.get_strides(); }
 
         operator const ndarray<T, R>&() const { return A; }
         bool is_const_ref() const { return true; }
@@ -248,35 +566,80 @@ public:
      * 
      */
     // ========================================================================
+    /**
+     * Rank-0 arrays constructed from a value keep it inline, without a memory
+     * buffer, so they never touch the heap. Copies of such an array hold
+     * their own value, rather than sharing it.
+     */
     template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
     ndarray(T value=T())
-    : scalar_offset(0)
-    , buf(std::make_shared<buffer<T>>(1, value))
+    : offset(0)
     {
+        scalar_value[0] = value;
     }
 
     template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(int scalar_offset, std::shared_ptr<buffer<T>>& buf)
-    : scalar_offset(scalar_offset)
+    ndarray(int offset, std::shared_ptr<buffer<T>>& buf)
+    : offset(offset)
     , buf(buf)
     {
     }
 
     template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
     ndarray(std::initializer_list<T> elements)
-    : sel({elements.size()})
+    : sel(std::array<int, 1>{int(elements.size())})
     , strides(sel.strides())
     , buf(std::make_shared<buffer<T>>(elements.begin(), elements.end()))
     {
     }
 
-    template<typename... Dims>
+    template<typename... Dims, typename = typename std::enable_if<std::is_same<
+        std::integer_sequence<bool, true, std::is_convertible<Dims, int>::value...>,
+        std::integer_sequence<bool, std::is_convertible<Dims, int>::value..., true>>::value>::type>
     ndarray(Dims... dims) : ndarray(std::array<int, R>({int(dims)...}))
     {
         static_assert(sizeof...(dims) == rank,
           "Number of arguments to ndarray constructor must match rank");
     }
 
+    /**
+     * Wraps memory owned by someone else (an MPI receive buffer, a shared
+     * memory segment, etc.) without copying it. Element (i, j, ...) is at
+     * data[i * strides[0] + j * strides[1] + ...], where the strides default
+     * to row-major. The deleter is invoked on data once the last array
+     * referring to the memory is gone. If the deleter is empty (the default)
+     * the memory is only borrowed, and must outlive every array using it.
+     */
+    ndarray(T* data, std::array<int, R> dim_sizes, std::function<void(T*)> deleter = nullptr)
+    : ndarray(data, dim_sizes, selector<R>(dim_sizes).strides(), deleter)
+    {
+    }
+
+    ndarray(
+        T* data,
+        std::array<int, R> dim_sizes,
+        std::array<int, R> strides,
+        std::function<void(T*)> deleter = nullptr)
+    : sel(dim_sizes)
+    , strides(strides)
+    {
+        auto lower = 0;
+        auto upper = 0;
+
+        for (int n = 0; n < R; ++n)
+        {
+            auto extent = (dim_sizes[n] - 1) * strides[n];
+            assert_valid_argument(dim_sizes[n] >= 0, "ndarray dim sizes must be non-negative");
+            lower += std::min(extent, 0);
+            upper += std::max(extent, 0);
+        }
+        auto count = size() == 0 ? 0 : upper - lower + 1;
+        auto release = deleter ? [deleter, data] (T*) { deleter(data); } : std::function<void(T*)>();
+
+        offset = -lower;
+        buf = std::make_shared<buffer<T>>(data + lower, count, release);
+    }
+
     template<typename SelectorType>
     ndarray(SelectorType sel, std::shared_ptr<buffer<T>>& buf)
     : sel(sel)
@@ -292,7 +655,7 @@ public:
     ndarray(std::array<int, R> dim_sizes)
     : sel(dim_sizes)
     , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(sel.size()))
+    , buf(R == 0 ? nullptr : buffer<T>::make(sel.size()))
     {
     }
 
@@ -305,16 +668,61 @@ public:
             "Size of data buffer is not the product of dim sizes");
     }
 
+    /**
+     * Creates a new array whose memory is laid out in the given order, e.g.
+     * ndarray<double, 2>({3, 4}, nd::layout::column_major). The layout does
+     * not affect indexing or iteration order; it only determines the memory
+     * strides.
+     */
+    ndarray(std::array<int, R> dim_sizes, layout order)
+    : sel(dim_sizes)
+    , strides(sel.strides(order))
+    , buf(R == 0 ? nullptr : buffer<T>::make(sel.size()))
+    {
+    }
+
+    /**
+     * Creates a view of an existing buffer with arbitrary memory strides,
+     * which may be negative. Element (i, j, ...) is found at offset + i *
+     * strides[0] + j * strides[1] + ... in the buffer. Throws if any element
+     * would fall outside the buffer.
+     */
+    ndarray(
+        std::array<int, R> dim_sizes,
+        std::array<int, R> strides,
+        int offset,
+        std::shared_ptr<buffer<T>>& buf)
+    : offset(offset)
+    , sel(dim_sizes)
+    , strides(strides)
+    , buf(buf)
+    {
+        auto lower = offset;
+        auto upper = offset;
+
+        for (int n = 0; n < R; ++n)
+        {
+            auto extent = (dim_sizes[n] - 1) * strides[n];
+            assert_valid_argument(dim_sizes[n] >= 0, "ndarray dim sizes must be non-negative");
+            lower += std::min(extent, 0);
+            upper += std::max(extent, 0);
+        }
+        assert_valid_argument(size() == 0 || (lower >= 0 && upper < int(buf->size())),
+            "Strides and offset address memory outside the data buffer");
+    }
+
     ndarray(const ndarray<T, R>& other)
     : sel(other.sel.shape())
     , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(size()))
+    , buf(R == 0 ? nullptr : buffer<T>::make(size()))
     {
         copy_internal(*this, other);
     }
 
     ndarray(ndarray<T, R>& other)
     {
+        offset = other.offset;
+        scalar_value = other.scalar_value;
         strides = other.strides;
         sel = other.sel;
         buf = other.buf;
@@ -331,16 +739,14 @@ public:
     template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
     ndarray<T, R>& operator=(T value)
     {
-        buf->operator[](scalar_offset) = value;
+        memory()[offset] = value;
         return *this;
     }
 
     template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
     ndarray<T, R>& operator=(T value)
     {
-        for (auto& a : *this)
-            a = value;
-
+        strided::for_each(shape(), [value] (T& a) { a = value; }, operand());
         return *this;
     }
 
@@ -352,6 +758,8 @@ public:
 
     void become(ndarray<T, R> other)
     {
+        offset = other.offset;
+        scalar_value = other.scalar_value;
         strides = other.strides;
         sel = other.sel;
         buf = other.buf;
@@ -360,25 +768,73 @@ public:
     template<typename... Sizes>
     auto reshape(Sizes... sizes)
     {
-        if (! contiguous())
-        {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
-        }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, buf);
+        return reshape(std::array<int, sizeof...(Sizes)>{int(sizes)...});
     }
 
     template<typename... Sizes>
     const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
     {
-        if (! contiguous())
+        return reshape(std::array<int, sizeof...(Sizes)>{int(sizes)...});
+    }
+
+    /**
+     * Returns an array with the same elements in row-major order, but the
+     * given shape. The result is a view sharing this array's memory whenever
+     * the strides allow one (see strided::reshape_strides), including for
+     * many non-contiguous views; otherwise the elements are copied. If
+     * copied is given, it is set to whether a copy was made, e.g.
+     * A.reshape({3, 4}, &copied). Throws
+     * std::invalid_argument if the new shape has a different size.
+     */
+    template<std::size_t Q>
+    ndarray<T, int(Q)> reshape(std::array<int, Q> new_shape, bool* copied=nullptr)
+    {
+        auto new_strides = std::array<int, Q>();
+        auto new_size = std::accumulate(new_shape.begin(), new_shape.end(), 1, std::multiplies<int>());
+
+        if (new_size != int(size()))
+        {
+            throw std::invalid_argument("incompatible reshape from "
+                + shape::to_string(shape())
+                + " to "
+                + shape::to_string(new_shape));
+        }
+
+        auto view = buf && strided::reshape_strides(shape(), get_strides(), new_shape, new_strides);
+
+        if (copied)
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
+            *copied = ! view;
         }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<std::shared_ptr<buffer<T>>&>(buf));
+
+        if (! view)
+        {
+            // A copy goes to a fresh buffer, since a rank-0 array may keep
+            // its value inline rather than in buf.
+            auto fresh = buffer<T>::make(size(), uninitialized);
+            auto to = strided::make_operand(fresh->data(), selector<R>(shape()).strides());
+            strided::copy(shape(), to, operand());
+            return {fresh, selector<Q>(new_shape), selector<Q>(new_shape).strides(), 0};
+        }
+        return {buf, selector<Q>(new_shape), new_strides, data_offset()};
+    }
+
+    template<std::size_t Q>
+    const ndarray<T, int(Q)> reshape(std::array<int, Q> new_shape, bool* copied=nullptr) const
+    {
+        return const_cast<ndarray<T, R>&>(*this).reshape(new_shape, copied);
+    }
+
+    template<std::size_t Q>
+    ndarray<T, int(Q)> reshape(const int (&new_shape)[Q], bool* copied=nullptr)
+    {
+        return reshape(to_array(new_shape, std::make_index_sequence<Q>()), copied);
+    }
+
+    template<std::size_t Q>
+    const ndarray<T, int(Q)> reshape(const int (&new_shape)[Q], bool* copied=nullptr) const
+    {
+        return reshape(to_array(new_shape, std::make_index_sequence<Q>()), copied);
     }
 
 
@@ -393,7 +849,18 @@ public:
     bool empty() const { return sel.empty(); }
     auto shape() const { return sel.shape(); }
     auto shape(int axis) const { return sel.shape(axis); }
-    bool contiguous() const { return sel.contiguous(); }
+
+    /**
+     * Returns true if this array spans its whole memory buffer, in row-major
+     * order.
+     */
+    bool contiguous() const
+    {
+        return sel.contiguous()
+        && strides == sel.strides()
+        && offset == 0
+        && buf && buf->size() == size();
+    }
 
 
 
@@ -406,7 +873,7 @@ public:
     template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
     ndarray<T, R - 1> operator[](int index)
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+        if (index < 0 || index >= sel.shape(0))
             throw std::out_of_range("ndarray: index out of range");
 
         return {offset_relative({index}), buf};
@@ -415,7 +882,7 @@ public:
     template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
     const ndarray<T, R - 1> operator[](int index) const
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+        if (index < 0 || index >= sel.shape(0))
             throw std::out_of_range("ndarray: index out of range");
 
         return {offset_relative({index}), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
@@ -424,19 +891,19 @@ public:
     template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
     ndarray<T, R - 1> operator[](int index)
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+        if (index < 0 || index >= sel.shape(0))
             throw std::out_of_range("ndarray: index out of range");
 
-        return {sel.select(index), buf};
+        return select_axis<0>(index);
     }
 
     template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
     const ndarray<T, R - 1> operator[](int index) const
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+        if (index < 0 || index >= sel.shape(0))
             throw std::out_of_range("ndarray: index out of range");
 
-        return {sel.select(index), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        return select_axis<0>(index);
     }
 
     template<typename... Index>
@@ -463,8 +930,7 @@ public:
         if (! sel.contains(index...))
             throw std::out_of_range("ndarray: selection out of range");
 
-        auto S = sel.select(index...);
-        return ndarray<T, S.rank>(S.reset(), buf);
+        return select_axes<0>(index...);
     }
 
     template<typename... Index>
@@ -473,66 +939,113 @@ public:
         if (! sel.contains(index...))
             throw std::out_of_range("ndarray: selection out of range");
 
-        auto S = sel.select(index...);
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        auto A = select_axes<0>(index...);
+        return typename decltype(A)::const_ref(A);
     }
 
     template<int Axis, typename Slice>
     auto take(Slice slice)
     {
         auto taken_sel = sel.template on<Axis>().select(slice).reset();
-        return ndarray<T, R>(taken_sel, buf);
+        return ndarray<T, R>(buf, taken_sel, strides, offset);
     }
 
     template<int Axis, typename Slice>
     auto take(Slice slice) const
     {
         auto S = sel.template on<Axis>().select(slice).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        return const_ref(ndarray<T, R>(buf, S, strides, offset));
+    }
+
+    /**
+     * Returns a view of the block of this array with the given lower corner
+     * and shape. Throws std::out_of_range if the block does not fit.
+     */
+    auto region(std::array<int, R> lower, std::array<int, R> extent)
+    {
+        return ndarray<T, R>(buf, region_selector(lower, extent), strides, offset);
+    }
+
+    auto region(std::array<int, R> lower, std::array<int, R> extent) const
+    {
+        return const_ref(ndarray<T, R>(buf, region_selector(lower, extent), strides, offset));
     }
 
     template<int Axis>
     auto shift(int distance)
     {
         auto shifted_sel = sel.template on<Axis>().shift(distance).reset();
-        return ndarray<T, R>(shifted_sel, buf);
+        return ndarray<T, R>(buf, shifted_sel, strides, offset);
     }
 
     template<int Axis>
     auto shift(int distance) const
     {
         auto S = sel.template on<Axis>().shift(distance).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        return const_ref(ndarray<T, R>(buf, S, strides, offset));
+    }
+
+    /**
+     * Returns a view of this array with the given axis reversed, by means of
+     * a negative memory stride.
+     */
+    template<int Axis>
+    auto reverse()
+    {
+        return reversed<Axis>();
+    }
+
+    template<int Axis>
+    auto reverse() const
+    {
+        return const_ref(reversed<Axis>());
+    }
+
+    /**
+     * Returns a view of this array with the order of its axes reversed. The
+     * transpose of a row-major array is a column-major view of the same
+     * memory.
+     */
+    auto transpose()
+    {
+        return transposed();
+    }
+
+    auto transpose() const
+    {
+        return const_ref(transposed());
     }
 
     template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
     operator T() const
     {
         // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
-        return buf->operator[](scalar_offset);
+        return memory()[offset];
     }
 
     ndarray<T, R> copy() const
     {
-        auto d = std::make_shared<buffer<T>>(begin(), end());
-        return {shape(), d};
+        auto A = ndarray<T, R>(shape());
+        strided::copy(shape(), A.operand(), operand());
+        return A;
     }
 
     template<typename new_type>
     ndarray<new_type, R> astype() const
     {
-        auto d = std::make_shared<buffer<new_type>>(begin(), end());
-        return {shape(), d};
+        auto A = ndarray<new_type, R>(shape());
+        strided::copy(shape(), A.operand(), operand());
+        return A;
     }
 
     const T* data() const
     {
-        return buf->data();
+        return memory();
     }
 
     T* data()
     {
-        return buf->data();
+        return memory();
     }
 
     selector<R> get_selector() const
@@ -540,6 +1053,43 @@ public:
         return sel;
     }
 
+    /**
+     * Returns the distance in memory, in units of elements, between
+     * neighboring elements along each axis of this view.
+     */
+    std::array<int, R> get_strides() const
+    {
+        std::array<int, R> s;
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = sel.skips[n] * strides[n];
+        }
+        return s;
+    }
+
+    /**
+     * Returns the distance in memory between neighbors along the given axis.
+     */
+    int memory_stride(int axis) const
+    {
+        return sel.skips[axis] * strides[axis];
+    }
+
+    /**
+     * Returns the offset of this view's first element from data().
+     */
+    int data_offset() const
+    {
+        int m = offset;
+
+        for (int n = 0; n < R; ++n)
+        {
+            m += sel.start[n] * strides[n];
+        }
+        return m;
+    }
+
     bool is_const_ref() const
     {
         return false;
@@ -574,19 +1124,19 @@ public:
      * 
      */
     // ========================================================================
-    template<typename U> auto& operator+=(U b) { for (auto& a : *this) { a += b; } return *this; }
-    template<typename U> auto& operator-=(U b) { for (auto& a : *this) { a -= b; } return *this; }
-    template<typename U> auto& operator*=(U b) { for (auto& a : *this) { a *= b; } return *this; }
-    template<typename U> auto& operator/=(U b) { for (auto& a : *this) { a /= b; } return *this; }
+    template<typename U> auto& operator+=(U b) { strided::for_each(shape(), [b] (T& a) { a += b; }, operand()); return *this; }
+    template<typename U> auto& operator-=(U b) { strided::for_each(shape(), [b] (T& a) { a -= b; }, operand()); return *this; }
+    template<typename U> auto& operator*=(U b) { strided::for_each(shape(), [b] (T& a) { a *= b; }, operand()); return *this; }
+    template<typename U> auto& operator/=(U b) { strided::for_each(shape(), [b] (T& a) { a /= b; }, operand()); return *this; }
     template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
 
-    template<typename U> auto operator+(U b) const { auto A = copy(); for (auto& a : A) { a += b; } return A; }
-    template<typename U> auto operator-(U b) const { auto A = copy(); for (auto& a : A) { a -= b; } return A; }
-    template<typename U> auto operator*(U b) const { auto A = copy(); for (auto& a : A) { a *= b; } return A; }
-    template<typename U> auto operator/(U b) const { auto A = copy(); for (auto& a : A) { a /= b; } return A; }
+    template<typename U> auto operator+(U b) const { auto A = copy_like(); A += b; return A; }
+    template<typename U> auto operator-(U b) const { auto A = copy_like(); A -= b; return A; }
+    template<typename U> auto operator*(U b) const { auto A = copy_like(); A *= b; return A; }
+    template<typename U> auto operator/(U b) const { auto A = copy_like(); A /= b; return A; }
     template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
     template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
     template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
@@ -620,101 +1170,155 @@ public:
 
     bool is(const ndarray<T, R>& other) const
     {
-        return (scalar_offset == other.scalar_offset
+        return (offset == other.offset
         && strides == other.strides
         && sel == other.sel
-        && buf == other.buf);
+        && buf == other.buf
+        && (buf || this == &other));
     }
 
     template<int other_rank>
     bool shares(const ndarray<T, other_rank>& other) const
     {
-        return buf == other.buf;
+        return buf && buf == other.buf;
     }
 
 
 
 
     // ========================================================================
-    class iterator
+    /**
+     * Iterators visit the elements in logical (row-major) order, whatever
+     * the memory layout. Their state is a pointer to the current element, a
+     * linear count of elements visited, the count left in the current row,
+     * and copies of the first element's address and of the extents and
+     * memory strides, so they stay valid while the memory is, even after
+     * the view they came from is gone (e.g. auto it = A[0].begin()). Steps
+     * and jumps within a row only move the pointer; the other extents are
+     * read only when a row ends. Comparisons (including against end()) look
+     * only at the linear count. They are random-access, so that e.g.
+     * std::sort and std::nth_element work on strided views in place; jumps
+     * of more than one element unflatten the new count through the shape.
+     */
+    template<typename V>
+    class basic_iterator
     {
     public:
         using difference_type = std::ptrdiff_t;
         using value_type = T;
-        using pointer = T*;
-        using reference = T&;
-        using iterator_category = std::forward_iterator_tag;
-
-        iterator() {}
-        iterator(ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+        using pointer = V*;
+        using reference = V&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        basic_iterator() {}
+        basic_iterator(const ndarray* array, int position)
+        : base(const_cast<V*>(array->memory() + array->data_offset()))
+        {
+            for (int n = 0; n < R; ++n)
+            {
+                shape[n] = array->sel.shape(n);
+                strides[n] = array->memory_stride(n);
+            }
+            seek(position);
+        }
+
+        basic_iterator& operator++()
+        {
+            ++position;
+            current += strides[R - 1];
+
+            if (--left == 0)
+            {
+                seek(position);
+            }
+            return *this;
+        }
+
+        basic_iterator& operator--()
         {
+            if (left == shape[R - 1])
+            {
+                seek(position - 1);
+            }
+            else
+            {
+                --position;
+                ++left;
+                current -= strides[R - 1];
+            }
+            return *this;
         }
 
-        iterator& operator++() { it.operator++(); return *this; }
-        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(iterator other) const { return mem != other.mem || it != other.it; }
-        T& operator*() { return mem[offset_absolute(*it)]; }
+        basic_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        basic_iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        basic_iterator& operator+=(difference_type n) { return jump(int(n)); }
+        basic_iterator& operator-=(difference_type n) { return jump(int(-n)); }
+        basic_iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        basic_iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        friend basic_iterator operator+(difference_type n, basic_iterator a) { return a += n; }
+        difference_type operator-(const basic_iterator& other) const { return position - other.position; }
+        bool operator==(const basic_iterator& other) const { return position == other.position; }
+        bool operator!=(const basic_iterator& other) const { return position != other.position; }
+        bool operator< (const basic_iterator& other) const { return position <  other.position; }
+        bool operator> (const basic_iterator& other) const { return position >  other.position; }
+        bool operator<=(const basic_iterator& other) const { return position <= other.position; }
+        bool operator>=(const basic_iterator& other) const { return position >= other.position; }
+        V& operator[](difference_type n) const { return *(*this + n); }
+        V& operator*() const { return *current; }
 
     private:
-        int offset_absolute(std::array<int, R> index) const
+        basic_iterator& jump(int n)
         {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
+            if (n < left && n >= left - shape[R - 1])
+            {
+                position += n;
+                left -= n;
+                current += n * strides[R - 1];
+            }
+            else
+            {
+                seek(position + n);
+            }
+            return *this;
         }
-        T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
+
+        void seek(int new_position)
+        {
+            position = new_position;
+            current = base;
+            left = 0;
+
+            for (int n = R - 1; n >= 0; --n)
+            {
+                if (shape[n] == 0)
+                {
+                    return;
+                }
+                int i = new_position % shape[n];
+                new_position /= shape[n];
+                current += i * strides[n];
+
+                if (n == R - 1)
+                {
+                    left = shape[n] - i;
+                }
+            }
+        }
+        V* current = nullptr;
+        V* base = nullptr;
+        int position = 0;
+        int left = 0;
+        std::array<int, R> shape;
+        std::array<int, R> strides;
     };
 
-    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+    using iterator = basic_iterator<T>;
+    using const_iterator = basic_iterator<const T>;
 
-
-
-
-    // ========================================================================
-    class const_iterator
-    {
-    public:
-        using difference_type = std::ptrdiff_t;
-        using value_type = T;
-        using pointer = const T*;
-        using reference = const T&;
-        using iterator_category = std::forward_iterator_tag;
-
-        const_iterator() {}
-        const_iterator(const ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
-        {
-        }
-
-        const_iterator& operator++() { it.operator++(); return *this; }
-        const_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(const_iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(const_iterator other) const { return mem != other.mem || it != other.it; }
-        const T& operator*() { return mem[offset_absolute(*it)]; }
-
-    private:
-        int offset_absolute(std::array<int, R> index) const
-        {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
-        }
-        const T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
-    };
-
-    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {this, 0}; }
+    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {this, int(size())}; }
+    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {this, 0}; }
+    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {this, int(size())}; }
 
 
 
@@ -770,7 +1374,7 @@ public:
         assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
 
         auto size = std::accumulate(S.begin(), S.end(), 1, std::multiplies<int>());
-        auto wbuf = std::make_shared<buffer<T>>(size);
+        auto wbuf = buffer<T>::make(size);
         auto dest = wbuf->begin();
 
         while (it != str.end())
@@ -791,26 +1395,145 @@ private:
      * 
      */
     // ========================================================================
-    int offset_relative(std::array<int, R> index) const
+    const T* memory() const
     {
-        int m = scalar_offset;
+        return buf ? buf->data() : scalar_value.data();
+    }
 
-        for (int n = 0; n < rank; ++n)
+    T* memory()
+    {
+        return buf ? buf->data() : scalar_value.data();
+    }
+
+    strided::operand<const T, R> operand() const
+    {
+        return {memory() + data_offset(), get_strides()};
+    }
+
+    strided::operand<T, R> operand()
+    {
+        return {memory() + data_offset(), get_strides()};
+    }
+
+    /**
+     * Returns a new array of the same shape, whose memory is laid out
+     * compactly in the memory order of this one. Element-wise operations
+     * then traverse both arrays sequentially.
+     */
+    template<typename U>
+    ndarray<U, R> allocate_like() const
+    {
+        auto shape = sel.shape();
+        auto order = strided::memory_order(shape, get_strides());
+        auto new_strides = std::array<int, R>();
+        int stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
         {
-            m += (sel.start[n] + sel.skips[n] * index[n]) * strides[n];
+            new_strides[order[n]] = stride;
+            stride *= shape[order[n]];
         }
-        return m;
+        return {buffer<U>::make(size()), selector<R>(shape), new_strides, 0};
     }
 
-    int offset_absolute(std::array<int, R> index) const
+    ndarray<T, R> copy_like() const
+    {
+        auto A = allocate_like<T>();
+        copy_internal(A, *this);
+        return A;
+    }
+
+    ndarray(std::shared_ptr<buffer<T>> buf, selector<R> sel, std::array<int, R> strides, int offset)
+    : offset(offset)
+    , sel(sel)
+    , strides(strides)
+    , buf(buf)
     {
-        int m = scalar_offset;
+    }
+
+    selector<R> region_selector(std::array<int, R> lower, std::array<int, R> extent) const
+    {
+        auto start = sel.start;
+        auto final = sel.final;
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (lower[n] < 0 || extent[n] < 0 || lower[n] + extent[n] > sel.shape(n))
+            {
+                throw std::out_of_range("ndarray: region out of range");
+            }
+            start[n] += lower[n] * sel.skips[n];
+            final[n] = start[n] + std::max(extent[n] - 1, 0) * sel.skips[n] + (extent[n] > 0);
+        }
+        return {sel.count, start, final, sel.skips};
+    }
+
+    template<int Axis, typename Slice>
+    ndarray<T, R> select_axis(Slice slice) const
+    {
+        return {buf, sel.template on<Axis>().select(slice).reset(), strides, offset};
+    }
+
+    template<int Axis>
+    ndarray<T, R - 1> select_axis(int index) const
+    {
+        auto new_strides = std::array<int, R - 1>();
+
+        for (int n = 0; n < R - 1; ++n)
+        {
+            new_strides[n] = strides[n < Axis ? n : n + 1];
+        }
+        auto new_offset = offset + (sel.start[Axis] + sel.skips[Axis] * index) * strides[Axis];
+        return {buf, sel.template on<Axis>().erase(), new_strides, new_offset};
+    }
 
+    template<int Axis>
+    ndarray<T, R> select_axes() const
+    {
+        return {buf, sel, strides, offset};
+    }
+
+    template<int Axis, typename First, typename... Rest>
+    auto select_axes(First first, Rest... rest) const
+    {
+        auto A = select_axis<Axis>(first);
+        return A.template select_axes<Axis + (decltype(A)::rank == R)>(rest...);
+    }
+
+    template<int Axis>
+    ndarray<T, R> reversed() const
+    {
+        auto new_strides = strides;
+        auto new_offset = offset + (sel.count[Axis] - 1) * strides[Axis];
+        new_strides[Axis] = -strides[Axis];
+        return {buf, sel.template on<Axis>().reverse().reset(), new_strides, new_offset};
+    }
+
+    ndarray<T, R> transposed() const
+    {
+        auto new_strides = strides;
+        std::reverse(new_strides.begin(), new_strides.end());
+        return {buf, sel.transpose(), new_strides, offset};
+    }
+
+    int offset_relative(std::array<int, R> index) const
+    {
         for (int n = 0; n < rank; ++n)
         {
-            m += index[n] * strides[n];
+            index[n] = sel.start[n] + sel.skips[n] * index[n];
         }
-        return m;
+        return offset_absolute(index);
+    }
+
+    int offset_absolute(std::array<int, R> index) const
+    {
+        return offset + shape::dot(index, strides);
+    }
+
+    template<std::size_t Q, std::size_t... I>
+    static std::array<int, Q> to_array(const int (&values)[Q], std::index_sequence<I...>)
+    {
+        return {values[I]...};
     }
 
     template<int length>
@@ -849,6 +1572,13 @@ private:
         }
     }
 
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+    {
+        target.memory()[target.offset] = source.memory()[source.offset];
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
     static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
     {
         if (target.shape() != source.shape())
@@ -858,14 +1588,7 @@ private:
                 + " to "
                 + shape::to_string(target.shape()));
         }
-
-        auto a = target.begin();
-        auto b = source.begin();
-
-        for (; a != target.end(); ++a, ++b)
-        {
-            *a = *b;
-        }
+        strided::copy(target.shape(), target.operand(), source.operand());
     }
 
 
@@ -875,10 +1598,11 @@ private:
      *
      */
     // ========================================================================
-    int scalar_offset = 0;
+    int offset = 0;
     selector<R> sel;
     std::array<int, R> strides;
     std::shared_ptr<buffer<T>> buf;
+    std::array<T, R == 0 ? 1 : 0> scalar_value;
 
 
 
@@ -889,7 +1613,10 @@ private:
      */
     template<typename, int>
     friend class ndarray;
-    friend class iterator;
+    template<typename, typename, int, typename>
+    friend struct binary_op;
+    template<typename, int, typename>
+    friend struct unary_op;
 }; // ND_IMPL_END
 
 
@@ -897,6 +1624,7 @@ private:
 
 // ============================================================================
 #ifdef TEST_NDARRAY
+#include <list>
 #include "catch.hpp"
 using T = double;
 
@@ -921,6 +1649,40 @@ TEST_CASE("ndarray can be constructed", "[ndarray]")
 }
 
 
+TEST_CASE("rank-0 ndarray's hold their value inline", "[ndarray]")
+{
+    SECTION("scalars constructed from a value do not share a buffer")
+    {
+        auto A = ndarray<T, 0>(1.5);
+        auto B = A;
+        B = 2.5;
+        CHECK(double(A) == 1.5);
+        CHECK(double(B) == 2.5);
+        CHECK_FALSE(B.shares(A));
+        CHECK(A.is(A));
+        CHECK_FALSE(A.is(B));
+    }
+
+    SECTION("scalars selected from an array still refer to its buffer")
+    {
+        auto A = nd::arange<T>(4);
+        auto B = A[2];
+        auto C = B;
+        C = 10.0;
+        CHECK(B.shares(A));
+        CHECK(C.shares(A));
+        CHECK(A(2) == 10.0);
+    }
+
+    SECTION("const scalars can be copied into new scalars")
+    {
+        const auto A = ndarray<T, 0>(1.5);
+        auto B = A;
+        CHECK(double(B) == 1.5);
+    }
+}
+
+
 TEST_CASE("ndarray can be created from basic factories", "[ndarray] [factories]")
 {
     SECTION("arange works correctly")
@@ -949,6 +1711,166 @@ TEST_CASE("ndarray can be created from basic factories", "[ndarray] [factories]"
             REQUIRE(a == 1);
         }
     }
+
+    SECTION("factories create arrays of any rank")
+    {
+        auto A = nd::arange<int>(3, 4, 5);
+        auto B = nd::zeros<double>(std::array<int, 2>{4, 6});
+        auto C = nd::full(2.5f, 7, 2);
+        auto D = nd::empty<double>(8, 9);
+
+        CHECK(A.shape() == (std::array<int, 3>{3, 4, 5}));
+        CHECK(A(2, 3, 4) == 59);
+        CHECK((A.reshape(60) == nd::arange<int>(60)).all());
+        CHECK((B == 0.0).all());
+        CHECK((C == 2.5f).all());
+        CHECK(C.shape() == (std::array<int, 2>{7, 2}));
+        CHECK(D.shape() == (std::array<int, 2>{8, 9}));
+        CHECK(D.contiguous());
+        CHECK((nd::ones<int>(3, 3) == 1).all());
+        CHECK(nd::zeros<double>(0, 4).empty());
+    }
+
+    SECTION("linspace includes both ends")
+    {
+        auto A = nd::linspace(1.0, 2.0, 11);
+        CHECK(A(0) == 1.0);
+        CHECK(A(5) == Approx(1.5));
+        CHECK(A(10) == Approx(2.0));
+    }
+
+    SECTION("large arrays are filled the same by any number of threads")
+    {
+        auto threads = nd::parallel::set_num_threads(1);
+        auto A = nd::arange<long>(600, 1000);
+        nd::parallel::set_num_threads(4);
+        auto B = nd::arange<long>(600, 1000);
+        auto C = nd::full(3L, 600, 1000);
+        nd::parallel::set_num_threads(threads);
+
+        CHECK((A == B).all());
+        CHECK(B(599, 999) == 599999);
+        CHECK((C == 3L).all());
+    }
+
+    SECTION("large arrays are filled by the workers that later process them")
+    {
+        auto threads = nd::parallel::set_num_threads(4);
+        auto filled = std::vector<std::thread::id>(4);
+        auto worked = std::vector<std::thread::id>(4);
+        int size = 1 << 20;
+        auto A = nd::generate<int>(std::array<int, 1>{size}, [&] (int i)
+        {
+            filled[i / (size / 4)] = std::this_thread::get_id();
+            return i;
+        });
+        nd::parallel::for_each_chunk(size, [&] (int lower, int) { worked[lower / (size / 4)] = std::this_thread::get_id(); });
+        nd::parallel::set_num_threads(threads);
+
+        CHECK(filled == worked);
+        CHECK(A(size - 1) == size - 1);
+    }
+}
+
+
+TEST_CASE("ndarray can be concatenated and stacked", "[ndarray] [factories]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(2, 3);
+    auto B = nd::arange<int>(4, 3) + 100;
+    auto C = nd::arange<int>(2, 5) + 200;
+
+    SECTION("concatenate along the first axis")
+    {
+        auto D = nd::concatenate({A, B});
+        REQUIRE(D.shape() == (std::array<int, 2>{6, 3}));
+        CHECK((D.take<0>(_|0|2) == A).all());
+        CHECK((D.take<0>(_|2|6) == B).all());
+        CHECK_FALSE(D.shares(A));
+    }
+
+    SECTION("concatenate along the last axis, from strided views")
+    {
+        auto E = C.reverse<1>();
+        auto D = nd::concatenate({A, E, A.take<1>(_|0|3|2)}, 1);
+        REQUIRE(D.shape() == (std::array<int, 2>{2, 10}));
+        CHECK((D.take<1>(_|0|3) == A).all());
+        CHECK((D.take<1>(_|3|8) == E).all());
+        CHECK(D(1, 8) == A(1, 0));
+        CHECK(D(1, 9) == A(1, 2));
+    }
+
+    SECTION("stack along a new axis at any position")
+    {
+        auto arrays = std::vector<nd::ndarray<int, 2>>{A, A + 1, A + 2};
+        auto S0 = nd::stack(arrays);
+        auto S1 = nd::stack(arrays, 1);
+        auto S2 = nd::stack<int, 2>(arrays.begin(), arrays.end(), 2);
+
+        REQUIRE(S0.shape() == (std::array<int, 3>{3, 2, 3}));
+        REQUIRE(S1.shape() == (std::array<int, 3>{2, 3, 3}));
+        REQUIRE(S2.shape() == (std::array<int, 3>{2, 3, 3}));
+
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                for (int j = 0; j < 3; ++j)
+                {
+                    CHECK(S0(k, i, j) == A(i, j) + k);
+                    CHECK(S1(i, k, j) == A(i, j) + k);
+                    CHECK(S2(i, j, k) == A(i, j) + k);
+                }
+            }
+        }
+    }
+
+    SECTION("arrays may come from any forward iterator range")
+    {
+        auto arrays = std::list<nd::ndarray<int, 2>>{A, B};
+        auto D = nd::concatenate<int, 2>(arrays.begin(), arrays.end());
+        auto S = nd::stack<int, 2>(arrays.begin(), std::next(arrays.begin()), 1);
+
+        REQUIRE(D.shape() == (std::array<int, 2>{6, 3}));
+        REQUIRE(S.shape() == (std::array<int, 3>{2, 1, 3}));
+        CHECK((D.take<0>(_|2|6) == B).all());
+        CHECK((S.take<1>(_|0|1).reshape(2, 3) == A).all());
+    }
+
+    SECTION("many large arrays are copied in parallel")
+    {
+        auto threads = nd::parallel::set_num_threads(3);
+        auto parts = std::vector<nd::ndarray<double, 2>>();
+
+        for (int k = 0; k < 7; ++k)
+        {
+            auto P = nd::full(double(k), 100, 500);
+            parts.emplace_back(P);
+        }
+        auto D = nd::concatenate(parts);
+        auto S = nd::stack(parts, 1);
+        nd::parallel::set_num_threads(threads);
+
+        REQUIRE(D.shape() == (std::array<int, 2>{700, 500}));
+        REQUIRE(S.shape() == (std::array<int, 3>{100, 7, 500}));
+
+        for (int k = 0; k < 7; ++k)
+        {
+            CHECK((D.take<0>(_|100 * k|100 * k + 100) == double(k)).all());
+            CHECK((S.take<1>(_|k|k + 1) == double(k)).all());
+        }
+    }
+
+    SECTION("mismatched shapes and bad axes are rejected")
+    {
+        CHECK_THROWS_AS(nd::concatenate({A, C}), std::invalid_argument);
+        CHECK_THROWS_AS(nd::concatenate({A, B}, 1), std::invalid_argument);
+        CHECK_THROWS_AS(nd::concatenate({A}, 2), std::invalid_argument);
+        CHECK_THROWS_AS(nd::stack({A, B}), std::invalid_argument);
+        CHECK_THROWS_AS(nd::stack({A}, 3), std::invalid_argument);
+        CHECK_THROWS_AS(nd::stack(std::vector<nd::ndarray<int, 2>>()), std::invalid_argument);
+        CHECK(nd::stack({A}, 2).shape() == (std::array<int, 3>{2, 3, 1}));
+    }
 }
 
 
@@ -1053,6 +1975,64 @@ TEST_CASE("ndarray can return a reshaped version of itself", "[ndarray] [reshape
     REQUIRE(A.reshape(10, 10).shares(A));
     REQUIRE(B.reshape(10, 10).shares(B));
     REQUIRE_THROWS_AS(A.reshape(10, 11), std::invalid_argument);
+
+    SECTION("a rank-0 array, which keeps its value inline, reshapes by copying")
+    {
+        auto copied = false;
+        auto S = nd::ndarray<double, 0>(3.0);
+        auto C = S.reshape({1}, &copied);
+        REQUIRE(C.shape() == std::array<int, 1>{1});
+        CHECK(C(0) == 3.0);
+        CHECK(copied);
+        CHECK(nd::ndarray<double, 0>(3.0).reshape(1, 1)(0, 0) == 3.0);
+    }
+}
+
+
+TEST_CASE("ndarray reshapes strided views without copying when it can", "[ndarray] [reshape]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(4 * 6).reshape(4, 6);
+    auto copied = true;
+
+    SECTION("a slab of rows is reshaped as a view")
+    {
+        auto B = A.take<0>(_|1|3).reshape({3, 4}, &copied);
+        CHECK_FALSE(copied);
+        CHECK(B.shares(A));
+        CHECK(B(0, 0) == 6);
+        CHECK(B(2, 3) == 17);
+        B(1, 1) = -1;
+        CHECK(A(1, 5) == -1);
+    }
+
+    SECTION("axes of a strided selection can be split but not merged")
+    {
+        auto S = A.select(_|0|4, _|0|4|2);
+        auto B = S.reshape({2, 2, 2}, &copied);
+        CHECK_FALSE(copied);
+        CHECK(B.shares(A));
+        CHECK(B(1, 0, 1) == A(2, 2));
+
+        auto C = S.reshape({8}, &copied);
+        CHECK(copied);
+        CHECK_FALSE(C.shares(A));
+        CHECK(C.contiguous());
+        CHECK(C(3) == A(1, 2));
+
+        A.select(_|0|4, _|0|6|2).reshape({12}, &copied);
+        CHECK_FALSE(copied);
+    }
+
+    SECTION("transposes are copied, in row-major order")
+    {
+        const auto& B = A;
+        auto C = A.transpose().reshape({24}, &copied);
+        CHECK(copied);
+        CHECK(C(1) == A(1, 0));
+        CHECK(B.reshape(2, 12).shares(B));
+        CHECK_THROWS_AS(B.reshape(5, 5), std::invalid_argument);
+    }
 }
 
 
@@ -1302,6 +2282,364 @@ TEST_CASE("ndarrays can perform skipped assignments", "[ndarray]")
     }
 }
 
+TEST_CASE("element-wise operations on high-rank views match iteration order", "[ndarray]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(2 * 3 * 4 * 5 * 6).reshape(2, 3, 4, 5, 6);
+    auto B = A.select(_|0|2, _|1|2, _|0|4|2, _|0|5, _|1|6).reverse<4>();
+    auto C = B * 2 + B;
+    auto D = B.copy();
+    auto E = B.astype<double>();
+    auto b = B.begin();
+
+    CHECK(C.shape() == std::array<int, 5>{2, 1, 2, 5, 5});
+
+    for (auto c = C.begin(), d = D.begin(); c != C.end(); ++b, ++c, ++d)
+    {
+        CHECK(*c == 3 * *b);
+        CHECK(*d == *b);
+    }
+    CHECK(D.contiguous());
+    CHECK(E(1, 0, 1, 4, 0) == B(1, 0, 1, 4, 0));
+}
+
+
+TEST_CASE("for_each_run visits arrays as inner runs", "[ndarray] [for_each_run]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(24).reshape(2, 3, 4);
+    auto B = nd::ndarray<int, 2>(3, 2);
+    const auto C = A.select(1, _|0|3, _|0|4|2);
+    int runs = 0;
+
+    nd::for_each_run([&] (int count, auto b, auto c)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            b[i] = 2 * c[i];
+        }
+        ++runs;
+    }, B, C);
+
+    CHECK(runs == 1);
+    CHECK(B(2, 1) == 2 * A(1, 2, 2));
+    CHECK(B(0, 0) == 2 * A(1, 0, 0));
+
+    runs = 0;
+    nd::for_each_run([&] (int count, auto) { runs += count; }, A);
+    CHECK(runs == 24);
+    CHECK_THROWS_AS(nd::for_each_run([] (int, auto, auto) {}, A, A.reshape(4, 3, 2)), std::invalid_argument);
+
+    const auto& D = A;
+    auto E = nd::ndarray<int, 2>(3, 4);
+    auto F = D.select(1, _|0|3, _|0|4);
+    REQUIRE(F.is_const_ref());
+
+    nd::for_each_run([&] (int count, auto e, auto f)
+    {
+        static_assert(std::is_same<decltype(&f[0]), const int*>::value, "runs of const views point to const data");
+
+        for (int i = 0; i < count; ++i)
+        {
+            e[i] = f[i];
+        }
+    }, E, F);
+
+    CHECK((E == A[1]).all());
+    CHECK(nd::make_nditer(D.select(0, _|0|3, _|0|4), F).get<1>() == 12);
+    CHECK(nd::make_nditer(D[0], D[1]).get<1>() == 12);
+}
+
+
+TEST_CASE("ndarray iterators are random-access", "[ndarray] [iterator]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(20).reshape(4, 5);
+    auto B = A.select(_|0|4, _|1|5|2).reverse<0>(); // 4 x 2, strided
+    const auto& C = B;
+
+    static_assert(std::is_same<std::iterator_traits<decltype(B.begin())>::iterator_category,
+        std::random_access_iterator_tag>::value, "ndarray iterators should be random-access");
+
+    CHECK(B.end() - B.begin() == 8);
+    CHECK(*(B.begin() + 3) == 13);
+    CHECK(B.begin()[3] == 13);
+    CHECK(C.begin()[7] == 3);
+    CHECK(*(B.end() - 1) == 3);
+    CHECK(*--B.end() == 3);
+    CHECK(B.begin() + 8 == B.end());
+    CHECK(B.begin() < B.end());
+    CHECK(*std::prev(C.end(), 2) == 1);
+
+    std::sort(B.begin(), B.end());
+    CHECK(std::is_sorted(C.begin(), C.end()));
+    CHECK(A(3, 1) == 1);
+    CHECK(A(0, 3) == 18);
+    CHECK(A(0, 0) == 0);
+
+    std::nth_element(B.begin(), B.begin() + 4, B.end(), std::greater<int>());
+    CHECK(B.begin()[4] == 8);
+}
+
+
+TEST_CASE("ndarray iterators compare on a linear count", "[ndarray] [iterator]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(12).reshape(3, 4);
+    auto E = A.select(_|0|3, _|0|0);
+    auto B = A.select(_|0|3|2, _|1|4|2);
+    auto visited = std::vector<int>(B.begin(), B.end());
+
+    CHECK(E.begin() == E.end());
+    CHECK(std::distance(E.begin(), E.end()) == 0);
+    CHECK(visited == std::vector<int>{1, 3, 9, 11});
+    CHECK(*--B.end() == 11);
+    CHECK(*----B.end() == 9);
+    auto C = nd::arange<int>(24).reshape(2, 3, 4).transpose();
+    auto flat = std::vector<int>(C.begin(), C.end());
+
+    for (int i = 0; i < 24; ++i)
+    {
+        for (int j = 0; j < 24; ++j)
+        {
+            CHECK(*(C.begin() + i + (j - i)) == flat[j]);
+            CHECK((C.begin() + i)[j - i] == flat[j]);
+        }
+    }
+    CHECK(sizeof(nd::ndarray<int, 1>::iterator) == 2 * sizeof(void*) + 4 * sizeof(int));
+    CHECK(sizeof(nd::ndarray<double, 3>::iterator) == 2 * sizeof(void*) + 8 * sizeof(int));
+}
+
+
+TEST_CASE("ndarray iterators outlive the views they came from", "[ndarray] [iterator]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(24).reshape(2, 3, 4);
+    auto row = A[1].begin();
+    auto row_end = A[1].end();
+
+    CHECK(std::accumulate(row, row_end, 0) == 12 * 12 + 66);
+    CHECK(*(row + 5) == 17);
+
+    auto it = nd::ndarray<int, 3>::iterator();
+    auto end = nd::ndarray<int, 3>::iterator();
+    {
+        auto V = A.select(_|0|2, _|0|3, _|1|4|2);
+        it = V.begin();
+        end = V.end();
+    }
+    CHECK(std::vector<int>(it, end) == std::vector<int>{1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23});
+    CHECK(*(it + 7) == 15);
+    CHECK(*(end - 1) == 23);
+}
+
+
+TEST_CASE("make_nditer steps several arrays in lockstep", "[ndarray] [nditer]")
+{
+    auto A = nd::arange<int>(6).reshape(2, 3);
+    auto B = nd::ndarray<double, 2>({3, 2}, nd::layout::column_major).transpose();
+    auto C = nd::ndarray<double, 2>(2, 3);
+
+    B = 0.5;
+
+    for (auto it = nd::make_nditer(C, A, B); ! it.done(); it.next())
+    {
+        it.get<0>() = it.get<1>() * it.get<2>();
+    }
+    CHECK(C(1, 2) == 2.5);
+    CHECK(C(0, 1) == 0.5);
+    CHECK_THROWS_AS(nd::make_nditer(A, A.reshape(3, 2)), std::invalid_argument);
+}
+
+
+TEST_CASE("ndarray assignment between overlapping views of one buffer", "[ndarray] [overlap]")
+{
+    SECTION("shifted views are copied in a safe direction")
+    {
+        auto A = nd::arange<int>(6);
+        auto B = nd::arange<int>(6);
+        A.shift<0>(1) = A.shift<0>(-1);
+        B.shift<0>(-1) = B.shift<0>(1);
+        CHECK(A(5) == 4);
+        CHECK(A(1) == 0);
+        CHECK(B(0) == 1);
+        CHECK(B(4) == 5);
+    }
+
+    SECTION("shifted views of a 2D array are copied in a safe direction")
+    {
+        auto A = nd::arange<int>(12).reshape(3, 4);
+        A.shift<0>(1) = A.shift<0>(-1);
+        CHECK(A(2, 3) == 7);
+        CHECK(A(1, 0) == 0);
+        CHECK(A(0, 0) == 0);
+    }
+
+    SECTION("reversed and transposed views are staged")
+    {
+        auto A = nd::arange<int>(5);
+        auto B = nd::arange<int>(9).reshape(3, 3);
+        A = A.reverse<0>();
+        B = B.transpose();
+        CHECK(A(0) == 4);
+        CHECK(A(4) == 0);
+        CHECK(B(0, 1) == 3);
+        CHECK(B(1, 0) == 1);
+        CHECK(B(2, 1) == 5);
+    }
+
+    SECTION("interleaved views with equal strides are staged")
+    {
+        auto buf = std::make_shared<nd::buffer<int>>(10);
+        std::iota(buf->begin(), buf->end(), 0);
+        auto T = ndarray<int, 2>({2, 3}, {3, 2}, 0, buf);
+        auto S = ndarray<int, 2>({2, 3}, {3, 2}, 1, buf);
+        T = S;
+        CHECK(T(0, 0) == 1);
+        CHECK(T(0, 2) == 5);
+        CHECK(T(1, 0) == 4);
+        CHECK(T(1, 2) == 8);
+    }
+
+    SECTION("compound operators read the source before it is written")
+    {
+        auto A = nd::arange<int>(6);
+        A.shift<0>(1) += A.shift<0>(-1);
+        CHECK(A(1) == 1);
+        CHECK(A(2) == 3);
+        CHECK(A(5) == 9);
+
+        auto B = nd::arange<int>(4).reshape(2, 2);
+        B -= B.transpose();
+        CHECK(B(0, 1) == -1);
+        CHECK(B(1, 0) == 1);
+    }
+}
+
+TEST_CASE("ndarray supports column-major and arbitrary strided layouts", "[ndarray] [layout]")
+{
+    auto _ = nd::axis::all();
+
+    SECTION("column-major arrays index and iterate in logical order")
+    {
+        auto A = ndarray<int, 2>({2, 3}, nd::layout::column_major);
+        auto n = 0;
+
+        for (auto& a : A) a = n++;
+
+        CHECK(A.get_strides() == std::array<int, 2>{1, 2});
+        CHECK(A(0, 1) == 1);
+        CHECK(A(1, 0) == 3);
+        CHECK(A.data()[1] == 3);
+        CHECK((A[1] == nd::ndarray<int, 1>{3, 4, 5}).all());
+        CHECK((A.select(_, 2) == nd::ndarray<int, 1>{2, 5}).all());
+        CHECK_FALSE(A.contiguous());
+    }
+
+    SECTION("transpose of a row-major array is a column-major view")
+    {
+        auto A = nd::arange<int>(6).reshape(2, 3);
+        auto B = A.transpose();
+
+        CHECK(B.shares(A));
+        CHECK(B.shape() == std::array<int, 2>{3, 2});
+        CHECK(B.get_strides() == std::array<int, 2>{1, 3});
+        CHECK(B(2, 1) == A(1, 2));
+        CHECK(B[2](1) == 5);
+        CHECK((B.transpose() == A).all());
+    }
+
+    SECTION("reversed views have negative strides")
+    {
+        auto A = nd::arange<int>(5);
+        auto B = A.reverse<0>();
+
+        CHECK(B.shares(A));
+        CHECK(B.get_strides()[0] == -1);
+        CHECK(B(0) == 4);
+        CHECK(B(4) == 0);
+        CHECK((B.take<0>(_|1|3) == nd::ndarray<int, 1>{3, 2}).all());
+
+        B.take<0>(_|0|2) = 10;
+        CHECK(A(3) == 10);
+        CHECK(A(4) == 10);
+    }
+
+    SECTION("views with explicit strides can wrap existing buffers")
+    {
+        auto data = std::make_shared<buffer<int>>(6);
+        auto A = ndarray<int, 2>({2, 3}, {1, 2}, 0, data);
+        auto B = ndarray<int, 2>({2, 3}, {3, 1}, 0, data);
+
+        for (int i = 0; i < 6; ++i) (*data)[i] = i;
+
+        CHECK(A(1, 2) == 5);
+        CHECK((A.transpose() == B.reshape(3, 2)).all());
+        CHECK_THROWS_AS((ndarray<int, 2>({2, 3}, {1, 3}, 0, data)), std::invalid_argument);
+        CHECK_THROWS_AS((ndarray<int, 1>({3}, {-1}, 1, data)), std::invalid_argument);
+    }
+
+    SECTION("element-wise operations mix layouts")
+    {
+        auto A = nd::arange<double>(12).reshape(3, 4);
+        auto B = ndarray<double, 2>({3, 4}, nd::layout::column_major);
+        B = A;
+
+        auto C = A + B;
+        auto D = B * 2.0;
+        CHECK((C == D).all());
+        CHECK(D.get_strides() == B.get_strides());
+        CHECK(std::vector<double>(C.begin(), C.end()) == std::vector<double>(D.begin(), D.end()));
+    }
+}
+
+
+TEST_CASE("ndarray can wrap externally owned memory", "[ndarray] [external]")
+{
+    SECTION("borrowed memory is shared, not copied")
+    {
+        double data[6] = {0, 1, 2, 3, 4, 5};
+        auto A = ndarray<double, 2>(data, {2, 3});
+
+        A(1, 1) = 10;
+        CHECK(data[4] == 10);
+        CHECK(A.data() == data);
+        CHECK(A[1].shares(A));
+        CHECK(A.contiguous());
+        CHECK((A.reshape(6) == A.reshape(3, 2).reshape(6)).all());
+    }
+
+    SECTION("Fortran-ordered and reversed memory can be wrapped with strides")
+    {
+        double data[6] = {0, 1, 2, 3, 4, 5};
+        auto A = ndarray<double, 2>(data, {2, 3}, {1, 2});
+        auto B = ndarray<double, 1>(data + 5, {6}, {-1});
+
+        CHECK(A(1, 0) == 1);
+        CHECK(A(0, 1) == 2);
+        CHECK(B(0) == 5);
+        CHECK(B(5) == 0);
+        CHECK(B.data() == data);
+    }
+
+    SECTION("the deleter is called when the last view is destroyed")
+    {
+        auto calls = 0;
+        auto data = new int[4]{0, 1, 2, 3};
+        {
+            auto A = ndarray<int, 1>(data, {4}, [&] (int* p) { delete [] p; ++calls; });
+            auto B = A.take<0>(nd::axis::all()|1|3);
+            {
+                auto C = A;
+            }
+            CHECK(calls == 0);
+            CHECK(B(0) == 1);
+        }
+        CHECK(calls == 1);
+    }
+}
+
+
 TEST_CASE("ndarray take and shift members work", "[ndarray::shift] [ndarray::take]")
 {
     auto _ = nd::axis::all();
@@ -1314,4 +2652,34 @@ TEST_CASE("ndarray take and shift members work", "[ndarray::shift] [ndarray::tak
     REQUIRE(nd::arange<int>(5).take<0>(_|2|5)(0) == 2);
     REQUIRE(nd::arange<int>(5).take<0>(_|2|5)(2) == 4);
 }
+
+
+TEST_CASE("ndarray region returns a view of a block", "[ndarray::region]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(6, 8);
+    const auto& C = A;
+    auto B = A.region({1, 2}, {3, 4});
+    auto D = C.region({1, 2}, {3, 4});
+    auto E = A.select(_|0|6|2, _|1|8|3).region({1, 1}, {2, 1});
+
+    REQUIRE(B.shape() == (std::array<int, 2>{3, 4}));
+    CHECK(B.shares(A));
+    CHECK(B(0, 0) == A(1, 2));
+    CHECK(B(2, 3) == A(3, 5));
+    CHECK(D.is_const_ref());
+    CHECK(D.shares(A));
+    CHECK(D(2, 3) == A(3, 5));
+    CHECK(E.shape() == (std::array<int, 2>{2, 1}));
+    CHECK(E(0, 0) == A(2, 4));
+    CHECK(E(1, 0) == A(4, 4));
+    CHECK(A.region({6, 8}, {0, 0}).size() == 0);
+    CHECK_THROWS_AS(A.region({4, 0}, {3, 1}), std::out_of_range);
+    CHECK_THROWS_AS(A.region({-1, 0}, {1, 1}), std::out_of_range);
+
+    B = 0;
+    CHECK(A(1, 2) == 0);
+    CHECK(A(3, 5) == 0);
+    CHECK(A(0, 2) == 2);
+}
 #endif // TEST_NDARRAY
@@ -0,0 +1,583 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    namespace parallel
+    {
+        inline int num_threads();
+        inline int set_num_threads(int count);
+
+        inline bool& inside();
+        inline std::vector<int> allowed_cpus();
+        inline bool pin_this_thread(int cpu);
+
+        class pool;
+
+        template<typename Function>
+        static inline void for_each_chunk(int size, Function f);
+
+        template<typename Function>
+        static inline void for_each_worker(int count, Function f);
+
+        class barrier;
+    }
+
+/**
+ * Kernels that support multithreading only use it when they touch at least
+ * this many elements; below that, the cost of waking threads dominates.
+ */
+#ifndef ND_PARALLEL_THRESHOLD
+#define ND_PARALLEL_THRESHOLD (1 << 18)
+#endif
+
+/**
+ * Number of times a thread polls a barrier before it starts yielding its
+ * core to other threads between polls.
+ */
+#ifndef ND_BARRIER_SPIN
+#define ND_BARRIER_SPIN 1024
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * The number of threads used by multithreaded kernels. Defaults to the
+ * number of hardware threads.
+ */
+int nd::parallel::num_threads() // ND_IMPL_START
+{
+    return set_num_threads(0);
+}
+
+/**
+ * Sets the number of threads used by multithreaded kernels, and returns the
+ * previous value. A count of 1 disables multithreading; counts less than 1
+ * leave the setting unchanged. This is not synchronized with kernels that
+ * are already running.
+ */
+int nd::parallel::set_num_threads(int count)
+{
+    static std::atomic<int> threads(std::max(int(std::thread::hardware_concurrency()), 1));
+
+    if (count > 0)
+    {
+        return threads.exchange(count);
+    }
+    return threads.load();
+}
+
+/**
+ * Whether the calling thread is running inside a multithreaded kernel or
+ * a worker started by for_each_worker. Kernels called from such a thread
+ * run serially on it, rather than starting threads of their own and
+ * oversubscribing the machine.
+ */
+bool& nd::parallel::inside()
+{
+    static thread_local bool flag = false;
+    return flag;
+}
+
+/**
+ * The CPUs the calling thread may run on, e.g. as restricted by taskset or
+ * a cgroup. Where the platform does not report them, these are taken to be
+ * all hardware threads.
+ */
+std::vector<int> nd::parallel::allowed_cpus()
+{
+    auto cpus = std::vector<int>();
+#ifdef __linux__
+    auto set = cpu_set_t();
+    CPU_ZERO(&set);
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty())
+    {
+        for (int cpu = 0; cpu < std::max(int(std::thread::hardware_concurrency()), 1); ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Restricts the calling thread to the given CPU (see allowed_cpus). Returns
+ * false if the platform does not support thread affinity or the request
+ * fails; the thread is then left unpinned.
+ */
+bool nd::parallel::pin_this_thread(int cpu)
+{
+#ifdef __linux__
+    auto set = cpu_set_t();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+
+
+
+/**
+ * A set of worker threads which are started the first time a kernel needs
+ * them, and then wait for work for the life of the process, so that large
+ * kernels do not pay for starting and joining threads on every call. Worker
+ * k is pinned to the k-th CPU the process may run on (see allowed_cpus),
+ * when there is one, so a given worker always runs near the same memory.
+ * The pool is never destroyed: its threads simply end with the process.
+ */
+class nd::parallel::pool
+{
+public:
+    /**
+     * The process-wide pool.
+     */
+    static pool& instance()
+    {
+        static pool* shared = new pool();
+        return *shared;
+    }
+
+    /**
+     * Invokes f(k) on worker k for every k in [0, count), starting workers
+     * as needed, and returns once they have all finished. f must not throw.
+     * Calls from different threads take turns. In a child process created
+     * by fork, which has none of the workers, the calls are made serially
+     * on the calling thread.
+     */
+    template<typename Function>
+    void run(int count, Function& f)
+    {
+        if (forked())
+        {
+            for (int k = 0; k < count; ++k)
+            {
+                f(k);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> turn(busy);
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (int(threads.size()) < count)
+        {
+            int k = int(threads.size());
+            threads.emplace_back([this, k, seen = generation] () { work(k, seen); });
+        }
+        task = [] (void* context, int k) { (*static_cast<Function*>(context))(k); };
+        context = &f;
+        active = count;
+        remaining = count;
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [this] { return remaining == 0; });
+    }
+
+private:
+    pool() : cpus(allowed_cpus())
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        owner = getpid();
+#endif
+    }
+
+    bool forked() const
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        return getpid() != owner;
+#else
+        return false;
+#endif
+    }
+
+    void work(int k, int seen)
+    {
+        inside() = true;
+
+        if (k < int(cpus.size()))
+        {
+            pin_this_thread(cpus[k]);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            wake.wait(lock, [this, seen] { return generation != seen; });
+            seen = generation;
+
+            if (k < active)
+            {
+                auto call = task;
+                auto data = context;
+                lock.unlock();
+                call(data, k);
+                lock.lock();
+
+                if (--remaining == 0)
+                {
+                    done.notify_one();
+                }
+            }
+        }
+    }
+
+    std::vector<int> cpus;
+    std::vector<std::thread> threads;
+    std::mutex busy;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    void (*task)(void*, int) = nullptr;
+    void* context = nullptr;
+    int generation = 0;
+    int active = 0;
+    int remaining = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    pid_t owner;
+#endif
+};
+
+
+
+
+/**
+ * Splits the range [0, size) into contiguous chunks, one per thread, and
+ * invokes f(lower, upper) on each chunk concurrently, on the workers of the
+ * shared pool; the calling thread waits. The partitioning depends only on
+ * size and num_threads(), and chunk k always runs on pool worker k, so
+ * chunk k of equal-sized ranges is always processed by the same (pinned)
+ * thread. Exceptions thrown by f are rethrown on the calling thread.
+ */
+template<typename Function>
+void nd::parallel::for_each_chunk(int size, Function f)
+{
+    int count = std::min(num_threads(), size);
+
+    if (count <= 1 || inside())
+    {
+        f(0, size);
+        return;
+    }
+
+    auto errors = std::vector<std::exception_ptr>(count);
+    auto chunk = [&] (int k)
+    {
+        try {
+            f(int(long(size) * k / count), int(long(size) * (k + 1) / count));
+        }
+        catch (...) {
+            errors[k] = std::current_exception();
+        }
+    };
+
+    pool::instance().run(count, chunk);
+
+    for (auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+
+
+/**
+ * Invokes f(k) for every k in [0, count), each on its own thread, and
+ * waits for them all. Unlike for_each_chunk, the number of threads is
+ * exactly count, so workers may synchronize with each other (e.g. through
+ * a barrier) for as long as they run. When the calling thread may run on
+ * at least count CPUs, worker k pins itself to the k-th of them before it
+ * calls f(k), so the memory it first touches stays local to it. The first
+ * exception thrown by a worker is rethrown on the calling thread.
+ */
+template<typename Function>
+void nd::parallel::for_each_worker(int count, Function f)
+{
+    auto errors = std::vector<std::exception_ptr>(count);
+    auto threads = std::vector<std::thread>();
+    auto cpus = allowed_cpus();
+    bool pin = count <= int(cpus.size());
+
+    for (int k = 0; k < count; ++k)
+    {
+        threads.emplace_back([&f, &errors, &cpus, pin, k] ()
+        {
+            inside() = true;
+
+            if (pin)
+            {
+                pin_this_thread(cpus[k]);
+            }
+
+            try {
+                f(k);
+            }
+            catch (...) {
+                errors[k] = std::current_exception();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    for (auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+
+
+/**
+ * A reusable barrier for a fixed number of threads, which spin on an
+ * atomic generation count instead of blocking in the kernel; threads
+ * yield while they wait once they have polled ND_BARRIER_SPIN times. A
+ * thread that fails may cancel the barrier, which releases every waiting
+ * thread now and in future with a return value of false, so that its
+ * peers can stop instead of waiting forever.
+ */
+class nd::parallel::barrier
+{
+public:
+    barrier(int count) : count(count)
+    {
+    }
+
+    /**
+     * Blocks until count threads have called wait since the barrier last
+     * opened. Returns false if the barrier has been cancelled.
+     */
+    bool wait()
+    {
+        int generation = opened.load(std::memory_order_acquire);
+
+        if (cancelled.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) == count - 1)
+        {
+            arrived.store(0, std::memory_order_relaxed);
+            opened.fetch_add(1, std::memory_order_release);
+            return true;
+        }
+        for (int spin = 0; opened.load(std::memory_order_acquire) == generation; ++spin)
+        {
+            if (spin >= ND_BARRIER_SPIN)
+            {
+                std::this_thread::yield();
+            }
+        }
+        return ! cancelled.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Releases all waiting threads, and makes every later wait return
+     * false immediately.
+     */
+    void cancel()
+    {
+        cancelled.store(true, std::memory_order_release);
+        opened.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    int count;
+    std::atomic<int> arrived {0};
+    std::atomic<int> opened {0};
+    std::atomic<bool> cancelled {false};
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_PARALLEL
+#include <atomic>
+#include <set>
+#include "catch.hpp"
+
+
+TEST_CASE("parallel::for_each_chunk covers the range exactly once", "[parallel]")
+{
+    auto visited = std::vector<std::atomic<int>>(1000);
+
+    nd::parallel::for_each_chunk(1000, [&] (int lower, int upper)
+    {
+        for (int i = lower; i < upper; ++i)
+        {
+            ++visited[i];
+        }
+    });
+
+    for (const auto& v : visited)
+    {
+        CHECK(v == 1);
+    }
+}
+
+
+TEST_CASE("parallel::for_each_chunk rethrows exceptions", "[parallel]")
+{
+    auto f = [] (int lower, int) { if (lower > 0) throw std::runtime_error("chunk"); };
+    auto threads = nd::parallel::set_num_threads(4);
+
+    CHECK(nd::parallel::num_threads() == 4);
+    CHECK_THROWS_AS(nd::parallel::for_each_chunk(100, f), std::runtime_error);
+    nd::parallel::set_num_threads(threads);
+    CHECK(nd::parallel::num_threads() == threads);
+}
+
+
+
+TEST_CASE("parallel::for_each_chunk runs serially inside a parallel region", "[parallel]")
+{
+    auto threads = nd::parallel::set_num_threads(4);
+    std::atomic<int> calls(0);
+
+    nd::parallel::for_each_chunk(4, [&] (int, int)
+    {
+        CHECK(nd::parallel::inside());
+        nd::parallel::for_each_chunk(100, [&] (int l, int u) { CHECK(l == 0); CHECK(u == 100); ++calls; });
+    });
+    CHECK(calls == 4);
+    CHECK_FALSE(nd::parallel::inside());
+    nd::parallel::set_num_threads(threads);
+}
+
+
+TEST_CASE("parallel::for_each_chunk reuses the same worker for each chunk", "[parallel]")
+{
+    auto threads = nd::parallel::set_num_threads(4);
+    auto first = std::vector<std::thread::id>(4);
+    auto second = std::vector<std::thread::id>(4);
+
+    nd::parallel::for_each_chunk(400, [&] (int lower, int) { first[lower / 100] = std::this_thread::get_id(); });
+    nd::parallel::for_each_chunk(400, [&] (int lower, int) { second[lower / 100] = std::this_thread::get_id(); });
+
+    CHECK(first == second);
+    CHECK(std::find(first.begin(), first.end(), std::this_thread::get_id()) == first.end());
+    CHECK(std::set<std::thread::id>(first.begin(), first.end()).size() == 4);
+    nd::parallel::set_num_threads(threads);
+}
+
+
+TEST_CASE("parallel::barrier keeps workers in lock step", "[parallel]")
+{
+    const int workers = 4;
+    const int rounds = 200;
+    nd::parallel::barrier sync(workers);
+    std::atomic<int> counter(0);
+    std::atomic<int> mismatches(0);
+
+    nd::parallel::for_each_worker(workers, [&] (int)
+    {
+        for (int r = 0; r < rounds; ++r)
+        {
+            ++counter;
+            sync.wait();
+
+            if (counter != workers * (r + 1))
+            {
+                ++mismatches;
+            }
+            sync.wait();
+        }
+    });
+    CHECK(counter == workers * rounds);
+    CHECK(mismatches == 0);
+}
+
+
+TEST_CASE("parallel::for_each_worker pins workers to allowed CPUs before they run", "[parallel]")
+{
+    auto cpus = nd::parallel::allowed_cpus();
+    int count = std::min(int(cpus.size()), 4);
+    auto placed = std::vector<int>(count, -1);
+
+    REQUIRE_FALSE(cpus.empty());
+
+    nd::parallel::for_each_worker(count, [&] (int k)
+    {
+#ifdef __linux__
+        auto set = cpu_set_t();
+        CPU_ZERO(&set);
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        placed[k] = CPU_COUNT(&set) == 1 && CPU_ISSET(cpus[k], &set) ? cpus[k] : -2;
+#else
+        placed[k] = cpus[k];
+#endif
+    });
+
+    for (int k = 0; k < count; ++k)
+    {
+        CHECK(placed[k] == cpus[k]);
+    }
+    CHECK(nd::parallel::allowed_cpus() == cpus);
+}
+
+
+TEST_CASE("parallel::barrier can be cancelled by a failing worker", "[parallel]")
+{
+    nd::parallel::barrier sync(3);
+    auto f = [&] (int k)
+    {
+        if (k == 1)
+        {
+            sync.cancel();
+            throw std::runtime_error("worker");
+        }
+        while (sync.wait())
+        {
+        }
+    };
+    CHECK_THROWS_AS(nd::parallel::for_each_worker(3, f), std::runtime_error);
+}
+
+#endif // TEST_PARALLEL
@@ -0,0 +1,412 @@
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include "ndarray.hpp"
+#include "parallel.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    class philox;
+
+    template<typename T, typename... Dims>
+    static inline ndarray<T, sizeof...(Dims)> random_uniform(philox& generator, Dims... dims);
+
+    template<typename T, typename... Dims>
+    static inline ndarray<T, sizeof...(Dims)> random_normal(philox& generator, Dims... dims);
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * A counter-based random number generator: Philox4x32-10 (Salmon et al.,
+ * "Parallel random numbers: as easy as 1, 2, 3", SC11). Block n of the
+ * stream is four 32-bit words computed from the counter (n, stream) and
+ * the key (seed) alone, so any part of the stream can be generated
+ * without the rest, in any order and on any thread.
+ *
+ * Fills map element i of an array (in row-major order, whatever its
+ * strides) to a fixed lane of block position + i / k, for k values per
+ * block, and are split across threads by whole blocks. An array therefore
+ * gets the same values for a given seed, stream and position regardless
+ * of the number of threads or the array's memory layout. Each fill then
+ * advances the position past the blocks it used, so consecutive fills
+ * are independent. Different streams of the same seed are independent
+ * sequences, e.g. one per Monte Carlo replica.
+ *
+ * For example:
+ *
+ * auto g = nd::philox(42);
+ * auto A = nd::random_normal<double>(g, 1000, 1000);
+ * g.uniform(B, -1.0, 1.0);
+ */
+class nd::philox // ND_IMPL_START
+{
+public:
+    using block_type = std::array<std::uint32_t, 4>;
+    using key_type = std::array<std::uint32_t, 2>;
+
+    philox(std::uint64_t seed=0, std::uint64_t stream=0) : seed(seed), stream(stream)
+    {
+    }
+
+    /**
+     * The Philox4x32-10 bijection of a 128-bit counter, under a 64-bit key.
+     */
+    static block_type block(block_type counter, key_type key)
+    {
+        std::uint32_t c[4][1] = {{counter[0]}, {counter[1]}, {counter[2]}, {counter[3]}};
+        rounds<1>(c, key);
+        return {c[0][0], c[1][0], c[2][0], c[3][0]};
+    }
+
+    /**
+     * Block n of this generator's stream, independently of its position.
+     */
+    block_type operator()(std::uint64_t n) const
+    {
+        return block(counter(n), key());
+    }
+
+    std::uint64_t get_seed() const { return seed; }
+    std::uint64_t get_stream() const { return stream; }
+    std::uint64_t get_position() const { return position; }
+
+    /**
+     * Sets the index of the next block a fill will use, e.g. to regenerate
+     * an earlier fill.
+     */
+    void set_position(std::uint64_t new_position)
+    {
+        position = new_position;
+    }
+
+    /**
+     * Fills A with values uniformly distributed in [low, high). Each value
+     * uses 53 random bits for double and 24 for float.
+     */
+    template<typename T, int R>
+    void uniform(ndarray<T, R>& A, T low=T(0), T high=T(1))
+    {
+        auto scale = high - low;
+
+        fill(A, [low, scale] (const std::uint32_t* x, T* out)
+        {
+            for (int j = 0; j < values_per_block<T>(); ++j)
+            {
+                out[j] = low + scale * unit<T>(x, j);
+            }
+        });
+    }
+
+    /**
+     * Fills A with normally distributed values, by the Box-Muller transform
+     * of pairs of uniform values from the same block.
+     */
+    template<typename T, int R>
+    void normal(ndarray<T, R>& A, T mean=T(0), T stddev=T(1))
+    {
+        fill(A, [mean, stddev] (const std::uint32_t* x, T* out)
+        {
+            const T two_pi = T(6.283185307179586476925);
+
+            for (int j = 0; j < values_per_block<T>(); j += 2)
+            {
+                auto r = stddev * std::sqrt(T(-2) * std::log(T(1) - unit<T>(x, j)));
+                auto a = two_pi * unit<T>(x, j + 1);
+                out[j + 0] = mean + r * std::cos(a);
+                out[j + 1] = mean + r * std::sin(a);
+            }
+        });
+    }
+
+private:
+    /**
+     * Number of blocks generated together. The rounds are a chain of
+     * dependent multiplies, so interleaving two counters keeps the
+     * multiplier busy; wider batches run out of registers.
+     */
+    enum { batch = 2 };
+
+    template<typename T>
+    static constexpr int values_per_block()
+    {
+        static_assert(std::is_floating_point<T>::value && sizeof(T) <= 8, "philox: only float and double are supported");
+        return sizeof(T) > 4 ? 2 : 4;
+    }
+
+    /**
+     * The j-th value in [0, 1) from a block.
+     */
+    template<typename T>
+    static T unit(const std::uint32_t* x, int j)
+    {
+        if (sizeof(T) > 4)
+        {
+            auto bits = (std::uint64_t(x[2 * j]) << 32 | x[2 * j + 1]) >> 11;
+            return T(std::int64_t(bits)) * T(1.0 / 9007199254740992.0);
+        }
+        return T(std::int32_t(x[j] >> 8)) * T(1.0 / 16777216.0);
+    }
+
+    template<int W>
+    static void rounds(std::uint32_t (&c)[4][W], key_type key)
+    {
+        std::uint32_t k0 = key[0];
+        std::uint32_t k1 = key[1];
+
+        for (int r = 0; r < 10; ++r)
+        {
+            for (int b = 0; b < W; ++b)
+            {
+                auto p0 = std::uint64_t(0xD2511F53) * c[0][b];
+                auto p1 = std::uint64_t(0xCD9E8D57) * c[2][b];
+                auto x0 = std::uint32_t(p1 >> 32) ^ c[1][b] ^ k0;
+                auto x2 = std::uint32_t(p0 >> 32) ^ c[3][b] ^ k1;
+                c[0][b] = x0;
+                c[1][b] = std::uint32_t(p1);
+                c[2][b] = x2;
+                c[3][b] = std::uint32_t(p0);
+            }
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+    }
+
+    block_type counter(std::uint64_t n) const
+    {
+        return {std::uint32_t(n), std::uint32_t(n >> 32), std::uint32_t(stream), std::uint32_t(stream >> 32)};
+    }
+
+    key_type key() const
+    {
+        return {std::uint32_t(seed), std::uint32_t(seed >> 32)};
+    }
+
+    /**
+     * Writes the values of blocks position + [0, blocks) to A, where
+     * transform(x, out) turns the four words of a block into the values
+     * for consecutive elements. Whole blocks are split across threads.
+     */
+    template<typename T, int R, typename Transform>
+    void fill(ndarray<T, R>& A, Transform transform)
+    {
+        static_assert(R >= 1, "philox: cannot fill a scalar");
+
+        const int k = values_per_block<T>();
+        auto size = long(A.size());
+        auto blocks = (size + k - 1) / k;
+        auto first = position;
+        auto dense = A.get_strides() == selector<R>(A.shape()).strides();
+        auto base = A.data() + A.data_offset();
+
+        auto range = [&] (int lower, int upper)
+        {
+            std::uint32_t c[4][batch];
+            T values[batch * k];
+            auto it = A.begin() + long(lower) * k;
+
+            for (long b = lower; b < upper; b += batch)
+            {
+                for (int j = 0; j < batch; ++j)
+                {
+                    auto ctr = counter(first + b + j);
+                    c[0][j] = ctr[0];
+                    c[1][j] = ctr[1];
+                    c[2][j] = ctr[2];
+                    c[3][j] = ctr[3];
+                }
+                rounds<batch>(c, key());
+
+                for (int j = 0; j < batch; ++j)
+                {
+                    std::uint32_t x[4] = {c[0][j], c[1][j], c[2][j], c[3][j]};
+                    transform(x, values + j * k);
+                }
+
+                auto start = b * k;
+                auto count = std::min(std::min(long(upper) - b, long(batch)) * k, size - start);
+
+                if (dense)
+                {
+                    std::copy(values, values + count, base + start);
+                }
+                else
+                {
+                    for (long i = 0; i < count; ++i)
+                    {
+                        *it = values[i];
+                        ++it;
+                    }
+                }
+            }
+        };
+
+        if (size >= ND_PARALLEL_THRESHOLD)
+        {
+            parallel::for_each_chunk(int(blocks), range);
+        }
+        else
+        {
+            range(0, int(blocks));
+        }
+        position += blocks;
+    }
+
+    std::uint64_t seed;
+    std::uint64_t stream;
+    std::uint64_t position = 0;
+};
+
+
+
+
+/**
+ * Returns a new array of the given shape with values uniformly distributed
+ * in [0, 1), drawn from the generator.
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::random_uniform(philox& generator, Dims... dims)
+{
+    auto A = ndarray<T, sizeof...(Dims)>(dims...);
+    generator.uniform(A);
+    return A;
+}
+
+/**
+ * Returns a new array of the given shape with standard normally distributed
+ * values, drawn from the generator.
+ */
+template<typename T, typename... Dims>
+nd::ndarray<T, sizeof...(Dims)> nd::random_normal(philox& generator, Dims... dims)
+{
+    auto A = ndarray<T, sizeof...(Dims)>(dims...);
+    generator.normal(A);
+    return A;
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_RANDOM
+#include "catch.hpp"
+
+
+TEST_CASE("philox matches the Random123 known-answer vectors", "[random]")
+{
+    using block = nd::philox::block_type;
+
+    CHECK(nd::philox::block({0, 0, 0, 0}, {0, 0}) == (block{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}));
+    CHECK(nd::philox::block({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff}) == (block{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}));
+    CHECK(nd::philox::block({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0}) == (block{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}));
+}
+
+
+TEST_CASE("philox fills do not depend on the number of threads", "[random]")
+{
+    auto A = nd::ndarray<double, 2>(1 << 10, 1 << 9);
+    auto B = nd::ndarray<double, 2>(1 << 10, 1 << 9);
+    auto g = nd::philox(7);
+    auto h = nd::philox(7);
+    auto threads = nd::parallel::set_num_threads(1);
+
+    g.normal(A);
+    nd::parallel::set_num_threads(5);
+    h.normal(B);
+    nd::parallel::set_num_threads(threads);
+
+    CHECK((A == B).all());
+    CHECK(g.get_position() == h.get_position());
+    CHECK(g.get_position() == A.size() / 2);
+}
+
+
+TEST_CASE("philox fills do not depend on the memory layout", "[random]")
+{
+    auto A = nd::ndarray<float, 2>(13, 7);
+    auto B = nd::ndarray<float, 2>(26, 7);
+    auto V = B.take<0>(nd::axis::all()|0|26|2).reverse<1>();
+    auto g = nd::philox(3, 1);
+    auto h = nd::philox(3, 1);
+
+    g.uniform(A);
+    h.uniform(V);
+
+    for (int i = 0; i < 13; ++i)
+    {
+        for (int j = 0; j < 7; ++j)
+        {
+            CHECK(A(i, j) == B(2 * i, 6 - j));
+        }
+    }
+}
+
+
+TEST_CASE("philox fills advance through the stream", "[random]")
+{
+    auto g = nd::philox(11);
+    auto A = nd::ndarray<double, 1>(20);
+    auto B = nd::ndarray<double, 1>(10);
+    auto C = nd::ndarray<double, 1>(10);
+
+    g.uniform(A);
+    g.set_position(0);
+    g.uniform(B);
+    g.uniform(C);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        CHECK(A(i) == B(i));
+        CHECK(A(i + 10) == C(i));
+    }
+
+    SECTION("odd sizes skip the rest of their last block")
+    {
+        auto D = nd::ndarray<double, 1>(3);
+        g.set_position(0);
+        g.uniform(D);
+        CHECK(g.get_position() == 2);
+        CHECK(D(2) == A(2));
+    }
+
+    SECTION("streams and seeds give different values")
+    {
+        auto h = nd::philox(11, 1);
+        auto k = nd::philox(12);
+        h.uniform(B);
+        k.uniform(C);
+        CHECK(B(0) != A(0));
+        CHECK(C(0) != A(0));
+    }
+}
+
+
+TEST_CASE("philox distributions have the right moments", "[random]")
+{
+    auto g = nd::philox(2024);
+    auto U = nd::random_uniform<double>(g, 100000);
+    auto N = nd::random_normal<float>(g, 100000);
+    auto V = nd::ndarray<double, 1>(100000);
+    g.uniform(V, -3.0, 5.0);
+
+    auto mean = [] (const auto& A) { return std::accumulate(A.begin(), A.end(), 0.0) / A.size(); };
+    auto square = [] (double s, double x) { return s + x * x; };
+
+    CHECK(std::all_of(U.begin(), U.end(), [] (double x) { return x >= 0.0 && x < 1.0; }));
+    CHECK(std::all_of(V.begin(), V.end(), [] (double x) { return x >= -3.0 && x < 5.0; }));
+    CHECK(mean(U) == Approx(0.5).margin(0.005));
+    CHECK(mean(V) == Approx(1.0).margin(0.04));
+    CHECK(mean(N) == Approx(0.0).margin(0.01));
+    CHECK(std::accumulate(N.begin(), N.end(), 0.0, square) / N.size() == Approx(1.0).margin(0.015));
+}
+
+#endif // TEST_RANDOM
@@ -1,7 +1,9 @@
 #pragma once
 #include <array>
+#include <algorithm>
 #include <numeric>
 #include <functional>
+#include <iterator>
 #include "shape.hpp"
 
 
@@ -12,6 +14,13 @@ namespace nd // ND_API_START
 {
     template<int Rank, int Axis> struct selector;
 
+    /**
+     * Memory layouts that strides can be generated for. Row-major (C order)
+     * puts the last axis adjacent in memory, column-major (Fortran order)
+     * puts the first axis adjacent in memory.
+     */
+    enum class layout { row_major, column_major };
+
     /**
      * Creates a selector without count (memory extent) information, e.g:
      *
@@ -250,14 +259,25 @@ struct nd::selector
         return {count, start, final, skips};
     }
 
-    std::array<int, rank> strides() const
+    std::array<int, rank> strides(layout order = layout::row_major) const
     {
         std::array<int, rank> s;
-        s[rank - 1] = 1;
+        int stride = 1;
 
-        for (int n = rank - 2; n >= 0; --n)
+        if (order == layout::column_major)
         {
-            s[n] = s[n + 1] * count[n + 1];
+            for (int n = 0; n < rank; ++n)
+            {
+                s[n] = stride;
+                stride *= count[n];
+            }
+            return s;
+        }
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            s[n] = stride;
+            stride *= count[n];
         }
         return s;
     }
@@ -275,7 +295,7 @@ struct nd::selector
 
     int shape(int axis) const
     {
-        return final[axis] / skips[axis] - start[axis] / skips[axis];
+        return std::max(final[axis] - start[axis] + skips[axis] - 1, 0) / skips[axis];
     }
 
     bool empty() const
@@ -346,6 +366,49 @@ struct nd::selector
         return true;
     }
 
+    /**
+     * Returns the row-major position of the given index among those visited
+     * by next(), starting from 0 at start. The final index, where next()
+     * stops, maps to size().
+     */
+    int position(const std::array<int, rank>& index) const
+    {
+        if (index == final)
+        {
+            return int(size());
+        }
+
+        int m = 0;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m = m * shape(n) + (index[n] - start[n]) / skips[n];
+        }
+        return m;
+    }
+
+    /**
+     * The inverse of position: unflattens a position in [0, size()] into the
+     * index visited at that step.
+     */
+    std::array<int, rank> index_at(int position) const
+    {
+        if (position >= int(size()))
+        {
+            return final;
+        }
+
+        std::array<int, rank> index;
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            int s = shape(n);
+            index[n] = start[n] + (position % s) * skips[n];
+            position /= s;
+        }
+        return index;
+    }
+
     template<typename... Index>
     bool contains(Index... index) const
     {
@@ -358,7 +421,7 @@ struct nd::selector
             auto start_index = std::get<0>(S[n]);
             auto final_index = std::get<1>(S[n]);
 
-            if (start_index < 0 || final_index > final[n] / skips[n] - start[n] / skips[n])
+            if (start_index < 0 || final_index > shape(n))
             {
                 return false;
             }
@@ -374,23 +437,109 @@ struct nd::selector
         return sel;
     }
 
+    /**
+     * Removes this axis from the selector altogether, leaving the remaining
+     * axes untouched. Unlike collapse, this makes no assumption about how
+     * the axes are laid out in memory; the caller is responsible for
+     * accounting for the memory offset of the selected index.
+     */
+    selector<rank - 1> erase() const
+    {
+        static_assert(axis < rank, "selector: cannot erase axis >= rank");
+
+        auto sel = selector<rank - 1>();
+
+        for (int n = 0; n < rank - 1; ++n)
+        {
+            int m = n < axis ? n : n + 1;
+            sel.count[n] = count[m];
+            sel.start[n] = start[m];
+            sel.final[n] = final[m];
+            sel.skips[n] = skips[m];
+        }
+        return sel;
+    }
+
+    /**
+     * Mirrors this axis within its count, so that index i of the new
+     * selector refers to position count - 1 - i of the old one. The
+     * selected elements are then visited in reverse order, provided the
+     * memory stride along this axis is negated as well.
+     */
+    selector<rank, axis> reverse() const
+    {
+        auto sel = *this;
+        auto last = start[axis] + skips[axis] * (shape(axis) - 1);
+
+        if (shape(axis) > 0)
+        {
+            sel.start[axis] = count[axis] - 1 - last;
+            sel.final[axis] = count[axis] - start[axis];
+        }
+        return sel;
+    }
+
+    /**
+     * Returns a selector with the order of the axes reversed.
+     */
+    selector<rank> transpose() const
+    {
+        auto sel = selector<rank>();
+
+        for (int n = 0; n < rank; ++n)
+        {
+            sel.count[n] = count[rank - 1 - n];
+            sel.start[n] = start[rank - 1 - n];
+            sel.final[n] = final[rank - 1 - n];
+            sel.skips[n] = skips[rank - 1 - n];
+        }
+        return sel;
+    }
+
 
 
 
     // ========================================================================
+    /**
+     * Random-access iterator over the indexes visited by next(). It keeps a
+     * linear count alongside the index, so comparisons and differences are
+     * O(1). Stepping by one is incremental; any other jump unflattens the new
+     * position through the selector (see index_at), which is O(rank).
+     */
     class iterator
     {
     public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::array<int, rank>;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+        using iterator_category = std::random_access_iterator_tag;
+
         iterator() {}
-        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind) {}
-        iterator& operator++() { sel.next(ind); return *this; }
+        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind), pos(sel.position(ind)) {}
+        iterator& operator++() { sel.next(ind); ++pos; return *this; }
         iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return ind == other.ind; }
-        bool operator!=(iterator other) const { return ind != other.ind; }
+        iterator& operator--() { return *this += -1; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { pos += int(n); ind = sel.index_at(pos); return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret += -n; }
+        friend iterator operator+(difference_type n, iterator a) { return a += n; }
+        difference_type operator-(const iterator& other) const { return position() - other.position(); }
+        bool operator==(const iterator& other) const { return pos == other.pos; }
+        bool operator!=(const iterator& other) const { return pos != other.pos; }
+        bool operator< (const iterator& other) const { return position() <  other.position(); }
+        bool operator> (const iterator& other) const { return position() >  other.position(); }
+        bool operator<=(const iterator& other) const { return position() <= other.position(); }
+        bool operator>=(const iterator& other) const { return position() >= other.position(); }
+        value_type operator[](difference_type n) const { return *(*this + n); }
         const std::array<int, rank>& operator*() const { return ind; }
+        difference_type position() const { return pos; }
     private:
         selector<rank> sel;
         std::array<int, rank> ind;
+        int pos = 0;
     };
 
     iterator begin() const { return {reset(), start}; }
@@ -563,6 +712,25 @@ TEST_CASE("selector<4> skips on all dimensions correctly", "[selector::skip]")
 }
 
 
+TEST_CASE("selector position and index_at are inverses", "[selector]")
+{
+    auto S = nd::selector<2>({10, 10}, {1, 2}, {8, 9}, {3, 2});
+    int m = 0;
+
+    for (auto it = S.begin(); it != S.end(); ++it, ++m)
+    {
+        CHECK(S.position(*it) == m);
+        CHECK(S.index_at(m) == *it);
+    }
+    CHECK(m == int(S.size()));
+    CHECK(S.position(S.final) == m);
+    CHECK(S.index_at(m) == S.final);
+    CHECK(S.end() - S.begin() == m);
+    CHECK(*(S.begin() + 4) == std::array<int, 2>{4, 2});
+    CHECK(*(S.end() - 1) == std::array<int, 2>{7, 8});
+}
+
+
 TEST_CASE("selector<1> next advances properly", "[selector::next]")
 {
     auto S = selector<1>(10);
@@ -621,4 +789,41 @@ TEST_CASE("selector can be shifed", "[selector::shift]")
     CHECK(selector<2>(10, 5).on<1>().shift(+1).shape()[1] ==  4);
 }
 
+
+TEST_CASE("selector generates row-major and column-major strides", "[selector::strides]")
+{
+    auto S = selector<3>(10, 12, 14);
+    CHECK(S.strides(layout::row_major) == std::array<int, 3>{168, 14, 1});
+    CHECK(S.strides(layout::column_major) == std::array<int, 3>{1, 10, 120});
+}
+
+
+TEST_CASE("selector shape is consistent with iteration for any skips", "[selector::shape]")
+{
+    auto S = selector<1>(10).slice(0, 3, 2);
+    auto n = 0;
+
+    for (auto index : S)
+    {
+        (void) index;
+        ++n;
+    }
+    CHECK(S.shape(0) == 2);
+    CHECK(n == 2);
+}
+
+
+TEST_CASE("selector can erase, reverse, and transpose axes", "[selector::erase] [selector::reverse]")
+{
+    auto S = selector<3>(2, 4, 6).on<1>().slice(1, 4, 2);
+
+    CHECK(S.on<0>().erase().count == std::array<int, 2>{4, 6});
+    CHECK(S.on<1>().erase().count == std::array<int, 2>{2, 6});
+    CHECK(S.on<1>().erase().shape() == std::array<int, 2>{2, 6});
+    CHECK(S.on<1>().reverse().start[1] == 0);
+    CHECK(S.on<1>().reverse().final[1] == 3);
+    CHECK(S.on<1>().reverse().shape() == S.shape());
+    CHECK(S.transpose().shape() == std::array<int, 3>{6, 2, 2});
+}
+
 #endif // TEST_SELECTOR
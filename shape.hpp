@@ -71,6 +71,23 @@ namespace nd // ND_API_START
             }
             return res + "]";
         }
+
+
+        /**
+         * Inner product of an index with a set of strides, i.e. a memory
+         * offset.
+         */
+        template<std::size_t Size>
+        int static inline dot(const std::array<int, Size>& a, const std::array<int, Size>& b)
+        {
+            int m = 0;
+
+            for (std::size_t n = 0; n < Size; ++n)
+            {
+                m += a[n] * b[n];
+            }
+            return m;
+        }
     }
 } // ND_API_END
 
@@ -156,6 +173,15 @@ auto nd::shape::make_shape(First first, Rest... rest)
 using namespace nd::shape;
 
 
+TEST_CASE("shape::dot computes offsets for any rank", "[shape]")
+{
+    CHECK(nd::shape::dot(std::array<int, 0>{}, std::array<int, 0>{}) == 0);
+    CHECK(nd::shape::dot(std::array<int, 1>{3}, std::array<int, 1>{2}) == 6);
+    CHECK(nd::shape::dot(std::array<int, 4>{1, 2, 3, 4}, std::array<int, 4>{60, 20, 5, 1}) == 119);
+    CHECK(nd::shape::dot(std::array<int, 5>{1, 1, 1, 1, 1}, std::array<int, 5>{1, 2, 3, 4, 5}) == 15);
+}
+
+
 TEST_CASE("make_shape works correctly", "[shape]")
 {
     auto _ = nd::axis::all();
@@ -0,0 +1,566 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <chrono>
+#include "ndarray.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+#if defined(__unix__) || defined(__APPLE__)
+    template<typename T, int R> class shared_array;
+#endif
+
+/**
+ * How long, in milliseconds, shared_array::attach waits by default for a
+ * segment that another process is still creating.
+ */
+#ifndef ND_SHM_ATTACH_MS
+#define ND_SHM_ATTACH_MS 1000
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+#if defined(__unix__) || defined(__APPLE__) // ND_IMPL_START
+
+/**
+ * An array in a named POSIX shared memory segment, which other processes
+ * on the same machine can attach to and use without copying. The segment
+ * starts with a small header recording the data type and shape, which
+ * attach() checks, followed by the elements in row-major order.
+ *
+ * The header also holds a sequence number for a seqlock: a writer wraps
+ * each update in write(), which makes the number odd while the update is
+ * in progress, and readers take consistent copies with snapshot(), which
+ * retries until the number was even and unchanged across the copy. There
+ * must be one writer at a time; readers never block it. Arrays returned by
+ * array() are zero-copy views of the segment, but reading them while the
+ * writer is active may see a mixture of old and new values.
+ *
+ * For example, in the producer:
+ *
+ * auto S = nd::shared_array<double, 2>::create("/frames", {480, 640});
+ * S.write([&] (auto A) { A = frame; });
+ *
+ * and in each consumer:
+ *
+ * auto S = nd::shared_array<double, 2>::attach("/frames");
+ * auto B = S.snapshot();
+ *
+ * Segments persist until unlink() is called on their name, and the memory
+ * until every process has released it.
+ */
+template<typename T, int R>
+class nd::shared_array
+{
+public:
+    static_assert(R <= 8, "shared_array: rank must be at most 8");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared_array: needs lock-free 64-bit atomics");
+
+    /**
+     * Creates a new segment with the given name (which should start with
+     * a slash) and shape, with zeroed elements. Throws std::system_error
+     * if the segment already exists or cannot be created; a segment that
+     * was created but could not be set up is removed again. The header's
+     * magic number is written last, so attach() never accepts a segment
+     * whose header is incomplete.
+     */
+    static shared_array create(const std::string& name, std::array<int, R> shape)
+    {
+        std::size_t size = 1;
+
+        for (int n = 0; n < R; ++n)
+        {
+            if (shape[n] < 0)
+            {
+                throw std::invalid_argument("shared_array: shape must be non-negative");
+            }
+            size *= shape[n];
+        }
+
+        int fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "shared_array: cannot create " + name);
+        }
+
+        auto bytes = header_bytes + size * sizeof(T);
+
+        if (ftruncate(fd, off_t(bytes)) == -1)
+        {
+            int error = errno;
+            close(fd);
+            shm_unlink(name.data());
+            throw std::system_error(error, std::generic_category(), "shared_array: cannot resize " + name);
+        }
+
+        auto S = map_created(fd, bytes, name);
+        auto dtype = dtype_str<T>::value();
+
+        std::memcpy(S.head->dtype, dtype.data(), sizeof(S.head->dtype));
+        S.head->rank = R;
+
+        for (int n = 0; n < R; ++n)
+        {
+            S.head->shape[n] = shape[n];
+        }
+        S.head->sequence.store(0, std::memory_order_relaxed);
+        S.head->magic.store(magic(), std::memory_order_release);
+        return S;
+    }
+
+    /**
+     * Maps an existing segment. A segment which another process is still
+     * creating (too small to hold a header, or without its magic number
+     * yet) is retried for up to wait_ms milliseconds. Throws
+     * std::system_error if it cannot be opened, and std::invalid_argument
+     * if it was not created by shared_array, is still incomplete when the
+     * wait ends, or holds a different data type or rank.
+     */
+    static shared_array attach(const std::string& name, int wait_ms=ND_SHM_ATTACH_MS)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+
+        while (true)
+        {
+            int fd = shm_open(name.data(), O_RDWR, 0);
+
+            if (fd == -1)
+            {
+                throw std::system_error(errno, std::generic_category(), "shared_array: cannot open " + name);
+            }
+
+            struct stat info;
+
+            if (fstat(fd, &info) == -1)
+            {
+                int error = errno;
+                close(fd);
+                throw std::system_error(error, std::generic_category(), "shared_array: cannot stat " + name);
+            }
+
+            if (std::size_t(info.st_size) >= header_bytes)
+            {
+                auto S = shared_array(fd, info.st_size, name);
+                auto m = S.head->magic.load(std::memory_order_acquire);
+
+                if (m == magic())
+                {
+                    S.check(std::size_t(info.st_size));
+                    return S;
+                }
+                if (m != 0)
+                {
+                    throw std::invalid_argument("shared_array: " + name + " was not created by shared_array");
+                }
+            }
+            else
+            {
+                close(fd);
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                throw std::invalid_argument("shared_array: " + name + " is incomplete; it may still be being created");
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    /**
+     * Removes the name of a segment, so that it can no longer be attached
+     * to; processes which have it mapped keep their memory. Returns false
+     * if there was no such segment.
+     */
+    static bool unlink(const std::string& name)
+    {
+        return shm_unlink(name.data()) == 0;
+    }
+
+    const std::string& get_name() const
+    {
+        return name;
+    }
+
+    std::array<int, R> shape() const
+    {
+        auto s = std::array<int, R>();
+
+        for (int n = 0; n < R; ++n)
+        {
+            s[n] = int(head->shape[n]);
+        }
+        return s;
+    }
+
+    std::size_t size() const
+    {
+        std::size_t size = 1;
+
+        for (int n = 0; n < R; ++n)
+        {
+            size *= std::size_t(head->shape[n]);
+        }
+        return size;
+    }
+
+    /**
+     * An array sharing the segment's memory, which keeps it mapped for as
+     * long as the array (or any view of it) exists.
+     */
+    ndarray<T, R> array() const
+    {
+        auto keep = mapping;
+        return ndarray<T, R>(data(), shape(), [keep] (T*) {});
+    }
+
+    /**
+     * The current sequence number: even when no write is in progress, and
+     * advanced by two for every completed write. Readers may poll it to
+     * see whether there is anything new.
+     */
+    std::uint64_t sequence() const
+    {
+        return head->sequence.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Invokes f(A) with an array sharing the segment's memory, marking the
+     * segment as being written for the duration, and returns the sequence
+     * number the write completed with. Only one process or thread may
+     * write at a time. If f throws, the write is still marked complete, so
+     * readers may see it partly done.
+     */
+    template<typename Function>
+    std::uint64_t write(Function f)
+    {
+        auto A = array();
+        auto s = head->sequence.load(std::memory_order_relaxed);
+
+        head->sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        try {
+            f(A);
+        }
+        catch (...) {
+            head->sequence.store(s + 2, std::memory_order_release);
+            throw;
+        }
+        head->sequence.store(s + 2, std::memory_order_release);
+        return s + 2;
+    }
+
+    /**
+     * Copies a consistent version of the segment into target, which must
+     * have the segment's shape, and returns its sequence number. Retries
+     * while a write is in progress, or if one started during the copy.
+     */
+    std::uint64_t snapshot(ndarray<T, R>& target) const
+    {
+        if (target.shape() != shape())
+        {
+            throw std::invalid_argument("shared_array: snapshot target has shape "
+                + shape::to_string(target.shape())
+                + " but the segment has shape "
+                + shape::to_string(shape()));
+        }
+
+        auto source = array();
+
+        for (int attempt = 0; ; ++attempt)
+        {
+            auto before = head->sequence.load(std::memory_order_acquire);
+
+            if (before % 2 == 0)
+            {
+                target = source;
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (head->sequence.load(std::memory_order_relaxed) == before)
+                {
+                    return before;
+                }
+            }
+            if (attempt >= 16)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Returns a new array holding a consistent copy of the segment.
+     */
+    ndarray<T, R> snapshot() const
+    {
+        auto A = ndarray<T, R>(shape());
+        snapshot(A);
+        return A;
+    }
+
+private:
+    struct header
+    {
+        std::atomic<std::uint64_t> magic;
+        char dtype[8];
+        std::int32_t rank;
+        std::int32_t unused;
+        std::int64_t shape[8];
+        std::atomic<std::uint64_t> sequence;
+    };
+
+    /**
+     * Elements start at this offset into the segment, so that they are
+     * aligned to a cache line and never share one with the header.
+     */
+    static constexpr std::size_t header_bytes = 128;
+
+    static std::uint64_t magic()
+    {
+        std::uint64_t m;
+        std::memcpy(&m, "ndshm01", sizeof(m));
+        return m;
+    }
+
+    /**
+     * Maps a segment just created under the given name, removing the name
+     * again if that fails.
+     */
+    static shared_array map_created(int fd, std::size_t bytes, const std::string& name)
+    {
+        try {
+            return shared_array(fd, bytes, name);
+        }
+        catch (...) {
+            shm_unlink(name.data());
+            throw;
+        }
+    }
+
+    /**
+     * Checks the rest of a published header against this type.
+     */
+    void check(std::size_t bytes) const
+    {
+        auto dtype = dtype_str<T>::value();
+
+        if (std::memcmp(head->dtype, dtype.data(), sizeof(head->dtype)) != 0)
+            throw std::invalid_argument("shared_array: " + name + " has the wrong data type");
+
+        if (head->rank != R)
+            throw std::invalid_argument("shared_array: " + name + " has the wrong rank");
+
+        if (header_bytes + size() * sizeof(T) > bytes)
+            throw std::invalid_argument("shared_array: " + name + " is smaller than its shape");
+    }
+
+    shared_array(int fd, std::size_t bytes, const std::string& name) : name(name)
+    {
+        static_assert(sizeof(header) <= header_bytes, "shared_array: header does not fit");
+
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        close(fd);
+
+        if (memory == MAP_FAILED)
+        {
+            throw std::system_error(error, std::generic_category(), "shared_array: cannot map " + name);
+        }
+        mapping = std::shared_ptr<void>(memory, [bytes] (void* memory) { munmap(memory, bytes); });
+        head = static_cast<header*>(memory);
+    }
+
+    T* data() const
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(mapping.get()) + header_bytes);
+    }
+
+    std::string name;
+    std::shared_ptr<void> mapping;
+    header* head;
+};
+
+template<typename T, int R>
+constexpr std::size_t nd::shared_array<T, R>::header_bytes;
+
+#endif // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_SHM
+#include <sys/wait.h>
+#include "catch.hpp"
+
+
+static std::string shm_test_name(const char* tag)
+{
+    return std::string("/nd-test-") + tag + "-" + std::to_string(getpid());
+}
+
+
+TEST_CASE("shared_array segments can be attached to without copying", "[shm]")
+{
+    auto name = shm_test_name("attach");
+    auto S = nd::shared_array<double, 2>::create(name, {3, 4});
+    auto C = nd::shared_array<double, 2>::attach(name);
+
+    REQUIRE(C.shape() == (std::array<int, 2>{3, 4}));
+    CHECK(S.sequence() == 0);
+    CHECK(S.write([] (nd::ndarray<double, 2> A) { A(1, 2) = 5.0; }) == 2);
+    CHECK(C.sequence() == 2);
+    CHECK(C.array()(1, 2) == 5.0);
+    CHECK(C.array()(0, 0) == 0.0);
+
+    SECTION("arrays keep the segment mapped")
+    {
+        auto A = C.array();
+        C = S;
+        CHECK(A(1, 2) == 5.0);
+    }
+
+    SECTION("attaching checks the header")
+    {
+        CHECK_THROWS_AS((nd::shared_array<int, 2>::attach(name)), std::invalid_argument);
+        CHECK_THROWS_AS((nd::shared_array<double, 3>::attach(name)), std::invalid_argument);
+        CHECK_THROWS_AS((nd::shared_array<double, 2>::create(name, {1, 1})), std::system_error);
+    }
+
+    CHECK(nd::shared_array<double, 2>::unlink(name));
+    CHECK_FALSE(nd::shared_array<double, 2>::unlink(name));
+    CHECK_THROWS_AS((nd::shared_array<double, 2>::attach(name)), std::system_error);
+}
+
+
+TEST_CASE("shared_array attach waits for segments still being created", "[shm]")
+{
+    SECTION("a segment that never gets a header is rejected once the wait ends")
+    {
+        auto name = shm_test_name("partial");
+        int fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        REQUIRE(fd != -1);
+        close(fd);
+
+        CHECK_THROWS_AS((nd::shared_array<double, 1>::attach(name, 5)), std::invalid_argument);
+        CHECK_THROWS_AS((nd::shared_array<double, 1>::create(name, {4})), std::system_error);
+        nd::shared_array<double, 1>::unlink(name);
+    }
+
+    SECTION("attaching as soon as the name appears sees a complete header")
+    {
+        auto name = shm_test_name("race");
+        auto failures = 0;
+
+        for (int round = 0; round < 50; ++round)
+        {
+            auto creator = std::thread([&] { nd::shared_array<int, 2>::create(name, {8, 16}); });
+
+            while (true)
+            {
+                try {
+                    auto C = nd::shared_array<int, 2>::attach(name);
+                    failures += C.shape() != std::array<int, 2>{8, 16};
+                    break;
+                }
+                catch (const std::system_error&) {
+                }
+                catch (const std::invalid_argument&) {
+                    ++failures;
+                    break;
+                }
+            }
+            creator.join();
+            nd::shared_array<int, 2>::unlink(name);
+        }
+        CHECK(failures == 0);
+    }
+}
+
+
+TEST_CASE("shared_array is visible to another process", "[shm]")
+{
+    auto name = shm_test_name("fork");
+    auto S = nd::shared_array<int, 1>::create(name, {100});
+    auto pid = fork();
+
+    if (pid == 0)
+    {
+        try {
+            auto C = nd::shared_array<int, 1>::attach(name);
+            C.write([] (nd::ndarray<int, 1> A) { for (int i = 0; i < 100; ++i) A(i) = i * i; });
+        }
+        catch (...) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    nd::shared_array<int, 1>::unlink(name);
+
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+    CHECK(S.sequence() == 2);
+    CHECK(S.snapshot()(99) == 99 * 99);
+}
+
+
+TEST_CASE("shared_array snapshots are consistent while a writer runs", "[shm]")
+{
+    auto name = shm_test_name("seqlock");
+    auto S = nd::shared_array<long, 1>::create(name, {4096});
+    auto C = nd::shared_array<long, 1>::attach(name);
+    nd::shared_array<long, 1>::unlink(name);
+
+    std::atomic<bool> done(false);
+    auto writer = std::thread([&] ()
+    {
+        for (long v = 1; v <= 2000; ++v)
+        {
+            S.write([v] (nd::ndarray<long, 1> A) { A = v; });
+        }
+        done = true;
+    });
+
+    auto B = nd::ndarray<long, 1>(4096);
+    auto torn = 0;
+
+    while (! done)
+    {
+        auto s = C.snapshot(B);
+        torn += ! std::all_of(B.begin(), B.end(), [&] (long x) { return x == B(0); });
+        CHECK(s % 2 == 0);
+        CHECK(B(0) == long(s / 2));
+    }
+    writer.join();
+
+    CHECK(torn == 0);
+    CHECK(C.snapshot()(4095) == 2000);
+
+    auto V = B.take<0>(nd::axis::all()|0|10);
+    CHECK_THROWS_AS(C.snapshot(V), std::invalid_argument);
+}
+
+#endif // TEST_SHM
@@ -0,0 +1,371 @@
+#pragma once
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int... Dims> class static_array;
+
+    /**
+     * Product of a list of extents, as a constant expression.
+     */
+    constexpr int static_size() { return 1; }
+
+    template<typename... Dims>
+    constexpr int static_size(int first, Dims... rest) { return first * static_size(rest...); }
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * An array whose extents are template parameters, e.g:
+ *
+ * auto A = nd::static_array<double, 3, 3>(1.0);
+ *
+ * The elements live in the object itself, so these never touch the heap.
+ * Strides, sizes, and offsets are constant expressions, and element-wise
+ * operations are expanded at compile time over every element. Operands with
+ * different shapes are rejected by static_assert rather than at run time.
+ * Static arrays convert to and from ndarray of the same rank, the latter
+ * throwing if the run-time shape does not match.
+ */
+template<typename T, int... Dims> // ND_IMPL_START
+class nd::static_array
+{
+public:
+
+
+    using dtype = T;
+    enum { rank = sizeof...(Dims) };
+
+
+
+
+    /**
+     * Compile-time shape queries
+     *
+     */
+    // ========================================================================
+    static constexpr std::array<int, rank> shape()
+    {
+        return {Dims...};
+    }
+
+    static constexpr int shape(int axis)
+    {
+        const std::array<int, rank> s = {Dims...};
+        return s[axis];
+    }
+
+    static constexpr int size()
+    {
+        return static_size(Dims...);
+    }
+
+    static constexpr std::array<int, rank> strides()
+    {
+        return strides(std::make_index_sequence<rank>());
+    }
+
+    static constexpr int strides(int axis)
+    {
+        int stride = 1;
+
+        for (int n = axis + 1; n < rank; ++n)
+        {
+            stride *= shape(n);
+        }
+        return stride;
+    }
+
+    template<typename... Index>
+    static constexpr int offset(Index... index)
+    {
+        static_assert(sizeof...(Index) == rank, "static_array: index size must match rank");
+
+        const std::array<int, rank> i = {int(index)...};
+        int m = 0;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m += i[n] * strides(n);
+        }
+        return m;
+    }
+
+    template<typename... Index>
+    static constexpr bool contains(Index... index)
+    {
+        const std::array<int, rank> i = {int(index)...};
+
+        for (int n = 0; n < rank; ++n)
+        {
+            if (i[n] < 0 || i[n] >= shape(n))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+
+
+    /**
+     * Constructors
+     *
+     */
+    // ========================================================================
+    static_array()
+    {
+        memory.fill(T());
+    }
+
+    explicit static_array(T value)
+    {
+        memory.fill(value);
+    }
+
+    static_array(std::initializer_list<T> elements)
+    {
+        if (elements.size() != std::size_t(size()))
+            throw std::invalid_argument("static_array: wrong number of elements in initializer list");
+
+        std::copy(elements.begin(), elements.end(), memory.begin());
+    }
+
+    explicit static_array(const ndarray<T, rank>& A)
+    {
+        if (A.shape() != shape())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(A.shape())
+                + " to "
+                + shape::to_string(shape()));
+        }
+        std::copy(A.begin(), A.end(), memory.begin());
+    }
+
+    operator ndarray<T, rank>() const
+    {
+        auto A = ndarray<T, rank>(shape());
+        std::copy(begin(), end(), A.begin());
+        return A;
+    }
+
+
+
+
+    /**
+     * Data accessors
+     *
+     */
+    // ========================================================================
+    template<typename... Index>
+    T& operator()(Index... index)
+    {
+        if (! contains(index...))
+            throw std::out_of_range("static_array: index out of range");
+
+        return memory[offset(index...)];
+    }
+
+    template<typename... Index>
+    const T& operator()(Index... index) const
+    {
+        if (! contains(index...))
+            throw std::out_of_range("static_array: index out of range");
+
+        return memory[offset(index...)];
+    }
+
+    T* data() { return memory.data(); }
+    const T* data() const { return memory.data(); }
+
+    T* begin() { return memory.data(); }
+    T* end() { return memory.data() + size(); }
+    const T* begin() const { return memory.data(); }
+    const T* end() const { return memory.data() + size(); }
+
+
+
+
+    /**
+     * Arithmetic and comparison operators
+     *
+     */
+    // ========================================================================
+    template<typename U> auto& operator+=(U b) { apply([&] (int n) { memory[n] += b; }); return *this; }
+    template<typename U> auto& operator-=(U b) { apply([&] (int n) { memory[n] -= b; }); return *this; }
+    template<typename U> auto& operator*=(U b) { apply([&] (int n) { memory[n] *= b; }); return *this; }
+    template<typename U> auto& operator/=(U b) { apply([&] (int n) { memory[n] /= b; }); return *this; }
+    template<typename U, int... D> auto& operator+=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] += B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator-=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] -= B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator*=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] *= B.memory[n]; }); return *this; }
+    template<typename U, int... D> auto& operator/=(const static_array<U, D...>& B) { check_shape(B); apply([&] (int n) { memory[n] /= B.memory[n]; }); return *this; }
+
+    template<typename U> auto operator+(U b) const { return map([&] (T a) { return a + b; }); }
+    template<typename U> auto operator-(U b) const { return map([&] (T a) { return a - b; }); }
+    template<typename U> auto operator*(U b) const { return map([&] (T a) { return a * b; }); }
+    template<typename U> auto operator/(U b) const { return map([&] (T a) { return a / b; }); }
+    template<typename U, int... D> auto operator+(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a + b; }); }
+    template<typename U, int... D> auto operator-(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a - b; }); }
+    template<typename U, int... D> auto operator*(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a * b; }); }
+    template<typename U, int... D> auto operator/(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a / b; }); }
+
+    template<typename U, int... D> auto operator==(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a == b; }); }
+    template<typename U, int... D> auto operator!=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a != b; }); }
+    template<typename U, int... D> auto operator>=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a >= b; }); }
+    template<typename U, int... D> auto operator<=(const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a <= b; }); }
+    template<typename U, int... D> auto operator> (const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a >  b; }); }
+    template<typename U, int... D> auto operator< (const static_array<U, D...>& B) const { return zip(B, [] (T a, U b) { return a <  b; }); }
+
+    template<typename U> auto operator==(U b) const { return map([&] (T a) { return a == b; }); }
+    template<typename U> auto operator!=(U b) const { return map([&] (T a) { return a != b; }); }
+    template<typename U> auto operator>=(U b) const { return map([&] (T a) { return a >= b; }); }
+    template<typename U> auto operator<=(U b) const { return map([&] (T a) { return a <= b; }); }
+    template<typename U> auto operator> (U b) const { return map([&] (T a) { return a >  b; }); }
+    template<typename U> auto operator< (U b) const { return map([&] (T a) { return a <  b; }); }
+
+    auto operator!() const { return map([] (T a) { return ! a; }); }
+    bool any() const { for (auto x : memory) if (x) return true; return false; }
+    bool all() const { for (auto x : memory) if (! x) return false; return true; }
+
+
+private:
+    /**
+     * Private utility methods
+     *
+     */
+    // ========================================================================
+    template<std::size_t... I>
+    static constexpr std::array<int, rank> strides(std::index_sequence<I...>)
+    {
+        return {strides(int(I))...};
+    }
+
+    template<typename Function, std::size_t... I>
+    static void apply(Function f, std::index_sequence<I...>)
+    {
+        int expand[] = {0, (f(int(I)), 0)...};
+        (void) expand;
+    }
+
+    template<typename Function>
+    static void apply(Function f)
+    {
+        apply(f, std::make_index_sequence<size()>());
+    }
+
+    template<typename Function>
+    auto map(Function f) const
+    {
+        auto C = static_array<decltype(f(T())), Dims...>();
+        apply([&] (int n) { C.memory[n] = f(memory[n]); });
+        return C;
+    }
+
+    template<typename U, int... D, typename Function>
+    auto zip(const static_array<U, D...>& B, Function f) const
+    {
+        check_shape(B);
+        auto C = static_array<decltype(f(T(), U())), Dims...>();
+        apply([&] (int n) { C.memory[n] = f(memory[n], B.memory[n]); });
+        return C;
+    }
+
+    template<typename U, int... D>
+    static void check_shape(const static_array<U, D...>&)
+    {
+        static_assert(std::is_same<std::integer_sequence<int, Dims...>, std::integer_sequence<int, D...>>::value,
+            "incompatible shapes for binary operation");
+    }
+
+
+
+
+    /**
+     * Data members
+     *
+     */
+    // ========================================================================
+    std::array<T, static_size(Dims...)> memory;
+
+
+
+
+    /**
+     * Grant friendship to static arrays of other types and shapes.
+     *
+     */
+    template<typename, int...>
+    friend class static_array;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_STATIC_ARRAY
+#include "catch.hpp"
+
+
+TEST_CASE("static_array has compile-time shape information", "[static_array]")
+{
+    using A = nd::static_array<double, 2, 3, 4>;
+
+    static_assert(A::rank == 3, "static_array: wrong rank");
+    static_assert(A::size() == 24, "static_array: wrong size");
+    static_assert(A::strides(0) == 12, "static_array: wrong stride");
+    static_assert(A::offset(1, 2, 3) == 23, "static_array: wrong offset");
+    static_assert(! A::contains(2, 0, 0), "static_array: wrong bounds");
+
+    CHECK(A::shape() == std::array<int, 3>{2, 3, 4});
+    CHECK(sizeof(A) == 24 * sizeof(double));
+}
+
+
+TEST_CASE("static_array supports element access and arithmetic", "[static_array]")
+{
+    auto A = nd::static_array<int, 2, 2>{1, 2, 3, 4};
+    auto B = nd::static_array<int, 2, 2>(1);
+
+    CHECK(A(1, 0) == 3);
+    CHECK(((A + B) == nd::static_array<int, 2, 2>{2, 3, 4, 5}).all());
+    CHECK(((A * 2) == nd::static_array<int, 2, 2>{2, 4, 6, 8}).all());
+    CHECK((A > 2).any());
+    CHECK_FALSE((A > 4).any());
+    CHECK_THROWS_AS(A(2, 0), std::out_of_range);
+
+    A += B;
+    CHECK(A(0, 0) == 2);
+
+    // Should fail to compile, incompatible shapes:
+    // A + nd::static_array<int, 4>();
+}
+
+
+TEST_CASE("static_array converts to and from ndarray", "[static_array] [ndarray]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<double>(12).reshape(3, 4);
+    auto S = nd::static_array<double, 2, 2>(A.select(_|1|3, _|0|2));
+    nd::ndarray<double, 2> B = S;
+
+    CHECK(S(0, 0) == 4);
+    CHECK(S(1, 1) == 9);
+    CHECK(B.shape() == std::array<int, 2>{2, 2});
+    CHECK(B(1, 0) == 8);
+    CHECK_THROWS_AS((nd::static_array<double, 3, 3>(A)), std::invalid_argument);
+}
+
+#endif // TEST_STATIC_ARRAY
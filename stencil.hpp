@@ -0,0 +1,931 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <initializer_list>
+#include "ndarray.hpp"
+#include "parallel.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int R> class stencil;
+    template<typename T, int R> struct neighbours;
+
+    template<typename Function, typename T, typename U, int R>
+    static inline void apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<U, R>& source, ndarray<T, R>& target);
+
+    template<typename Function, typename T, int R>
+    static inline ndarray<T, R> apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<T, R>& source);
+
+    /**
+     * Cache-blocked traversal used by the stencil kernels. The last two axes
+     * of a shape are cut into tiles of ND_STENCIL_TILE_Y x ND_STENCIL_TILE_X
+     * elements, and every row of a tile (along the last axis) is visited,
+     * sweeping any leading axes inside the tile, before moving to the next
+     * tile. The rows of source data read by a tile then stay in cache while
+     * it is processed, including the neighbouring planes of 3D stencils.
+     */
+    namespace tiling
+    {
+        template<std::size_t R, typename Function>
+        static inline void for_each_row(std::array<int, R> shape, bool threaded, Function f);
+
+        template<typename T, typename U, int R>
+        static inline void check_interior(const char* caller, const ndarray<U, R>& source, const ndarray<T, R>& target, typename stencil<T, R>::offset_type shape);
+    }
+
+/**
+ * Extents of the tiles visited by tiling::for_each_row, along the last and
+ * second-to-last axes.
+ */
+#ifndef ND_STENCIL_TILE_X
+#define ND_STENCIL_TILE_X 256
+#endif
+
+#ifndef ND_STENCIL_TILE_Y
+#define ND_STENCIL_TILE_Y 32
+#endif
+
+/**
+ * Cache size, in bytes, that the planes kept in flight by a temporally
+ * blocked stencil::sweep should fit in; about the size of a per-core L2.
+ */
+#ifndef ND_STENCIL_CACHE
+#define ND_STENCIL_CACHE (1 << 20)
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * Accessor passed to user stencil functions: n(di, dj, ...) returns the
+ * source element at the given offset from the one being updated. Offsets
+ * must be within the radius given to apply_stencil; they are not checked.
+ */
+template<typename T, int R> // ND_IMPL_START
+struct nd::neighbours
+{
+    template<typename... Offsets>
+    const T& operator()(Offsets... offsets) const
+    {
+        static_assert(sizeof...(Offsets) == R, "neighbours: number of offsets must match rank");
+        return center[shape::dot(std::array<int, R>{offsets...}, strides)];
+    }
+
+    const T* center;
+    std::array<int, R> strides;
+};
+
+
+
+
+/**
+ * A linear stencil: a list of offsets and coefficients. Applying it to a
+ * source array computes, for every point at least radius() away from the
+ * source's edges,
+ *
+ *     target(i) = sum_k coefficient_k * source(i + radius + offset_k)
+ *
+ * in a single pass, instead of one temporary per term as with sums of
+ * shifted views. The target has the interior shape, shape - 2 * radius.
+ */
+template<typename T, int R>
+class nd::stencil
+{
+public:
+    using offset_type = std::array<int, R>;
+
+    /**
+     * Creates a stencil from a list of {offset, coefficient} pairs, e.g.
+     *
+     * auto d2 = nd::stencil<double, 1>{{{-1}, 1.0}, {{0}, -2.0}, {{1}, 1.0}};
+     */
+    stencil(std::initializer_list<std::pair<offset_type, T>> terms={}) : terms(terms)
+    {
+    }
+
+    /**
+     * The standard 2R + 1 point Laplacian, scaled by the given factor (e.g.
+     * one over the squared grid spacing).
+     */
+    static stencil laplacian(T scale=T(1))
+    {
+        auto L = stencil();
+        L.add(offset_type(), -2 * R * scale);
+
+        for (int n = 0; n < R; ++n)
+        {
+            auto offset = offset_type();
+            offset[n] = -1;
+            L.add(offset, scale);
+            offset[n] = +1;
+            L.add(offset, scale);
+        }
+        return L;
+    }
+
+    /**
+     * Adds a term to the stencil.
+     */
+    stencil& add(offset_type offset, T coefficient)
+    {
+        terms.emplace_back(offset, coefficient);
+        return *this;
+    }
+
+    /**
+     * The largest absolute offset along each axis.
+     */
+    offset_type radius() const
+    {
+        auto r = offset_type();
+
+        for (const auto& term : terms)
+        {
+            for (int n = 0; n < R; ++n)
+            {
+                r[n] = std::max(r[n], std::abs(term.first[n]));
+            }
+        }
+        return r;
+    }
+
+    /**
+     * The shape of the region updated when the stencil is applied to a
+     * source of the given shape.
+     */
+    offset_type interior(offset_type shape) const
+    {
+        auto r = radius();
+
+        for (int n = 0; n < R; ++n)
+        {
+            shape[n] = std::max(shape[n] - 2 * r[n], 0);
+        }
+        return shape;
+    }
+
+    /**
+     * Applies the stencil to the source, writing the interior shape of the
+     * target. The target may be any view (e.g. the interior of another
+     * array), but must not overlap the source. Throws std::invalid_argument
+     * if the target has the wrong shape or overlaps the source.
+     */
+    template<typename U>
+    void apply(const ndarray<U, R>& source, ndarray<T, R>& target) const
+    {
+        auto shape = interior(source.shape());
+        tiling::check_interior("stencil::apply", source, target, shape);
+        apply_rows(source, target, long(target.size()) * std::max(int(terms.size()), 1) >= ND_PARALLEL_THRESHOLD);
+    }
+
+    /**
+     * Applies the stencil to the source, returning a new array of the
+     * interior shape.
+     */
+    template<typename U>
+    ndarray<T, R> operator()(const ndarray<U, R>& source) const
+    {
+        auto target = ndarray<T, R>(interior(source.shape()));
+        apply(source, target);
+        return target;
+    }
+
+    /**
+     * Applies the stencil the given number of times, holding the points
+     * within radius() of the edges fixed, and returns the result.
+     *
+     * With a time_block of 1, each step is a full sweep over the array,
+     * which streams it through memory once per step. Larger time blocks
+     * advance that many steps per pass, as a wavefront along the first
+     * axis: plane p is taken to step k as soon as planes p +- radius()[0]
+     * are at step k - 1, so each intermediate step only needs a ring of
+     * 2 * radius()[0] + 1 planes, which stays in cache. The array is then
+     * read and written once per time_block steps rather than once per
+     * step, and the results are identical. To keep the ring in cache for
+     * large planes, the second axis is cut into slabs which recompute a
+     * halo of time_block * radius()[1] rows; slabs are split across
+     * threads. Rank-1 arrays always use full sweeps.
+     */
+    ndarray<T, R> sweep(const ndarray<T, R>& A, int steps, int time_block=1) const
+    {
+        if (steps < 0 || time_block < 1)
+        {
+            throw std::invalid_argument("stencil::sweep: steps must be non-negative and time_block positive");
+        }
+
+        auto r = radius();
+        auto source = A.copy();
+        auto target = source.copy();
+        auto swap = ndarray<T, R>();
+
+        for (int done = 0, s = 0; done < steps; done += s)
+        {
+            s = R == 1 ? 1 : std::min(time_block, steps - done);
+
+            if (s == 1)
+            {
+                auto inner = target.region(r, interior(A.shape()));
+                apply(source, inner);
+            }
+            else
+            {
+                sweep_wavefront(source, target, s, std::integral_constant<bool, (R > 1)>());
+            }
+            swap.become(source);
+            source.become(target);
+            target.become(swap);
+        }
+        return source;
+    }
+
+    const std::vector<std::pair<offset_type, T>>& get_terms() const
+    {
+        return terms;
+    }
+
+private:
+    /**
+     * Writes the interior of target from that of source, s steps on (see
+     * sweep). The second axis is cut into slabs, sized so that the planes
+     * a slab keeps in flight fit in ND_STENCIL_CACHE bytes, and each slab
+     * runs its own wavefront over a halo of s * radius()[1] extra rows on
+     * either side; slabs are split across threads.
+     */
+    void sweep_wavefront(const ndarray<T, R>& source, ndarray<T, R>& target, int s, std::true_type) const
+    {
+        auto r = radius();
+        auto shape = source.shape();
+        auto inner = interior(shape);
+
+        if (std::find(inner.begin(), inner.end(), 0) != inner.end())
+        {
+            return;
+        }
+
+        int halo = s * r[1];
+        int slots = 2 * r[0] + 1;
+        long row = long(source.size() / (long(shape[0]) * shape[1])) * sizeof(T);
+        long fit = ND_STENCIL_CACHE / ((s + 1) * slots * row) - 2 * halo;
+        int threads = parallel::num_threads();
+        int height = int(std::max(std::min(fit, long(inner[1] + threads - 1) / threads), long(std::max(2 * halo, 1))));
+        int slabs = (inner[1] + height - 1) / height;
+
+        auto run = [&] (int lower, int upper)
+        {
+            auto ring = std::vector<T>();
+
+            for (int n = lower; n < upper; ++n)
+            {
+                int c0 = r[1] + n * height;
+                int c1 = std::min(c0 + height, r[1] + inner[1]);
+                int l0 = std::max(c0 - halo, 0);
+                int l1 = std::min(c1 + halo, shape[1]);
+                auto corner = offset_type();
+                auto extent = shape;
+                corner[1] = l0;
+                extent[1] = l1 - l0;
+
+                auto a = source.region(corner, extent);
+                auto b = target.region(corner, extent);
+                wavefront(a, b, s, c0 - l0, c1 - l0, ring);
+            }
+        };
+
+        if (slabs > 1 && long(source.size()) * s >= ND_PARALLEL_THRESHOLD)
+        {
+            parallel::for_each_chunk(slabs, run);
+        }
+        else
+        {
+            run(0, slabs);
+        }
+    }
+
+    void sweep_wavefront(const ndarray<T, R>&, ndarray<T, R>&, int, std::false_type) const
+    {
+    }
+
+    /**
+     * Advances source by s steps, writing rows [c0, c1) of the second axis
+     * of target. Plane p (an index along the first axis) is taken to step
+     * k as soon as planes p +- radius()[0] are at step k - 1, so the
+     * intermediate steps only need a ring of 2 * radius()[0] + 1 planes
+     * each. Boundary planes are copied into the ring, and so is the
+     * boundary of each plane before its interior is computed; rows outside
+     * [c0, c1) may be inexact, as they depend on rows outside the source.
+     */
+    template<int Q = R>
+    void wavefront(const ndarray<T, R>& source, ndarray<T, R>& target, int s, int c0, int c1, std::vector<T>& ring) const
+    {
+        using plane_type = std::array<int, Q - 1>;
+
+        auto r = radius();
+        auto shape = source.shape();
+        auto ps = plane_type();
+        auto pr = plane_type();
+        auto ss = plane_type();
+        auto ts = plane_type();
+
+        for (int n = 1; n < R; ++n)
+        {
+            ps[n - 1] = shape[n];
+            pr[n - 1] = r[n];
+            ss[n - 1] = source.get_strides()[n];
+            ts[n - 1] = target.get_strides()[n];
+        }
+
+        int n0 = shape[0];
+        int r0 = r[0];
+        int slots = 2 * r0 + 1;
+        int size = int(source.size() / n0);
+        auto rs = selector<Q - 1>(ps).strides();
+        auto s0 = source.data() + source.data_offset();
+        auto t0 = target.data() + target.data_offset();
+        auto all0 = pr;
+        auto all1 = ps;
+        auto core0 = pr;
+        auto core1 = ps;
+
+        for (int n = 0; n < R - 1; ++n)
+        {
+            all1[n] -= pr[n];
+            core1[n] -= pr[n];
+        }
+        core0[0] = c0;
+        core1[0] = c1;
+        ring.resize(std::size_t(s - 1) * slots * size);
+
+        auto slot = [&] (int k, int p)
+        {
+            return ring.data() + (std::size_t(k - 1) * slots + p % slots) * size;
+        };
+
+        auto copy_plane = [&] (int k, int p, bool boundary_only)
+        {
+            auto from = strided::make_operand(s0 + p * source.get_strides()[0], ss);
+            auto to = strided::make_operand(slot(k, p), rs);
+
+            if (! boundary_only)
+            {
+                strided::copy(ps, to, from);
+                return;
+            }
+
+            tiling::for_each_row(ps, false, [&] (const plane_type& index, int count)
+            {
+                bool edge = false;
+
+                for (int n = 0; n < R - 2; ++n)
+                {
+                    edge = edge || index[n] < pr[n] || index[n] >= ps[n] - pr[n];
+                }
+
+                auto a = to.data + shape::dot(index, rs);
+                auto b = from.data + shape::dot(index, ss);
+                int x = index[R - 2];
+                int x0 = edge ? count : std::min(std::max(pr[R - 2] - x, 0), count);
+                int x1 = edge ? count : std::max(std::min(ps[R - 2] - pr[R - 2] - x, count), x0);
+
+                for (int i = 0; i < count; ++i)
+                {
+                    if (i == x0) i = x1;
+                    if (i < count) a[i * rs[R - 2]] = b[i * ss[R - 2]];
+                }
+            });
+        };
+
+        auto planes = std::vector<const T*>(slots);
+
+        for (int z = 0; z < n0 + (s - 1) * r0; ++z)
+        {
+            for (int k = 1; k <= s; ++k)
+            {
+                int p = z - (k - 1) * r0;
+
+                if (p < 0 || p >= n0)
+                {
+                    continue;
+                }
+                if (p < r0 || p >= n0 - r0)
+                {
+                    if (k < s) copy_plane(k, p, false);
+                    continue;
+                }
+                if (k < s)
+                {
+                    copy_plane(k, p, true);
+                }
+
+                for (int q = 0; q < slots; ++q)
+                {
+                    planes[q] = k == 1 ? s0 + (p - r0 + q) * source.get_strides()[0] : slot(k - 1, p - r0 + q);
+                }
+
+                if (k < s)
+                {
+                    apply_plane(planes.data(), k == 1 ? ss : rs, slot(k, p), rs, all0, all1);
+                }
+                else
+                {
+                    apply_plane(planes.data(), k == 1 ? ss : rs, t0 + p * target.get_strides()[0], ts, core0, core1);
+                }
+            }
+        }
+    }
+
+    /**
+     * Computes the points [lower, upper) of one plane (an index along the
+     * first axis), given the planes at offsets -radius()[0] ...
+     * radius()[0] from it, with strides is, into a plane with strides os.
+     */
+    template<std::size_t P>
+    void apply_plane(const T* const* planes, std::array<int, P> is, T* out, std::array<int, P> os, std::array<int, P> lower, std::array<int, P> upper) const
+    {
+        int r0 = radius()[0];
+        int k1 = int(terms.size());
+        auto shape = std::array<int, P>();
+        auto offsets = std::vector<int>();
+        auto coefficients = std::vector<T>();
+
+        for (int n = 0; n < int(P); ++n)
+        {
+            shape[n] = std::max(upper[n] - lower[n], 0);
+        }
+
+        for (const auto& term : terms)
+        {
+            auto d = std::array<int, P>();
+            std::copy(term.first.begin() + 1, term.first.end(), d.begin());
+            offsets.push_back(int(planes[r0 + term.first[0]] - planes[r0]) + shape::dot(d, is));
+            coefficients.push_back(term.second);
+        }
+
+        auto s0 = planes[r0] + shape::dot(lower, is);
+        auto t0 = out + shape::dot(lower, os);
+
+        tiling::for_each_row(shape, false, [&] (const std::array<int, P>& index, int count)
+        {
+            auto t = t0 + shape::dot(index, os);
+            auto s = s0 + shape::dot(index, is);
+
+            if (k1 == 0)
+            {
+                for (int i = 0; i < count; ++i) t[i * os[P - 1]] = T();
+            }
+            else
+            {
+                row(count, t, os[P - 1], s, is[P - 1], offsets.data(), coefficients.data(), k1);
+            }
+        });
+    }
+
+    /**
+     * Applies the stencil to source, writing the target, which must have
+     * the interior shape.
+     */
+    template<typename U>
+    void apply_rows(const ndarray<U, R>& source, ndarray<T, R>& target, bool threaded) const
+    {
+        auto shape = target.shape();
+        auto ss = source.get_strides();
+        auto ts = target.get_strides();
+        auto s0 = source.data() + source.data_offset() + shape::dot(radius(), ss);
+        auto t0 = target.data() + target.data_offset();
+        auto offsets = std::vector<int>();
+        auto coefficients = std::vector<T>();
+
+        for (const auto& term : terms)
+        {
+            offsets.push_back(shape::dot(term.first, ss));
+            coefficients.push_back(term.second);
+        }
+
+        int k1 = int(terms.size());
+
+        tiling::for_each_row(shape, threaded, [&] (const offset_type& index, int count)
+        {
+            auto t = t0 + shape::dot(index, ts);
+            auto s = s0 + shape::dot(index, ss);
+
+            if (k1 == 0)
+            {
+                for (int i = 0; i < count; ++i) t[i * ts[R - 1]] = T();
+            }
+            else if (ts[R - 1] == 1 && ss[R - 1] == 1)
+            {
+                row(count, t, 1, s, 1, offsets.data(), coefficients.data(), k1);
+            }
+            else
+            {
+                row(count, t, ts[R - 1], s, ss[R - 1], offsets.data(), coefficients.data(), k1);
+            }
+        });
+    }
+
+    /**
+     * Evaluates the stencil along one row. Terms are taken in groups of up
+     * to eight, each group in a single loop over the row with its count
+     * fixed at compile time, so that the group's sum is formed in registers
+     * and the loop vectorizes. The row of the target is short enough
+     * (ND_STENCIL_TILE_X) to stay in L1 between groups.
+     */
+    template<typename U>
+    static void row(int count, T* t, int ts, const U* s, int ss, const int* offsets, const T* coefficients, int terms)
+    {
+        for (int k = 0; k < terms; k += 8)
+        {
+            switch (std::min(terms - k, 8))
+            {
+                case 1: row_group<1>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 2: row_group<2>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 3: row_group<3>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 4: row_group<4>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 5: row_group<5>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 6: row_group<6>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 7: row_group<7>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+                case 8: row_group<8>(count, t, ts, s, ss, offsets + k, coefficients + k, k == 0); break;
+            }
+        }
+    }
+
+    template<int K, typename U>
+    static void row_group(int count, T* t, int ts, const U* s, int ss, const int* offsets, const T* coefficients, bool first)
+    {
+        const U* p[K];
+        T c[K];
+
+        for (int k = 0; k < K; ++k)
+        {
+            p[k] = s + offsets[k];
+            c[k] = coefficients[k];
+        }
+
+        if (ts == 1 && ss == 1)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                T a = first ? T() : t[i];
+
+                for (int k = 0; k < K; ++k)
+                {
+                    a += c[k] * p[k][i];
+                }
+                t[i] = a;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                T a = first ? T() : t[i * ts];
+
+                for (int k = 0; k < K; ++k)
+                {
+                    a += c[k] * p[k][i * ss];
+                }
+                t[i * ts] = a;
+            }
+        }
+    }
+
+    std::vector<std::pair<offset_type, T>> terms;
+};
+
+
+
+
+/**
+ * Applies a user function over the interior of the source, in a single
+ * tiled and multithreaded pass:
+ *
+ *     target(i) = f(n), where n(d...) == source(i + radius + d...)
+ *
+ * The function receives a neighbours accessor, and may read offsets of up
+ * to radius along each axis. The target must have shape
+ * source.shape() - 2 * radius and must not overlap the source; otherwise
+ * std::invalid_argument is thrown. For example,
+ *
+ * nd::apply_stencil([] (auto n) { return n(-1, 0) + n(1, 0) + n(0, -1) + n(0, 1) - 4 * n(0, 0); }, {1, 1}, A, B);
+ */
+template<typename Function, typename T, typename U, int R>
+void nd::apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<U, R>& source, ndarray<T, R>& target)
+{
+    auto shape = source.shape();
+
+    for (int n = 0; n < R; ++n)
+    {
+        if (radius[n] < 0)
+        {
+            throw std::invalid_argument("apply_stencil: radius must be non-negative");
+        }
+        shape[n] = std::max(shape[n] - 2 * radius[n], 0);
+    }
+    tiling::check_interior("apply_stencil", source, target, shape);
+
+    auto ss = source.get_strides();
+    auto ts = target.get_strides();
+    auto s0 = source.data() + source.data_offset() + shape::dot(radius, ss);
+    auto t0 = target.data() + target.data_offset();
+    bool threaded = long(target.size()) * 4 >= ND_PARALLEL_THRESHOLD;
+
+    tiling::for_each_row(shape, threaded, [&] (const std::array<int, R>& index, int count)
+    {
+        auto t = t0 + shape::dot(index, ts);
+        auto n = neighbours<U, R>{s0 + shape::dot(index, ss), ss};
+
+        for (int i = 0; i < count; ++i)
+        {
+            t[i * ts[R - 1]] = f(n);
+            n.center += ss[R - 1];
+        }
+    });
+}
+
+
+
+
+/**
+ * Applies a user function over the interior of the source, returning a new
+ * array of shape source.shape() - 2 * radius.
+ */
+template<typename Function, typename T, int R>
+nd::ndarray<T, R> nd::apply_stencil(Function f, typename stencil<T, R>::offset_type radius, const ndarray<T, R>& source)
+{
+    auto shape = source.shape();
+
+    for (int n = 0; n < R; ++n)
+    {
+        shape[n] = std::max(shape[n] - 2 * radius[n], 0);
+    }
+
+    auto target = ndarray<T, R>(shape);
+    apply_stencil(f, radius, source, target);
+    return target;
+}
+
+
+
+
+/**
+ * Invokes f(index, count) for every row of the given shape, where index is
+ * the first element of the row and count its length; a row is a run of at
+ * most ND_STENCIL_TILE_X elements along the last axis. Rows are visited
+ * tile by tile (see tiling), and whole tiles are split across threads when
+ * threaded is true.
+ */
+template<std::size_t R, typename Function>
+void nd::tiling::for_each_row(std::array<int, R> shape, bool threaded, Function f)
+{
+    static_assert(R >= 1, "tiling: rank must be at least 1");
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
+        {
+            return;
+        }
+    }
+
+    const int X = ND_STENCIL_TILE_X;
+    const int Y = ND_STENCIL_TILE_Y;
+    const int y = R >= 2 ? int(R) - 2 : 0;
+    int nx = (shape[R - 1] + X - 1) / X;
+    int ny = R >= 2 ? (shape[y] + Y - 1) / Y : 1;
+
+    auto tiles = [&] (int lower, int upper)
+    {
+        for (int tile = lower; tile < upper; ++tile)
+        {
+            auto start = std::array<int, R>();
+            auto final = shape;
+            auto skips = std::array<int, R>();
+            std::fill(skips.begin(), skips.end(), 1);
+
+            int x0 = (tile % nx) * X;
+            start[R - 1] = x0;
+            final[R - 1] = x0 + 1;
+
+            if (R >= 2)
+            {
+                start[y] = (tile / nx) * Y;
+                final[y] = std::min(start[y] + Y, shape[y]);
+            }
+
+            auto sel = selector<int(R)>(shape, start, final, skips);
+            auto index = start;
+            int count = std::min(X, shape[R - 1] - x0);
+
+            do {
+                f(index, count);
+            } while (sel.next(index));
+        }
+    };
+
+    if (threaded)
+    {
+        parallel::for_each_chunk(nx * ny, tiles);
+    }
+    else
+    {
+        tiles(0, nx * ny);
+    }
+}
+
+
+
+
+/**
+ * Throws std::invalid_argument if the target of a stencil does not have the
+ * given interior shape, or if it overlaps the source.
+ */
+template<typename T, typename U, int R>
+void nd::tiling::check_interior(const char* caller, const ndarray<U, R>& source, const ndarray<T, R>& target, typename stencil<T, R>::offset_type shape)
+{
+    if (target.shape() != shape)
+    {
+        throw std::invalid_argument(std::string(caller)
+            + ": target has shape "
+            + shape::to_string(target.shape())
+            + " but the interior of the source has shape "
+            + shape::to_string(shape));
+    }
+    if (source.size() == 0 || target.size() == 0)
+    {
+        return;
+    }
+
+    auto x = strided::extent(source.shape(), strided::make_operand(source.data() + source.data_offset(), source.get_strides()));
+    auto y = strided::extent(target.shape(), strided::make_operand(target.data() + target.data_offset(), target.get_strides()));
+    auto before = std::less<const void*>();
+
+    if (before(x[0], y[1] + 1) && before(y[0], x[1] + 1))
+    {
+        throw std::invalid_argument(std::string(caller) + ": target must not overlap the source");
+    }
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_STENCIL
+#include "catch.hpp"
+
+
+TEST_CASE("tiling::for_each_row visits every element once", "[stencil]")
+{
+    auto shape = std::array<int, 3>{3, ND_STENCIL_TILE_Y + 5, ND_STENCIL_TILE_X + 7};
+    auto visits = nd::ndarray<int, 3>(shape);
+
+    nd::tiling::for_each_row(shape, false, [&] (std::array<int, 3> index, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            ++visits(index[0], index[1], index[2] + i);
+        }
+    });
+    CHECK((visits == 1).all());
+}
+
+
+TEST_CASE("stencils agree with sums of shifted views", "[stencil]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::ndarray<double, 2>(40, 300);
+    int n = 0;
+
+    for (auto& a : A)
+    {
+        a = (n = (n * 37 + 11) % 101) - 50;
+    }
+
+    auto expected = nd::ndarray<double, 2>(
+        A.shift<0>(-2).take<1>(_|1|299) +
+        A.shift<0>(+2).take<1>(_|1|299) +
+        A.take<0>(_|1|39).shift<1>(-2) +
+        A.take<0>(_|1|39).shift<1>(+2) -
+        A.take<0>(_|1|39).take<1>(_|1|299) * 4.0);
+
+    SECTION("with a coefficient list")
+    {
+        auto L = nd::stencil<double, 2>::laplacian();
+        auto B = L(A);
+        CHECK(L.radius() == std::array<int, 2>{1, 1});
+        CHECK(B.shape() == std::array<int, 2>{38, 298});
+        CHECK((B == expected).all());
+    }
+
+    SECTION("with a user function")
+    {
+        auto B = nd::apply_stencil([] (auto n) { return n(-1, 0) + n(1, 0) + n(0, -1) + n(0, 1) - 4 * n(0, 0); }, {1, 1}, A);
+        CHECK((B == expected).all());
+    }
+
+    SECTION("into the interior of another array, from a transposed source")
+    {
+        auto At = nd::ndarray<double, 2>(A.transpose()).copy().transpose();
+        auto B = nd::ndarray<double, 2>(40, 300);
+        auto interior = B.select(_|1|39, _|1|299);
+        nd::stencil<double, 2>::laplacian().apply(At, interior);
+        CHECK((B.select(_|1|39, _|1|299) == expected).all());
+        CHECK(B(0, 0) == 0.0);
+    }
+
+    SECTION("errors are reported")
+    {
+        auto B = nd::ndarray<double, 2>(10, 10);
+        auto L = nd::stencil<double, 2>::laplacian();
+        auto self = A.select(_|1|39, _|1|299);
+        CHECK_THROWS_AS(L.apply(A, B), std::invalid_argument);
+        CHECK_THROWS_AS(L.apply(A, self), std::invalid_argument);
+    }
+}
+
+
+TEST_CASE("3D stencils with asymmetric terms are multithreaded", "[stencil]")
+{
+    auto threads = nd::parallel::set_num_threads(3);
+    auto A = nd::ndarray<double, 3>(20, 70, 300);
+    int n = 0;
+
+    for (auto& a : A)
+    {
+        a = (n = (n * 37 + 11) % 101) - 50;
+    }
+
+    auto S = nd::stencil<double, 3>{{{0, 0, 2}, 0.5}, {{-1, 1, 0}, 2.0}};
+    auto B = S(A);
+
+    CHECK(S.radius() == std::array<int, 3>{1, 1, 2});
+    CHECK(B.shape() == std::array<int, 3>{18, 68, 296});
+
+    for (int i = 0; i < 18; i += 5)
+        for (int j = 0; j < 68; j += 7)
+            for (int k = 0; k < 296; k += 11)
+                CHECK(B(i, j, k) == 0.5 * A(i + 1, j + 1, k + 4) + 2.0 * A(i, j + 2, k + 2));
+
+    nd::parallel::set_num_threads(threads);
+}
+
+TEST_CASE("temporally blocked sweeps agree with full sweeps", "[stencil]")
+{
+    SECTION("2D, in one slab and in several")
+    {
+        auto A = nd::ndarray<double, 2>(37, 53);
+        auto L = nd::stencil<double, 2>::laplacian(0.1).add({0, 0}, 1.0);
+        int n = 0;
+
+        for (auto& a : A)
+        {
+            a = (n = (n * 37 + 11) % 101) - 50;
+        }
+
+        auto B = L.sweep(A, 7);
+        auto C = A.copy();
+
+        for (int step = 0; step < 7; ++step)
+        {
+            auto inner = C.select(nd::axis::all()|1|36, nd::axis::all()|1|52);
+            inner = L(C);
+        }
+        CHECK((B == C).all());
+        CHECK((L.sweep(A, 7, 3) == B).all());
+        CHECK((L.sweep(A, 7, 7) == B).all());
+
+        auto threads = nd::parallel::set_num_threads(4);
+        CHECK((L.sweep(A, 7, 2) == B).all());
+        nd::parallel::set_num_threads(threads);
+        CHECK((L.sweep(A, 7, 4) == B).all());
+        CHECK((L.sweep(A, 0, 4) == A).all());
+        CHECK_THROWS_AS(L.sweep(A, 1, 0), std::invalid_argument);
+    }
+
+    SECTION("3D, asymmetric, multithreaded")
+    {
+        auto threads = nd::parallel::set_num_threads(3);
+        auto A = nd::ndarray<double, 3>(40, 50, 60);
+        auto S = nd::stencil<double, 3>{{{0, 0, 0}, 0.5}, {{-1, 0, 0}, 0.25}, {{0, 1, 2}, 0.125}, {{0, -1, 0}, 0.125}};
+        int n = 0;
+
+        for (auto& a : A)
+        {
+            a = (n = (n * 37 + 11) % 101) - 50;
+        }
+
+        auto B = S.sweep(A, 5);
+        CHECK((S.sweep(A, 5, 2) == B).all());
+        CHECK((S.sweep(A, 5, 5) == B).all());
+        nd::parallel::set_num_threads(threads);
+    }
+}
+
+#endif // TEST_STENCIL
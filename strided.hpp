@@ -0,0 +1,1114 @@
+#pragma once
+#include <array>
+#include <tuple>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <utility>
+#include "parallel.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    namespace strided
+    {
+        /**
+         * A pointer to the first element of an array view, together with its
+         * per-axis memory strides (in units of elements). This is the form in
+         * which the element-wise kernels see their operands.
+         */
+        template<typename T, int R>
+        struct operand
+        {
+            T* data;
+            std::array<int, R> strides;
+        };
+
+        template<typename T, std::size_t R>
+        static inline operand<T, int(R)> make_operand(T* data, std::array<int, R> strides)
+        {
+            return {data, strides};
+        }
+
+        /**
+         * A one-dimensional run of elements: a base pointer and a stride (in
+         * units of elements). Kernels receive one of these per operand for
+         * each inner loop, along with its length.
+         */
+        template<typename T>
+        struct run
+        {
+            T& operator[](int i) const { return data[i * stride]; }
+            T* data;
+            int stride;
+        };
+
+        template<std::size_t R>
+        static inline std::array<int, R> memory_order(std::array<int, R> shape, std::array<int, R> strides);
+
+        /**
+         * A loop nest over N operands that visits the same elements as an
+         * array of shape and strides, but with size-one axes dropped, the
+         * remaining axes ordered outermost first by the first operand's
+         * strides, and adjacent axes merged wherever every operand allows
+         * it. Only the first rank entries of shape and strides are used.
+         * Each operand's traversal starts at its data pointer plus start.
+         */
+        template<int R, int N>
+        struct loop_nest
+        {
+            int rank;
+            std::array<int, R> shape;
+            std::array<std::array<int, R>, N> strides;
+            std::array<int, N> start;
+        };
+
+        template<std::size_t R, std::size_t N>
+        static inline loop_nest<int(R), int(N)> make_loop_nest(std::array<int, R> shape, std::array<std::array<int, R>, N> strides);
+
+        template<std::size_t R, typename Function, typename... T>
+        static inline void for_each(std::array<int, R> shape, Function f, operand<T, int(R)>... operands);
+
+        template<std::size_t R, std::size_t Q>
+        static inline bool reshape_strides(std::array<int, R> shape, std::array<int, R> strides, std::array<int, Q> new_shape, std::array<int, Q>& new_strides);
+
+        template<std::size_t R, typename Function, typename... T>
+        static inline void for_each_run(std::array<int, R> shape, Function f, operand<T, int(R)>... operands);
+
+        template<int R, int N, typename Function, typename... T>
+        static inline void walk(const loop_nest<R, N>& nest, Function f, T*... data);
+
+        template<int R, int N, typename Function, typename... T>
+        static inline void walk_runs(const loop_nest<R, N>& nest, Function f, T*... data);
+
+        template<int R, typename... T>
+        class nditer;
+
+        template<std::size_t R, typename T>
+        static inline std::array<T*, 2> extent(std::array<int, R> shape, operand<T, int(R)> a);
+
+        template<std::size_t R, typename T, typename U>
+        static inline bool overlaps(std::array<int, R> shape, operand<T, int(R)> a, operand<U, int(R)> b);
+
+        template<std::size_t R, typename Function, typename T, typename U>
+        static inline void update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<U, int(R)> source);
+
+        template<std::size_t R, typename Function, typename T>
+        static inline void update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<const T, int(R)> source);
+
+        template<std::size_t R, typename T, typename U>
+        static inline void copy(std::array<int, R> shape, operand<T, int(R)> target, operand<U, int(R)> source);
+
+        template<int R, typename T, typename U>
+        static inline void copy_nest(const loop_nest<R, 2>& nest, T* target, U* source);
+
+        template<typename T, typename U>
+        static inline void copy_run(int count, T* target, int target_stride, U* source, int source_stride);
+
+        template<typename T, typename U>
+        static inline void copy_tile(int rows, int cols, T* target, std::array<int, 2> target_strides, U* source, std::array<int, 2> source_strides);
+    }
+
+/**
+ * Edge length of the square blocks in which strided::copy transposes data
+ * between views whose inner strides differ. A block of each operand should
+ * fit comfortably in the L1 cache.
+ */
+#ifndef ND_COPY_TILE
+#define ND_COPY_TILE 32
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+/**
+ * Returns a permutation of the axes, from the largest absolute stride to the
+ * smallest. Walking the axes in this order, with the last one innermost,
+ * visits the elements in the order they sit in memory. Axes with equal
+ * strides keep their logical order, so row-major arrays are unchanged, and
+ * axes of length one (whose stride is irrelevant) are moved outward.
+ */
+template<std::size_t R> // ND_IMPL_START
+std::array<int, R> nd::strided::memory_order(std::array<int, R> shape, std::array<int, R> strides)
+{
+    std::array<int, R> order;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        order[n] = n;
+    }
+
+    auto key = [&] (int n) { return shape[n] == 1 ? 0 : std::abs(strides[n]); };
+
+    std::stable_sort(order.begin(), order.end(), [&] (int a, int b)
+    {
+        return key(a) > key(b);
+    });
+    return order;
+}
+
+
+
+/**
+ * Builds the loop nest for the given shape and per-operand strides. Axes
+ * along which the first operand has a negative stride are flipped, as in
+ * for_each. An empty shape yields a nest of rank one and length zero.
+ */
+template<std::size_t R, std::size_t N>
+nd::strided::loop_nest<int(R), int(N)> nd::strided::make_loop_nest(std::array<int, R> shape, std::array<std::array<int, R>, N> strides)
+{
+    auto nest = loop_nest<int(R), int(N)>{};
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
+        {
+            nest.rank = 1;
+            return nest;
+        }
+        if (strides[0][n] < 0)
+        {
+            for (int k = 0; k < int(N); ++k)
+            {
+                nest.start[k] += (shape[n] - 1) * strides[k][n];
+                strides[k][n] = -strides[k][n];
+            }
+        }
+    }
+
+    for (int a : memory_order(shape, strides[0]))
+    {
+        if (shape[a] == 1)
+        {
+            continue;
+        }
+
+        int m = nest.rank - 1;
+        bool merge = m >= 0;
+
+        for (int k = 0; k < int(N) && merge; ++k)
+        {
+            merge = nest.strides[k][m] == strides[k][a] * shape[a];
+        }
+
+        if (! merge)
+        {
+            m = nest.rank++;
+            nest.shape[m] = 1;
+        }
+
+        nest.shape[m] *= shape[a];
+
+        for (int k = 0; k < int(N); ++k)
+        {
+            nest.strides[k][m] = strides[k][a];
+        }
+    }
+    return nest;
+}
+
+
+
+
+/**
+ * Finds strides under which the memory of a view with the given shape and
+ * strides can be read in the given new shape, in row-major order, without
+ * copying. This is possible when each group of old axes that is merged or
+ * split into new axes is itself laid out like a row-major block, e.g. when
+ * taking a range of rows from a larger array, or splitting an axis of a
+ * strided selection. Returns false if no such strides exist. Axes of length
+ * one are ignored, and empty views can always be reshaped. The sizes of the
+ * two shapes must agree.
+ */
+template<std::size_t R, std::size_t Q>
+bool nd::strided::reshape_strides(std::array<int, R> shape, std::array<int, R> strides, std::array<int, Q> new_shape, std::array<int, Q>& new_strides)
+{
+    std::array<int, R> old_shape;
+    std::array<int, R> old_strides;
+    int rank = 0;
+    int size = 1;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        size *= shape[n];
+
+        if (shape[n] != 1)
+        {
+            old_shape[rank] = shape[n];
+            old_strides[rank] = strides[n];
+            ++rank;
+        }
+    }
+
+    new_strides.fill(1);
+
+    if (size == 0)
+    {
+        for (int n = int(Q) - 2; n >= 0; --n)
+        {
+            new_strides[n] = new_strides[n + 1] * std::max(new_shape[n + 1], 1);
+        }
+        return true;
+    }
+
+    int oi = 0, oj = 1;
+    int ni = 0, nj = 1;
+
+    while (ni < int(Q) && oi < rank)
+    {
+        int np = new_shape[ni];
+        int op = old_shape[oi];
+
+        while (np != op)
+        {
+            if (np < op && nj < int(Q))
+            {
+                np *= new_shape[nj++];
+            }
+            else if (np > op && oj < rank)
+            {
+                op *= old_shape[oj++];
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        // k < R follows from oj <= rank; it is spelled out for -Warray-bounds
+        for (int k = oi + 1; k < oj && k < int(R); ++k)
+        {
+            if (old_strides[k - 1] != old_shape[k] * old_strides[k])
+            {
+                return false;
+            }
+        }
+
+        new_strides[nj - 1] = old_strides[oj - 1];
+
+        for (int k = nj - 1; k > ni; --k)
+        {
+            new_strides[k - 1] = new_strides[k] * new_shape[k];
+        }
+
+        ni = nj++;
+        oi = oj++;
+    }
+    return true;
+}
+
+
+
+
+/**
+ * Invokes f(a, b, ...) with references to the elements of each operand at
+ * every index of the given shape. The loop nest is first reduced (see
+ * make_loop_nest): size-one axes are dropped, the rest are walked in the
+ * memory order of the first operand with the smallest stride innermost, and
+ * axes are merged wherever every operand's strides allow it. A contiguous
+ * view of any rank is then a single loop. Axes along which the first
+ * operand has a negative stride are walked backwards, so that it is always
+ * traversed toward increasing addresses. Since all operands visit the same
+ * logical indexes, the traversal order is invisible to element-wise
+ * operations.
+ */
+template<std::size_t R, typename Function, typename... T>
+void nd::strided::for_each(std::array<int, R> shape, Function f, operand<T, int(R)>... operands)
+{
+    walk(make_loop_nest<R, sizeof...(T)>(shape, {operands.strides...}), f, operands.data...);
+}
+
+
+
+
+
+/**
+ * Invokes f(count, a, b, ...) once for every inner loop of the reduced loop
+ * nest (see for_each), where a, b, ... are strided::run's of the operands and
+ * count is the length of the runs. Runs are visited in the memory order of
+ * the first operand, and the first operand's stride is never negative. For
+ * contiguous operands there is a single run covering all elements. Empty
+ * shapes produce no runs.
+ */
+template<std::size_t R, typename Function, typename... T>
+void nd::strided::for_each_run(std::array<int, R> shape, Function f, operand<T, int(R)>... operands)
+{
+    walk_runs(make_loop_nest<R, sizeof...(T)>(shape, {operands.strides...}), f, operands.data...);
+}
+
+
+
+
+
+
+
+/**
+ * Invokes f(a, b, ...) at every index of a loop nest, exactly as given: no
+ * axes are flipped or reordered. Each operand's traversal begins at its data
+ * pointer plus the nest's start offset.
+ */
+template<int R, int N, typename Function, typename... T>
+void nd::strided::walk(const loop_nest<R, N>& nest, Function f, T*... data)
+{
+    walk_runs(nest, [&f] (int count, run<T>... runs)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            f(runs[i]...);
+        }
+    }, data...);
+}
+
+
+
+
+/**
+ * Invokes f(count, a, b, ...) for each inner loop of a loop nest, exactly
+ * as given, where a, b, ... are strided::run's of the operands. Each
+ * operand's traversal begins at its data pointer plus the nest's start
+ * offset. A nest of rank zero is a single run of length one.
+ */
+template<int R, int N, typename Function, typename... T>
+void nd::strided::walk_runs(const loop_nest<R, N>& nest, Function f, T*... data)
+{
+    static_assert(sizeof...(T) == N, "walk: wrong number of operands for loop nest");
+    nditer<R, T...>(nest, data...).for_each_run(f);
+}
+
+
+
+
+/**
+ * An iterator over several operands of the same shape in lockstep, possibly
+ * of different types, e.g. two inputs and an output. The loop nest is
+ * reduced once up front (see make_loop_nest), and the iterator then keeps a
+ * single multi-index: each step advances every operand's pointer by its own
+ * stride, with no per-operand index or offset computation. Usage:
+ *
+ * for (auto it = nditer<2, double, const int>(shape, C, A); ! it.done(); it.next())
+ * {
+ *     it.get<0>() = 2 * it.get<1>();
+ * }
+ *
+ * Elements are visited in the memory order of the first operand. Kernels
+ * may instead step a whole inner loop at a time, with count(), inner<K>()
+ * and next_run().
+ */
+template<int R, typename... T>
+class nd::strided::nditer
+{
+public:
+    enum { operands = sizeof...(T) };
+
+    nditer(std::array<int, R> shape, operand<T, R>... operands)
+    : nditer(make_loop_nest<std::size_t(R), sizeof...(T)>(shape, {operands.strides...}), operands.data...)
+    {
+    }
+
+    nditer(const loop_nest<R, sizeof...(T)>& nest, T*... data) : nest(nest), data(data...)
+    {
+        advance_all(std::index_sequence_for<T...>());
+        index.fill(0);
+
+        for (int n = 0; n < nest.rank; ++n)
+        {
+            if (nest.shape[n] == 0)
+            {
+                finished = true;
+            }
+        }
+    }
+
+    /** True once every element has been visited. */
+    bool done() const
+    {
+        return finished;
+    }
+
+    /** The length of the current inner loop. */
+    int count() const
+    {
+        return nest.rank == 0 ? 1 : nest.shape[nest.rank - 1];
+    }
+
+    /** The current inner loop of operand K, from its first element. */
+    template<int K>
+    auto inner() const
+    {
+        using U = typename std::tuple_element<K, std::tuple<T...>>::type;
+        return run<U>{std::get<K>(data), nest.rank == 0 ? 0 : nest.strides[K][nest.rank - 1]};
+    }
+
+    /** The current element of operand K. */
+    template<int K>
+    auto& get() const
+    {
+        return inner<K>()[position];
+    }
+
+    /** Advances to the next element. */
+    nditer& next()
+    {
+        if (++position == count())
+        {
+            position = 0;
+            next_run();
+        }
+        return *this;
+    }
+
+    /** Advances to the start of the next inner loop. */
+    nditer& next_run()
+    {
+        for (int k = nest.rank - 2; k >= 0; --k)
+        {
+            advance(k, 1, std::index_sequence_for<T...>());
+
+            if (++index[k] < nest.shape[k])
+            {
+                return *this;
+            }
+            advance(k, -nest.shape[k], std::index_sequence_for<T...>());
+            index[k] = 0;
+        }
+        finished = true;
+        return *this;
+    }
+
+    /**
+     * Invokes f(count, a, b, ...) on each remaining inner loop, with a, b, ...
+     * the operands' runs, leaving the iterator done.
+     */
+    template<typename Function>
+    void for_each_run(Function f)
+    {
+        for_each_run(f, std::index_sequence_for<T...>());
+    }
+
+private:
+    template<typename Function, std::size_t... K>
+    void for_each_run(Function f, std::index_sequence<K...>)
+    {
+        for (; ! finished; next_run())
+        {
+            f(count() - position, run<T>{std::get<K>(data) + position * inner<K>().stride, inner<K>().stride}...);
+            position = 0;
+        }
+    }
+
+    template<std::size_t... K>
+    void advance_all(std::index_sequence<K...>)
+    {
+        int expand[] = {0, (std::get<K>(data) += nest.start[K], 0)...};
+        (void) expand;
+    }
+
+    template<std::size_t... K>
+    void advance(int axis, int steps, std::index_sequence<K...>)
+    {
+        int expand[] = {0, (std::get<K>(data) += steps * nest.strides[K][axis], 0)...};
+        (void) expand;
+    }
+
+    loop_nest<R, sizeof...(T)> nest;
+    std::tuple<T*...> data;
+    std::array<int, R> index;
+    int position = 0;
+    bool finished = false;
+};
+
+
+
+
+/**
+ * Returns pointers to the lowest and highest addressed elements of a
+ * non-empty operand with the given shape.
+ */
+template<std::size_t R, typename T>
+std::array<T*, 2> nd::strided::extent(std::array<int, R> shape, operand<T, int(R)> a)
+{
+    auto lower = a.data;
+    auto upper = a.data;
+
+    for (int n = 0; n < int(R); ++n)
+    {
+        auto d = (shape[n] - 1) * a.strides[n];
+        (d < 0 ? lower : upper) += d;
+    }
+    return {lower, upper};
+}
+
+
+
+
+/**
+ * Returns true if the address ranges spanned by two operands of the given
+ * shape intersect. They may still have no element in common, e.g. when one
+ * interleaves with the other.
+ */
+template<std::size_t R, typename T, typename U>
+bool nd::strided::overlaps(std::array<int, R> shape, operand<T, int(R)> a, operand<U, int(R)> b)
+{
+    for (int n = 0; n < int(R); ++n)
+    {
+        if (shape[n] == 0)
+        {
+            return false;
+        }
+    }
+
+    auto x = extent(shape, a);
+    auto y = extent(shape, b);
+    auto before = std::less<const void*>();
+
+    return before(x[0], y[1] + 1) && before(y[0], x[1] + 1);
+}
+
+
+
+
+/**
+ * Invokes f(a, b) over the elements of target and source, with the result
+ * being as if the source had been read in full before the target was
+ * written. Operands of different types cannot share memory, so this is
+ * for_each unless the types match (see the overload below).
+ */
+template<std::size_t R, typename Function, typename T, typename U>
+void nd::strided::update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<U, int(R)> source)
+{
+    for_each(shape, f, target, source);
+}
+
+/**
+ * If the operands overlap and have equal strides, each target element is a
+ * fixed distance in memory from its source element. When in addition the
+ * reduced loop nest visits addresses in increasing order (each axis' stride
+ * spans the full extent of the axes inside it), a traversal which moves
+ * away from the source (like memmove) never overwrites an element before it
+ * is read. Interleaved views, e.g. strides {3, 2} over shape {2, 3}, revisit
+ * lower addresses and are not walked this way. Otherwise only the part of the source's address range
+ * which falls inside the target's is staged in a temporary buffer, and the
+ * rest of the source is read in place.
+ */
+template<std::size_t R, typename Function, typename T>
+void nd::strided::update(std::array<int, R> shape, Function f, operand<T, int(R)> target, operand<const T, int(R)> source)
+{
+    if (! overlaps(shape, target, source))
+    {
+        for_each(shape, f, target, source);
+        return;
+    }
+
+    auto nest = make_loop_nest<R, 2>(shape, {target.strides, source.strides});
+    bool monotonic = true;
+
+    for (int n = 0; n + 1 < nest.rank; ++n)
+    {
+        monotonic = monotonic && nest.strides[0][n] >= nest.strides[0][n + 1] * nest.shape[n + 1];
+    }
+
+    if (target.strides == source.strides && monotonic)
+    {
+        if (std::less<const T*>()(source.data, target.data))
+        {
+            for (int n = 0; n < nest.rank; ++n)
+            {
+                for (int k = 0; k < 2; ++k)
+                {
+                    nest.start[k] += (nest.shape[n] - 1) * nest.strides[k][n];
+                    nest.strides[k][n] = -nest.strides[k][n];
+                }
+            }
+        }
+        walk(nest, f, target.data, source.data);
+        return;
+    }
+
+    auto t = extent(shape, target);
+    auto s = extent(shape, source);
+    const T* lower = std::max<const T*>(t[0], s[0], std::less<const T*>());
+    const T* upper = std::min<const T*>(t[1], s[1], std::less<const T*>());
+    auto stage = std::unique_ptr<T[]>(new T[upper - lower + 1]);
+
+    std::copy(lower, upper + 1, stage.get());
+
+    for_each(shape, [&] (T& a, const T& b)
+    {
+        auto p = &b;
+        f(a, lower <= p && p <= upper ? stage[p - lower] : b);
+    }, target, source);
+}
+
+/**
+ * Copies the elements of source into target, which have the given shape.
+ * Axes are coalesced so that the inner loop is as long as possible, and
+ * inner runs which are contiguous on both sides become a single memcpy when
+ * the element types match and are trivially copyable. When the source is
+ * not contiguous along the target's inner axis, but is along another one,
+ * the two axes are copied in square tiles so that neither side streams
+ * through the cache a single element per line. Large copies are split
+ * across threads along the outermost axis. Overlapping operands are instead
+ * copied serially by update.
+ */
+template<std::size_t R, typename T, typename U>
+void nd::strided::copy(std::array<int, R> shape, operand<T, int(R)> target, operand<U, int(R)> source)
+{
+    if (overlaps(shape, target, source))
+    {
+        update(shape, [] (auto& a, const auto& b) { a = b; }, target, source);
+        return;
+    }
+
+    auto nest = make_loop_nest<R, 2>(shape, {target.strides, source.strides});
+    auto t = target.data + nest.start[0];
+    auto s = source.data + nest.start[1];
+    auto& ss = nest.strides[1];
+    int r = nest.rank;
+    int size = 1;
+
+    if (r == 0)
+    {
+        *t = *s;
+        return;
+    }
+
+    for (int n = 0; n < r; ++n)
+    {
+        size *= nest.shape[n];
+    }
+
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (r >= 2 && std::abs(ss[r - 1]) != 1)
+    {
+        int j = r - 2;
+
+        for (int n = 0; n < r - 1; ++n)
+        {
+            if (std::abs(ss[n]) < std::abs(ss[j]))
+            {
+                j = n;
+            }
+        }
+
+        if (std::abs(ss[j]) < std::abs(ss[r - 1]))
+        {
+            for (; j < r - 2; ++j)
+            {
+                std::swap(nest.shape[j], nest.shape[j + 1]);
+                std::swap(nest.strides[0][j], nest.strides[0][j + 1]);
+                std::swap(nest.strides[1][j], nest.strides[1][j + 1]);
+            }
+        }
+    }
+
+    auto block = [&] (int lower, int upper)
+    {
+        auto part = nest;
+        part.shape[0] = upper - lower;
+        copy_nest(part, t + lower * nest.strides[0][0], s + lower * nest.strides[1][0]);
+    };
+
+    if (size >= ND_PARALLEL_THRESHOLD)
+    {
+        parallel::for_each_chunk(nest.shape[0], block);
+    }
+    else
+    {
+        block(0, nest.shape[0]);
+    }
+}
+
+
+
+
+/**
+ * Copies over a two-operand loop nest, of rank at least one. The innermost
+ * axis is copied as a run, or the innermost two as tiles if the source is
+ * more contiguous along the second-innermost axis than along the innermost.
+ */
+template<int R, typename T, typename U>
+void nd::strided::copy_nest(const loop_nest<R, 2>& nest, T* target, U* source)
+{
+    const int r = nest.rank;
+    const auto& shape = nest.shape;
+    const auto& ts = nest.strides[0];
+    const auto& ss = nest.strides[1];
+    const bool tile = r >= 2 && std::abs(ss[r - 2]) < std::abs(ss[r - 1]);
+    const int outer = tile ? r - 2 : r - 1;
+    auto index = std::array<int, R>();
+    index.fill(0);
+
+    while (true)
+    {
+        if (tile)
+        {
+            copy_tile(shape[r - 2], shape[r - 1], target, {ts[r - 2], ts[r - 1]}, source, {ss[r - 2], ss[r - 1]});
+        }
+        else
+        {
+            copy_run(shape[r - 1], target, ts[r - 1], source, ss[r - 1]);
+        }
+
+        int k = outer - 1;
+
+        for (; k >= 0; --k)
+        {
+            target += ts[k];
+            source += ss[k];
+
+            if (++index[k] < shape[k])
+            {
+                break;
+            }
+            target -= ts[k] * shape[k];
+            source -= ss[k] * shape[k];
+            index[k] = 0;
+        }
+
+        if (k < 0)
+        {
+            return;
+        }
+    }
+}
+
+
+
+
+/**
+ * Copies a one-dimensional run between non-overlapping operands.
+ */
+template<typename T, typename U>
+void nd::strided::copy_run(int count, T* target, int target_stride, U* source, int source_stride)
+{
+    using V = typename std::remove_const<U>::type;
+
+    if (std::is_same<T, V>::value && std::is_trivially_copyable<T>::value && target_stride == 1 && source_stride == 1)
+    {
+        std::memcpy(target, source, count * sizeof(T));
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        target[i * target_stride] = source[i * source_stride];
+    }
+}
+
+
+
+
+/**
+ * Copies a two-dimensional block in square tiles of ND_COPY_TILE elements on
+ * a side.
+ */
+template<typename T, typename U>
+void nd::strided::copy_tile(int rows, int cols, T* target, std::array<int, 2> ts, U* source, std::array<int, 2> ss)
+{
+    for (int i0 = 0; i0 < rows; i0 += ND_COPY_TILE)
+    {
+        for (int j0 = 0; j0 < cols; j0 += ND_COPY_TILE)
+        {
+            int i1 = std::min(i0 + ND_COPY_TILE, rows);
+            int j1 = std::min(j0 + ND_COPY_TILE, cols);
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    target[i * ts[0] + j * ts[1]] = source[i * ss[0] + j * ss[1]];
+                }
+            }
+        }
+    }
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_STRIDED
+#include <vector>
+#include "catch.hpp"
+
+
+TEST_CASE("memory_order sorts axes by decreasing stride", "[strided]")
+{
+    CHECK(nd::strided::memory_order<3>({2, 3, 4}, {12, 4, 1}) == std::array<int, 3>{0, 1, 2});
+    CHECK(nd::strided::memory_order<3>({2, 3, 4}, {1, 2, 6}) == std::array<int, 3>{2, 1, 0});
+    CHECK(nd::strided::memory_order<2>({2, 3}, {-3, 1}) == std::array<int, 2>{0, 1});
+}
+
+
+TEST_CASE("reshape_strides finds views where strides allow them", "[strided]")
+{
+    auto strides = std::array<int, 2>();
+
+    // rows 1 and 2 of a 4 x 6 array, as 12 elements or 3 x 4
+    auto flat = std::array<int, 1>();
+    CHECK(nd::strided::reshape_strides<2, 1>({2, 6}, {6, 1}, {12}, flat));
+    CHECK(flat[0] == 1);
+    CHECK(nd::strided::reshape_strides<2, 2>({2, 6}, {6, 1}, {3, 4}, strides));
+    CHECK(strides == std::array<int, 2>{4, 1});
+
+    // columns 0 and 2 of a 4 x 6 array: the rows can be split, not merged
+    auto split = std::array<int, 3>();
+    CHECK(nd::strided::reshape_strides<2, 3>({4, 2}, {6, 2}, {2, 2, 2}, split));
+    CHECK(split == std::array<int, 3>{12, 6, 2});
+    CHECK_FALSE(nd::strided::reshape_strides<2, 2>({4, 2}, {6, 2}, {2, 4}, strides));
+
+    // but every other column of it is just every other element
+    CHECK(nd::strided::reshape_strides<2, 2>({4, 3}, {6, 2}, {3, 4}, strides));
+    CHECK(strides == std::array<int, 2>{8, 2});
+
+    // size-one axes are ignored, transposes cannot be flattened
+    CHECK(nd::strided::reshape_strides<3, 2>({3, 1, 4}, {8, 99, 2}, {3, 4}, strides));
+    CHECK(strides == std::array<int, 2>{8, 2});
+    CHECK_FALSE(nd::strided::reshape_strides<2, 2>({3, 4}, {1, 3}, {4, 3}, strides));
+    CHECK(nd::strided::reshape_strides<2, 2>({3, 0}, {1, 3}, {0, 4}, strides));
+}
+
+TEST_CASE("strided::for_each visits column-major memory sequentially", "[strided]")
+{
+    int memory[6] = {0, 1, 2, 3, 4, 5};
+    int visited[6];
+    int n = 0;
+
+    auto A = nd::strided::make_operand<int, 2>(memory, {1, 2});
+    nd::strided::for_each<2>({2, 3}, [&] (int a) { visited[n++] = a; }, A);
+
+    for (int i = 0; i < 6; ++i)
+    {
+        CHECK(visited[i] == i);
+    }
+}
+
+
+TEST_CASE("strided::for_each reduces contiguous high-rank loops to one", "[strided]")
+{
+    int memory[24];
+    int n = 0;
+
+    for (int i = 0; i < 24; ++i)
+    {
+        memory[i] = i;
+    }
+
+    // shape (2, 1, 3, 1, 4), row-major with junk strides on the size-one axes
+    auto A = nd::strided::make_operand<int, 5>(memory, {12, 99, 4, -7, 1});
+    auto nest = nd::strided::make_loop_nest<5, 1>({2, 1, 3, 1, 4}, {{A.strides}});
+    nd::strided::for_each<5>({2, 1, 3, 1, 4}, [&] (int a) { CHECK(a == n++); }, A);
+
+    CHECK(nest.rank == 1);
+    CHECK(n == 24);
+}
+
+TEST_CASE("strided::for_each_run passes inner runs to the kernel", "[strided]")
+{
+    int memory[15];
+    int runs = 0;
+    int total = 0;
+
+    for (int i = 0; i < 15; ++i)
+    {
+        memory[i] = i;
+    }
+
+    // every other column of a 3 x 5 row-major array
+    auto A = nd::strided::make_operand<int, 2>(memory + 1, {5, 2});
+    nd::strided::for_each_run<2>({3, 2}, [&] (int count, nd::strided::run<int> a)
+    {
+        CHECK(count == 2);
+        CHECK(a.stride == 2);
+        total += a[0] + a[1];
+        ++runs;
+    }, A);
+
+    CHECK(runs == 3);
+    CHECK(total == 1 + 3 + 6 + 8 + 11 + 13);
+
+    nd::strided::for_each_run<2>({3, 0}, [&] (int, nd::strided::run<int>) { ++runs; }, A);
+    CHECK(runs == 3);
+}
+
+TEST_CASE("strided::nditer steps operands of different types in lockstep", "[strided]")
+{
+    int source[6] = {0, 1, 2, 3, 4, 5};
+    double target[6] = {0, 0, 0, 0, 0, 0};
+    int n = 0;
+
+    // target (row-major, 2 x 3) = source (column-major, 2 x 3) / 2
+    auto T = nd::strided::make_operand<double, 2>(target, {3, 1});
+    auto S = nd::strided::make_operand<const int, 2>(source, {1, 2});
+
+    for (auto it = nd::strided::nditer<2, double, const int>({2, 3}, T, S); ! it.done(); it.next())
+    {
+        it.get<0>() = it.get<1>() / 2.0;
+        ++n;
+    }
+
+    CHECK(n == 6);
+    CHECK(target[1] == 1.0);
+    CHECK(target[3] == 0.5);
+    CHECK(target[5] == 2.5);
+
+    auto runs = 0;
+    auto it = nd::strided::nditer<2, double>({2, 3}, T);
+    it.next();
+    it.for_each_run([&] (int count, nd::strided::run<double> a) { CHECK(count == 5); CHECK(a[0] == 1.0); ++runs; });
+    CHECK(runs == 1);
+    CHECK(it.done());
+
+    CHECK(nd::strided::nditer<2, double>({2, 0}, T).done());
+    CHECK(nd::strided::nditer<0, double>({}, nd::strided::make_operand<double, 0>(target, {})).count() == 1);
+}
+
+TEST_CASE("strided::for_each walks operands in lockstep", "[strided]")
+{
+    int source[6] = {0, 1, 2, 3, 4, 5};
+    int target[6] = {0, 0, 0, 0, 0, 0};
+
+    // target is the transpose of source, with its columns reversed
+    auto A = nd::strided::make_operand<int, 2>(target + 2, {3, -1});
+    auto B = nd::strided::make_operand<int, 2>(source, {1, 2});
+    nd::strided::for_each<2>({2, 3}, [] (int& a, int b) { a = b; }, A, B);
+
+    CHECK(target[0] == 4);
+    CHECK(target[1] == 2);
+    CHECK(target[2] == 0);
+    CHECK(target[3] == 5);
+    CHECK(target[4] == 3);
+    CHECK(target[5] == 1);
+}
+
+
+TEST_CASE("make_loop_nest coalesces and drops axes", "[strided]")
+{
+    auto contiguous = nd::strided::make_loop_nest<3, 1>({2, 3, 4}, {{{12, 4, 1}}});
+    CHECK(contiguous.rank == 1);
+    CHECK(contiguous.shape[0] == 24);
+    CHECK(contiguous.strides[0][0] == 1);
+
+    auto row = nd::strided::make_loop_nest<3, 2>({1, 3, 4}, {{{12, 4, 1}, {0, 8, 2}}});
+    CHECK(row.rank == 1);
+    CHECK(row.shape[0] == 12);
+    CHECK(row.strides[1][0] == 2);
+
+    auto transposed = nd::strided::make_loop_nest<2, 2>({3, 4}, {{{4, 1}, {1, 3}}});
+    CHECK(transposed.rank == 2);
+
+    auto reversed = nd::strided::make_loop_nest<1, 2>({5}, {{{-1}, {1}}});
+    CHECK(reversed.start[0] == -4);
+    CHECK(reversed.start[1] == 4);
+    CHECK(reversed.strides[1][0] == -1);
+
+    CHECK(nd::strided::make_loop_nest<2, 1>({3, 0}, {{{1, 1}}}).shape[0] == 0);
+}
+
+
+TEST_CASE("strided::copy handles contiguous, tiled, and reversed copies", "[strided]")
+{
+    auto check_transpose = [] (int rows, int cols)
+    {
+        auto source = std::vector<int>(rows * cols);
+        auto target = std::vector<int>(rows * cols);
+
+        for (int i = 0; i < rows * cols; ++i)
+        {
+            source[i] = i;
+        }
+
+        // target(i, j) = source(j, i), with source stored column-major
+        auto A = nd::strided::make_operand<int, 2>(target.data(), {cols, 1});
+        auto B = nd::strided::make_operand<const int, 2>(source.data(), {1, rows});
+        nd::strided::copy<2>({rows, cols}, A, B);
+
+        for (int i = 0; i < rows; ++i)
+        {
+            for (int j = 0; j < cols; ++j)
+            {
+                if (target[i * cols + j] != source[i + j * rows]) return false;
+            }
+        }
+        return true;
+    };
+
+    CHECK(check_transpose(3, 5));
+    CHECK(check_transpose(70, 45));
+
+    auto threads = nd::parallel::set_num_threads(3);
+    CHECK(check_transpose(600, 500));
+    nd::parallel::set_num_threads(threads);
+
+    int source[6] = {0, 1, 2, 3, 4, 5};
+    int target[6] = {0, 0, 0, 0, 0, 0};
+    nd::strided::copy<1>({6}, nd::strided::make_operand<int, 1>(target + 5, {-1}), nd::strided::make_operand<int, 1>(source, {1}));
+    CHECK(target[0] == 5);
+    CHECK(target[5] == 0);
+
+    nd::strided::copy<2>({2, 3}, nd::strided::make_operand<int, 2>(target, {3, 1}), nd::strided::make_operand<int, 2>(source, {3, 1}));
+    CHECK(std::equal(source, source + 6, target));
+}
+
+
+TEST_CASE("strided::update handles operands that overlap in memory", "[strided]")
+{
+    auto assign = [] (int& a, const int& b) { a = b; };
+    int memory[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+
+    // memory[1:7] = memory[0:6], needs a backward traversal
+    nd::strided::update<1>({6}, assign,
+        nd::strided::make_operand<int, 1>(memory + 1, {1}),
+        nd::strided::make_operand<const int, 1>(memory, {1}));
+
+    CHECK(memory[0] == 0);
+    CHECK(memory[1] == 0);
+    CHECK(memory[6] == 5);
+    CHECK(memory[7] == 7);
+
+    // memory[0:8] = memory[8:0:-1], needs staging
+    nd::strided::update<1>({8}, assign,
+        nd::strided::make_operand<int, 1>(memory, {1}),
+        nd::strided::make_operand<const int, 1>(memory + 7, {-1}));
+
+    CHECK(memory[0] == 7);
+    CHECK(memory[1] == 5);
+    CHECK(memory[7] == 0);
+
+    // equal strides, but the walk visits offsets 0, 2, 4, 3, ... so it is
+    // not monotonic in memory, and a forward traversal would read a 4 that
+    // was already overwritten
+    int grid[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+    nd::strided::update<2>({2, 3}, assign,
+        nd::strided::make_operand<int, 2>(grid, {3, 2}),
+        nd::strided::make_operand<const int, 2>(grid + 1, {3, 2}));
+
+    CHECK(grid[0] == 1);
+    CHECK(grid[2] == 3);
+    CHECK(grid[4] == 5);
+    CHECK(grid[3] == 4);
+    CHECK(grid[5] == 6);
+    CHECK(grid[7] == 8);
+
+    CHECK(nd::strided::overlaps<1>({4},
+        nd::strided::make_operand<int, 1>(memory, {2}),
+        nd::strided::make_operand<int, 1>(memory + 1, {2})));
+    CHECK_FALSE(nd::strided::overlaps<1>({4},
+        nd::strided::make_operand<int, 1>(memory, {1}),
+        nd::strided::make_operand<int, 1>(memory + 4, {1})));
+}
+
+#endif // TEST_STRIDED
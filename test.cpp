@@ -2,8 +2,30 @@
 #define TEST_BUFFER
 #define TEST_NDARRAY
 #define TEST_SHAPE
+#define TEST_STATIC_ARRAY
+#define TEST_STRIDED
+#define TEST_DLPACK
+#define TEST_PARALLEL
+#define TEST_LINALG
+#define TEST_STENCIL
+#define TEST_BOUNDARY
+#define TEST_DECOMPOSITION
+#define TEST_SHM
+#define TEST_RANDOM
+#define TEST_GROWABLE
 
 #include "selector.hpp"
 #include "ndarray.hpp"
 #include "shape.hpp"
 #include "buffer.hpp"
+#include "static_array.hpp"
+#include "strided.hpp"
+#include "dlpack.hpp"
+#include "parallel.hpp"
+#include "linalg.hpp"
+#include "stencil.hpp"
+#include "boundary.hpp"
+#include "decomposition.hpp"
+#include "shm.hpp"
+#include "random.hpp"
+#include "growable.hpp"